@@ -1,4 +1,5 @@
 #include "el2_mmu.h"
+#include "arch_ops.h"
 
 #define EL2_PT_ENTRIES 512
 #define PAGE_SIZE      0x1000ull
@@ -10,6 +11,10 @@
 #define PA_48_MASK     ((1ull << 48) - 1ull) // Architected PA limit for QEMU virt
 
 #define EL2_DESC_TABLE 0x3ull              // Table descriptors have [1:0]=11
+#define EL2_DESC_BLOCK 0x1ull              // L1/L2 block descriptors have [1:0]=01
+#define EL2_DESC_TYPE_MASK 0x3ull
+#define L2_BLOCK_SIZE  (1ull << L2_SHIFT)  // 2MB block at level 2
+#define EL2_DESC_ADDR_MASK (PA_48_MASK & PAGE_MASK)
 #define EL2_PTE_PAGE   0x3ull              // L3 entries are also [1:0]=11
 #define EL2_PTE_ATTR(x)   (((u64)(x) & 0x7ull) << 2) // AttrIndx -> MAIR_EL2 byte
 #define EL2_PTE_SH_INNER  (0x3ull << 8)    // Inner-shareable so I/D caches stay coherent
@@ -39,8 +44,7 @@ static unsigned l3_used;
 // If we run out of page-table memory something is badly wrong; hang in place.
 static void el2_pt_hang(void)
 {
-    for (;;)
-        asm volatile("wfi");
+    cpu_halt();
 }
 
 static void zero_qword_array(u64* buf, unsigned count)
@@ -99,6 +103,7 @@ static el2_l2_table_t* ensure_l2(u64 l1_idx)
 }
 
 // Stage-1 EL2 uses 4KB granules, so the terminal level is L3. Ensure we have one.
+// A 2MB block already covering the range is split into 512 equivalent pages.
 static el2_l3_table_t* ensure_l3(el2_l2_table_t* l2, u64 l2_idx)
 {
     el2_l3_table_t* tbl = l2->children[l2_idx];
@@ -106,11 +111,29 @@ static el2_l3_table_t* ensure_l3(el2_l2_table_t* l2, u64 l2_idx)
         return tbl;
 
     tbl = alloc_l3();
+    u64 old = l2->entries[l2_idx];
+    if ((old & EL2_DESC_TYPE_MASK) == EL2_DESC_BLOCK)
+    {
+        u64 attrs = old & ~EL2_DESC_ADDR_MASK & ~EL2_DESC_TYPE_MASK;
+        u64 base = old & EL2_DESC_ADDR_MASK;
+        for (unsigned i = 0; i < EL2_PT_ENTRIES; ++i)
+            tbl->entries[i] = (base + (u64)i * PAGE_SIZE) | attrs | EL2_PTE_PAGE;
+    }
     l2->children[l2_idx] = tbl;
     l2->entries[l2_idx] = ((u64)tbl & PAGE_MASK) | EL2_DESC_TABLE;
     return tbl;
 }
 
+static u64 leaf_attrs(u8 attr_idx, bool ro, bool exec)
+{
+    u64 attrs = EL2_PTE_ATTR(attr_idx) | EL2_PTE_SH_INNER | EL2_PTE_AF;
+    if (ro)
+        attrs |= EL2_PTE_RDONLY;
+    if (!exec)
+        attrs |= EL2_PTE_PXN | EL2_PTE_UXN;
+    return attrs;
+}
+
 // Install one 4KB mapping using the requested attributes.
 static void map_page(u64 va, u64 pa, u8 attr_idx, bool ro, bool exec)
 {
@@ -121,18 +144,24 @@ static void map_page(u64 va, u64 pa, u8 attr_idx, bool ro, bool exec)
     el2_l2_table_t* l2 = ensure_l2(l1_idx);
     el2_l3_table_t* l3 = ensure_l3(l2, l2_idx);
 
-    u64 desc = (pa & (PA_48_MASK & PAGE_MASK)) |
-               EL2_PTE_PAGE |
-               EL2_PTE_ATTR(attr_idx) |
-               EL2_PTE_SH_INNER |
-               EL2_PTE_AF;
+    l3->entries[l3_idx] = (pa & EL2_DESC_ADDR_MASK) | EL2_PTE_PAGE |
+                          leaf_attrs(attr_idx, ro, exec);
+}
 
-    if (ro)
-        desc |= EL2_PTE_RDONLY;
-    if (!exec)
-        desc |= EL2_PTE_PXN | EL2_PTE_UXN;
+// Install a 2MB block if the L2 slot is still empty. Returns false when the
+// slot already holds finer mappings so the caller falls back to pages.
+static bool map_block(u64 va, u64 pa, u8 attr_idx, bool ro, bool exec)
+{
+    u64 l1_idx = (va >> L1_SHIFT) & LVL_INDEX_MASK;
+    u64 l2_idx = (va >> L2_SHIFT) & LVL_INDEX_MASK;
+
+    el2_l2_table_t* l2 = ensure_l2(l1_idx);
+    if (l2->entries[l2_idx] & EL2_DESC_TYPE_MASK)
+        return false;
 
-    l3->entries[l3_idx] = desc;
+    l2->entries[l2_idx] = (pa & EL2_DESC_ADDR_MASK & ~(L2_BLOCK_SIZE - 1ull)) |
+                          EL2_DESC_BLOCK | leaf_attrs(attr_idx, ro, exec);
+    return true;
 }
 
 void el2_map_range(u64 va_start, u64 pa_start, u64 size,
@@ -148,20 +177,29 @@ void el2_map_range(u64 va_start, u64 pa_start, u64 size,
     u64 end = va_start + size;
     u64 limit = (end + PAGE_SIZE - 1ull) & PAGE_MASK;
 
-    for (u64 cur = va; cur < limit; cur += PAGE_SIZE)
+    for (u64 cur = va; cur < limit; )
     {
         u64 cur_pa = pa + (cur - va);
+        // Large, congruently aligned spans (guest RAM windows) use 2MB blocks.
+        if (((cur | cur_pa) & (L2_BLOCK_SIZE - 1ull)) == 0 &&
+            limit - cur >= L2_BLOCK_SIZE &&
+            map_block(cur, cur_pa, attr_idx, ro, exec))
+        {
+            cur += L2_BLOCK_SIZE;
+            continue;
+        }
         map_page(cur, cur_pa, attr_idx, ro, exec);
+        cur += PAGE_SIZE;
     }
 }
 
 void el2_mmu_enable(void)
 {
-    asm volatile("dsb ishst" ::: "memory"); // Ensure page-table writes are visible
+    dsb(ishst); // Ensure page-table writes are visible
 
     // TTBR0_EL2 points at the root of the EL2 stage-1 walk; PA must be aligned.
     u64 ttbr0 = (u64)el2_l1 & (PA_48_MASK & PAGE_MASK);
-    asm volatile("msr TTBR0_EL2, %0" : : "r"(ttbr0)); // Program Translation Table Base Register 0
+    write_sysreg(TTBR0_EL2, ttbr0); // Program Translation Table Base Register 0
 
     /*
      * TCR_EL2:
@@ -179,10 +217,11 @@ void el2_mmu_enable(void)
     const u64 IPS_48   = 0b101ull << 16;  // TCR_EL2.IPS (physical address range)
 
     u64 tcr = T0SZ | TG0_4K | SH0_INNER | ORGN0_WB | IRGN0_WB | IPS_48;
-    asm volatile("msr TCR_EL2, %0" : : "r"(tcr));              // Translation Control Register
-    asm volatile("msr MAIR_EL2, %0" : : "r"(MAIR_EL2_VALUE)); // Memory Attribute Indirection Register
+    write_sysreg(TCR_EL2, tcr);             // Translation Control Register
+    write_sysreg(MAIR_EL2, MAIR_EL2_VALUE); // Memory Attribute Indirection Register
 
-    asm volatile("dsb ish; isb" ::: "memory"); // Synchronize before enabling stage-1
+    dsb(ish); // Synchronize before enabling stage-1
+    isb();
 
     /*
      * SCTLR_EL2 bits we touch:
@@ -191,11 +230,10 @@ void el2_mmu_enable(void)
      *  - I (bit12) turns on instruction cache
      * Everything else remains as set by early boot.
      */
-    u64 sctlr;
-    asm volatile("mrs %0, SCTLR_EL2" : "=r"(sctlr));  // Read System Control Register
+    u64 sctlr = read_sysreg(SCTLR_EL2);  // Read System Control Register
     sctlr |= (1ull << 0)  |   // SCTLR_EL2.M   -> MMU enable
              (1ull << 2)  |   // SCTLR_EL2.C   -> data cache enable
              (1ull << 12);    // SCTLR_EL2.I   -> instruction cache enable
-    asm volatile("msr SCTLR_EL2, %0" : : "r"(sctlr) : "memory"); // Write back updated control bits
-    asm volatile("isb"); // Ensure subsequent instructions see enabled MMU/I-cache state
+    write_sysreg(SCTLR_EL2, sctlr); // Write back updated control bits
+    isb(); // Ensure subsequent instructions see enabled MMU/I-cache state
 }
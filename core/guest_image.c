@@ -0,0 +1,239 @@
+#include <stddef.h>
+#include "guest_image.h"
+#include "memops.h"
+#include "s2_mmu.h"
+
+#define IMG_PAGE      0x1000ull
+#define IMG_PAGE_MASK (IMG_PAGE - 1ull)
+
+// The parts of the ELF64 headers the loader reads.
+#define EI_NIDENT     16
+#define ELFCLASS64    2
+#define ELFDATA2LSB   1
+#define ET_EXEC       2
+#define EM_AARCH64    183
+#define PT_LOAD       1
+#define PF_X          0x1u
+#define PF_W          0x2u
+
+typedef struct
+{
+    u8 e_ident[EI_NIDENT];
+    u16 e_type;
+    u16 e_machine;
+    u32 e_version;
+    u64 e_entry;
+    u64 e_phoff;
+    u64 e_shoff;
+    u32 e_flags;
+    u16 e_ehsize;
+    u16 e_phentsize;
+    u16 e_phnum;
+    u16 e_shentsize;
+    u16 e_shnum;
+    u16 e_shstrndx;
+} elf64_ehdr_t;
+
+typedef struct
+{
+    u32 p_type;
+    u32 p_flags;
+    u64 p_offset;
+    u64 p_vaddr;
+    u64 p_paddr;
+    u64 p_filesz;
+    u64 p_memsz;
+    u64 p_align;
+} elf64_phdr_t;
+
+// One loadable range: `filesz` bytes at image offset `offset`, then zeroes up
+// to `memsz`, at IPA `ipa`.
+typedef struct
+{
+    u64 ipa;
+    u64 offset;
+    u64 filesz;
+    u64 memsz;
+    bool write;
+    bool exec;
+} img_seg_t;
+
+// Backs every .bss page until the guest writes to it.
+static const u8 img_zero_page[IMG_PAGE] __attribute__((aligned(4096)));
+
+static inline u64 img_align_down(u64 v)
+{
+    return v & ~IMG_PAGE_MASK;
+}
+
+static inline u64 img_align_up(u64 v)
+{
+    return (v + IMG_PAGE_MASK) & ~IMG_PAGE_MASK;
+}
+
+static bool img_in_window(u64 ipa, u64 len, u64 base, u64 size)
+{
+    return ipa >= base && len <= size && ipa - base <= size - len;
+}
+
+// Map one segment page by page: whole file pages point into the image, whole
+// .bss pages at the zero page, and a page holding both (or the edge of the
+// segment) gets a private copy now.
+static bool img_map_segment(const u8 *image, const img_seg_t *seg, guest_image_t *out)
+{
+    const u64 start = img_align_down(seg->ipa);
+    const u64 end = img_align_up(seg->ipa + seg->memsz);
+    const u64 file_end = seg->ipa + seg->filesz;
+
+    for (u64 page = start; page < end; page += IMG_PAGE)
+    {
+        if (page >= seg->ipa && page + IMG_PAGE <= file_end)
+        {
+            const u64 pa = (u64)(image + seg->offset + (page - seg->ipa));
+            if (!s2_map_guest_page(page, pa, seg->write, seg->exec, true))
+                return false;
+            if (seg->write)
+                out->cow_pages++;
+            else
+                out->shared_pages++;
+            continue;
+        }
+        if (page >= file_end)
+        {
+            if (!s2_map_guest_page(page, (u64)img_zero_page, seg->write, seg->exec, true))
+                return false;
+            if (seg->write)
+                out->cow_pages++;
+            else
+                out->shared_pages++;
+            continue;
+        }
+
+        u8 *frame = s2_frame_alloc();
+        if (!frame)
+            return false;
+        const u64 from = page > seg->ipa ? page : seg->ipa;
+        const u64 to = page + IMG_PAGE < file_end ? page + IMG_PAGE : file_end;
+        hyp_memcpy(frame + (from - page), image + seg->offset + (from - seg->ipa), to - from);
+        if (seg->exec)
+            s2_sync_icache(frame);
+        if (!s2_map_guest_page(page, (u64)frame, seg->write, seg->exec, false))
+            return false;
+        out->copied_pages++;
+    }
+    return true;
+}
+
+static void img_note_span(const img_seg_t *seg, guest_image_t *out)
+{
+    const u64 start = img_align_down(seg->ipa);
+    const u64 end = img_align_up(seg->ipa + seg->memsz);
+    if (!out->ipa_end || start < out->ipa_start)
+        out->ipa_start = start;
+    if (end > out->ipa_end)
+        out->ipa_end = end;
+}
+
+static bool img_is_elf(const u8 *image, u64 size)
+{
+    return size >= sizeof(elf64_ehdr_t) && image[0] == 0x7F && image[1] == 'E' &&
+           image[2] == 'L' && image[3] == 'F';
+}
+
+// Build a segment from a program header; false unless it fits the image and
+// the window and can be mapped page for page out of the image.
+static bool img_elf_segment(const elf64_phdr_t *ph, u64 size, u64 ipa_base, u64 ipa_size,
+                            img_seg_t *seg)
+{
+    if (ph->p_filesz > ph->p_memsz || ph->p_offset > size || ph->p_filesz > size - ph->p_offset)
+        return false;
+    if (!img_in_window(ph->p_paddr, ph->p_memsz, ipa_base, ipa_size))
+        return false;
+    if ((ph->p_offset ^ ph->p_paddr) & IMG_PAGE_MASK)
+        return false;
+    seg->ipa = ph->p_paddr;
+    seg->offset = ph->p_offset;
+    seg->filesz = ph->p_filesz;
+    seg->memsz = ph->p_memsz;
+    seg->write = (ph->p_flags & PF_W) != 0;
+    seg->exec = (ph->p_flags & PF_X) != 0;
+    return true;
+}
+
+static bool img_load_elf(const u8 *image, u64 size, u64 ipa_base, u64 ipa_size,
+                         guest_image_t *out)
+{
+    const elf64_ehdr_t *eh = (const elf64_ehdr_t *)image;
+    if (eh->e_ident[4] != ELFCLASS64 || eh->e_ident[5] != ELFDATA2LSB ||
+        eh->e_type != ET_EXEC || eh->e_machine != EM_AARCH64 ||
+        eh->e_phentsize != sizeof(elf64_phdr_t) || (eh->e_phoff & 7u) ||
+        eh->e_phoff > size || (u64)eh->e_phnum * sizeof(elf64_phdr_t) > size - eh->e_phoff)
+        return false;
+    const elf64_phdr_t *ph = (const elf64_phdr_t *)(image + eh->e_phoff);
+
+    // Validate every segment before stage-2 changes. Two segments may not
+    // share a page: each page has one backing.
+    u32 loads = 0;
+    for (u32 i = 0; i < eh->e_phnum; ++i)
+    {
+        img_seg_t seg;
+        if (ph[i].p_type != PT_LOAD || !ph[i].p_memsz)
+            continue;
+        if (!img_elf_segment(&ph[i], size, ipa_base, ipa_size, &seg))
+            return false;
+        for (u32 j = 0; j < i; ++j)
+        {
+            img_seg_t prev;
+            if (ph[j].p_type != PT_LOAD || !ph[j].p_memsz)
+                continue;
+            img_elf_segment(&ph[j], size, ipa_base, ipa_size, &prev);
+            if (img_align_down(seg.ipa) < img_align_up(prev.ipa + prev.memsz) &&
+                img_align_down(prev.ipa) < img_align_up(seg.ipa + seg.memsz))
+                return false;
+        }
+        loads++;
+    }
+    if (!loads || !img_in_window(eh->e_entry, 4, ipa_base, ipa_size))
+        return false;
+
+    for (u32 i = 0; i < eh->e_phnum; ++i)
+    {
+        img_seg_t seg;
+        if (ph[i].p_type != PT_LOAD || !ph[i].p_memsz)
+            continue;
+        img_elf_segment(&ph[i], size, ipa_base, ipa_size, &seg);
+        if (!img_map_segment(image, &seg, out))
+            return false;
+        img_note_span(&seg, out);
+    }
+    out->entry = eh->e_entry;
+    return true;
+}
+
+// A raw image is one writable, executable segment.
+static bool img_load_raw(const u8 *image, u64 size, u64 ipa_base, u64 ipa_size,
+                         guest_image_t *out)
+{
+    if (size > ipa_size)
+        return false;
+    const img_seg_t seg = {
+        .ipa = ipa_base, .offset = 0, .filesz = size, .memsz = size,
+        .write = true, .exec = true,
+    };
+    if (!img_map_segment(image, &seg, out))
+        return false;
+    img_note_span(&seg, out);
+    out->entry = ipa_base;
+    return true;
+}
+
+bool guest_image_load(const void *image, u64 size, u64 ipa_base, u64 ipa_size,
+                      guest_image_t *out)
+{
+    hyp_memset(out, 0, sizeof(*out));
+    if (!size || (((u64)image | ipa_base | ipa_size) & IMG_PAGE_MASK))
+        return false;
+    if (img_is_elf(image, size))
+        return img_load_elf(image, size, ipa_base, ipa_size, out);
+    return img_load_raw(image, size, ipa_base, ipa_size, out);
+}
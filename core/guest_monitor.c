@@ -1,22 +1,245 @@
+#include <stdbool.h>
 #include "guest_stubs.h"
 #include "guest_monitor.h"
 
 extern void console_puts(const char*);
 extern void console_hex64(u64);
 
-void guest_shared_dump(void)
-{
-    console_puts("EL2: guest shared slots snapshot\n");
-    for (u32 slot = 0; slot < GUEST_SHARED_SLOT_COUNT; ++slot)
-    {
-        volatile u64 *ptr = guest_shared_slot(slot);
-        u64 value = *ptr;
-        console_puts("  slot ");
-        console_hex64(slot);
-        console_puts(" @ ");
-        console_hex64((u64)ptr);
-        console_puts(" = ");
-        console_hex64(value);
+#define MONITOR_PERIOD_US    10000ull
+#define MONITOR_BLOCK_BYTES  256u
+#define MONITOR_BLOCKS       16u    // 4 KiB of history per guest
+#define MONITOR_RECORD_MAX   (2u * 10u + GUEST_TELEMETRY_FIELDS * 10u)
+#define MONITOR_REPORT_EVERY 256u
+
+// One record: varint time delta, varint mask of changed fields, then one
+// zigzag varint value delta per set bit. A block's first record is encoded
+// against time 0 and all-zero fields, so every block decodes on its own and
+// overwriting the oldest one never breaks a delta chain.
+typedef struct
+{
+    u8 data[MONITOR_BLOCKS][MONITOR_BLOCK_BYTES];
+    u16 used[MONITOR_BLOCKS];
+    u32 cur;                            // block being appended to
+    u32 filled;                         // blocks holding records
+    u64 last_time;                      // encoder state of block `cur`
+    u64 last[GUEST_TELEMETRY_FIELDS];
+    u32 last_seq;
+    u64 samples;                        // records appended
+    u64 torn;                           // periods skipped mid-update
+    u64 bytes;                          // encoded bytes appended
+} monitor_history_t;
+
+static monitor_history_t history[GUEST_TELEMETRY_COUNT];
+static u64 sample_period;
+static u64 next_sample;
+
+static inline u64 read_cntpct(void)
+{
+    u64 v;
+    asm volatile("isb; mrs %0, CNTPCT_EL0" : "=r"(v));
+    return v;
+}
+
+static u32 put_varint(u8 *p, u64 v)
+{
+    u32 n = 0;
+    while (v >= 0x80u) {
+        p[n++] = (u8)(v | 0x80u);
+        v >>= 7;
+    }
+    p[n++] = (u8)v;
+    return n;
+}
+
+static u32 get_varint(const u8 *p, u64 *v)
+{
+    u32 n = 0;
+    u64 out = 0;
+    for (u32 shift = 0; shift < 64; shift += 7) {
+        const u8 b = p[n++];
+        out |= (u64)(b & 0x7Fu) << shift;
+        if (!(b & 0x80u))
+            break;
+    }
+    *v = out;
+    return n;
+}
+
+static inline u64 zigzag(u64 delta)
+{
+    return (delta << 1) ^ (u64)((s64)delta >> 63);
+}
+
+static inline u64 unzigzag(u64 v)
+{
+    return (v >> 1) ^ (u64)-(s64)(v & 1u);
+}
+
+void guest_monitor_init(void)
+{
+    volatile u64 *page = (volatile u64*)GUEST_SHARED_BASE;
+    for (u64 i = 0; i < GUEST_SHARED_SIZE / sizeof(u64); ++i)
+        page[i] = 0;
+
+    u8 *h = (u8*)history;
+    for (u64 i = 0; i < sizeof(history); ++i)
+        h[i] = 0;
+
+    u64 frq;
+    asm volatile("mrs %0, CNTFRQ_EL0" : "=r"(frq));
+    sample_period = frq / 1000000ull * MONITOR_PERIOD_US;
+    next_sample = read_cntpct() + sample_period;
+}
+
+// Copy the record if no update is in flight. The guest is not running while
+// EL2 samples, so an odd sequence would stay odd: skip instead of spinning.
+static bool monitor_snapshot(volatile struct guest_telemetry *t, u32 *seq, u64 *out)
+{
+    const u32 before = t->seq;
+    if (before & 1u)
+        return false;
+    asm volatile("dmb ishld" ::: "memory");
+    for (u32 i = 0; i < GUEST_TELEMETRY_FIELDS; ++i)
+        out[i] = t->field[i];
+    asm volatile("dmb ishld" ::: "memory");
+    if (t->seq != before)
+        return false;
+    *seq = before;
+    return true;
+}
+
+static u32 monitor_encode(const monitor_history_t *h, u64 now, const u64 *vals, u8 *rec)
+{
+    u32 mask = 0;
+    for (u32 i = 0; i < GUEST_TELEMETRY_FIELDS; ++i)
+        if (vals[i] != h->last[i])
+            mask |= 1u << i;
+
+    u32 n = put_varint(rec, now - h->last_time);
+    n += put_varint(rec + n, mask);
+    for (u32 i = 0; i < GUEST_TELEMETRY_FIELDS; ++i)
+        if (mask & (1u << i))
+            n += put_varint(rec + n, zigzag(vals[i] - h->last[i]));
+    return n;
+}
+
+static void monitor_append(monitor_history_t *h, u64 now, const u64 *vals)
+{
+    u8 rec[MONITOR_RECORD_MAX];
+    u32 len = monitor_encode(h, now, vals, rec);
+    if (!h->filled || h->used[h->cur] + len > MONITOR_BLOCK_BYTES) {
+        // Open the next block and re-encode against its zero base.
+        if (h->filled)
+            h->cur = (h->cur + 1u) % MONITOR_BLOCKS;
+        if (h->filled < MONITOR_BLOCKS)
+            h->filled++;
+        h->used[h->cur] = 0;
+        h->last_time = 0;
+        for (u32 i = 0; i < GUEST_TELEMETRY_FIELDS; ++i)
+            h->last[i] = 0;
+        len = monitor_encode(h, now, vals, rec);
+    }
+
+    u8 *dst = &h->data[h->cur][h->used[h->cur]];
+    for (u32 i = 0; i < len; ++i)
+        dst[i] = rec[i];
+    h->used[h->cur] = (u16)(h->used[h->cur] + len);
+    h->last_time = now;
+    for (u32 i = 0; i < GUEST_TELEMETRY_FIELDS; ++i)
+        h->last[i] = vals[i];
+    h->samples++;
+    h->bytes += len;
+}
+
+static void monitor_report(u64 guest_id, const monitor_history_t *h)
+{
+    console_puts("EL2: telemetry guest ");
+    console_hex64(guest_id);
+    console_puts(" samples=");
+    console_hex64(h->samples);
+    console_puts(" torn=");
+    console_hex64(h->torn);
+    console_puts(" bytes=");
+    console_hex64(h->bytes);
+    console_puts(" raw=");
+    console_hex64(h->samples * sizeof(struct guest_telemetry));
+    console_puts("\n");
+}
+
+void guest_monitor_sample(void)
+{
+    const u64 now = read_cntpct();
+    if (!sample_period || (s64)(now - next_sample) < 0)
+        return;
+    next_sample = now + sample_period;
+
+    for (u64 g = 0; g < GUEST_TELEMETRY_COUNT; ++g) {
+        monitor_history_t *h = &history[g];
+        u64 vals[GUEST_TELEMETRY_FIELDS];
+        u32 seq;
+        if (!monitor_snapshot(guest_telemetry(g), &seq, vals)) {
+            h->torn++;
+            continue;
+        }
+        if (seq == h->last_seq)
+            continue; // nothing written since the last record
+        h->last_seq = seq;
+        monitor_append(h, now, vals);
+        if (h->samples % MONITOR_REPORT_EVERY == 0)
+            monitor_report(g, h);
+    }
+}
+
+static void dump_block(const u8 *p, u32 used)
+{
+    u64 time = 0;
+    u64 vals[GUEST_TELEMETRY_FIELDS] = { 0 };
+    for (u32 off = 0; off < used;) {
+        u64 delta, mask;
+        off += get_varint(p + off, &delta);
+        off += get_varint(p + off, &mask);
+        time += delta;
+        console_puts("  t=");
+        console_hex64(time);
+        for (u32 i = 0; i < GUEST_TELEMETRY_FIELDS; ++i) {
+            if (!(mask & (1u << i)))
+                continue;
+            u64 v;
+            off += get_varint(p + off, &v);
+            vals[i] += unzigzag(v);
+            console_puts(" f");
+            console_hex64(i);
+            console_puts("=");
+            console_hex64(vals[i]);
+        }
         console_puts("\n");
     }
 }
+
+void guest_telemetry_dump(u64 guest_id)
+{
+    if (guest_id >= GUEST_TELEMETRY_COUNT)
+        return;
+    const monitor_history_t *h = &history[guest_id];
+
+    console_puts("EL2: guest telemetry snapshot\n");
+    u64 vals[GUEST_TELEMETRY_FIELDS];
+    u32 seq;
+    if (monitor_snapshot(guest_telemetry(guest_id), &seq, vals)) {
+        for (u32 i = 0; i < GUEST_TELEMETRY_FIELDS; ++i) {
+            console_puts("  field ");
+            console_hex64(i);
+            console_puts(" = ");
+            console_hex64(vals[i]);
+            console_puts("\n");
+        }
+    } else {
+        console_puts("  (update in progress)\n");
+    }
+
+    monitor_report(guest_id, h);
+    for (u32 b = 0; b < h->filled; ++b) {
+        const u32 blk = (h->cur + MONITOR_BLOCKS - h->filled + 1u + b) % MONITOR_BLOCKS;
+        dump_block(h->data[blk], h->used[blk]);
+    }
+}
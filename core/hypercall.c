@@ -0,0 +1,342 @@
+#include <stdint.h>
+#include "trap.h"
+#include "guest_api.h"
+#include "guest_layout.h"
+#include "guest_mem.h"
+#include "memops.h"
+#include "timer.h"
+#include "vgic.h"
+#include "vm.h"
+#include "prof.h"
+#include "poll_core.h"
+
+extern void console_puts(const char*);
+extern void console_hex64(u64);
+
+// Exit accounting for task reports: how many records EL2 consumed and how many
+// guest exits it took to get them (per-report calls, multicalls, ring drains).
+static struct
+{
+    u64 records;
+    u64 sync_exits;
+    u64 ring_exits;
+} report_stats;
+
+// Set while a multicall runs so its reports count as a single exit.
+static bool in_multicall;
+static bool multicall_reported;
+
+void guest_report_print(const vcpu_t *current, const struct guest_task_result *res)
+{
+    console_puts("[guest");
+    char suffix[3] = { '0' + (char)current->vcpu_id, ']', '\0' };
+    console_puts(suffix);
+    console_puts(" ");
+    // `desc` sits in guest memory, which the guest may still be writing:
+    // print a terminated copy.
+    char desc[sizeof(res->desc) + 1];
+    hyp_memcpy(desc, res->desc, sizeof(res->desc));
+    desc[sizeof(res->desc)] = '\0';
+    console_puts(desc);
+    console_puts(" data0=");
+    console_hex64(res->data0);
+    console_puts(" data1=");
+    console_hex64(res->data1);
+    if (res->stolen_ns) {
+        console_puts(" stolen_ns=");
+        console_hex64(res->stolen_ns);
+    }
+    console_puts("\n");
+
+    // Report timer telemetry carried in the guest task result to validate virtual time isolation.
+    if (res->time_before || res->time_after || res->time_target || res->memwalk_time)
+    {
+        console_puts("  timers: before=");
+        console_hex64(res->time_before);
+        console_puts(" after=");
+        console_hex64(res->time_after);
+        console_puts(" target=");
+        console_hex64(res->time_target);
+        console_puts(" memwalk_time=");
+        console_hex64(res->memwalk_time);
+        console_puts("\n");
+    }
+}
+
+// SCHISM_HYP_TASK_REPORT: x1 points at a struct guest_task_result.
+static void hyp_task_report(vcpu_t *vcpu, smccc_args_t *args)
+{
+    const struct guest_task_result *res =
+        guest_ipa_to_ptr(args->a[1], sizeof(struct guest_task_result));
+    if (!res) {
+        args->a[0] = SMCCC_RET_INVALID_PARAM;
+        return;
+    }
+
+    if (in_multicall)
+        multicall_reported = true;
+    else
+        report_stats.sync_exits++;
+    report_stats.records++;
+    guest_report_print(vcpu, res);
+    args->a[0] = SMCCC_RET_SUCCESS;
+}
+
+// Consume every record the guest queued in its report ring. Called from the
+// doorbell hypercall and from the WFI path, so one exit drains a whole batch.
+u32 guest_report_ring_drain(vcpu_t *current)
+{
+    if (!current || current->vcpu_id < 0 ||
+        current->vcpu_id >= GUEST_REPORT_RING_COUNT)
+        return 0;
+
+    struct guest_report_ring *ring = (struct guest_report_ring *)vm_record_pa(
+        current->vm, GUEST_REPORT_RING_BASE + (u64)current->vcpu_id * GUEST_REPORT_RING_STRIDE);
+
+    u32 tail = ring->tail;
+    u32 head = ring->head;
+    if (head == tail)
+        return 0;
+    if (head - tail > GUEST_REPORT_RING_ENTRIES)
+    {
+        // A corrupted producer index: drop the batch rather than replaying stale slots.
+        console_puts("EL2: report ring overrun, resyncing\n");
+        ring->tail = head;
+        return 0;
+    }
+
+    asm volatile("dmb ish" ::: "memory"); // read head before the records it covers
+    u32 drained = 0;
+    for (; tail != head; ++tail, ++drained)
+        guest_report_print(current, &ring->entries[tail % GUEST_REPORT_RING_ENTRIES]);
+    asm volatile("dmb ish" ::: "memory"); // finish reading slots before handing them back
+    ring->tail = tail;
+
+    report_stats.ring_exits++;
+    report_stats.records += drained;
+
+    console_puts("  ring: drained=");
+    console_hex64(drained);
+    console_puts(" records=");
+    console_hex64(report_stats.records);
+    console_puts(" exits=");
+    console_hex64(report_stats.sync_exits + report_stats.ring_exits);
+    console_puts("\n");
+    return drained;
+}
+
+// SCHISM_HYP_RING_DOORBELL: the guest crossed its watermark or flushed.
+static void hyp_ring_doorbell(vcpu_t *vcpu, smccc_args_t *args)
+{
+    args->a[1] = guest_report_ring_drain(vcpu);
+    args->a[0] = SMCCC_RET_SUCCESS;
+}
+
+// SCHISM_HYP_TIME_SET: rebase the guest's virtual time to x1. Adjusts
+// the counter offset and reprograms the timers so pending compares stay coherent.
+static void hyp_time_set(vcpu_t *current, smccc_args_t *args)
+{
+    u64 desired = args->a[1];
+    u64 phys_counter;
+    asm volatile("mrs %0, CNTPCT_EL0" : "=r"(phys_counter));
+
+    u64 offset = phys_counter - desired;
+    current->arch.cntvct_el0 = desired;
+    current->arch.cntvoff_el2 = offset;
+    timer_load_offset(offset);
+    pvclock_rebased(current);
+    poll_ring_publish_offset(current);
+    u64 phys_cval = timer_cval_to_hw(current, current->arch.tf.cntp_cval_el0);
+    asm volatile("msr CNTP_CVAL_EL0, %0" : : "r"(phys_cval));
+    asm volatile("msr CNTP_CTL_EL0, %0" : : "r"(current->arch.tf.cntp_ctl_el0));
+    asm volatile("msr CNTV_CVAL_EL0, %0" : : "r"(current->arch.tf.cntv_cval_el0));
+    asm volatile("msr CNTV_CTL_EL0, %0" : : "r"(current->arch.tf.cntv_ctl_el0));
+    asm volatile("isb");
+    args->a[0] = SMCCC_RET_SUCCESS;
+    args->a[1] = desired; // applied value
+}
+
+// SCHISM_HYP_YIELD_TO: paravirtual spinlocks name the lock holder so EL2 can
+// run it instead of letting the caller burn its slice.
+static void hyp_yield_to(vcpu_t *vcpu, smccc_args_t *args)
+{
+    switch (vcpu_yield_to(vcpu, (int)args->a[1])) {
+    case 0:  args->a[0] = SMCCC_RET_SUCCESS; break;
+    case -2: args->a[0] = SMCCC_RET_NOT_REQUIRED; break;
+    default: args->a[0] = SMCCC_RET_INVALID_PARAM; break;
+    }
+}
+
+// SCHISM_HYP_CHAN_DOORBELL: the caller published into a channel ring whose
+// other end sleeps. Making the doorbell SGI pending also ends the peer's WFI
+// block, so it runs at the caller's next exit instead of at its timeout.
+static void hyp_chan_doorbell(vcpu_t *vcpu, smccc_args_t *args)
+{
+    vcpu_t *peer = vm_find_vcpu(vcpu->vm, (int)args->a[1]);
+    if (!peer || peer == vcpu || peer->vcpu_id >= GUEST_CHAN_RINGS) {
+        args->a[0] = SMCCC_RET_INVALID_PARAM;
+        return;
+    }
+    const bool was_blocked = peer->blocked;
+    vgic_set_pending(peer, GUEST_CHAN_SGI);
+    args->a[0] = SMCCC_RET_SUCCESS;
+    args->a[1] = was_blocked && !peer->blocked;
+}
+
+// SCHISM_HYP_TIME_GET: register-only query of the guest's virtual counter.
+static void hyp_time_get(vcpu_t *vcpu, smccc_args_t *args)
+{
+    (void)vcpu;
+    u64 cnt, frq;
+    asm volatile("isb; mrs %0, CNTVCT_EL0" : "=r"(cnt));
+    asm volatile("mrs %0, CNTFRQ_EL0" : "=r"(frq));
+    args->a[0] = SMCCC_RET_SUCCESS;
+    args->a[1] = cnt;
+    args->a[2] = frq;
+}
+
+// SCHISM_HYP_MULTICALL: run a vector of calls (x1 = ops, x2 = count) in one
+// exit. Stops at the first failing entry; x1 returns how many completed.
+static void hyp_multicall(vcpu_t *vcpu, smccc_args_t *args)
+{
+    const u64 count = args->a[2];
+    if (!count || count > SCHISM_MULTICALL_MAX) {
+        args->a[0] = SMCCC_RET_INVALID_PARAM;
+        return;
+    }
+    struct smccc_multicall_op *ops =
+        guest_ipa_to_ptr(args->a[1], count * sizeof(struct smccc_multicall_op));
+    if (!ops) {
+        args->a[0] = SMCCC_RET_INVALID_PARAM;
+        return;
+    }
+
+    in_multicall = true;
+    multicall_reported = false;
+    u64 done = 0;
+    u64 status = SMCCC_RET_SUCCESS;
+    for (; done < count; ++done)
+    {
+        smccc_args_t op;
+        op.a[0] = ops[done].fid;
+        for (u32 i = 0; i < 6; ++i)
+            op.a[i + 1] = ops[done].args[i];
+        op.a[7] = 0;
+
+        if ((u32)op.a[0] == SCHISM_HYP_MULTICALL)
+            op.a[0] = SMCCC_RET_INVALID_PARAM; // no nesting
+        else
+            smccc_dispatch(vcpu, &op);
+
+        for (u32 i = 0; i < 4; ++i)
+            ops[done].ret[i] = op.a[i];
+        if ((s64)(s32)op.a[0] < 0) {
+            status = op.a[0];
+            break;
+        }
+    }
+    if (multicall_reported)
+        report_stats.sync_exits++;
+    in_multicall = false;
+
+    args->a[0] = status;
+    args->a[1] = done;
+}
+
+// SMCCC_VENDOR_HYP_CALL_UID: identifies the hypervisor (x0-x3 hold a UUID).
+static void hyp_call_uid(vcpu_t *vcpu, smccc_args_t *args)
+{
+    (void)vcpu;
+    args->a[0] = 0x5c415b1du; // "schism" UUID 5c415b1d-6d5a-4e1c-9a3e-3f2a7c1b0e44
+    args->a[1] = 0x4e1c6d5au;
+    args->a[2] = 0x3f2a9a3eu;
+    args->a[3] = 0x440e1b7cu;
+}
+
+static void hyp_revision(vcpu_t *vcpu, smccc_args_t *args)
+{
+    (void)vcpu;
+    args->a[0] = SCHISM_HYP_REVISION_MAJOR;
+    args->a[1] = SCHISM_HYP_REVISION_MINOR;
+}
+
+// PSCI SYSTEM_OFF: the VM is the whole machine, so pass the request on to the
+// firmware. `make bench` relies on this to end the QEMU run.
+static void psci_system_off(vcpu_t *vcpu, smccc_args_t *args)
+{
+    guest_report_ring_drain(vcpu);
+    prof_dump();
+    console_puts("EL2: guest requested SYSTEM_OFF\n");
+    register u64 x0 asm("x0") = PSCI_SYSTEM_OFF;
+    asm volatile("smc #0" : "+r"(x0) : : "x1", "x2", "x3", "memory");
+    args->a[0] = x0; // only reached if the firmware refused
+}
+
+// Legacy immediates (HVC #0x60-#0x62) predate the SMCCC services; they shuffle
+// their ad-hoc registers into an SMCCC call so both paths share one handler.
+static trap_result_t legacy_call(trap_ctx_t *ctx, u32 fid, u32 arg_reg, u32 ret_slot, u32 ret_reg)
+{
+    vcpu_t *current = ctx->vcpu;
+    if (!current)
+        return TRAP_UNHANDLED;
+
+    smccc_args_t args = { .a = { fid } };
+    args.a[1] = current->arch.tf.regs[arg_reg];
+    smccc_dispatch(current, &args);
+    current->arch.tf.regs[ret_reg] = args.a[ret_slot];
+    return TRAP_RESUME;
+}
+
+// HVC #0x60: task report, pointer in x1.
+static trap_result_t handle_guest_task_report(trap_ctx_t *ctx)
+{
+    if (ctx->vcpu && !ctx->vcpu->arch.tf.regs[1])
+        return TRAP_RESUME;
+    return legacy_call(ctx, SCHISM_HYP_TASK_REPORT, 1, 0, 0);
+}
+
+// HVC #0x61: time override, target in x0, applied value returned in x0.
+static trap_result_t handle_guest_time_override(trap_ctx_t *ctx)
+{
+    return legacy_call(ctx, SCHISM_HYP_TIME_SET, 0, 1, 0);
+}
+
+// HVC #0x62: report-ring doorbell, records drained returned in x0.
+static trap_result_t handle_guest_report_doorbell(trap_ctx_t *ctx)
+{
+    return legacy_call(ctx, SCHISM_HYP_RING_DOORBELL, 0, 1, 0);
+}
+
+// HVC #0x63: the guest's EL1 vectors forward an unexpected synchronous exception.
+static trap_result_t handle_guest_fault_report(trap_ctx_t *ctx)
+{
+    console_puts("EL2: guest synchronous exception report\n");
+    if (ctx->vcpu) {
+        u64 guest_esr = ctx->vcpu->arch.tf.regs[0];
+        u64 guest_elr = ctx->vcpu->arch.tf.regs[1];
+        console_puts("  guest ESR_EL1: "); console_hex64(guest_esr); console_puts("\n");
+        console_puts("  guest ELR_EL1: "); console_hex64(guest_elr); console_puts("\n");
+    }
+    for (;;)
+        asm volatile("wfi");
+    return TRAP_UNHANDLED;
+}
+
+void hypercall_init(void)
+{
+    trap_register_smccc(SMCCC_VENDOR_HYP_CALL_UID, hyp_call_uid);
+    trap_register_smccc(SMCCC_VENDOR_HYP_REVISION, hyp_revision);
+    trap_register_smccc(SCHISM_HYP_TASK_REPORT, hyp_task_report);
+    trap_register_smccc(SCHISM_HYP_TIME_SET, hyp_time_set);
+    trap_register_smccc(SCHISM_HYP_TIME_GET, hyp_time_get);
+    trap_register_smccc(SCHISM_HYP_RING_DOORBELL, hyp_ring_doorbell);
+    trap_register_smccc(SCHISM_HYP_YIELD_TO, hyp_yield_to);
+    trap_register_smccc(SCHISM_HYP_CHAN_DOORBELL, hyp_chan_doorbell);
+    trap_register_smccc(SCHISM_HYP_MULTICALL, hyp_multicall);
+    trap_register_smccc(PSCI_SYSTEM_OFF, psci_system_off);
+
+    trap_register_hvc(0x60, handle_guest_task_report);
+    trap_register_hvc(0x61, handle_guest_time_override);
+    trap_register_hvc(0x62, handle_guest_report_doorbell);
+    trap_register_hvc(0x63, handle_guest_fault_report);
+}
@@ -0,0 +1,86 @@
+#include <stddef.h>
+#include "irq.h"
+#include "gic.h"
+
+extern void console_puts(const char*);
+extern void console_hex64(u64);
+
+// Forwarded interrupts between two statistics lines on the console.
+#define IRQ_STATS_PERIOD 256u
+
+typedef struct irq_stats
+{
+    u64 count;
+    u64 forwarded;
+    u64 lat_sum;   // CNTPCT ticks from source to list register
+    u64 lat_max;
+    u64 lat_count;
+} irq_stats_t;
+
+static irq_handler_t irq_table[IRQ_NR_INTIDS];
+static irq_stats_t irq_stats[IRQ_NR_INTIDS];
+
+bool irq_register(u32 intid, irq_handler_t fn)
+{
+    if (intid >= IRQ_NR_INTIDS || irq_table[intid])
+        return false;
+    irq_table[intid] = fn;
+    return true;
+}
+
+void irq_note_latency(u32 intid, u64 ticks)
+{
+    if (intid >= IRQ_NR_INTIDS)
+        return;
+    irq_stats_t *st = &irq_stats[intid];
+    st->lat_sum += ticks;
+    st->lat_count++;
+    if (ticks > st->lat_max)
+        st->lat_max = ticks;
+}
+
+static void irq_stats_print(u32 intid)
+{
+    const irq_stats_t *st = &irq_stats[intid];
+    console_puts("EL2: IRQ ");
+    console_hex64(intid);
+    console_puts(" taken=");
+    console_hex64(st->count);
+    console_puts(" forwarded=");
+    console_hex64(st->forwarded);
+    console_puts(" latency avg=");
+    console_hex64(st->lat_count ? st->lat_sum / st->lat_count : 0);
+    console_puts(" max=");
+    console_hex64(st->lat_max);
+    console_puts(" ticks\n");
+}
+
+void irq_dispatch(vcpu_t *vcpu)
+{
+    for (;;) {
+        const u64 iar = gic_ack();
+        const u32 intid = (u32)(iar & 0xFFFFFFu);
+        if (intid >= GIC_INTID_SPURIOUS)
+            break;
+
+        irq_result_t res = IRQ_UNHANDLED;
+        if (intid < IRQ_NR_INTIDS) {
+            irq_stats[intid].count++;
+            if (irq_table[intid])
+                res = irq_table[intid](vcpu, intid);
+        }
+
+        gic_eoi(iar); // priority drop only
+        if (res == IRQ_FORWARDED) {
+            if ((++irq_stats[intid].forwarded % IRQ_STATS_PERIOD) == 0)
+                irq_stats_print(intid);
+            continue; // the guest's EOI deactivates it through ICH_LR.HW
+        }
+        gic_deactivate(iar);
+        if (res == IRQ_UNHANDLED) {
+            console_puts("EL2: unexpected IRQ ");
+            console_hex64(intid);
+            console_puts("\n");
+        }
+    }
+}
@@ -4,7 +4,35 @@
 #include "el2_mmu.h"
 #include "s2_mmu.h"
 #include "vcpu.h"
+#include "vm.h"
 #include "guest_stubs.h"
+#include "guest_api.h"
+#include "poll_core.h"
+#include "trap.h"
+#include "gic.h"
+#include "timer.h"
+#include "steal_time.h"
+#include "memops.h"
+#include "virtio_mmio.h"
+#include "guest_monitor.h"
+#include "vpmu.h"
+#include "prof.h"
+#include "guest_image.h"
+#include "vm_snapshot.h"
+#include "wss.h"
+
+// Build with BENCH=1 (`make bench`) to boot the benchmark guests instead of
+// counter_os and memwalk_os.
+#ifndef CONFIG_BENCH
+#define CONFIG_BENCH 0
+#endif
+
+// Build with GUEST_IMG=<file> to stage that image at GUEST_IMAGE_BASE and
+// boot it as a third vCPU next to the built-in guests.
+#ifndef CONFIG_GUEST_IMAGE
+#define CONFIG_GUEST_IMAGE 0
+#define GUEST_IMAGE_BYTES  0ull
+#endif
 
 extern void console_init(void);
 extern void console_puts(const char*);
@@ -15,6 +43,7 @@ extern u8 __rodata_start[], __rodata_end[];
 extern u8 __data_start[], __data_end[];
 extern u8 __bss_start[], __bss_end[];
 extern u8 __stack_bottom[], __stack_top[];
+extern u8 __poll_stack_bottom[], __poll_stack_top[];
 
 static inline u64 read_CurrentEL(void){ u64 x; asm volatile("mrs %0, CurrentEL":"=r"(x)); return x; }
 
@@ -25,7 +54,8 @@ static void bss_clear(void){
 
 extern void el1_start(void);
 
-static vcpu_t vcpu_pool[2];
+static vcpu_t *vcpu_pool[2]; // from the boot CPU's arena (vcpu_alloc())
+static sch_vm_t vm0;
 
 static void memclr(void* ptr, size_t bytes)
 {
@@ -34,9 +64,29 @@ static void memclr(void* ptr, size_t bytes)
         *p++ = 0;
 }
 
-static void vcpu_init_slot(vcpu_t* vcpu, int id, u64 entry, u64 stack, u64 vttbr_snapshot)
+// Map the guest RAM above the hypervisor image 1:1 so EL2 can follow guest
+// pointers (mailboxes, report/poll rings, hypercall buffers). The image itself
+// keeps its per-section permissions; the window starts at the next 2MB
+// boundary so it can use block mappings.
+static void map_guest_ram_window(void)
+{
+    const u64 block = 0x200000ull;
+    u64 start = ((u64)__poll_stack_top + block - 1ull) & ~(block - 1ull);
+    u64 end = GUEST_RAM_BASE + GUEST_RAM_SIZE;
+    if (start < end)
+        el2_map_range(start, start, end - start, NORMAL_WB, false, false);
+}
+
+static void report_rings_reset(void)
+{
+    for (u32 i = 0; i < GUEST_REPORT_RING_COUNT; ++i)
+        memclr((void*)(GUEST_REPORT_RING_BASE + i * GUEST_REPORT_RING_STRIDE),
+               sizeof(struct guest_report_ring));
+}
+
+static void vcpu_init_slot(vcpu_t* vcpu, int id, u64 entry, u64 stack, u64 vttbr_snapshot,
+                           u32 features)
 {
-    memclr(vcpu, sizeof(*vcpu));
     vcpu->arch.cntvoff_el2 = 0;
     asm volatile("mrs %0, TTBR0_EL1" : "=r"(vcpu->arch.tf.ttbr0_el1));
     asm volatile("mrs %0, TTBR1_EL1" : "=r"(vcpu->arch.tf.ttbr1_el1));
@@ -46,7 +96,7 @@ static void vcpu_init_slot(vcpu_t* vcpu, int id, u64 entry, u64 stack, u64 vttbr
     asm volatile("mrs %0, CNTKCTL_EL1" : "=r"(vcpu->arch.tf.cntkctl_el1));
     asm volatile("mrs %0, CNTP_CTL_EL0" : "=r"(vcpu->arch.tf.cntp_ctl_el0));
     asm volatile("mrs %0, CNTP_CVAL_EL0" : "=r"(vcpu->arch.tf.cntp_cval_el0));
-    vcpu->arch.tf.cntp_cval_el0 += vcpu->arch.cntvoff_el2;
+    vcpu->arch.tf.cntp_cval_el0 -= vcpu->arch.cntvoff_el2;
     asm volatile("mrs %0, CNTV_CTL_EL0" : "=r"(vcpu->arch.tf.cntv_ctl_el0));
     asm volatile("mrs %0, CNTV_CVAL_EL0" : "=r"(vcpu->arch.tf.cntv_cval_el0));
     vcpu->arch.tf.elr_el1 = entry;
@@ -59,13 +109,52 @@ static void vcpu_init_slot(vcpu_t* vcpu, int id, u64 entry, u64 stack, u64 vttbr
     asm volatile("mrs %0, CNTPCT_EL0" : "=r"(cntpct));
     vcpu->arch.cntvct_el0 = cntpct; // start virtual counter aligned with physical
     vcpu->vcpu_id = id;
+    vcpu_set_features(vcpu, features);
 }
 
+#if CONFIG_GUEST_IMAGE
+// Map the staged image into the load window without copying it and give it a
+// vCPU of its own, entered with its stack at the top of the window. NULL if
+// the image does not load.
+static vcpu_t* guest_image_boot(u64 vttbr_snapshot)
+{
+    guest_image_t img;
+    if (GUEST_IMAGE_BYTES > GUEST_IMAGE_SIZE ||
+        !guest_image_load((const void*)GUEST_IMAGE_BASE, GUEST_IMAGE_BYTES,
+                          GUEST_LOAD_BASE, GUEST_LOAD_SIZE, &img)) {
+        console_puts("EL2: guest image load failed.\n");
+        return NULL;
+    }
+    console_puts("EL2: guest image entry=");
+    console_hex64(img.entry);
+    console_puts(" shared=");
+    console_hex64(img.shared_pages);
+    console_puts(" cow=");
+    console_hex64(img.cow_pages);
+    console_puts(" copied=");
+    console_hex64(img.copied_pages);
+    console_puts("\n");
+
+    vcpu_t* vcpu = vcpu_alloc(0);
+    if (vcpu)
+        // Unlike the demo guests, an image is free to use FP/SIMD.
+        vcpu_init_slot(vcpu, 2, img.entry, GUEST_LOAD_BASE + GUEST_LOAD_SIZE, vttbr_snapshot,
+                       VCPU_FEAT_VGIC | VCPU_FEAT_FP);
+    return vcpu;
+}
+#endif
+
 void el2_main(void){
     bss_clear();
     console_init();
     console_puts("EL2: Hello from EL2!\n");
 
+    trap_init();
+    hypercall_init();
+    vtimer_init();
+    vgic_init();
+    memops_init();
+
     el2_mmu_init();
     el2_map_range((u64)__text_start,  (u64)__text_start,
                   (u64)(__text_end   - __text_start),
@@ -87,30 +176,118 @@ void el2_main(void){
                   (u64)(__stack_top   - __stack_bottom),
                   NORMAL_WB, false, false);
 
+    el2_map_range((u64)__poll_stack_bottom, (u64)__poll_stack_bottom,
+                  (u64)(__poll_stack_top - __poll_stack_bottom),
+                  NORMAL_WB, false, false);
+
     el2_map_range(UART_PA, UART_PA, UART_SIZE,
                   DEVICE_nGnRE, false, false);
 
+    el2_map_range(GICD_BASE, GICD_BASE, GICD_SIZE,
+                  DEVICE_nGnRE, false, false);
+
+    el2_map_range(GICR_BASE, GICR_BASE, GICR_STRIDE * GICR_MAP_CPUS,
+                  DEVICE_nGnRE, false, false);
+
+    map_guest_ram_window();
+
+    el2_map_range(DISK_IMAGE_BASE, DISK_IMAGE_BASE, DISK_IMAGE_SIZE,
+                  NORMAL_WB, false, false);
+
+#if CONFIG_GUEST_IMAGE
+    el2_map_range(GUEST_IMAGE_BASE, GUEST_IMAGE_BASE, GUEST_IMAGE_SIZE,
+                  NORMAL_WB, true, false);
+#endif
+
     el2_mmu_enable();
     console_puts("EL2: Stage-1 MMU enabled.\n");
 
-    s2_build_tables_identity(0x40000000ull, 0x40000000ull,
-                             0x40000000ull, 1, S2_VM_GUARD_BYTES,
+    // Guest RAM only: the disk image right above it stays EL2-private.
+    s2_build_tables_identity(GUEST_RAM_BASE, GUEST_RAM_BASE,
+                             GUEST_RAM_SIZE, 1, S2_VM_GUARD_BYTES,
                              1, 1, 1);
     console_puts("EL2: Stage-2 tables built.\n");
 
     s2_program_regs_and_enable();
     console_puts("EL2: Stage-2 MMU enabled.\n");
 
+    gic_init();
+    console_puts("EL2: GICv3 and virtual CPU interface enabled.\n");
+    vpmu_init();
+    prof_init();
+
+    guest_monitor_init();
+    report_rings_reset();
+    poll_rings_reset();
+    pvclock_reset();
+    steal_time_init();
+    vm_snapshot_init();
+    wss_init();
+    memclr((void*)GUEST_LOCK_BASE, GUEST_LOCK_SIZE);
+    memclr((void*)GUEST_CHAN_BASE, GUEST_CHAN_RINGS * GUEST_CHAN_STRIDE);
+
     u64 vttbr_snapshot;
     asm volatile("mrs %0, VTTBR_EL2" : "=r"(vttbr_snapshot));
 
-    vcpu_init_slot(&vcpu_pool[0], 0, (u64)guest_counter_os, 0x40080000ull, vttbr_snapshot);
-    vcpu_init_slot(&vcpu_pool[1], 1, (u64)guest_memwalk_os, 0x400A0000ull, vttbr_snapshot);
+    vcpu_pool[0] = vcpu_alloc(0);
+    vcpu_pool[1] = vcpu_alloc(0);
+
+    // The guests are built with -mgeneral-regs-only and never touch FP/SIMD;
+    // only counter_os profiles itself with the PMU.
+#if CONFIG_BENCH
+    vcpu_init_slot(vcpu_pool[0], 0, (u64)guest_bench_os, 0x40080000ull, vttbr_snapshot,
+                   VCPU_FEAT_VGIC);
+    vcpu_init_slot(vcpu_pool[1], 1, (u64)guest_bench_peer, 0x400A0000ull, vttbr_snapshot,
+                   VCPU_FEAT_VGIC);
+#else
+    vcpu_init_slot(vcpu_pool[0], 0, (u64)guest_counter_os, 0x40080000ull, vttbr_snapshot,
+                   VCPU_FEAT_VGIC | VCPU_FEAT_PMU);
+    vcpu_init_slot(vcpu_pool[1], 1, (u64)guest_memwalk_os, 0x400A0000ull, vttbr_snapshot,
+                   VCPU_FEAT_VGIC);
+#endif
+#if CONFIG_GUEST_IMAGE
+    vcpu_t* image_vcpu = guest_image_boot(vttbr_snapshot);
+#endif
+
+    // Both guests share one identity stage-2, so they are the vCPUs of one VM.
+    vm_init(&vm0, 0, vttbr_snapshot);
+    vm_add_vcpu(&vm0, vcpu_pool[0]);
+    vm_add_vcpu(&vm0, vcpu_pool[1]);
+#if CONFIG_GUEST_IMAGE
+    if (image_vcpu)
+        vm_add_vcpu(&vm0, image_vcpu);
+#endif
+    vgic_mmio_attach(&vm0);
+    mmio_scratch_attach(&vm0, GUEST_MMIO_SCRATCH_BASE);
+    if (!virtio_blk_attach(&vm0, GUEST_VIRTIO_BLK_BASE, GUEST_VIRTIO_BLK_INTID,
+                           (void*)DISK_IMAGE_BASE, DISK_IMAGE_SIZE))
+        console_puts("EL2: virtio-blk attach failed.\n");
+    for (u32 i = 0; i < GUEST_NET_PORTS; ++i) {
+        const u8 mac[VIRTIO_NET_ETH_ALEN] = { 0x52, 0x54, 0x00, 0x5c, 0x00, (u8)i };
+        if (!virtio_net_attach(&vm0, GUEST_VIRTIO_NET_BASE + i * GUEST_VIRTIO_NET_STRIDE,
+                               GUEST_VIRTIO_NET_INTID + i, mac))
+            console_puts("EL2: virtio-net attach failed.\n");
+    }
+
+    vcpu_scheduler_register(vcpu_pool[0]);
+    vcpu_scheduler_register(vcpu_pool[1]);
+    vcpu_scheduler_set_current(vcpu_pool[0]);
+    vcpu_acct_set(vcpu_pool[0], VCPU_ACCT_RUNNABLE); // start the accounting clocks
+    vcpu_acct_set(vcpu_pool[1], VCPU_ACCT_RUNNABLE);
+#if CONFIG_GUEST_IMAGE
+    if (image_vcpu) {
+        vcpu_scheduler_register(image_vcpu);
+        vcpu_acct_set(image_vcpu, VCPU_ACCT_RUNNABLE);
+    }
+#endif
 
-    vcpu_scheduler_register(&vcpu_pool[0]);
-    vcpu_scheduler_register(&vcpu_pool[1]);
-    vcpu_scheduler_set_current(&vcpu_pool[0]);
+#if CONFIG_POLL_CORE
+    poll_ring_bind(0, vcpu_pool[0]);
+    poll_ring_bind(1, vcpu_pool[1]);
+    if (poll_core_start())
+        console_puts("EL2: Polling core requested on CPU1.\n");
+#endif
 
     console_puts("EL2: Launching initial VCPU...\n");
-    vcpu_run(&vcpu_pool[0]);
+    vcpu_run(vcpu_pool[0]);
 }
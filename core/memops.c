@@ -0,0 +1,10 @@
+#include "memops.h"
+
+u8 memops_mops_enabled;
+
+void memops_init(void)
+{
+    u64 isar2;
+    asm volatile("mrs %0, S3_0_C0_C6_2" : "=r"(isar2)); // ID_AA64ISAR2_EL1
+    memops_mops_enabled = ((isar2 >> 16) & 0xFull) != 0; // MOPS, bits [19:16]
+}
@@ -0,0 +1,221 @@
+#include <stddef.h>
+#include "mmio_bus.h"
+#include "vm.h"
+
+// ESR_EL2 ISS fields for data aborts.
+#define DABT_ISV        (1ull << 24)
+#define DABT_SAS(esr)   ((u32)(((esr) >> 22) & 0x3u))
+#define DABT_SSE        (1ull << 21)
+#define DABT_SRT(esr)   ((u32)(((esr) >> 16) & 0x1Fu))
+#define DABT_SF         (1ull << 15)
+#define DABT_WNR        (1ull << 6)
+
+// One decoded guest load or store.
+typedef struct mmio_access
+{
+    bool is_write;
+    bool sign_extend;
+    bool sf;          // destination is an X register
+    u32 size;         // bytes
+    u32 rt;
+    bool writeback;   // pre/post-indexed: Rn += imm9 after the access
+    u32 rn;
+    s64 imm9;
+} mmio_access_t;
+
+void mmio_bus_init(mmio_bus_t *bus)
+{
+    bus->count = 0;
+}
+
+bool mmio_bus_register(mmio_bus_t *bus, u64 base, u64 size, const mmio_ops_t *ops,
+                       void *opaque, const char *name)
+{
+    if (!size || base + size < base || bus->count >= MMIO_BUS_MAX_REGIONS)
+        return false;
+
+    u32 pos = 0;
+    while (pos < bus->count && bus->regions[pos].base < base)
+        ++pos;
+    if (pos > 0) {
+        const mmio_region_t *prev = &bus->regions[pos - 1];
+        if (prev->base + prev->size > base)
+            return false;
+    }
+    if (pos < bus->count && base + size > bus->regions[pos].base)
+        return false;
+
+    for (u32 i = bus->count; i > pos; --i)
+        bus->regions[i] = bus->regions[i - 1];
+    bus->regions[pos] = (mmio_region_t){
+        .base = base, .size = size, .ops = ops, .opaque = opaque, .name = name,
+    };
+    bus->count++;
+    return true;
+}
+
+mmio_region_t *mmio_bus_find(mmio_bus_t *bus, u64 ipa)
+{
+    u32 lo = 0, hi = bus->count;
+    while (lo < hi) {
+        const u32 mid = lo + (hi - lo) / 2u;
+        mmio_region_t *r = &bus->regions[mid];
+        if (ipa < r->base)
+            hi = mid;
+        else if (ipa - r->base >= r->size)
+            lo = mid + 1u;
+        else
+            return r;
+    }
+    return NULL;
+}
+
+// ISV=1: the syndrome describes the access completely.
+static void mmio_decode_esr(u64 esr, mmio_access_t *acc)
+{
+    acc->is_write = (esr & DABT_WNR) != 0;
+    acc->sign_extend = (esr & DABT_SSE) != 0;
+    acc->sf = (esr & DABT_SF) != 0;
+    acc->size = 1u << DABT_SAS(esr);
+    acc->rt = DABT_SRT(esr);
+    acc->writeback = false;
+}
+
+// ISV=0 (e.g. pre/post-indexed forms): decode the integer single-register
+// load/store classes by hand. Pairs, exclusives and SIMD&FP are refused; the
+// class masks include bit 26 (V) so that a SIMD&FP access never matches.
+static bool mmio_decode_insn(u32 insn, mmio_access_t *acc)
+{
+    acc->writeback = false;
+    if ((insn & 0x3F000000u) == 0x39000000u) {
+        // unsigned immediate offset
+    } else if ((insn & 0x3F200000u) == 0x38000000u) {
+        const u32 idx = (insn >> 10) & 0x3u; // 0 unscaled, 1 post, 2 unprivileged, 3 pre
+        if (idx == 1u || idx == 3u) {
+            acc->writeback = true;
+            acc->imm9 = ((s64)((insn >> 12) & 0x1FFu) << 55) >> 55;
+        }
+    } else if ((insn & 0x3F200C00u) == 0x38200800u) {
+        // register offset
+    } else {
+        return false;
+    }
+
+    const u32 size_log = insn >> 30;
+    const u32 opc = (insn >> 22) & 0x3u;
+    acc->size = 1u << size_log;
+    acc->rt = insn & 0x1Fu;
+    acc->rn = (insn >> 5) & 0x1Fu;
+    switch (opc) {
+    case 0: // STR*
+        acc->is_write = true;
+        acc->sign_extend = false;
+        acc->sf = size_log == 3u;
+        break;
+    case 1: // LDR*, zero-extending
+        acc->is_write = false;
+        acc->sign_extend = false;
+        acc->sf = size_log == 3u;
+        break;
+    case 2: // LDRS* into Xt; size 3 is PRFM
+        if (size_log == 3u)
+            return false;
+        acc->is_write = false;
+        acc->sign_extend = true;
+        acc->sf = true;
+        break;
+    default: // LDRS* into Wt
+        if (size_log >= 2u)
+            return false;
+        acc->is_write = false;
+        acc->sign_extend = true;
+        acc->sf = false;
+        break;
+    }
+    // Writeback to the base register of the access itself is unpredictable.
+    return !(acc->writeback && acc->rn == acc->rt && acc->rn != 31u);
+}
+
+// Read the faulting instruction through the guest's own stage-1 and stage-2.
+// PAR_EL1 belongs to the guest, so it is preserved around the AT.
+static bool mmio_fetch_insn(u64 va, u32 *insn)
+{
+    u64 saved, par;
+    asm volatile("mrs %0, PAR_EL1" : "=r"(saved));
+    asm volatile("at s12e1r, %0; isb" : : "r"(va));
+    asm volatile("mrs %0, PAR_EL1" : "=r"(par));
+    asm volatile("msr PAR_EL1, %0" : : "r"(saved));
+    if (par & 1u)
+        return false;
+    const u64 pa = (par & 0x0000FFFFFFFFF000ull) | (va & 0xFFFull);
+    *insn = *(volatile u32 *)pa;
+    return true;
+}
+
+static bool mmio_writeback(vcpu_t *vcpu, const mmio_access_t *acc)
+{
+    if (!acc->writeback)
+        return true;
+    if (acc->rn == 31u) {
+        // SP: only SP_EL1 is in the trapframe, so refuse EL1t/EL0 stacks.
+        if ((vcpu->arch.tf.spsr_el1 & 0xFu) != 0x5u)
+            return false;
+        vcpu->arch.tf.sp_el1 += (u64)acc->imm9;
+    } else {
+        vcpu->arch.tf.regs[acc->rn] += (u64)acc->imm9;
+    }
+    return true;
+}
+
+bool mmio_emulate(vcpu_t *vcpu, u64 esr, u64 ipa, u64 elr)
+{
+    sch_vm_t *vm = vcpu->vm;
+    if (!vm)
+        return false;
+    vcpu->mmio.exits++;
+
+    // Regions never overlap, so a range check alone validates the cached
+    // slot even if a later registration shifted the table.
+    mmio_region_t *r = vcpu->mmio.last;
+    if (r && ipa - r->base < r->size) {
+        vcpu->mmio.cache_hits++;
+    } else {
+        r = mmio_bus_find(&vm->mmio, ipa);
+        if (!r)
+            return false;
+        vcpu->mmio.last = r;
+    }
+
+    mmio_access_t acc;
+    if (esr & DABT_ISV) {
+        mmio_decode_esr(esr, &acc);
+    } else {
+        u32 insn;
+        if (!mmio_fetch_insn(elr, &insn) || !mmio_decode_insn(insn, &acc))
+            return false;
+        vcpu->mmio.decoded++;
+    }
+
+    const u64 offset = ipa - r->base;
+    const u64 mask = acc.size == 8u ? ~0ull : (1ull << (acc.size * 8u)) - 1ull;
+    r->accesses++;
+    if (acc.is_write) {
+        const u64 val = acc.rt == 31u ? 0 : vcpu->arch.tf.regs[acc.rt] & mask;
+        if (!r->ops->write || !r->ops->write(vcpu, r->opaque, offset, acc.size, val))
+            return false;
+    } else {
+        u64 val = 0;
+        if (!r->ops->read || !r->ops->read(vcpu, r->opaque, offset, acc.size, &val))
+            return false;
+        val &= mask;
+        if (acc.sign_extend && acc.size < 8u) {
+            const u32 shift = 64u - acc.size * 8u;
+            val = (u64)(((s64)(val << shift)) >> shift);
+        }
+        if (!acc.sf)
+            val &= 0xFFFFFFFFull;
+        if (acc.rt != 31u)
+            vcpu->arch.tf.regs[acc.rt] = val;
+    }
+    return mmio_writeback(vcpu, &acc);
+}
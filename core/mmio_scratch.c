@@ -0,0 +1,63 @@
+#include <stddef.h>
+#include "mmio_bus.h"
+#include "vm.h"
+
+// A register file with no side effects, so a guest can time the bare cost of
+// an emulated access.
+//   0x00 DATA  read/write latch
+//   0x08 COUNT accesses seen by this device (read-only)
+#define SCRATCH_REG_DATA  0x00u
+#define SCRATCH_REG_COUNT 0x08u
+#define SCRATCH_SIZE      0x1000ull
+
+typedef struct mmio_scratch
+{
+    u64 data;
+    u64 count;
+} mmio_scratch_t;
+
+static mmio_scratch_t scratch_pool[4];
+static u32 scratch_used;
+
+static bool scratch_read(vcpu_t *vcpu, void *opaque, u64 offset, u32 size, u64 *val)
+{
+    (void)vcpu;
+    (void)size;
+    mmio_scratch_t *s = opaque;
+    s->count++;
+    switch (offset) {
+    case SCRATCH_REG_DATA:  *val = s->data; break;
+    case SCRATCH_REG_COUNT: *val = s->count; break;
+    default:                *val = 0; break;
+    }
+    return true;
+}
+
+static bool scratch_write(vcpu_t *vcpu, void *opaque, u64 offset, u32 size, u64 val)
+{
+    (void)vcpu;
+    (void)size;
+    mmio_scratch_t *s = opaque;
+    s->count++;
+    if (offset == SCRATCH_REG_DATA)
+        s->data = val;
+    return true;
+}
+
+static const mmio_ops_t scratch_ops = {
+    .read = scratch_read,
+    .write = scratch_write,
+};
+
+bool mmio_scratch_attach(struct sch_vm *vm, u64 base)
+{
+    if (scratch_used >= sizeof(scratch_pool) / sizeof(scratch_pool[0]))
+        return false;
+    mmio_scratch_t *s = &scratch_pool[scratch_used];
+    s->data = 0;
+    s->count = 0;
+    if (!mmio_bus_register(&vm->mmio, base, SCRATCH_SIZE, &scratch_ops, s, "scratch"))
+        return false;
+    scratch_used++;
+    return true;
+}
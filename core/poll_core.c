@@ -0,0 +1,254 @@
+#include <stddef.h>
+#include "poll_core.h"
+#include "el2_mmu.h"
+#include "guest_layout.h"
+#include "memops.h"
+#include "trap.h"
+
+extern void console_puts(const char*);
+extern void console_hex64(u64);
+extern void console_enable_smp(void);
+extern void _secondary_start(void);
+
+// PSCI is provided by QEMU through the SMC conduit when virtualization=on.
+#define PSCI_CPU_ON_64   0xC4000003ull
+#define POLL_CORE_MPIDR  1ull // CPU1 on QEMU virt (Aff0 = 1)
+
+// Per-window accounting: utilization is busy/total ticks of the polling loop,
+// latency is the guest-virtual time between submission and completion.
+static struct
+{
+    u64 window_start;
+    u64 busy_ticks;
+    u64 requests;
+    u64 lat_sum;
+    u64 lat_max;
+} poll_stats;
+
+static inline u64 read_cntpct(void)
+{
+    u64 val;
+    asm volatile("isb; mrs %0, CNTPCT_EL0" : "=r"(val) :: "memory");
+    return val;
+}
+
+static inline u64 read_cntfrq(void)
+{
+    u64 val;
+    asm volatile("mrs %0, CNTFRQ_EL0" : "=r"(val));
+    return val;
+}
+
+// What CPU1 may know about the vCPU behind each ring. The vCPU is bound once,
+// before the polling core starts, and never changes; its counter offset
+// moves on every world switch and time rebase, so CPU0 republishes it under
+// a seqcount instead of CPU1 reading vcpu_t while CPU0 writes it.
+typedef struct
+{
+    const vcpu_t *vcpu;
+    u32 seq;     // odd while CPU0 is writing cntvoff
+    u64 cntvoff;
+} poll_binding_t;
+
+static poll_binding_t poll_bindings[GUEST_POLL_RING_COUNT];
+
+static inline struct guest_poll_ring* poll_ring_at(u32 idx)
+{
+    return (struct guest_poll_ring*)(GUEST_POLL_RING_BASE + (u64)idx * GUEST_POLL_RING_STRIDE);
+}
+
+static s64 psci_cpu_on(u64 mpidr, u64 entry, u64 context_id)
+{
+    register u64 x0 asm("x0") = PSCI_CPU_ON_64;
+    register u64 x1 asm("x1") = mpidr;
+    register u64 x2 asm("x2") = entry;
+    register u64 x3 asm("x3") = context_id;
+    asm volatile("smc #0" : "+r"(x0), "+r"(x1), "+r"(x2), "+r"(x3) :: "memory");
+    return (s64)x0;
+}
+
+void poll_rings_reset(void)
+{
+    for (u32 i = 0; i < GUEST_POLL_RING_COUNT; ++i)
+    {
+        u8 *p = (u8*)poll_ring_at(i);
+        for (size_t b = 0; b < sizeof(struct guest_poll_ring); ++b)
+            p[b] = 0;
+    }
+}
+
+void poll_ring_bind(u32 idx, const vcpu_t *vcpu)
+{
+    if (idx >= GUEST_POLL_RING_COUNT)
+        return;
+    poll_binding_t *b = &poll_bindings[idx];
+    b->cntvoff = vcpu->arch.cntvoff_el2;
+    __atomic_store_n(&b->vcpu, vcpu, __ATOMIC_RELEASE);
+}
+
+void poll_ring_publish_offset(const vcpu_t *vcpu)
+{
+    for (u32 i = 0; i < GUEST_POLL_RING_COUNT; ++i)
+    {
+        poll_binding_t *b = &poll_bindings[i];
+        if (b->vcpu != vcpu)
+            continue;
+        __atomic_store_n(&b->seq, b->seq + 1u, __ATOMIC_RELAXED); // odd: update in progress
+        asm volatile("dmb ishst" ::: "memory");
+        b->cntvoff = vcpu->arch.cntvoff_el2;
+        __atomic_store_n(&b->seq, b->seq + 1u, __ATOMIC_RELEASE);
+    }
+}
+
+// Seqcount reader; CPU0 holds the count odd for two stores at most.
+static u64 poll_binding_offset(const poll_binding_t *b)
+{
+    for (;;)
+    {
+        const u32 seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1u)
+            continue;
+        const u64 cntvoff = __atomic_load_n(&b->cntvoff, __ATOMIC_RELAXED);
+        asm volatile("dmb ishld" ::: "memory");
+        if (__atomic_load_n(&b->seq, __ATOMIC_RELAXED) == seq)
+            return cntvoff;
+    }
+}
+
+bool poll_core_start(void)
+{
+    console_enable_smp(); // CPU1 prints too; serialize the UART from here on
+    s64 ret = psci_cpu_on(POLL_CORE_MPIDR, (u64)_secondary_start, 0);
+    if (ret != 0)
+    {
+        console_puts("EL2: PSCI CPU_ON for polling core failed: ");
+        console_hex64((u64)ret);
+        console_puts("\n");
+        return false;
+    }
+    return true;
+}
+
+static void poll_console(const vcpu_t *vcpu, const struct guest_poll_req *req)
+{
+    // Like guest_report_print(): the guest can rewrite the text, terminator
+    // included, while it is printed, so print a copy.
+    char text[sizeof(req->payload.text)];
+    hyp_memcpy(text, req->payload.text, sizeof(text) - 1u);
+    text[sizeof(text) - 1u] = '\0';
+    char prefix[10] = { '[', 'g', 'u', 'e', 's', 't', '0' + (char)vcpu->vcpu_id, ']', ' ', '\0' };
+    console_puts(prefix);
+    console_puts(text);
+}
+
+static void poll_service(const vcpu_t *vcpu, struct guest_poll_req *req, u64 virt_now)
+{
+    switch (req->op)
+    {
+        case GUEST_POLL_OP_TASK_REPORT:
+            guest_report_print(vcpu, &req->payload.report);
+            break;
+        case GUEST_POLL_OP_TIME_QUERY:
+            req->ret[0] = virt_now;
+            req->ret[1] = read_cntfrq();
+            break;
+        case GUEST_POLL_OP_CONSOLE:
+            poll_console(vcpu, req);
+            break;
+        default:
+            break;
+    }
+}
+
+// Complete everything queued in one guest's ring. The bound vCPU's CNTVOFF
+// converts our physical counter into the guest's virtual time for latency and
+// time queries.
+static u32 poll_ring(u32 idx)
+{
+    struct guest_poll_ring *ring = poll_ring_at(idx);
+    const poll_binding_t *b = &poll_bindings[idx];
+    const vcpu_t *vcpu = __atomic_load_n(&b->vcpu, __ATOMIC_ACQUIRE);
+    if (!vcpu)
+        return 0;
+
+    u32 tail = ring->tail;
+    u32 head = ring->head;
+    if (head == tail)
+        return 0;
+    if (head - tail > GUEST_POLL_RING_ENTRIES)
+    {
+        ring->tail = head; // corrupted producer index; drop the batch
+        return 0;
+    }
+
+    asm volatile("dmb ish" ::: "memory"); // read head before the requests it covers
+    u32 done = 0;
+    for (; tail != head; ++tail, ++done)
+    {
+        struct guest_poll_req *req = &ring->entries[tail % GUEST_POLL_RING_ENTRIES];
+        u64 virt_now = read_cntpct() - poll_binding_offset(b);
+        poll_service(vcpu, req, virt_now);
+
+        u64 latency = virt_now - req->submit_time;
+        poll_stats.lat_sum += latency;
+        if (latency > poll_stats.lat_max)
+            poll_stats.lat_max = latency;
+
+        asm volatile("dmb ish" ::: "memory"); // results visible before completion
+        ring->tail = tail + 1;
+    }
+    poll_stats.requests += done;
+    return done;
+}
+
+static void poll_report_window(u64 now)
+{
+    u64 total = now - poll_stats.window_start;
+    if (poll_stats.requests)
+    {
+        console_puts("EL2[cpu1]: poll util_pct=");
+        console_hex64(total ? (poll_stats.busy_ticks * 100) / total : 0);
+        console_puts(" reqs=");
+        console_hex64(poll_stats.requests);
+        console_puts(" lat_avg=");
+        console_hex64(poll_stats.lat_sum / poll_stats.requests);
+        console_puts(" lat_max=");
+        console_hex64(poll_stats.lat_max);
+        console_puts(" ticks\n");
+    }
+    poll_stats.window_start = now;
+    poll_stats.busy_ticks = 0;
+    poll_stats.requests = 0;
+    poll_stats.lat_sum = 0;
+    poll_stats.lat_max = 0;
+}
+
+void el2_poll_core_main(u64 context_id)
+{
+    (void)context_id;
+    el2_mmu_enable(); // tables were built by CPU0; just load them
+
+    for (u32 i = 0; i < GUEST_POLL_RING_COUNT; ++i)
+        poll_ring_at(i)->online = 1;
+    console_puts("EL2[cpu1]: polling core online\n");
+
+    const u64 window = read_cntfrq(); // report once per second
+    poll_stats.window_start = read_cntpct();
+
+    for (;;)
+    {
+        u64 t0 = read_cntpct();
+        u32 done = 0;
+        for (u32 i = 0; i < GUEST_POLL_RING_COUNT; ++i)
+            done += poll_ring(i);
+        u64 t1 = read_cntpct();
+
+        if (done)
+            poll_stats.busy_ticks += t1 - t0;
+        else
+            asm volatile("yield");
+
+        if (t1 - poll_stats.window_start >= window)
+            poll_report_window(t1);
+    }
+}
@@ -0,0 +1,196 @@
+#include <stddef.h>
+#include "arch_ops.h"
+#include "gic.h"
+#include "prof.h"
+#include "vcpu.h"
+#include "vpmu.h"
+
+#if CONFIG_PROFILE
+
+extern void console_puts(const char*);
+extern void console_hex64(u64);
+
+typedef struct
+{
+    u64 pc;   // ELR_EL2 at the overflow
+    u32 vcpu; // scheduled vCPU, PROF_NO_VCPU when idle
+    u32 el;   // exception level the sample interrupted
+} prof_sample_t;
+
+typedef struct
+{
+    prof_sample_t samples[PROF_SAMPLES];
+    u32 count;
+} prof_buf_t;
+
+// The FIQ handler appends to buf[active]; prof_poll() swaps the buffers with
+// FIQs masked for two instructions and prints the full one with them open,
+// so the printing itself shows up in the profile instead of blocking it.
+typedef struct
+{
+    prof_buf_t buf[2];
+    u32 active;
+    u64 taken;   // overflows handled
+    u64 dropped; // samples lost to a full buffer
+} prof_cpu_t;
+
+static prof_cpu_t prof_cpus[PROF_MAX_CPUS];
+static u32 prof_counter;
+static bool prof_enabled;
+
+static u32 prof_cpu_index(void)
+{
+    const u32 aff0 = (u32)(read_sysreg(MPIDR_EL1) & 0xFFu);
+    return aff0 < PROF_MAX_CPUS ? aff0 : 0;
+}
+
+// Reload the reserved counter to overflow PROF_PERIOD cycles from now. The
+// guest's PMSELR_EL0 may be live, so it is put back.
+static void prof_arm(void)
+{
+    const u64 sel = read_sysreg(PMSELR_EL0);
+    write_sysreg(PMSELR_EL0, prof_counter);
+    isb();
+    write_sysreg(PMXEVCNTR_EL0, (u32)(0u - PROF_PERIOD));
+    write_sysreg(PMSELR_EL0, sel);
+    isb();
+}
+
+static void prof_record(u64 pc, u64 spsr)
+{
+    prof_cpu_t *c = &prof_cpus[prof_cpu_index()];
+    prof_buf_t *b = &c->buf[c->active];
+    c->taken++;
+    if (b->count >= PROF_SAMPLES)
+    {
+        c->dropped++;
+        return;
+    }
+    const vcpu_t *v = vcpu_scheduler_current();
+    prof_sample_t *s = &b->samples[b->count++];
+    s->pc = pc;
+    s->vcpu = v ? (u32)v->vcpu_id : PROF_NO_VCPU;
+    s->el = (u32)((spsr >> 2) & 0x3u);
+}
+
+// PPI 23 is shared with the guest counters. The overflow is taken with
+// EOImode 1: a guest overflow forwarded with the HW bit stays active until the
+// guest deactivates it, and EL2 sampling pauses until then.
+static void prof_handle(u64 elr, u64 spsr, bool from_guest)
+{
+    const u64 iar = gic_ack0();
+    if ((iar & 0xFFFFFFull) >= GIC_INTID_SPURIOUS)
+        return;
+
+    bool forwarded = false;
+    if ((iar & 0xFFFFFFull) == GIC_PPI_PMU)
+    {
+        const u64 bit = 1ull << prof_counter;
+        if (read_sysreg(PMOVSSET_EL0) & bit)
+        {
+            write_sysreg(PMOVSCLR_EL0, bit);
+            prof_record(elr, spsr);
+            prof_arm();
+        }
+        forwarded = vpmu_overflow(from_guest);
+    }
+    gic_eoi0(iar);
+    if (!forwarded)
+        gic_deactivate(iar);
+}
+
+void prof_fiq(u64 elr, u64 spsr)
+{
+    prof_handle(elr, spsr, true);
+}
+
+void prof_fiq_el2(u64 elr, u64 spsr)
+{
+    prof_handle(elr, spsr, false);
+}
+
+// One "PROF s <pc> <cpu:32 el:16 vcpu:16>" line per sample.
+static void prof_print(u32 cpu, prof_buf_t *b)
+{
+    for (u32 i = 0; i < b->count; ++i)
+    {
+        const prof_sample_t *s = &b->samples[i];
+        console_puts("PROF s ");
+        console_hex64(s->pc);
+        console_puts(" ");
+        console_hex64(((u64)cpu << 32) | ((u64)s->el << 16) | (s->vcpu & 0xFFFFu));
+        console_puts("\n");
+    }
+    b->count = 0;
+}
+
+static void prof_flush(u32 cpu)
+{
+    prof_cpu_t *c = &prof_cpus[cpu];
+    const u64 daif = prof_fiq_save();
+    prof_buf_t *full = &c->buf[c->active];
+    c->active ^= 1u;
+    prof_fiq_restore(daif);
+    prof_print(cpu, full);
+}
+
+void prof_poll(void)
+{
+    if (!prof_enabled)
+        return;
+    const u32 cpu = prof_cpu_index();
+    const prof_cpu_t *c = &prof_cpus[cpu];
+    if (c->buf[c->active].count >= PROF_SAMPLES / 2u)
+        prof_flush(cpu);
+}
+
+void prof_dump(void)
+{
+    if (!prof_enabled)
+        return;
+    const u32 cpu = prof_cpu_index();
+    const prof_cpu_t *c = &prof_cpus[cpu];
+    prof_flush(cpu);
+    console_puts("PROF end cpu=");
+    console_hex64(cpu);
+    console_puts(" taken=");
+    console_hex64(c->taken);
+    console_puts(" dropped=");
+    console_hex64(c->dropped);
+    console_puts("\n");
+}
+
+void prof_init(void)
+{
+    const int ctr = vpmu_el2_counter();
+    if (ctr < 0)
+    {
+        console_puts("EL2: profiler off, no PMU counter to reserve\n");
+        return;
+    }
+    prof_counter = (u32)ctr;
+
+    // CPU cycles at EL0, EL1 and (NSH) EL2; MDCR_EL2.HPME enables it.
+    write_sysreg(PMSELR_EL0, prof_counter);
+    isb();
+    write_sysreg(PMXEVTYPER_EL0, PMEVTYPER_NSH | PMU_EVT_CPU_CYCLES);
+    prof_arm();
+    write_sysreg(PMOVSCLR_EL0, 1ull << prof_counter);
+    write_sysreg(PMINTENSET_EL1, 1ull << prof_counter);
+    write_sysreg(PMCNTENSET_EL0, 1ull << prof_counter);
+    isb();
+
+    gic_ppi_enable(GIC_PPI_PMU, false);
+    gic_ppi_set_fiq(GIC_PPI_PMU);
+    gic_ppi_enable(GIC_PPI_PMU, true);
+    prof_enabled = true;
+
+    console_puts("EL2: profiler counter=");
+    console_hex64(prof_counter);
+    console_puts(" period=");
+    console_hex64(PROF_PERIOD);
+    console_puts("\n");
+    prof_el2_unmask();
+}
+
+#endif /* CONFIG_PROFILE */
@@ -0,0 +1,53 @@
+#include <stddef.h>
+#include "timer.h"
+#include "guest_api.h"
+#include "guest_layout.h"
+#include "vm.h"
+
+static inline struct guest_pvclock *pvclock_page(const vcpu_t *vcpu)
+{
+    if (!vcpu || vcpu->vcpu_id < 0 || vcpu->vcpu_id >= GUEST_PVCLOCK_COUNT)
+        return NULL;
+    return (struct guest_pvclock *)vm_record_pa(vcpu->vm, GUEST_PVCLOCK_BASE +
+                                                (u64)vcpu->vcpu_id * GUEST_PVCLOCK_STRIDE);
+}
+
+void pvclock_reset(void)
+{
+    u64 frq;
+    asm volatile("mrs %0, CNTFRQ_EL0" : "=r"(frq));
+    for (u32 i = 0; i < GUEST_PVCLOCK_COUNT; ++i)
+    {
+        struct guest_pvclock *pv = (struct guest_pvclock *)
+            (GUEST_PVCLOCK_BASE + (u64)i * GUEST_PVCLOCK_STRIDE);
+        pv->seq = 0;
+        pv->flags = timer_ecv_enabled ? GUEST_PVCLOCK_F_ECV : 0;
+        pv->cntvoff = 0;
+        pv->cntfrq = frq;
+        pv->rebase_count = 0;
+    }
+}
+
+static void pvclock_write(struct guest_pvclock *pv, u64 cntvoff, u64 rebases)
+{
+    pv->seq = pv->seq + 1; // odd: update in progress
+    asm volatile("dmb ishst" ::: "memory");
+    pv->cntvoff = cntvoff;
+    pv->rebase_count = rebases;
+    asm volatile("dmb ishst" ::: "memory");
+    pv->seq = pv->seq + 1;
+}
+
+void pvclock_update(const vcpu_t *vcpu)
+{
+    struct guest_pvclock *pv = pvclock_page(vcpu);
+    if (pv && pv->cntvoff != vcpu->arch.cntvoff_el2)
+        pvclock_write(pv, vcpu->arch.cntvoff_el2, pv->rebase_count);
+}
+
+void pvclock_rebased(const vcpu_t *vcpu)
+{
+    struct guest_pvclock *pv = pvclock_page(vcpu);
+    if (pv)
+        pvclock_write(pv, vcpu->arch.cntvoff_el2, pv->rebase_count + 1);
+}
@@ -1,6 +1,8 @@
 #include "s2_mmu.h"
 #include "types.h"
+#include "arch_ops.h"
 #include "platform.h"
+#include "timer.h"
 
 #define S2_PT_ENTRIES   512
 #define S2_PAGE_SIZE    0x1000ull
@@ -11,6 +13,11 @@
 #define LVL_INDEX_MASK  0x1ffull
 #define S2_MAX_L2_TABLES 16
 #define S2_MAX_L3_TABLES 1024
+#define S2_FRAME_POOL_PAGES 512
+#define S2_MAX_ROOTS    8
+#define S2_AGE_TLBI_PAGES 32 // more accessed pages than this: flush the VMID instead
+#define S2_SW_MASK      (S2_SW_COW | S2_SW_SHARED)
+#define VMID_SHIFT      48
 
 typedef struct s2_l3_table {
     u64 entries[S2_PT_ENTRIES];
@@ -21,12 +28,43 @@ typedef struct s2_l2_table {
     s2_l3_table_t* children[S2_PT_ENTRIES];
 } s2_l2_table_t;
 
-static u64 s2_l1[S2_PT_ENTRIES] __attribute__((aligned(4096)));
+// One stage-2 context: the level-1 table VTTBR_EL2 points at and the L2
+// tables behind it. Root 0 is the one s2_build_tables_identity() builds;
+// s2_clone() hands out the others.
+typedef struct s2_root {
+    u64 l1[S2_PT_ENTRIES];
+    s2_l2_table_t* l1_children[S2_PT_ENTRIES];
+    u64 vttbr;
+} __attribute__((aligned(4096))) s2_root_t;
+
+// A root is in use while its vttbr is set; root 0 always is.
+static s2_root_t s2_roots[S2_MAX_ROOTS];
+// Root the software walks below operate on: the running guest's.
+static s2_root_t* s2_cur = &s2_roots[0];
+// Tables and frames are handed out from the top of each pool; s2_release()
+// returns them to a free stack that is used first.
 static s2_l2_table_t s2_l2_pool[S2_MAX_L2_TABLES] __attribute__((aligned(4096)));
 static s2_l3_table_t s2_l3_pool[S2_MAX_L3_TABLES] __attribute__((aligned(4096)));
-static s2_l2_table_t* s2_l1_children[S2_PT_ENTRIES];
 static u16 s2_l2_used;
 static u16 s2_l3_used;
+static u16 s2_l2_free[S2_MAX_L2_TABLES];
+static u16 s2_l3_free[S2_MAX_L3_TABLES];
+static u16 s2_l2_nfree;
+static u16 s2_l3_nfree;
+static u8 s2_frame_pool[S2_FRAME_POOL_PAGES][S2_PAGE_SIZE] __attribute__((aligned(4096)));
+static u32 s2_frame_pool_used;
+static u16 s2_frame_free[S2_FRAME_POOL_PAGES];
+static u32 s2_frame_nfree;
+// Roots mapping each guest RAM page or pool frame S2_SW_COUNTED; 0 for a page
+// nobody shares that way. The pool is checked first: on the target it lies
+// inside guest RAM.
+static u8 s2_frame_sharers[S2_FRAME_POOL_PAGES];
+static u8 s2_ram_sharers[GUEST_RAM_SIZE / S2_PAGE_SIZE];
+
+bool s2_hw_access_flag(void)
+{
+    return (read_sysreg(ID_AA64MMFR1_EL1) & 0xFull) != 0; // HAFDBS
+}
 
 static inline u64 vtcr_el2_value(void)
 {
@@ -36,6 +74,8 @@ static inline u64 vtcr_el2_value(void)
     // - SL0=1 (starting level 1 for Stage-2)
     // - ORGN0=1, IRGN0=1 (Write-Back Read/Write Allocate - WBWA)
     // - SH0=3 (Inner Shareable)
+    // - HA=1 where FEAT_HAFDBS allows it; every entry starts with AF set, so
+    //   only the working-set sampler ever gives the walker a flag to set
     const u64 TG0_4K  = 0b00ull << 14;  // VTCR_EL2.TG0 -> 4KB granule for Stage-2
     const u64 SH0_IS  = 0b11ull << 12;  // VTCR_EL2.SH0 -> Inner Shareable
     const u64 ORGN0_WB= 0b1ull  << 10;  // VTCR_EL2.ORGN0 -> Outer WBWA
@@ -43,11 +83,10 @@ static inline u64 vtcr_el2_value(void)
     const u64 SL0_L1  = 0b01ull << 6;   // VTCR_EL2.SL0 -> start walk at level 1
     const u64 PS_48   = 0b101ull<< 16;  // VTCR_EL2.PS  -> 48-bit physical address range
     const u64 T0SZ    = (64 - IPA_BITS); // VTCR_EL2.T0SZ -> IPA size (39 bits here)
-    return TG0_4K | SH0_IS | ORGN0_WB | IRGN0_WB | SL0_L1 | T0SZ | PS_48;
+    const u64 HA      = s2_hw_access_flag() ? 1ull << 21 : 0; // VTCR_EL2.HA -> hardware AF updates
+    return TG0_4K | SH0_IS | ORGN0_WB | IRGN0_WB | SL0_L1 | T0SZ | PS_48 | HA;
 }
 
-#define WR(reg, val) asm volatile("msr " reg ", %0" ::"r"(val) : "memory")
-
 #define PA_48_MASK ((1ull << 48) - 1)
 
 static inline u64 align_down(u64 val, u64 align)
@@ -62,8 +101,7 @@ static inline u64 align_up(u64 val, u64 align)
 
 static void s2_pt_panic(void)
 {
-    for (;;)
-        asm volatile("wfi");
+    cpu_halt();
 }
 
 static void zero_qwords(u64* buf, u64 count)
@@ -78,20 +116,41 @@ static void zero_l2_children(s2_l2_table_t* tbl)
         tbl->children[i] = 0;
 }
 
+static u8* s2_sharers(u64 pa)
+{
+    const u64 pool = (u64)s2_frame_pool;
+    if (pa - pool < sizeof(s2_frame_pool))
+        return &s2_frame_sharers[(pa - pool) / S2_PAGE_SIZE];
+    if (pa - GUEST_RAM_BASE < GUEST_RAM_SIZE)
+        return &s2_ram_sharers[(pa - GUEST_RAM_BASE) / S2_PAGE_SIZE];
+    return 0;
+}
+
 static void s2_tables_reset(void)
 {
-    zero_qwords(s2_l1, S2_PT_ENTRIES);
+    s2_cur = &s2_roots[0];
+    for (u32 i = 1; i < S2_MAX_ROOTS; ++i)
+        s2_roots[i].vttbr = 0;
+    zero_qwords(s2_cur->l1, S2_PT_ENTRIES);
     for (u64 i = 0; i < S2_PT_ENTRIES; ++i)
-        s2_l1_children[i] = 0;
+        s2_cur->l1_children[i] = 0;
     s2_l2_used = 0;
     s2_l3_used = 0;
+    s2_l2_nfree = 0;
+    s2_l3_nfree = 0;
+    s2_frame_pool_used = 0;
+    s2_frame_nfree = 0;
+    for (u32 i = 0; i < S2_FRAME_POOL_PAGES; ++i)
+        s2_frame_sharers[i] = 0;
+    zero_qwords((u64*)s2_ram_sharers, sizeof(s2_ram_sharers) / sizeof(u64));
 }
 
 static s2_l2_table_t* alloc_l2(void)
 {
-    if (s2_l2_used >= S2_MAX_L2_TABLES)
+    if (!s2_l2_nfree && s2_l2_used >= S2_MAX_L2_TABLES)
         s2_pt_panic();
-    s2_l2_table_t* tbl = &s2_l2_pool[s2_l2_used++];
+    s2_l2_table_t* tbl = s2_l2_nfree ? &s2_l2_pool[s2_l2_free[--s2_l2_nfree]]
+                                     : &s2_l2_pool[s2_l2_used++];
     zero_qwords(tbl->entries, S2_PT_ENTRIES);
     zero_l2_children(tbl);
     return tbl;
@@ -99,23 +158,24 @@ static s2_l2_table_t* alloc_l2(void)
 
 static s2_l3_table_t* alloc_l3(void)
 {
-    if (s2_l3_used >= S2_MAX_L3_TABLES)
+    if (!s2_l3_nfree && s2_l3_used >= S2_MAX_L3_TABLES)
         s2_pt_panic();
-    s2_l3_table_t* tbl = &s2_l3_pool[s2_l3_used++];
+    s2_l3_table_t* tbl = s2_l3_nfree ? &s2_l3_pool[s2_l3_free[--s2_l3_nfree]]
+                                     : &s2_l3_pool[s2_l3_used++];
     zero_qwords(tbl->entries, S2_PT_ENTRIES);
     return tbl;
 }
 
 static s2_l2_table_t* ensure_l2(u64 l1_idx)
 {
-    s2_l2_table_t* tbl = s2_l1_children[l1_idx];
+    s2_l2_table_t* tbl = s2_cur->l1_children[l1_idx];
     if (tbl)
         return tbl;
 
     tbl = alloc_l2();
-    s2_l1_children[l1_idx] = tbl;
+    s2_cur->l1_children[l1_idx] = tbl;
     u64 desc = ((u64)tbl & PA_48_MASK & S2_PAGE_MASK) | S2_TABLE;
-    s2_l1[l1_idx] = desc;
+    s2_cur->l1[l1_idx] = desc;
     return tbl;
 }
 
@@ -171,6 +231,276 @@ static void s2_map_identity_range(u64 ipa_start, u64 pa_start, u64 size,
     }
 }
 
+u32 s2_remapped_pages;
+
+// Level-3 entry for `ipa`, or NULL if the IPA is not mapped.
+static u64* s2_lookup_pte(u64 ipa)
+{
+    s2_l2_table_t* l2 = s2_cur->l1_children[(ipa >> L1_SHIFT) & LVL_INDEX_MASK];
+    if (!l2)
+        return 0;
+    s2_l3_table_t* l3 = l2->children[(ipa >> L2_SHIFT) & LVL_INDEX_MASK];
+    if (!l3)
+        return 0;
+    u64* pte = &l3->entries[(ipa >> L3_SHIFT) & LVL_INDEX_MASK];
+    return (*pte & S2_DESC_VALID) ? pte : 0;
+}
+
+static inline u64 s2_pte_pa(u64 pte)
+{
+    return pte & (PA_48_MASK & S2_PAGE_MASK);
+}
+
+// Whether a page counts towards s2_remapped_pages: mapped elsewhere than its
+// IPA, or shared, so EL2 may not write the IPA directly.
+static inline bool s2_pte_remapped(u64 pte, u64 ipa)
+{
+    return (pte & S2_DESC_VALID) && (s2_pte_pa(pte) != ipa || (pte & S2_SW_MASK));
+}
+
+static bool s2_cow_break(u64* pte, u64 ipa);
+
+// Level-3 entry for an IPA EL2 is about to access, or NULL. EL2 may write
+// through what s2_ipa_to_ptr() returns, so a shared page gets its private
+// copy first; read-only shared pages are refused.
+static inline u64* s2_lookup_pte_el2(u64 ipa)
+{
+    u64* pte = s2_lookup_pte(ipa);
+    if (pte && (*pte & S2_SW_MASK) && (!(*pte & S2_SW_COW) || !s2_cow_break(pte, ipa)))
+        return 0;
+    return pte;
+}
+
+void* s2_ipa_to_ptr(u64 ipa, u64 len)
+{
+    const u64 first = align_down(ipa, S2_PAGE_SIZE);
+    u64* pte = s2_lookup_pte_el2(first);
+    if (!pte)
+        return 0;
+    const u64 base = s2_pte_pa(*pte);
+    // Every further page of the range has to follow on physically.
+    for (u64 page = first + S2_PAGE_SIZE; len && page < ipa + len; page += S2_PAGE_SIZE)
+    {
+        u64* next = s2_lookup_pte_el2(page);
+        if (!next || s2_pte_pa(*next) != base + (page - first))
+            return 0;
+    }
+    return (void*)(base + (ipa - first));
+}
+
+bool s2_swap_pages(u64 ipa_a, u64 ipa_b)
+{
+    if (((ipa_a | ipa_b) & ~S2_PAGE_MASK) || ipa_a == ipa_b)
+        return false;
+    u64* a = s2_lookup_pte(ipa_a);
+    u64* b = s2_lookup_pte(ipa_b);
+    if (!a || !b || ((*a | *b) & S2_SW_MASK))
+        return false;
+
+    const u64 old_a = *a;
+    const u64 old_b = *b;
+    const u64 pa_a = s2_pte_pa(old_a);
+    const u64 pa_b = s2_pte_pa(old_b);
+
+    // Break-before-make: the output address of a live entry may not change
+    // in place.
+    *a = 0;
+    *b = 0;
+    dsb(ishst);
+    tlbi_va(ipas2e1is, ipa_a >> 12);
+    tlbi_va(ipas2e1is, ipa_b >> 12);
+    dsb(ish);
+    *a = (old_a & ~(PA_48_MASK & S2_PAGE_MASK)) | pa_b;
+    *b = (old_b & ~(PA_48_MASK & S2_PAGE_MASK)) | pa_a;
+    // Combined stage-1+2 entries are tagged by VMID only.
+    dsb(ishst);
+    tlbi(vmalle1is);
+    dsb(ish);
+    isb();
+
+    s2_remapped_pages -= (u32)(pa_a != ipa_a) + (u32)(pa_b != ipa_b);
+    s2_remapped_pages += (u32)(pa_b != ipa_a) + (u32)(pa_a != ipa_b);
+    return true;
+}
+
+void* s2_frame_alloc(void)
+{
+    if (!s2_frame_nfree && s2_frame_pool_used >= S2_FRAME_POOL_PAGES)
+        return 0;
+    u8* frame = s2_frame_nfree ? s2_frame_pool[s2_frame_free[--s2_frame_nfree]]
+                               : s2_frame_pool[s2_frame_pool_used++];
+    zero_qwords((u64*)frame, S2_PAGE_SIZE / sizeof(u64));
+    return frame;
+}
+
+u32 s2_frames_used(void)
+{
+    return s2_frame_pool_used - s2_frame_nfree;
+}
+
+// Install `desc` for the page at `ipa`. A live entry is invalidated and its
+// TLB entries flushed before the new one may appear (break-before-make).
+static void s2_replace_pte(u64* pte, u64 ipa, u64 desc)
+{
+    if (*pte & S2_DESC_VALID)
+    {
+        *pte = 0;
+        dsb(ishst);
+        tlbi_va(ipas2e1is, ipa >> 12);
+        dsb(ish);
+    }
+    *pte = desc;
+    // Combined stage-1+2 entries are tagged by VMID only.
+    dsb(ishst);
+    tlbi(vmalle1is);
+    dsb(ish);
+    isb();
+}
+
+void s2_sync_icache(const void* page)
+{
+    const u64 line = 4ull << ((read_sysreg(CTR_EL0) >> 16) & 0xFull); // DminLine
+    for (u64 off = 0; off < S2_PAGE_SIZE; off += line)
+        dc_va(cvau, (const u8*)page + off);
+    dsb(ish);
+    ic(ialluis);
+    dsb(ish);
+}
+
+bool s2_map_guest_page(u64 ipa, u64 pa, bool write, bool exec, bool cow)
+{
+    if ((ipa | pa) & ~S2_PAGE_MASK)
+        return false;
+    u64* pte = &ensure_l3(ensure_l2((ipa >> L1_SHIFT) & LVL_INDEX_MASK),
+                          (ipa >> L2_SHIFT) & LVL_INDEX_MASK)
+                    ->entries[(ipa >> L3_SHIFT) & LVL_INDEX_MASK];
+    const bool was_remapped = s2_pte_remapped(*pte, ipa);
+    if ((*pte & S2_DESC_VALID) && (*pte & S2_SW_COUNTED))
+        s2_sharers(s2_pte_pa(*pte))[0]--;
+
+    u64 desc = (pa & (PA_48_MASK & S2_PAGE_MASK)) | S2_PAGE | S2_AF | S2_SH_INNER |
+               S2_MEMATTR(S2_ATTRIDX_NORMAL) | S2AP_R;
+    if (!exec)
+        desc |= S2_XN;
+    if (write && cow)
+        desc |= S2_SW_COW;
+    else if (write)
+        desc |= S2AP_W;
+    else if (cow)
+        desc |= S2_SW_SHARED;
+    s2_replace_pte(pte, ipa, desc);
+
+    s2_remapped_pages += (u32)s2_pte_remapped(desc, ipa) - (u32)was_remapped;
+    return true;
+}
+
+static bool s2_cow_break(u64* pte, u64 ipa)
+{
+    const u64 old = *pte;
+    u8* sharers = (old & S2_SW_COUNTED) ? s2_sharers(s2_pte_pa(old)) : 0;
+    u64 pa = s2_pte_pa(old);
+    // The last root sharing the page takes it over as it is.
+    if (!sharers || *sharers > 1)
+    {
+        u8* frame = s2_frame_alloc();
+        if (!frame)
+            return false;
+        const u64* src = (const u64*)pa;
+        for (u64 i = 0; i < S2_PAGE_SIZE / sizeof(u64); ++i)
+            ((u64*)frame)[i] = src[i];
+        if (!(old & S2_XN))
+            s2_sync_icache(frame);
+        pa = (u64)frame;
+    }
+    if (sharers)
+        (*sharers)--;
+
+    const u64 desc = (old & ~(PA_48_MASK & S2_PAGE_MASK) & ~(S2_SW_COW | S2_SW_COUNTED)) |
+                     (pa & PA_48_MASK) | S2AP_W | S2_AF;
+    s2_replace_pte(pte, ipa, desc);
+    s2_remapped_pages += (u32)s2_pte_remapped(desc, ipa) - (u32)s2_pte_remapped(old, ipa);
+    return true;
+}
+
+bool s2_cow_fault(u64 ipa)
+{
+    u64* pte = s2_lookup_pte(align_down(ipa, S2_PAGE_SIZE));
+    if (!pte || !(*pte & S2_SW_COW))
+        return false;
+    return s2_cow_break(pte, align_down(ipa, S2_PAGE_SIZE));
+}
+
+bool s2_cow_pending(u64 ipa)
+{
+    const u64* pte = s2_lookup_pte(align_down(ipa, S2_PAGE_SIZE));
+    return pte && (*pte & S2_SW_COW);
+}
+
+static u64 s2_af_faults;
+
+u32 s2_age_pages(u64 ipa, u32 pages, u64* accessed, u64* mapped)
+{
+    u32 found = 0, young = 0;
+    for (u32 i = 0; i < pages; ++i)
+    {
+        const u64 bit = 1ull << (i % 64u);
+        if (!(i % 64u))
+            accessed[i / 64u] = mapped[i / 64u] = 0;
+        const u64 page = ipa + (u64)i * S2_PAGE_SIZE;
+        u64* pte = s2_lookup_pte(page);
+        if (!pte)
+            continue;
+        mapped[i / 64u] |= bit;
+        found++;
+        if (!(*pte & S2_AF))
+            continue;
+        // With VTCR_EL2.HA the walker may set AF under our feet.
+        __atomic_fetch_and(pte, ~S2_AF, __ATOMIC_RELAXED);
+        accessed[i / 64u] |= bit;
+        young++;
+    }
+    if (!young)
+        return found;
+
+    // A page whose flag was still clear cannot be in a TLB: the walker does
+    // not cache such an entry. Only the accessed ones need invalidating.
+    dsb(ishst);
+    if (young <= S2_AGE_TLBI_PAGES)
+    {
+        for (u32 i = 0; i < pages; ++i)
+            if (accessed[i / 64u] & (1ull << (i % 64u)))
+                tlbi_va(ipas2e1is, (ipa + (u64)i * S2_PAGE_SIZE) >> 12);
+        dsb(ish);
+        // Combined stage-1+2 entries are tagged by VMID only.
+        tlbi(vmalle1is);
+    }
+    else
+    {
+        tlbi(vmalls12e1is);
+    }
+    dsb(ish);
+    isb();
+    return found;
+}
+
+bool s2_access_fault(u64 ipa)
+{
+    u64* pte = s2_lookup_pte(align_down(ipa, S2_PAGE_SIZE));
+    if (!pte)
+        return false;
+    // Setting AF needs no break-before-make.
+    __atomic_fetch_or(pte, S2_AF, __ATOMIC_RELAXED);
+    dsb(ishst);
+    isb();
+    s2_af_faults++;
+    return true;
+}
+
+u64 s2_access_faults(void)
+{
+    return s2_af_faults;
+}
+
 void s2_build_tables_identity(u64 ipa, u64 pa, u64 vm_size, u32 vm_count,
                               u64 guard_bytes, u8 read, u8 write, u8 exec)
 {
@@ -190,30 +520,33 @@ void s2_build_tables_identity(u64 ipa, u64 pa, u64 vm_size, u32 vm_count,
         s2_map_identity_range(slot_ipa, slot_pa, vm_size, read, write, exec);
     }
 
-    asm volatile("dsb ishst" ::: "memory");
+    dsb(ishst);
 }
 
-void s2_program_regs_and_enable(void)
+// Helper function to determine VMID mask based on CPU features
+static inline u16 vmid_mask_from_cpu(void)
 {
-    WR("MAIR_EL2", MAIR_EL2_VALUE);   // Stage-2 memory attributes (AttrIndx -> Normal WBRWA / Device)
-    WR("VTCR_EL2", vtcr_el2_value()); // Stage-2 translation control (granule/shareability/cacheability)
-    const u64 VMID_SHIFT = 48;
+    u64 mmfr1 = read_sysreg(ID_AA64MMFR1_EL1);
+    u64 vmidbits = (mmfr1 >> 4) & 0xF;     // VMIDBits field
+    return (vmidbits == 0x2) ? 0xFFFFu : 0xFFu; // 16 or 8 bits
+}
 
-    // Check CPU features to determine VMID size (8 or 16 bits)
-    u16 mask;
-    {
-        u64 mmfr1;
-        asm volatile("mrs %0, ID_AA64MMFR1_EL1" : "=r"(mmfr1));
-        u64 vmidbits = (mmfr1 >> 4) & 0xF;     // VMIDBits
-        mask = (vmidbits == 0x2) ? 0xFFFFu : 0xFFu; // FEAT_VMID16 ?
-    }
-    u64 vmid_field = ((u64)(VMID & mask)) << VMID_SHIFT; // VMID -> [63:48]
-    uintptr_t l1_base = (uintptr_t)s2_l1;                          // 4KB-aligned L1 table base
+void s2_program_regs_and_enable(void)
+{
+    write_sysreg(MAIR_EL2, MAIR_EL2_VALUE);   // Stage-2 memory attributes (AttrIndx -> Normal WBRWA / Device)
+    write_sysreg(VTCR_EL2, vtcr_el2_value()); // Stage-2 translation control (granule/shareability/cacheability)
+    u64 vmid_field = ((u64)(VMID & vmid_mask_from_cpu())) << VMID_SHIFT; // VMID -> [63:48]
+    uintptr_t l1_base = (uintptr_t)s2_roots[0].l1;                   // 4KB-aligned L1 table base
     u64 baddr_field = ((u64)l1_base) & PA_48_MASK;       // Table base PA -> bits [47:0]
 
     u64 vttbr = vmid_field | baddr_field;                // Combine VMID and base address
-    WR("VTTBR_EL2", vttbr);                                   // Stage-2 translation table base register
-    asm volatile("dsb ish; tlbi vmalls12e1is; dsb ish; isb"); // Barrier + invalidate guest/host Stage-1/2 TLBs
+    s2_roots[0].vttbr = vttbr;
+    write_sysreg(VTTBR_EL2, vttbr);                           // Stage-2 translation table base register
+    // Barrier + invalidate guest/host Stage-1/2 TLBs
+    dsb(ish);
+    tlbi(vmalls12e1is);
+    dsb(ish);
+    isb();
 
     /*
      * HCR_EL2 (Hypervisor Configuration Register) controls virtualization at EL2.
@@ -223,8 +556,7 @@ void s2_program_regs_and_enable(void)
      * Below it is read, updated, and written back to enable S2 and desired traps.
      */
 
-    u64 hcr;
-    asm volatile("mrs %0, HCR_EL2" : "=r"(hcr)); // Read current HCR_EL2.
+    u64 hcr = read_sysreg(HCR_EL2);         // Read current HCR_EL2.
     u64 vm = (1ull << 0);                   // HCR_EL2.VM  -> enable Stage-2 translation
     u64 rw = (1ull << 31);                  // HCR_EL2.RW  -> force guest EL1 into AArch64
     u64 twe = (1ull << 14);                 // HCR_EL2.TWE -> trap guest WFE to EL2
@@ -234,36 +566,260 @@ void s2_program_regs_and_enable(void)
     u64 imo = (1ull << 4);                  // HCR_EL2.IMO -> route physical IRQs to EL2
     u64 amo = (1ull << 5);                  // HCR_EL2.AMO -> route SError/async aborts to EL2
     hcr |= vm | rw | twe | twi | tsc | fmo | imo | amo;
-    WR("HCR_EL2", hcr); // Enable Stage-2 translations with the selected traps
-    asm volatile("dsb ish; tlbi vmalls12e1is; dsb ish; isb"); // Flush guest TLBs after toggling VM bit
+    write_sysreg(HCR_EL2, hcr); // Enable Stage-2 translations with the selected traps
+    // Flush guest TLBs after toggling VM bit
+    dsb(ish);
+    tlbi(vmalls12e1is);
+    dsb(ish);
+    isb();
 
     /*
      * CNTHCTL_EL2 controls which timer/counter system registers EL1 can access
-     * directly. Keep physical counter/timer accesses trapped (EL1PCTEN/EL1PCEN
-     * cleared) so we can virtualize time with CNTVOFF_EL2 and software
-     * emulation. Virtual timer/counter accesses remain usable.
+     * directly. With FEAT_ECV, CNTPOFF_EL2 shifts the physical counter into the
+     * guest's time base, so EL1PCTEN/EL1PCEN are opened and CNTPCT/CNTP_* run
+     * natively. Otherwise they stay trapped and core/sysreg.c emulates them on
+     * top of CNTVOFF_EL2. Virtual timer/counter accesses remain usable.
      */
-    const u64 trap_physical_timers = 0; // EL1PCEN=0, EL1PCTEN=0
-    WR("CNTHCTL_EL2", trap_physical_timers);
+    write_sysreg(CNTHCTL_EL2, timer_cnthctl_init());
 }
 
-// Helper function to determine VMID mask based on CPU features
-static inline u16 vmid_mask_from_cpu(void)
+static s2_root_t* s2_find_root(u64 vttbr)
 {
-    u64 mmfr1;
-    asm volatile("mrs %0, ID_AA64MMFR1_EL1" : "=r"(mmfr1));
-    u64 vmidbits = (mmfr1 >> 4) & 0xF;     // VMIDBits field
-    return (vmidbits == 0x2) ? 0xFFFFu : 0xFFu; // 16 or 8 bits
+    for (u32 i = 0; vttbr && i < S2_MAX_ROOTS; ++i)
+        if (s2_roots[i].vttbr == vttbr)
+            return &s2_roots[i];
+    return 0;
+}
+
+// Tables a copy of `root` takes.
+static void s2_root_tables(const s2_root_t* root, u32* l2_need, u32* l3_need)
+{
+    *l2_need = 0;
+    *l3_need = 0;
+    for (u64 i = 0; i < S2_PT_ENTRIES; ++i)
+    {
+        const s2_l2_table_t* l2 = root->l1_children[i];
+        if (!l2)
+            continue;
+        (*l2_need)++;
+        for (u64 j = 0; j < S2_PT_ENTRIES; ++j)
+            *l3_need += l2->children[j] != 0;
+    }
+}
+
+u32 s2_clone_room(u64 src_vttbr)
+{
+    const s2_root_t* src = s2_find_root(src_vttbr);
+    if (!src)
+        return 0;
+    u32 room = 0;
+    for (u32 i = 1; i < S2_MAX_ROOTS; ++i)
+        room += !s2_roots[i].vttbr;
+    u32 l2_need, l3_need;
+    s2_root_tables(src, &l2_need, &l3_need);
+    const u32 l2_free = S2_MAX_L2_TABLES - s2_l2_used + s2_l2_nfree;
+    const u32 l3_free = S2_MAX_L3_TABLES - s2_l3_used + s2_l3_nfree;
+    if (l2_need && l2_free / l2_need < room)
+        room = l2_free / l2_need;
+    if (l3_need && l3_free / l3_need < room)
+        room = l3_free / l3_need;
+    return room;
+}
+
+void s2_activate(u64 vttbr)
+{
+    if (vttbr == s2_cur->vttbr)
+        return;
+    s2_root_t* root = s2_find_root(vttbr);
+    if (root)
+        s2_cur = root;
+}
+
+static bool s2_in_ranges(u64 ipa, const s2_range_t* ranges, u32 count)
+{
+    for (u32 i = 0; i < count; ++i)
+        if (ipa - ranges[i].ipa < ranges[i].size)
+            return true;
+    return false;
+}
+
+u64 s2_clone(u64 src_vttbr, const s2_range_t* direct, u32 ndirect)
+{
+    s2_root_t* src = s2_find_root(src_vttbr);
+    if (!src || !s2_clone_room(src_vttbr))
+        return 0;
+
+    // A clone is either built whole or not at all; s2_clone_room() checked
+    // the tables as well as the root.
+    u32 idx = 1;
+    while (s2_roots[idx].vttbr)
+        idx++;
+    s2_root_t* dst = &s2_roots[idx];
+    zero_qwords(dst->l1, S2_PT_ENTRIES);
+    for (u64 i = 0; i < S2_PT_ENTRIES; ++i)
+        dst->l1_children[i] = 0;
+    dst->vttbr = ((u64)((VMID + idx) & vmid_mask_from_cpu()) << VMID_SHIFT) |
+                 ((u64)dst->l1 & PA_48_MASK);
+
+    for (u64 i = 0; i < S2_PT_ENTRIES; ++i)
+    {
+        const s2_l2_table_t* l2 = src->l1_children[i];
+        if (!l2)
+            continue;
+        s2_l2_table_t* nl2 = alloc_l2();
+        dst->l1_children[i] = nl2;
+        dst->l1[i] = ((u64)nl2 & PA_48_MASK & S2_PAGE_MASK) | S2_TABLE;
+
+        for (u64 j = 0; j < S2_PT_ENTRIES; ++j)
+        {
+            s2_l3_table_t* l3 = l2->children[j];
+            if (!l3)
+            {
+                nl2->entries[j] = l2->entries[j];
+                continue;
+            }
+            s2_l3_table_t* nl3 = alloc_l3();
+            nl2->children[j] = nl3;
+            nl2->entries[j] = ((u64)nl3 & PA_48_MASK & S2_PAGE_MASK) | S2_TABLE;
+
+            const u64 base = (i << L1_SHIFT) | (j << L2_SHIFT);
+            for (u64 k = 0; k < S2_PT_ENTRIES; ++k)
+            {
+                const u64 ipa = base | (k << L3_SHIFT);
+                u64 pte = l3->entries[k];
+                // A writable page is shared from now on: each side but the
+                // last to write it takes its own copy. Where the page can be
+                // counted, the last writer keeps it.
+                if ((pte & S2_DESC_VALID) && (pte & S2AP_W) &&
+                    !s2_in_ranges(ipa, direct, ndirect))
+                {
+                    const bool was_remapped = s2_pte_remapped(pte, ipa);
+                    u8* sharers = s2_sharers(s2_pte_pa(pte));
+                    pte = (pte & ~S2AP_W) | S2_SW_COW;
+                    if (sharers)
+                    {
+                        *sharers = 2;
+                        pte |= S2_SW_COUNTED;
+                    }
+                    l3->entries[k] = pte;
+                    s2_remapped_pages += 1u - (u32)was_remapped;
+                }
+                else if ((pte & S2_DESC_VALID) && (pte & S2_SW_COUNTED))
+                {
+                    s2_sharers(s2_pte_pa(pte))[0]++;
+                }
+                nl3->entries[k] = pte;
+                s2_remapped_pages += (u32)s2_pte_remapped(pte, ipa);
+            }
+        }
+    }
+
+    // Revoking write permission needs no break-before-make, only the stale
+    // writable entries gone, for whichever VMID the source runs under. This
+    // also drops whatever a released root left cached under the new VMID.
+    dsb(ishst);
+    tlbi(alle1is);
+    dsb(ish);
+    isb();
+    return dst->vttbr;
+}
+
+u32 s2_frames_contiguous(void)
+{
+    return S2_FRAME_POOL_PAGES - s2_frame_pool_used;
+}
+
+u64 s2_copy_range(u64 vttbr, u64 ipa, u64 size)
+{
+    s2_root_t* root = s2_find_root(vttbr);
+    const u64 pages = size / S2_PAGE_SIZE;
+    if (!root || root == &s2_roots[0] || ((ipa | size) & ~S2_PAGE_MASK) || !pages ||
+        pages > s2_frames_contiguous())
+        return 0;
+    s2_root_t* const prev = s2_cur;
+    s2_cur = root;
+    for (u64 off = 0; off < size; off += S2_PAGE_SIZE)
+        if (!s2_lookup_pte(ipa + off))
+        {
+            s2_cur = prev;
+            return 0;
+        }
+
+    // Straight from the top of the pool, so the copy is as contiguous as the
+    // IPA range and EL2 can index it from one base.
+    u8* const base = s2_frame_pool[s2_frame_pool_used];
+    s2_frame_pool_used += (u32)pages;
+    for (u64 off = 0; off < size; off += S2_PAGE_SIZE)
+    {
+        u64* pte = s2_lookup_pte(ipa + off);
+        const u64 old = *pte;
+        u8* frame = base + off;
+        const u64* src = (const u64*)s2_pte_pa(old);
+        for (u64 i = 0; i < S2_PAGE_SIZE / sizeof(u64); ++i)
+            ((u64*)frame)[i] = src[i];
+        if (!(old & S2_XN))
+            s2_sync_icache(frame);
+        if (old & S2_SW_COUNTED)
+            s2_sharers(s2_pte_pa(old))[0]--;
+
+        // The root has not run yet: s2_clone() flushed its VMID, so nothing
+        // can hold the old entry.
+        const u64 desc = (old & ~(PA_48_MASK & S2_PAGE_MASK) & ~S2_SW_MASK & ~S2_SW_COUNTED) |
+                         ((u64)frame & PA_48_MASK) | S2AP_W | S2_AF;
+        *pte = desc;
+        s2_remapped_pages += (u32)s2_pte_remapped(desc, ipa + off) -
+                             (u32)s2_pte_remapped(old, ipa + off);
+    }
+    dsb(ishst);
+    s2_cur = prev;
+    return (u64)base;
+}
+
+void s2_release(u64 vttbr)
+{
+    s2_root_t* root = s2_find_root(vttbr);
+    if (!root || root == &s2_roots[0])
+        return;
+    for (u64 i = 0; i < S2_PT_ENTRIES; ++i)
+    {
+        s2_l2_table_t* l2 = root->l1_children[i];
+        if (!l2)
+            continue;
+        for (u64 j = 0; j < S2_PT_ENTRIES; ++j)
+        {
+            s2_l3_table_t* l3 = l2->children[j];
+            if (!l3)
+                continue;
+            const u64 base = (i << L1_SHIFT) | (j << L2_SHIFT);
+            for (u64 k = 0; k < S2_PT_ENTRIES; ++k)
+            {
+                const u64 pte = l3->entries[k];
+                s2_remapped_pages -= (u32)s2_pte_remapped(pte, base | (k << L3_SHIFT));
+                if (!(pte & S2_DESC_VALID) || !(pte & S2_SW_COUNTED))
+                    continue;
+                // Nobody maps a frame whose last counted sharer goes.
+                const u64 pa = s2_pte_pa(pte);
+                const u64 pool = (u64)s2_frame_pool;
+                if (!--s2_sharers(pa)[0] && pa - pool < sizeof(s2_frame_pool))
+                    s2_frame_free[s2_frame_nfree++] = (u16)((pa - pool) / S2_PAGE_SIZE);
+            }
+            s2_l3_free[s2_l3_nfree++] = (u16)(l3 - s2_l3_pool);
+        }
+        s2_l2_free[s2_l2_nfree++] = (u16)(l2 - s2_l2_pool);
+    }
+    root->vttbr = 0;
+    if (s2_cur == root)
+        s2_cur = &s2_roots[0];
 }
 
 // This function sets up the necessary registers and transitions from EL2 to EL1
 void enter_el1_at(void (*el1_pc)(void), u64 sp_el1)
 {
 
-    asm volatile("msr SP_EL1, %0" ::"r"(sp_el1) : "memory"); // Program SP_EL1 for the guest
+    write_sysreg(SP_EL1, sp_el1);    // Program SP_EL1 for the guest
     const u64 EL1h = 0x5ull;         // SPSR_EL2.M bits -> return to EL1h
     const u64 DAIF = 0xFull << 6;    // SPSR_EL2.DAIF -> mask IRQ/FIQ/SError/Debug
-    WR("SPSR_EL2", EL1h | DAIF);          // Save return state + interrupt mask
-    WR("ELR_EL2", (u64)el1_pc);      // Link register for eret -> guest entry PC
-    asm volatile("isb; eret");            // Synchronize and drop to EL1
+    write_sysreg(SPSR_EL2, EL1h | DAIF); // Save return state + interrupt mask
+    write_sysreg(ELR_EL2, (u64)el1_pc); // Link register for eret -> guest entry PC
+    cpu_eret();                      // Synchronize and drop to EL1
 }
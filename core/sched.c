@@ -0,0 +1,179 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include "arch_ops.h"
+#include "vcpu.h"
+#include "vm.h"
+#include "timer.h"
+
+// Run queue and pick-next policy. Kept apart from the world switch in
+// core/vcpu.c so `make host-bench` can build it for Linux.
+
+#define VCPU_SCHED_MAX 8
+static vcpu_t* sched_runqueue[VCPU_SCHED_MAX];
+static size_t sched_len;
+static size_t sched_idx;
+static vcpu_t* sched_current;
+
+static int sched_find_slot(vcpu_t* vcpu)
+{
+    for (size_t i = 0; i < sched_len; ++i)
+        if (sched_runqueue[i] == vcpu)
+            return (int)i;
+    return -1;
+}
+
+void vcpu_scheduler_register(vcpu_t* vcpu)
+{
+    if (!vcpu || sched_len >= VCPU_SCHED_MAX)
+        return;
+    if (sched_find_slot(vcpu) >= 0)
+        return;
+    sched_runqueue[sched_len++] = vcpu;
+    if (!sched_current)
+    {
+        sched_current = vcpu;
+        sched_idx = sched_len - 1;
+    }
+}
+
+void vcpu_scheduler_set_current(vcpu_t* vcpu)
+{
+    if (!vcpu)
+        return;
+    int slot = sched_find_slot(vcpu);
+    if (slot < 0 && sched_len < VCPU_SCHED_MAX)
+    {
+        sched_runqueue[sched_len] = vcpu;
+        slot = (int)sched_len;
+        sched_len++;
+    }
+    if (slot >= 0)
+    {
+        sched_current = vcpu;
+        sched_idx = (size_t)slot;
+    }
+}
+
+vcpu_t* vcpu_scheduler_current(void)
+{
+    return sched_current;
+}
+
+vcpu_t* vcpu_scheduler_find(int vcpu_id)
+{
+    for (size_t i = 0; i < sched_len; ++i)
+        if (sched_runqueue[i] && sched_runqueue[i]->vcpu_id == vcpu_id)
+            return sched_runqueue[i];
+    return NULL;
+}
+
+// Pick the next VCPU: a directed-yield target if the current one named a
+// runnable one, otherwise the next runnable VCPU round-robin, the current one
+// last. Blocked VCPUs are skipped; if all of them are blocked, idle until a
+// timer wakes one. Returns true if the current VCPU changed; the caller
+// performs the switch.
+bool vcpu_scheduler_yield(void)
+{
+    if (!sched_current)
+        return false;
+
+    vcpu_t* directed = sched_current->yield_to;
+    sched_current->yield_to = NULL;
+    if (directed && !directed->blocked) {
+        int slot = sched_find_slot(directed);
+        if (slot >= 0) {
+            bool changed = directed != sched_current;
+            sched_current = directed;
+            sched_idx = (size_t)slot;
+            return changed;
+        }
+    }
+
+    for (;;) {
+        for (size_t step = 1; step <= sched_len; ++step) {
+            size_t next = (sched_idx + step) % sched_len;
+            vcpu_t* target = sched_runqueue[next];
+            if (!target || target->blocked)
+                continue;
+            bool changed = target != sched_current;
+            sched_current = target;
+            sched_idx = next;
+            return changed;
+        }
+        vtimer_idle();
+    }
+}
+
+// Spin-loop detection: a vCPU that keeps taking WFE exits at the same PC
+// within a short window is waiting on something another vCPU must do.
+#define SPIN_WINDOW_US      50ull
+#define SPIN_STREAK_MIN     4u
+
+static bool vcpu_spin_detect(vcpu_t* vcpu, u64 pc)
+{
+    isb();
+    const u64 now = read_sysreg(CNTPCT_EL0);
+    const u64 frq = read_sysreg(CNTFRQ_EL0);
+    const u64 window = (frq / 1000000ull) * SPIN_WINDOW_US;
+
+    if (pc == vcpu->spin.last_pc && now - vcpu->spin.last_time < window)
+        vcpu->spin.streak++;
+    else
+        vcpu->spin.streak = 1;
+    vcpu->spin.last_pc = pc;
+    vcpu->spin.last_time = now;
+
+    if (vcpu->spin.streak < SPIN_STREAK_MIN)
+        return false;
+    vcpu->spin.streak = 0;
+    vcpu->spin.spins_detected++;
+    return true;
+}
+
+// A sibling in the same VM that lost the CPU to slice expiry is the likely
+// lock holder; prefer it over round-robin.
+static vcpu_t* vcpu_preempted_sibling(const vcpu_t* vcpu)
+{
+    const sch_vm_t* vm = vcpu->vm;
+    if (!vm)
+        return NULL;
+    for (u32 i = 0; i < vm->nr_vcpus; ++i) {
+        vcpu_t* sib = vm->vcpus[i];
+        if (sib != vcpu && sib->preempted && !sib->blocked)
+            return sib;
+    }
+    return NULL;
+}
+
+void vcpu_wfe_exit(vcpu_t* vcpu, u64 pc)
+{
+    vcpu->spin.wfe_exits++;
+    const bool spinning = vcpu_spin_detect(vcpu, pc);
+
+    vcpu_t* target = vcpu_preempted_sibling(vcpu);
+    if (target) {
+        vcpu->spin.directed_yields++;
+        vcpu->yield_to = target;
+        vcpu->request_yield = true;
+    } else if (spinning) {
+        vcpu->request_yield = true; // nobody preempted: plain round-robin yield
+    }
+    // Otherwise resume: WFE is a hint and the waker may be running elsewhere.
+}
+
+int vcpu_yield_to(vcpu_t* vcpu, int target_id)
+{
+    vcpu->spin.yield_to_calls++;
+    vcpu_t* target = vm_find_vcpu(vcpu->vm, target_id);
+    if (!target || target == vcpu) {
+        vcpu->spin.yield_to_misses++;
+        return -1;
+    }
+    if (target->blocked) {
+        vcpu->spin.yield_to_misses++;
+        return -2;
+    }
+    vcpu->yield_to = target;
+    vcpu->request_yield = true;
+    return 0;
+}
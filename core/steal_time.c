@@ -0,0 +1,96 @@
+#include <stddef.h>
+#include "steal_time.h"
+#include "trap.h"
+#include "guest_api.h"
+#include "guest_layout.h"
+#include "vm.h"
+
+static u64 counter_hz;
+
+static inline u64 read_cntpct(void)
+{
+    u64 v;
+    asm volatile("isb; mrs %0, CNTPCT_EL0" : "=r"(v));
+    return v;
+}
+
+// The record's IPA, which is what the guest is told; 0 for no record.
+static u64 steal_record_ipa(const vcpu_t *vcpu)
+{
+    if (!vcpu || vcpu->vcpu_id < 0 || vcpu->vcpu_id >= GUEST_STEAL_TIME_COUNT)
+        return 0;
+    return GUEST_STEAL_TIME_BASE + (u64)vcpu->vcpu_id * GUEST_STEAL_TIME_STRIDE;
+}
+
+static struct pv_time_stolen *steal_record(const vcpu_t *vcpu)
+{
+    const u64 ipa = steal_record_ipa(vcpu);
+    return ipa ? (struct pv_time_stolen *)vm_record_pa(vcpu->vm, ipa) : NULL;
+}
+
+u64 counter_ticks_to_ns(u64 ticks)
+{
+    if (!counter_hz)
+        return 0;
+    // Split to keep ticks * 1e9 from overflowing for long uptimes.
+    return (ticks / counter_hz) * 1000000000ull +
+           ((ticks % counter_hz) * 1000000000ull) / counter_hz;
+}
+
+void vcpu_acct_set(vcpu_t *vcpu, u8 state)
+{
+    if (vcpu->acct.state == state && vcpu->acct.since)
+        return;
+
+    const u64 now = read_cntpct();
+    if (vcpu->acct.since)
+    {
+        const u64 delta = now - vcpu->acct.since;
+        switch (vcpu->acct.state)
+        {
+        case VCPU_ACCT_RUNNING: vcpu->acct.run += delta; break;
+        case VCPU_ACCT_BLOCKED: vcpu->acct.blocked += delta; break;
+        default:
+        {
+            vcpu->acct.wait += delta;
+            struct pv_time_stolen *st = steal_record(vcpu);
+            if (st)
+                st->stolen_time = counter_ticks_to_ns(vcpu->acct.wait);
+            break;
+        }
+        }
+    }
+    vcpu->acct.state = state;
+    vcpu->acct.since = now;
+}
+
+// PV_TIME_FEATURES: x1 names the function being probed.
+static void pv_time_features(vcpu_t *vcpu, smccc_args_t *args)
+{
+    (void)vcpu;
+    const u32 fid = (u32)args->a[1];
+    args->a[0] = (fid == PV_TIME_FEATURES || fid == PV_TIME_ST)
+                     ? SMCCC_RET_SUCCESS : SMCCC_RET_NOT_SUPPORTED;
+}
+
+// PV_TIME_ST: IPA of the calling vCPU's stolen-time record.
+static void pv_time_st(vcpu_t *vcpu, smccc_args_t *args)
+{
+    const u64 ipa = steal_record_ipa(vcpu);
+    args->a[0] = ipa ? ipa : SMCCC_RET_NOT_SUPPORTED;
+}
+
+void steal_time_init(void)
+{
+    asm volatile("mrs %0, CNTFRQ_EL0" : "=r"(counter_hz));
+    for (u32 i = 0; i < GUEST_STEAL_TIME_COUNT; ++i)
+    {
+        struct pv_time_stolen *st = (struct pv_time_stolen *)
+            (GUEST_STEAL_TIME_BASE + (u64)i * GUEST_STEAL_TIME_STRIDE);
+        st->revision = 0;
+        st->attributes = 0;
+        st->stolen_time = 0;
+    }
+    trap_register_smccc(PV_TIME_FEATURES, pv_time_features);
+    trap_register_smccc(PV_TIME_ST, pv_time_st);
+}
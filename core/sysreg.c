@@ -0,0 +1,237 @@
+#include <stddef.h>
+#include "trap.h"
+#include "timer.h"
+
+// Timer virtualization strategy:
+// - Each vCPU keeps its own virtual counter value (saved in cntvct_el0). When a vCPU is loaded we program
+//   CNTVOFF_EL2 = CNTPCT - cntvct_el0, so CNTVCT resumes from that saved value (time freezes while descheduled).
+// - With FEAT_ECV the same offset goes into CNTPOFF_EL2 and CNTHCTL_EL2 opens EL1PCTEN/EL1PCEN: CNTPCT and
+//   CNTP_* then run natively in the guest's time base and none of the handlers below are reached.
+// - Without ECV, CNTHCTL_EL2 traps physical timer/counter sysregs (CNTPCT/CNTP_*). When EC=0x18 triggers, we
+//   translate CNTP_* accesses between the guest's virtual count and the hardware physical counter using
+//   CNTVOFF_EL2. CNTV_* accesses are passed through because hardware already applies CNTVOFF_EL2.
+// - Guests can optionally rebase their virtual time via SCHISM_HYP_TIME_SET, which recomputes the offset and
+//   reprograms CNTP/CNTV compares so pending timers stay coherent.
+// The encodings below decode ESR_EL2 values for EC=0x18 (trapped MSR/MRS/System instructions) so we know
+// which counter/timer sysreg the guest touched.
+// - CNTPCT_EL0: physical counter; CNTVOFF is not applied.
+// - CNTVCT_EL0: virtual counter with CNTVOFF applied.
+// - CNTP_*: physical timer compare/control; we translate to/from virtual counts via CNTVOFF.
+// - CNTV_*: virtual timer compare/control; already in the virtual domain.
+enum {
+    SYS_CNTPCT_EL0    = SYS_REG_ENCODE(3, 3, 14, 0, 1), // Physical Count Register
+    SYS_CNTVCT_EL0    = SYS_REG_ENCODE(3, 3, 14, 0, 2), // Virtual Count Register
+    SYS_CNTP_TVAL_EL0 = SYS_REG_ENCODE(3, 3, 14, 2, 0), // Physical Timer TimerValue Register
+    SYS_CNTP_CTL_EL0  = SYS_REG_ENCODE(3, 3, 14, 2, 1), // Physical Timer Control Register
+    SYS_CNTP_CVAL_EL0 = SYS_REG_ENCODE(3, 3, 14, 2, 2), // Physical Timer CompareValue Register
+    SYS_CNTV_TVAL_EL0 = SYS_REG_ENCODE(3, 3, 14, 3, 0), // Virtual Timer TimerValue Register
+    SYS_CNTV_CTL_EL0  = SYS_REG_ENCODE(3, 3, 14, 3, 1), // Virtual Timer Control Register
+    SYS_CNTV_CVAL_EL0 = SYS_REG_ENCODE(3, 3, 14, 3, 2), // Virtual Timer CompareValue Register
+};
+
+u8 timer_ecv_enabled;
+
+u64 timer_cnthctl_init(void)
+{
+    u64 mmfr0;
+    asm volatile("mrs %0, ID_AA64MMFR0_EL1" : "=r"(mmfr0));
+    const u64 ecv = (mmfr0 >> 60) & 0xF; // 1: ECV, 2: ECV plus CNTHCTL_EL2.ECV/CNTPOFF_EL2
+
+    if (ecv < 2)
+    {
+        timer_ecv_enabled = 0;
+        return 0; // EL1PCEN=0, EL1PCTEN=0: trap and emulate below
+    }
+
+    asm volatile("msr " CNTPOFF_EL2_SYSREG ", xzr");
+    timer_ecv_enabled = 1;
+    return CNTHCTL_EL1PCTEN | CNTHCTL_EL1PCEN | CNTHCTL_ECV;
+}
+
+void timer_load_offset(u64 offset)
+{
+    asm volatile("msr CNTVOFF_EL2, %0" : : "r"(offset) : "memory");
+    if (timer_ecv_enabled)
+        asm volatile("msr " CNTPOFF_EL2_SYSREG ", %0" : : "r"(offset) : "memory");
+}
+
+// Read the current virtual counter (CNTVCT_EL0) with CNTVOFF already applied.
+static inline u64 virtual_counter_now(void)
+{
+    u64 val;
+    asm volatile("mrs %0, CNTVCT_EL0" : "=r"(val));
+    return val;
+}
+
+// CNTPCT/CNTVCT: both return the virtualized counter. Writes never occur.
+static bool sysreg_counter(vcpu_t *vcpu, bool is_read, u64 *val)
+{
+    (void)vcpu;
+    if (is_read)
+        *val = virtual_counter_now();
+    return true;
+}
+
+static bool sysreg_cntp_cval(vcpu_t *vcpu, bool is_read, u64 *val)
+{
+    if (is_read)
+    {
+        // Read CNTP_CVAL: fetch physical compare value, subtract CNTVOFF to present a virtual count.
+        u64 phys;
+        asm volatile("mrs %0, CNTP_CVAL_EL0" : "=r"(phys));
+        u64 virt_val = timer_cval_from_hw(vcpu, phys);
+        vcpu->arch.tf.cntp_cval_el0 = virt_val;
+        *val = virt_val;
+    }
+    else
+    {
+        // Write CNTP_CVAL: guest supplies a virtual count; convert back to physical and program CNTP_CVAL_EL0.
+        vcpu->arch.tf.cntp_cval_el0 = *val;
+        u64 phys_val = timer_cval_to_hw(vcpu, *val);
+        asm volatile("msr CNTP_CVAL_EL0, %0" : : "r"(phys_val));
+    }
+    return true;
+}
+
+static bool sysreg_cntp_ctl(vcpu_t *vcpu, bool is_read, u64 *val)
+{
+    if (is_read)
+    {
+        // Read CNTP_CTL: expose the hardware control bits (EN/IMASK/ISTATUS) to the guest.
+        u64 ctl;
+        asm volatile("mrs %0, CNTP_CTL_EL0" : "=r"(ctl));
+        vcpu->arch.tf.cntp_ctl_el0 = ctl;
+        *val = ctl;
+    }
+    else
+    {
+        // Write CNTP_CTL: accept guest EN/IMASK and program hardware; ISTATUS is read-only.
+        u64 ctl = *val & 0x3u; // only enable and IMASK are writable
+        vcpu->arch.tf.cntp_ctl_el0 = ctl;
+        asm volatile("msr CNTP_CTL_EL0, %0" : : "r"(ctl));
+    }
+    return true;
+}
+
+static bool sysreg_cntp_tval(vcpu_t *vcpu, bool is_read, u64 *val)
+{
+    u64 virt_now = virtual_counter_now();
+    if (is_read)
+    {
+        // Read CNTP_TVAL: return (virtual CVAL - virtual counter) as a signed 32-bit delta.
+        s64 delta = (s64)(vcpu->arch.tf.cntp_cval_el0 - virt_now);
+        *val = (u64)delta;
+    }
+    else
+    {
+        // Write CNTP_TVAL: treat guest value as signed delta, derive absolute virtual target, then program CNTP_CVAL.
+        s64 delta = (int32_t)*val; // TVAL is a signed 32-bit offset
+        u64 target = virt_now + delta;
+        vcpu->arch.tf.cntp_cval_el0 = target;
+        u64 phys_target = timer_cval_to_hw(vcpu, target);
+        asm volatile("msr CNTP_CVAL_EL0, %0" : : "r"(phys_target));
+    }
+    return true;
+}
+
+static bool sysreg_cntv_cval(vcpu_t *vcpu, bool is_read, u64 *val)
+{
+    if (is_read)
+    {
+        // Read CNTV_CVAL: pass through the virtual timer compare value as-is.
+        u64 cval;
+        asm volatile("mrs %0, CNTV_CVAL_EL0" : "=r"(cval));
+        vcpu->arch.tf.cntv_cval_el0 = cval;
+        *val = cval;
+    }
+    else
+    {
+        // Write CNTV_CVAL: program the virtual timer compare value directly.
+        vcpu->arch.tf.cntv_cval_el0 = *val;
+        asm volatile("msr CNTV_CVAL_EL0, %0" : : "r"(*val));
+    }
+    return true;
+}
+
+static bool sysreg_cntv_ctl(vcpu_t *vcpu, bool is_read, u64 *val)
+{
+    if (is_read)
+    {
+        // Read CNTV_CTL: expose virtual timer control bits (EN/IMASK/ISTATUS).
+        u64 ctl;
+        asm volatile("mrs %0, CNTV_CTL_EL0" : "=r"(ctl));
+        vcpu->arch.tf.cntv_ctl_el0 = ctl;
+        *val = ctl;
+    }
+    else
+    {
+        // Write CNTV_CTL: accept guest EN/IMASK and program virtual timer control.
+        u64 ctl = *val & 0x3u;
+        vcpu->arch.tf.cntv_ctl_el0 = ctl;
+        asm volatile("msr CNTV_CTL_EL0, %0" : : "r"(ctl));
+    }
+    return true;
+}
+
+static bool sysreg_cntv_tval(vcpu_t *vcpu, bool is_read, u64 *val)
+{
+    u64 virt_now = virtual_counter_now();
+    if (is_read)
+    {
+        // Read CNTV_TVAL: return (CNTV_CVAL - CNTVCT) as signed delta.
+        u64 cval;
+        asm volatile("mrs %0, CNTV_CVAL_EL0" : "=r"(cval));
+        vcpu->arch.tf.cntv_cval_el0 = cval;
+        s64 delta = (s64)(cval - virt_now);
+        *val = (u64)delta;
+    }
+    else
+    {
+        // Write CNTV_TVAL: treat guest value as signed delta and program CNTV_CVAL accordingly.
+        s64 delta = (int32_t)*val;
+        u64 target = virt_now + delta;
+        vcpu->arch.tf.cntv_cval_el0 = target;
+        asm volatile("msr CNTV_CVAL_EL0, %0" : : "r"(target));
+    }
+    return true;
+}
+
+// Emulated system registers, sorted by encoding so lookups are a binary search.
+// Keep new entries in order; sysreg_table_check() verifies it at boot.
+static const sysreg_trap_t sysreg_table[] = {
+    { SYS_CNTPCT_EL0,    sysreg_counter   },
+    { SYS_CNTVCT_EL0,    sysreg_counter   },
+    { SYS_CNTP_TVAL_EL0, sysreg_cntp_tval },
+    { SYS_CNTP_CTL_EL0,  sysreg_cntp_ctl  },
+    { SYS_CNTP_CVAL_EL0, sysreg_cntp_cval },
+    { SYS_CNTV_TVAL_EL0, sysreg_cntv_tval },
+    { SYS_CNTV_CTL_EL0,  sysreg_cntv_ctl  },
+    { SYS_CNTV_CVAL_EL0, sysreg_cntv_cval },
+};
+
+#define SYSREG_TABLE_LEN (sizeof(sysreg_table) / sizeof(sysreg_table[0]))
+
+const sysreg_trap_t *sysreg_trap_find(u32 encoding)
+{
+    size_t lo = 0, hi = SYSREG_TABLE_LEN;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        u32 key = sysreg_table[mid].encoding;
+        if (key == encoding)
+            return &sysreg_table[mid];
+        if (key < encoding)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+bool sysreg_table_check(void)
+{
+    for (size_t i = 1; i < SYSREG_TABLE_LEN; ++i)
+        if (sysreg_table[i - 1].encoding >= sysreg_table[i].encoding)
+            return false;
+    return true;
+}
@@ -1,39 +1,25 @@
 #include <stdint.h>
+#include <stddef.h>
 #include "vcpu.h"
-#include "guest_api.h"
-#include "guest_layout.h"
+#include "trap.h"
+#include "timer.h"
+#include "irq.h"
+#include "mmio_bus.h"
+#include "s2_mmu.h"
+#include "vpmu.h"
+#include "prof.h"
 
 extern void console_puts(const char*);
 extern void console_hex64(u64);
 
-#define SYS_REG_ENCODE(op0, op1, crn, crm, op2) \
-    ((u32)(((op0) << 14) | ((op1) << 10) | ((crn) << 6) | ((crm) << 2) | (op2)))
-
-
-// Timer virtualization strategy:
-// - Each vCPU keeps its own virtual counter value (saved in cntvct_el0). On entry we program CNTVOFF_EL2
-//   so that CNTVCT reads match that saved value plus elapsed host time since scheduling in.
-// - CNTHCTL_EL2 traps physical timer/counter sysregs (CNTPCT/CNTP_*). When EC=0x18 triggers, we translate
-//   CNTP_* accesses between the guest's virtual count and the hardware physical counter using CNTVOFF_EL2.
-//   CNTV_* accesses are passed through because hardware already applies CNTVOFF_EL2.
-// - Guests can optionally rebase their virtual time via HVC #0x61 (handle_guest_time_override), which
-//   recomputes CNTVOFF_EL2 and reprograms CNTP/CNTV compares so pending timers stay coherent.
-// The encodings below decode ESR_EL2 values for EC=0x18 (trapped MSR/MRS/System instructions) so we know
-// which counter/timer sysreg the guest touched.
-// - CNTPCT_EL0: physical counter; CNTVOFF is not applied.
-// - CNTVCT_EL0: virtual counter with CNTVOFF applied.
-// - CNTP_*: physical timer compare/control; we translate to/from virtual counts via CNTVOFF.
-// - CNTV_*: virtual timer compare/control; already in the virtual domain.
-enum {
-    SYS_CNTPCT_EL0    = SYS_REG_ENCODE(3, 3, 14, 0, 1), // Physical Count Register
-    SYS_CNTVCT_EL0    = SYS_REG_ENCODE(3, 3, 14, 0, 2), // Virtual Count Register
-    SYS_CNTP_TVAL_EL0 = SYS_REG_ENCODE(3, 3, 14, 2, 0), // Physical Timer TimerValue Register
-    SYS_CNTP_CTL_EL0  = SYS_REG_ENCODE(3, 3, 14, 2, 1), // Physical Timer Control Register
-    SYS_CNTP_CVAL_EL0 = SYS_REG_ENCODE(3, 3, 14, 2, 2), // Physical Timer CompareValue Register
-    SYS_CNTV_TVAL_EL0 = SYS_REG_ENCODE(3, 3, 14, 3, 0), // Virtual Timer TimerValue Register
-    SYS_CNTV_CTL_EL0  = SYS_REG_ENCODE(3, 3, 14, 3, 1), // Virtual Timer Control Register
-    SYS_CNTV_CVAL_EL0 = SYS_REG_ENCODE(3, 3, 14, 3, 2), // Virtual Timer CompareValue Register
-};
+// Vector slot codes pushed by vectors_el2.S: bits[5:4] select the source
+// (0x00 SP0, 0x10 SPx, 0x20 lower EL AArch64, 0x30 lower EL AArch32) and
+// bits[1:0] the kind (0 sync, 1 IRQ, 2 FIQ, 3 SError).
+#define VECTOR_KIND(code)        ((code) & 0x3u)
+#define VECTOR_KIND_SYNC         0x0u
+#define VECTOR_KIND_IRQ          0x1u
+#define VECTOR_KIND_FIQ          0x2u
+#define VECTOR_FROM_LOWER_EL(code) ((code) >= 0x20u)
 
 // Decode the trapped system register from an ESR_EL2 value for EC=0x18 (sysreg trap).
 static inline u32 esr_sys64_sysreg(u64 esr)
@@ -59,14 +45,6 @@ static inline bool esr_sys64_is_read(u64 esr)
     return ((esr >> 21) & 0x1u) != 0;
 }
 
-// Read the current virtual counter (CNTVCT_EL0) with CNTVOFF already applied.
-static inline u64 virtual_counter_now(void)
-{
-    u64 val;
-    asm volatile("mrs %0, CNTVCT_EL0" : "=r"(val));
-    return val;
-}
-
 // Move ELR_EL2 (and the cached trapframe ELR_EL1) past the trapped instruction.
 static void advance_guest_elr(vcpu_t *current, u64 elr)
 {
@@ -76,295 +54,385 @@ static void advance_guest_elr(vcpu_t *current, u64 elr)
         current->arch.tf.elr_el1 = next;
 }
 
-// Print a guest-supplied task report (HVC #0x60) and return whether it was handled.
-static bool handle_guest_task_report(u64 elr)
+// Per-EC exit counters, exported for benchmarks through trap_exit_count().
+static u64 trap_ec_counts[ESR_EC_COUNT];
+
+// Hypercall immediates: direct-indexed, filled by trap_register_hvc().
+static trap_handler_t hvc_imm_table[TRAP_HVC_IMM_SLOTS];
+
+// SMCCC function IDs are sparse 32-bit values, so they live in a small
+// open-addressed hash table; lookups stay O(1) as services are added.
+#define SMCCC_HASH_BITS  6u
+#define SMCCC_HASH_SLOTS (1u << SMCCC_HASH_BITS)
+
+static struct
 {
-    (void)elr;
-    vcpu_t *current = vcpu_scheduler_current();
-    if (!current)
-        return false;
+    u32 fid;
+    smccc_handler_t fn;
+} smccc_table[SMCCC_HASH_SLOTS];
 
-    u64 ptr = current->arch.tf.regs[1];
-    const struct guest_task_result *res = (const struct guest_task_result *)ptr;
-    if (!res)
-        return true;
+static inline u32 smccc_hash(u32 fid)
+{
+    return (fid * 2654435761u) >> (32u - SMCCC_HASH_BITS); // Fibonacci hashing
+}
 
-    console_puts("[guest");
-    char suffix[3] = { '0' + (char)current->vcpu_id, ']', '\0' };
-    console_puts(suffix);
-    console_puts(" ");
-    console_puts(res->desc);
-    console_puts(" data0=");
-    console_hex64(res->data0);
-    console_puts(" data1=");
-    console_hex64(res->data1);
-    console_puts("\n");
+bool trap_register_hvc(u16 imm16, trap_handler_t fn)
+{
+    if (imm16 == 0 || imm16 >= TRAP_HVC_IMM_SLOTS)
+        return false; // HVC #0 is reserved for SMCCC calls
+    hvc_imm_table[imm16] = fn;
+    return true;
+}
 
-    // Report timer telemetry carried in the guest task result to validate virtual time isolation.
-    if (res->time_before || res->time_after || res->time_target || res->memwalk_time)
+bool trap_register_smccc(u32 function_id, smccc_handler_t fn)
+{
+    u32 slot = smccc_hash(function_id);
+    for (u32 probe = 0; probe < SMCCC_HASH_SLOTS; ++probe)
     {
-        console_puts("  timers: before=");
-        console_hex64(res->time_before);
-        console_puts(" after=");
-        console_hex64(res->time_after);
-        console_puts(" target=");
-        console_hex64(res->time_target);
-        console_puts(" memwalk_time=");
-        console_hex64(res->memwalk_time);
-        console_puts("\n");
+        if (!smccc_table[slot].fn || smccc_table[slot].fid == function_id)
+        {
+            smccc_table[slot].fid = function_id;
+            smccc_table[slot].fn = fn;
+            return true;
+        }
+        slot = (slot + 1u) & (SMCCC_HASH_SLOTS - 1u);
     }
-    return true;
+    return false;
 }
 
-// Handle trapped accesses to CNT* timer sysregs (EC=0x18) and emulate them with virtual time.
-// Physical timer registers (CNTP_*) are converted between virtual and physical counter domains via CNTVOFF.
-// Virtual timer registers (CNTV_*) are passed through because CNTVOFF_EL2 already biases CNTVCT.
-static bool handle_timer_sysreg(u64 esr, u64 elr)
+smccc_handler_t trap_smccc_lookup(u32 function_id)
 {
-    vcpu_t *current = vcpu_scheduler_current();
-    if (!current)
-        return false;
+    u32 slot = smccc_hash(function_id);
+    for (u32 probe = 0; probe < SMCCC_HASH_SLOTS; ++probe)
+    {
+        if (!smccc_table[slot].fn)
+            return NULL;
+        if (smccc_table[slot].fid == function_id)
+            return smccc_table[slot].fn;
+        slot = (slot + 1u) & (SMCCC_HASH_SLOTS - 1u);
+    }
+    return NULL;
+}
 
-    const u32 sysreg = esr_sys64_sysreg(esr);
-    const u32 rt = esr_sys64_rt(esr);
-    const bool is_read = esr_sys64_is_read(esr);
+u64 trap_exit_count(u32 ec)
+{
+    return ec < ESR_EC_COUNT ? trap_ec_counts[ec] : 0;
+}
 
-    u64 virt_now = virtual_counter_now();
+// EC=0x01: WFI/WFE, told apart by ISS.TI (0 WFI, 1 WFE).
+// WFI drains the report ring (a yield doubles as its doorbell) and hands the
+// CPU to the next vCPU; with the virtual timer armed the vCPU blocks until the
+// timer fires. WFE means the guest is waiting on another vCPU, so it goes
+// through the directed-yield policy in vcpu_wfe_exit() instead.
+static trap_result_t trap_wfx(trap_ctx_t *ctx)
+{
+    vcpu_t *vcpu = ctx->vcpu;
+    if (!vcpu)
+        return TRAP_ADVANCE;
 
-    switch (sysreg)
-    {
-        case SYS_CNTPCT_EL0:
-        case SYS_CNTVCT_EL0:
-            // Read the virtualized counter (returns CNTVCT with CNTVOFF applied). Writes never occur.
-            if (is_read && rt < 31)
-                current->arch.tf.regs[rt] = virt_now;
-            advance_guest_elr(current, elr);
-            return true;
+    if ((ctx->esr & 0x1u) != 0) {
+        vcpu_wfe_exit(vcpu, ctx->elr);
+        return TRAP_ADVANCE;
+    }
 
-        case SYS_CNTP_CVAL_EL0:
-        {
-            if (is_read)
-            {
-                // Read CNTP_CVAL: fetch physical compare value, add CNTVOFF to present a virtual count.
-                u64 phys;
-                asm volatile("mrs %0, CNTP_CVAL_EL0" : "=r"(phys));
-                u64 virt_val = phys + current->arch.cntvoff_el2;
-                current->arch.tf.cntp_cval_el0 = virt_val;
-                if (rt < 31)
-                    current->arch.tf.regs[rt] = virt_val;
-            }
-            else
-            {
-                // Write CNTP_CVAL: guest supplies a virtual count; convert back to physical and program CNTP_CVAL_EL0.
-                u64 virt_val = (rt < 31) ? current->arch.tf.regs[rt] : 0;
-                current->arch.tf.cntp_cval_el0 = virt_val;
-                u64 phys_val = virt_val - current->arch.cntvoff_el2;
-                asm volatile("msr CNTP_CVAL_EL0, %0" : : "r"(phys_val));
-            }
-            advance_guest_elr(current, elr);
-            asm volatile("isb");
-            return true;
-        }
+    console_puts("EL2: WFI from guest detected, yielding... sysreg exits=");
+    console_hex64(trap_ec_counts[ESR_EC_SYS64]);
+    console_puts(" wfe exits=");
+    console_hex64(vcpu->spin.wfe_exits);
+    console_puts(" spins=");
+    console_hex64(vcpu->spin.spins_detected);
+    console_puts(" directed=");
+    console_hex64(vcpu->spin.directed_yields);
+    console_puts(" yield_to=");
+    console_hex64(vcpu->spin.yield_to_calls);
+    console_puts("/");
+    console_hex64(vcpu->spin.yield_to_misses);
+    console_puts(" mmio exits/hits/decoded=");
+    console_hex64(vcpu->mmio.exits);
+    console_puts("/");
+    console_hex64(vcpu->mmio.cache_hits);
+    console_puts("/");
+    console_hex64(vcpu->mmio.decoded);
+    console_puts("\n");
 
-        case SYS_CNTP_CTL_EL0:
-        {
-            if (is_read)
-            {
-                // Read CNTP_CTL: expose the hardware control bits (EN/IMASK/ISTATUS) to the guest.
-                u64 ctl;
-                asm volatile("mrs %0, CNTP_CTL_EL0" : "=r"(ctl));
-                current->arch.tf.cntp_ctl_el0 = ctl;
-                if (rt < 31)
-                    current->arch.tf.regs[rt] = ctl;
-            }
-            else
-            {
-                // Write CNTP_CTL: accept guest EN/IMASK and program hardware; ISTATUS is read-only.
-                u64 ctl = (rt < 31) ? current->arch.tf.regs[rt] : 0;
-                ctl &= 0x3u; // only enable and IMASK are writable
-                current->arch.tf.cntp_ctl_el0 = ctl;
-                asm volatile("msr CNTP_CTL_EL0, %0" : : "r"(ctl));
-            }
-            advance_guest_elr(current, elr);
-            asm volatile("isb");
-            return true;
-        }
+    guest_report_ring_drain(vcpu);
+    vtimer_block(vcpu);
+    vcpu->request_yield = true;
+    return TRAP_ADVANCE;
+}
 
-        case SYS_CNTP_TVAL_EL0:
-        {
-            if (is_read)
-            {
-                // Read CNTP_TVAL: return (virtual CVAL - virtual counter) as a signed 32-bit delta.
-                u64 virt_cval = current->arch.tf.cntp_cval_el0;
-                s64 delta = (s64)(virt_cval - virt_now);
-                if (rt < 31)
-                    current->arch.tf.regs[rt] = (u64)delta;
-            }
-            else
-            {
-                // Write CNTP_TVAL: treat guest value as signed delta, derive absolute virtual target, then program CNTP_CVAL.
-                u64 raw = (rt < 31) ? current->arch.tf.regs[rt] : 0;
-                s64 delta = (int32_t)raw; // TVAL is a signed 32-bit offset
-                u64 target = virt_now + delta;
-                current->arch.tf.cntp_cval_el0 = target;
-                u64 phys_target = target - current->arch.cntvoff_el2;
-                asm volatile("msr CNTP_CVAL_EL0, %0" : : "r"(phys_target));
-            }
-            advance_guest_elr(current, elr);
-            asm volatile("isb");
-            return true;
-        }
+// SMCCC 1.1 dispatch. Only fast calls exist here; SMC32 calls see and return
+// 32-bit values. x4-x17 are preserved because the trapframe is restored whole.
+void smccc_dispatch(vcpu_t *vcpu, smccc_args_t *args)
+{
+    const u32 fid = (u32)args->a[0];
+    const bool smc32 = (fid & SMCCC_SMC64) == 0;
 
-        case SYS_CNTV_CVAL_EL0:
-        {
-            if (is_read)
-            {
-                // Read CNTV_CVAL: pass through the virtual timer compare value as-is.
-                u64 val;
-                asm volatile("mrs %0, CNTV_CVAL_EL0" : "=r"(val));
-                current->arch.tf.cntv_cval_el0 = val;
-                if (rt < 31)
-                    current->arch.tf.regs[rt] = val;
-            }
-            else
-            {
-                // Write CNTV_CVAL: program the virtual timer compare value directly.
-                u64 val = (rt < 31) ? current->arch.tf.regs[rt] : 0;
-                current->arch.tf.cntv_cval_el0 = val;
-                asm volatile("msr CNTV_CVAL_EL0, %0" : : "r"(val));
-            }
-            advance_guest_elr(current, elr);
-            asm volatile("isb");
-            return true;
-        }
+    smccc_handler_t fn = (fid & SMCCC_FAST_CALL) ? trap_smccc_lookup(fid) : NULL;
+    if (!fn) {
+        args->a[0] = smc32 ? (u32)SMCCC_RET_NOT_SUPPORTED : SMCCC_RET_NOT_SUPPORTED;
+        return;
+    }
 
-        case SYS_CNTV_CTL_EL0:
-        {
-            if (is_read)
-            {
-                // Read CNTV_CTL: expose virtual timer control bits (EN/IMASK/ISTATUS).
-                u64 ctl;
-                asm volatile("mrs %0, CNTV_CTL_EL0" : "=r"(ctl));
-                current->arch.tf.cntv_ctl_el0 = ctl;
-                if (rt < 31)
-                    current->arch.tf.regs[rt] = ctl;
-            }
-            else
-            {
-                // Write CNTV_CTL: accept guest EN/IMASK and program virtual timer control.
-                u64 ctl = (rt < 31) ? current->arch.tf.regs[rt] : 0;
-                ctl &= 0x3u;
-                current->arch.tf.cntv_ctl_el0 = ctl;
-                asm volatile("msr CNTV_CTL_EL0, %0" : : "r"(ctl));
-            }
-            advance_guest_elr(current, elr);
-            asm volatile("isb");
-            return true;
-        }
+    if (smc32)
+        for (u32 i = 1; i < SMCCC_NR_ARGS; ++i)
+            args->a[i] = (u32)args->a[i];
+    fn(vcpu, args);
+    if (smc32)
+        for (u32 i = 0; i < 4; ++i)
+            args->a[i] = (u32)args->a[i];
+}
 
-        case SYS_CNTV_TVAL_EL0:
-        {
-            if (is_read)
-            {
-                // Read CNTV_TVAL: return (CNTV_CVAL - CNTVCT) as signed delta.
-                u64 val;
-                asm volatile("mrs %0, CNTV_CVAL_EL0" : "=r"(val));
-                current->arch.tf.cntv_cval_el0 = val;
-                s64 delta = (s64)(val - virt_now);
-                if (rt < 31)
-                    current->arch.tf.regs[rt] = (u64)delta;
-            }
-            else
-            {
-                // Write CNTV_TVAL: treat guest value as signed delta and program CNTV_CVAL accordingly.
-                u64 raw = (rt < 31) ? current->arch.tf.regs[rt] : 0;
-                s64 delta = (int32_t)raw;
-                u64 target = virt_now + delta;
-                current->arch.tf.cntv_cval_el0 = target;
-                asm volatile("msr CNTV_CVAL_EL0, %0" : : "r"(target));
-            }
-            advance_guest_elr(current, elr);
-            asm volatile("isb");
-            return true;
-        }
+// Load x0-x7 into an SMCCC argument block, dispatch, and write back x0-x3.
+static trap_result_t trap_smccc(trap_ctx_t *ctx)
+{
+    vcpu_t *vcpu = ctx->vcpu;
+    if (!vcpu)
+        return TRAP_UNHANDLED;
 
-        default:
-            break;
-    }
+    smccc_args_t args;
+    for (u32 i = 0; i < SMCCC_NR_ARGS; ++i)
+        args.a[i] = vcpu->arch.tf.regs[i];
 
-    return false;
+    smccc_dispatch(vcpu, &args);
+
+    for (u32 i = 0; i < 4; ++i)
+        vcpu->arch.tf.regs[i] = args.a[i];
+    return TRAP_RESUME;
 }
 
-// Adjust CNTVOFF_EL2 and timer hardware when a guest asks to set its virtual time (HVC #0x61).
-static bool handle_guest_time_override(void)
+// EC=0x17: SMC trapped by HCR_EL2.TSC. Same services as HVC #0, but ELR still
+// points at the SMC, so the instruction is retired. Non-zero immediates are
+// reserved by SMCCC and rejected.
+static trap_result_t trap_smc(trap_ctx_t *ctx)
 {
-    vcpu_t *current = vcpu_scheduler_current();
-    if (!current)
-        return false;
+    if (!ctx->vcpu)
+        return TRAP_UNHANDLED;
+
+    if ((ctx->esr & 0xFFFF) != 0)
+        ctx->vcpu->arch.tf.regs[0] = SMCCC_RET_NOT_SUPPORTED;
+    else if (trap_smccc(ctx) != TRAP_RESUME)
+        return TRAP_UNHANDLED;
+    return TRAP_ADVANCE;
+}
 
-    u64 desired = current->arch.tf.regs[0]; // x0 holds target virtual counter value
-    u64 phys_counter;
-    asm volatile("mrs %0, CNTPCT_EL0" : "=r"(phys_counter));
-
-    u64 offset = desired - phys_counter;
-    current->arch.cntvct_el0 = desired;
-    current->arch.cntvoff_el2 = offset;
-    asm volatile("msr CNTVOFF_EL2, %0" : : "r"(offset) : "memory");
-    u64 phys_cval = current->arch.tf.cntp_cval_el0 - offset;
-    asm volatile("msr CNTP_CVAL_EL0, %0" : : "r"(phys_cval));
-    asm volatile("msr CNTP_CTL_EL0, %0" : : "r"(current->arch.tf.cntp_ctl_el0));
-    asm volatile("msr CNTV_CVAL_EL0, %0" : : "r"(current->arch.tf.cntv_cval_el0));
-    asm volatile("msr CNTV_CTL_EL0, %0" : : "r"(current->arch.tf.cntv_ctl_el0));
-    asm volatile("isb");
-    current->arch.tf.regs[0] = desired; // return the applied value in x0
-    return true;
+// SMCCC_VERSION: we implement the 1.1 convention (x0-x3 results, x4-x17 preserved).
+static void smccc_version(vcpu_t *vcpu, smccc_args_t *args)
+{
+    (void)vcpu;
+    args->a[0] = SMCCC_VERSION_1_1;
 }
 
-// Dispatch hypercalls issued as HVC (currently report/time override/debug traps).
-static bool handle_guest_hvc(u64 esr, u64 elr)
+// SMCCC_ARCH_FEATURES: x1 = function ID to probe; 0 if it is implemented.
+static void smccc_arch_features(vcpu_t *vcpu, smccc_args_t *args)
 {
-    const u64 imm16 = esr & 0xFFFF;
-    if (imm16 == 0x60)
-        return handle_guest_task_report(elr);
-    if (imm16 == 0x61)
-        return handle_guest_time_override();
-    if (imm16 == 0x63) {
-        vcpu_t *current = vcpu_scheduler_current();
-        console_puts("EL2: guest synchronous exception report\n");
-        if (current) {
-            u64 guest_esr = current->arch.tf.regs[0];
-            u64 guest_elr = current->arch.tf.regs[1];
-            console_puts("  guest ESR_EL1: "); console_hex64(guest_esr); console_puts("\n");
-            console_puts("  guest ELR_EL1: "); console_hex64(guest_elr); console_puts("\n");
-        }
-        for (;;)
-            asm volatile("wfi");
+    (void)vcpu;
+    const u32 fid = (u32)args->a[1];
+    args->a[0] = trap_smccc_lookup(fid) ? SMCCC_RET_SUCCESS : SMCCC_RET_NOT_SUPPORTED;
+}
+
+// EC=0x16: HVC. Non-zero immediates index the legacy hypercall table.
+static trap_result_t trap_hvc(trap_ctx_t *ctx)
+{
+    const u64 imm16 = ctx->esr & 0xFFFF;
+    if (imm16 == 0)
+        return trap_smccc(ctx);
+    if (imm16 < TRAP_HVC_IMM_SLOTS && hvc_imm_table[imm16])
+        return hvc_imm_table[imm16](ctx);
+    return TRAP_UNHANDLED;
+}
+
+// Take a synchronous exception with syndrome `esr` (the EC for EL1 or EL0
+// already chosen) to the guest's own EL1 vectors: ELR_EL1 and SPSR_EL1
+// describe the trapped instruction, and the guest resumes at VBAR_EL1 plus
+// the offset for the level it was at, with every exception masked.
+static trap_result_t trap_inject_sync(trap_ctx_t *ctx, u64 esr)
+{
+    const u64 mode = ctx->spsr & 0xFu;  // SPSR_EL2.M[3:0]: 0 EL0t, 4 EL1t, 5 EL1h
+    const u64 offset = (mode & 0xCu) == 0 ? 0x400u : (mode & 1u) ? 0x200u : 0x0u;
+    u64 vbar;
+    asm volatile("mrs %0, VBAR_EL1" : "=r"(vbar));
+    asm volatile("msr ESR_EL1, %0" :: "r"(esr));
+    asm volatile("msr ELR_EL1, %0" :: "r"(ctx->elr));
+    asm volatile("msr SPSR_EL1, %0" :: "r"(ctx->spsr));
+
+    const u64 pc = vbar + offset;
+    const u64 spsr = 0x3C5u; // EL1h, D, A, I and F masked
+    asm volatile("msr ELR_EL2, %0" :: "r"(pc));
+    asm volatile("msr SPSR_EL2, %0" :: "r"(spsr));
+    ctx->vcpu->arch.tf.elr_el1 = pc;
+    ctx->vcpu->arch.tf.spsr_el1 = spsr;
+    return TRAP_RESUME;
+}
+
+// The trapped instruction is UNDEFINED for this vCPU: a feature it was
+// created without (FP/SIMD, SVE, the PMU) behaves as if the CPU lacked it.
+static trap_result_t trap_inject_undef(trap_ctx_t *ctx)
+{
+    if (!ctx->vcpu)
+        return TRAP_UNHANDLED;
+    return trap_inject_sync(ctx, 1u << 25); // EC 0x00, IL: a 32-bit instruction
+}
+
+// A synchronous external abort on the guest's access, as if the memory system
+// had failed it; FAR_EL1 gets the faulting address.
+static trap_result_t trap_inject_dabt(trap_ctx_t *ctx)
+{
+    const bool from_el0 = (ctx->spsr & 0xCu) == 0;
+    const u64 ec = from_el0 ? ESR_EC_DABT_LOW : ESR_EC_DABT_CUR;
+    // IL and WnR carry over; DFSC 0x10 is a synchronous external abort.
+    const u64 esr = (ec << ESR_EC_SHIFT) | (ctx->esr & ((1u << 25) | (1u << 6))) | 0x10u;
+    asm volatile("msr FAR_EL1, %0" :: "r"(ctx->far));
+    return trap_inject_sync(ctx, esr);
+}
+
+// EC=0x18: MSR/MRS. Look up the register and move the value between the
+// handler and Xt; the common exit path retires the instruction.
+static trap_result_t trap_sysreg(trap_ctx_t *ctx)
+{
+    if (!ctx->vcpu)
+        return TRAP_UNHANDLED;
+
+    const u32 encoding = esr_sys64_sysreg(ctx->esr);
+    if (vpmu_is_pmu_sysreg(encoding)) // first PMU access: load it and retry
+        return vpmu_trap(ctx->vcpu) ? TRAP_RESUME : trap_inject_undef(ctx);
+
+    const sysreg_trap_t *entry = sysreg_trap_find(encoding);
+    if (!entry)
+        return TRAP_UNHANDLED;
+
+    const u32 rt = esr_sys64_rt(ctx->esr);
+    const bool is_read = esr_sys64_is_read(ctx->esr);
+    u64 val = (!is_read && rt < 31) ? ctx->vcpu->arch.tf.regs[rt] : 0; // rt=31 is XZR
+
+    if (!entry->fn(ctx->vcpu, is_read, &val))
+        return TRAP_UNHANDLED;
+    if (is_read && rt < 31)
+        ctx->vcpu->arch.tf.regs[rt] = val;
+    return TRAP_ADVANCE;
+}
+
+// IPA of a stage-2 permission fault. HPFAR_EL2 only holds it when the fault
+// hit a stage-1 table walk, so otherwise FAR_EL2 goes back through the
+// guest's stage 1. False if that walk fails now: the guest changed its tables
+// since, and retrying the access sorts it out.
+static bool dabt_perm_ipa(u64 iss, u64 far, u64 *ipa)
+{
+    u64 hpfar;
+    asm volatile("mrs %0, HPFAR_EL2" : "=r"(hpfar));
+    if (iss & (1u << 7)) { // S1PTW
+        *ipa = (hpfar & 0xFFFFFFFFFF0ull) << 8;
+        return true;
     }
-    return false;
+
+    u64 par, guest_par;
+    asm volatile("mrs %0, PAR_EL1" : "=r"(guest_par));
+    asm volatile("at s1e1r, %0" :: "r"(far));
+    isb();
+    asm volatile("mrs %0, PAR_EL1" : "=r"(par));
+    asm volatile("msr PAR_EL1, %0" :: "r"(guest_par));
+    if (par & 1u) // PAR_EL1.F
+        return false;
+    *ipa = (par & 0xFFFFFFFFF000ull) | (far & 0xFFFull);
+    return true;
 }
 
-// Top-level EL2 exception handler: decode EC, fast-path known traps, and dump state otherwise.
-void el2_exception_common(u64 esr, u64 elr, u64 spsr, u64 far, u64 code) {
-    u64 ec = (esr >> 26) & 0x3F; // Exception Class
+// A stage-2 write permission fault on a copy-on-write page (a loaded image,
+// core/guest_image.c, or a cloned VM, core/vm_snapshot.c): give the guest its
+// private copy and retry the store. With the frame pool empty the store
+// cannot complete; on a read-only page (an image's text or rodata) it never
+// may. Either way the guest gets an abort instead of EL2 stopping.
+static trap_result_t trap_dabt_perm(trap_ctx_t *ctx, u64 iss)
+{
+    if (!(iss & (1u << 6)) || (iss & (1u << 10))) // WnR clear: a read; FnV: FAR unknown
+        return TRAP_UNHANDLED;
+    u64 ipa;
+    if (!dabt_perm_ipa(iss, ctx->far, &ipa))
+        return TRAP_RESUME;
+    if (s2_cow_fault(ipa))
+        return TRAP_RESUME;
+    console_puts(s2_cow_pending(ipa) ? "EL2: frame pool empty, aborting guest store to "
+                                     : "EL2: aborting guest store to read-only ");
+    console_hex64(ipa);
+    console_puts("\n");
+    return trap_inject_dabt(ctx);
+}
+
+// A stage-2 access-flag fault: the working-set sampler (core/wss.c) cleared
+// the flag and the CPU does not set it in hardware. HPFAR_EL2 is valid for
+// these, and the page is all that matters.
+static trap_result_t trap_s2_access(void)
+{
+    u64 hpfar;
+    asm volatile("mrs %0, HPFAR_EL2" : "=r"(hpfar));
+    return s2_access_fault((hpfar & 0xFFFFFFFFFF0ull) << 8) ? TRAP_RESUME : TRAP_UNHANDLED;
+}
 
-    if (ec == 0x01) {
-        console_puts("EL2: WFI/WFE from guest detected, yielding...\n");
-        u64 next = elr + 4; // skip WFI/WFE
-        asm volatile("msr ELR_EL2, %0" :: "r"(next)); // Advance ELR_EL2
+// EC=0x24: data abort from the guest. A stage-2 translation fault on an IPA
+// claimed by an emulated device is an MMIO access, a permission fault may be
+// a first write to a copy-on-write page, an access-flag fault a page the
+// working-set sampler aged; anything else is fatal.
+static trap_result_t trap_dabt(trap_ctx_t *ctx)
+{
+    if (!ctx->vcpu)
+        return TRAP_UNHANDLED;
+
+    const u64 iss = ctx->esr & 0x1FFFFFFu;
+    const u32 dfsc = (u32)(iss & 0x3Fu);
+    if ((dfsc & 0x3Cu) == 0x0Cu)      // permission fault, levels 0-3
+        return trap_dabt_perm(ctx, iss);
+    if ((dfsc & 0x3Cu) == 0x08u)      // access flag fault, levels 0-3
+        return trap_s2_access();
+    if ((dfsc & 0x3Cu) != 0x04u)      // translation fault, levels 0-3
+        return TRAP_UNHANDLED;
+    if (iss & ((1u << 10) | (1u << 7))) // FnV: FAR unknown; S1PTW: guest table walk
+        return TRAP_UNHANDLED;
+
+    u64 hpfar;
+    asm volatile("mrs %0, HPFAR_EL2" : "=r"(hpfar));
+    const u64 ipa = ((hpfar & 0xFFFFFFFFFF0ull) << 8) | (ctx->far & 0xFFFull);
+    return mmio_emulate(ctx->vcpu, ctx->esr, ipa, ctx->elr) ? TRAP_ADVANCE : TRAP_UNHANDLED;
+}
 
-        vcpu_t* current = vcpu_scheduler_current();
-        if (current) {
-            current->arch.tf.elr_el1 = next;
-            current->request_yield = true;
-        }
+// EC=0x20: instruction abort from the guest. Only the access-flag faults of
+// aged pages are expected; the guest cannot execute from MMIO.
+static trap_result_t trap_iabt(trap_ctx_t *ctx)
+{
+    if (!ctx->vcpu)
+        return TRAP_UNHANDLED;
+    if ((ctx->esr & 0x3Cu) == 0x08u)  // IFSC: access flag fault, levels 0-3
+        return trap_s2_access();
+    return TRAP_UNHANDLED;
+}
 
-        return;
+// Exception-class dispatch table, built at compile time. Adding a trap type is
+// one entry here; the hot path stays a single indexed load.
+static const trap_handler_t ec_table[ESR_EC_COUNT] = {
+    [ESR_EC_WFX]   = trap_wfx,
+    [ESR_EC_FP]    = trap_inject_undef, // CPTR_EL2.TFP: a vCPU without VCPU_FEAT_FP
+    [ESR_EC_SVE]   = trap_inject_undef, // CPTR_EL2.TZ: a vCPU without VCPU_FEAT_SVE
+    [ESR_EC_HVC64] = trap_hvc,
+    [ESR_EC_SMC64] = trap_smc,
+    [ESR_EC_SYS64] = trap_sysreg,
+    [ESR_EC_IABT_LOW] = trap_iabt,
+    [ESR_EC_DABT_LOW] = trap_dabt,
+};
+
+void trap_init(void)
+{
+    trap_register_smccc(SMCCC_VERSION, smccc_version);
+    trap_register_smccc(SMCCC_ARCH_FEATURES, smccc_arch_features);
+
+    if (!sysreg_table_check()) {
+        console_puts("EL2: sysreg trap table is not sorted\n");
+        for (;;)
+            asm volatile("wfi");
     }
+}
 
-    if (ec == 0x16 && handle_guest_hvc(esr, elr))
-        return;
-    if (ec == 0x18 && handle_timer_sysreg(esr, elr))
-        return;
+static void trap_dump_and_hang(u64 esr, u64 elr, u64 spsr, u64 far, u64 code)
+{
+    u64 ec = esr_ec(esr);
 
     console_puts("\n=== EL2 Exception ===\n");
     console_puts("ESR: "); console_hex64(esr); console_puts("\n");
@@ -430,3 +498,47 @@ void el2_exception_common(u64 esr, u64 elr, u64 spsr, u64 far, u64 code) {
     }
     for(;;) asm volatile("wfi"); // hang
 }
+
+// Top-level EL2 exception handler: dispatch guest synchronous exits through
+// the EC table, retire the instruction once in common code, dump otherwise.
+void el2_exception_common(u64 esr, u64 elr, u64 spsr, u64 far, u64 code) {
+    if (VECTOR_FROM_LOWER_EL(code))
+        prof_el2_unmask();
+
+#if CONFIG_PROFILE
+    // The profiler's PMU overflow, taken from a guest by HCR_EL2.FMO.
+    if (VECTOR_KIND(code) == VECTOR_KIND_FIQ && VECTOR_FROM_LOWER_EL(code)) {
+        prof_fiq(elr, spsr);
+        return;
+    }
+#endif
+
+    // IRQs are routed to EL2 by HCR_EL2.IMO and arrive as exits from the
+    // guest; EL2 itself runs with them masked.
+    if (VECTOR_KIND(code) == VECTOR_KIND_IRQ && VECTOR_FROM_LOWER_EL(code)) {
+        irq_dispatch(vcpu_scheduler_current());
+        return;
+    }
+
+    if (VECTOR_KIND(code) == VECTOR_KIND_SYNC && VECTOR_FROM_LOWER_EL(code)) {
+        const u32 ec = esr_ec(esr);
+        trap_ec_counts[ec]++;
+
+        trap_ctx_t ctx = {
+            .esr = esr, .elr = elr, .spsr = spsr, .far = far, .code = code,
+            .vcpu = vcpu_scheduler_current(),
+        };
+        const trap_handler_t fn = ec_table[ec];
+        const trap_result_t res = fn ? fn(&ctx) : TRAP_UNHANDLED;
+
+        if (res == TRAP_ADVANCE) {
+            advance_guest_elr(ctx.vcpu, elr);
+            isb();
+            return;
+        }
+        if (res == TRAP_RESUME)
+            return;
+    }
+
+    trap_dump_and_hang(esr, elr, spsr, far, code);
+}
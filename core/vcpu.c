@@ -2,6 +2,16 @@
 #include <stdbool.h>
 #include "s2_mmu.h"
 #include "vcpu.h"
+#include "timer.h"
+#include "gic.h"
+#include "vgic.h"
+#include "steal_time.h"
+#include "vm.h"
+#include "guest_monitor.h"
+#include "vpmu.h"
+#include "prof.h"
+#include "wss.h"
+#include "poll_core.h"
 #include <stddef.h>
 
 // Forward declarations to avoid missing uart_pl011.h dependency.
@@ -18,92 +28,33 @@ trapframe_t *current_trapframe = NULL;
 // the exception vector restores from it when returning to C.
 u64 host_saved_area[16];
 
-#define VCPU_SCHED_MAX 8
-static vcpu_t* sched_runqueue[VCPU_SCHED_MAX];
-static size_t sched_len;
-static size_t sched_idx;
-static vcpu_t* sched_current;
-
-static int sched_find_slot(vcpu_t* vcpu)
-{
-    for (size_t i = 0; i < sched_len; ++i)
-        if (sched_runqueue[i] == vcpu)
-            return (int)i;
-    return -1;
-}
-
-void vcpu_scheduler_register(vcpu_t* vcpu)
-{
-    if (!vcpu || sched_len >= VCPU_SCHED_MAX)
-        return;
-    if (sched_find_slot(vcpu) >= 0)
-        return;
-    sched_runqueue[sched_len++] = vcpu;
-    if (!sched_current)
-    {
-        sched_current = vcpu;
-        sched_idx = sched_len - 1;
-    }
-}
-
-void vcpu_scheduler_set_current(vcpu_t* vcpu)
-{
-    if (!vcpu)
-        return;
-    int slot = sched_find_slot(vcpu);
-    if (slot < 0 && sched_len < VCPU_SCHED_MAX)
-    {
-        sched_runqueue[sched_len] = vcpu;
-        slot = (int)sched_len;
-        sched_len++;
-    }
-    if (slot >= 0)
-    {
-        sched_current = vcpu;
-        sched_idx = (size_t)slot;
-    }
-}
-
-vcpu_t* vcpu_scheduler_current(void)
-{
-    return sched_current;
-}
-
-bool vcpu_scheduler_yield(void)
-{
-    if (sched_len <= 1 || !sched_current)
-        return false;
-
-    size_t next = (sched_idx + 1) % sched_len;
-    vcpu_t* target = sched_runqueue[next];
-    if (!target || target == sched_current)
-        return false;
-
-    vcpu_t* prev = sched_current;
-    sched_current = target;
-    sched_idx = next;
-
-    world_switch(prev, target);
-    return true;
-}
+static vcpu_t* hw_loaded; // VCPU whose FP/PAuth/VGIC state and counter offset are live in hardware
 
 void vcpu_run(vcpu_t* vcpu)
 {
     if (!vcpu)
         return;
     vcpu_scheduler_set_current(vcpu);
-    
+    vtimer_slice_start();
+
+    vcpu_t *prev = NULL;
     while (1) {
         vcpu_t *current = vcpu_scheduler_current();
         if (!current) break;
 
         // Run the guest. This returns when the guest traps.
-        world_switch(NULL, current);
+        world_switch(prev, current);
+        prev = NULL;
 
         // Check if the guest requested a yield (e.g. WFI)
         if (current->request_yield) {
             current->request_yield = false;
-            vcpu_scheduler_yield();
+            if (vcpu_scheduler_yield())
+                prev = current;
+            vtimer_slice_start();
+            guest_monitor_sample();
+            prof_poll();
+            wss_poll(current); // before world_switch() leaves its stage-2 root
         }
     }
 }
@@ -113,7 +64,7 @@ static void save_fp(vcpu_t *vcpu)
     if (!vcpu)
         return;
 
-    uint8_t *base = (uint8_t *)vcpu->arch.fp.vregs;
+    uint8_t *base = (uint8_t *)vcpu->arch.fp->vregs;
     // Store Q0-Q31 registers
     asm volatile(
         "stp q0, q1, [%0]\n" // This stores Q0 and Q1 (each 128 bits) at offset 0 of the fp vregs array
@@ -138,18 +89,20 @@ static void save_fp(vcpu_t *vcpu)
 
     u64 tmp;
     asm volatile("mrs %0, FPCR" : "=r"(tmp)); // Read FPCR (Floating Point Control Register)
-    vcpu->arch.fp.fpcr = (u32)tmp;
+    vcpu->arch.fp->fpcr = (u32)tmp;
     asm volatile("mrs %0, FPSR" : "=r"(tmp)); // Read FPSR (Floating Point Status Register)
-    vcpu->arch.fp.fpsr = (u32)tmp;
-    vcpu->arch.fp.used = 1;
+    vcpu->arch.fp->fpsr = (u32)tmp;
+    vcpu->arch.fp->used = 1;
 }
 
+// A vCPU that has never saved restores its zeroed registers rather than
+// whatever the previous FP vCPU left behind.
 static void restore_fp(vcpu_t *vcpu)
 {
-    if (!vcpu || !vcpu->arch.fp.used)
+    if (!vcpu)
         return;
 
-    const uint8_t *base = (const uint8_t *)vcpu->arch.fp.vregs;
+    const uint8_t *base = (const uint8_t *)vcpu->arch.fp->vregs;
 
     asm volatile(
         "ldp q0, q1, [%0]\n"
@@ -172,9 +125,9 @@ static void restore_fp(vcpu_t *vcpu)
         : "r"(base)
         : "memory");
 
-    u64 tmp = vcpu->arch.fp.fpcr;
+    u64 tmp = vcpu->arch.fp->fpcr;
     asm volatile("msr FPCR, %0" : : "r"(tmp));
-    tmp = vcpu->arch.fp.fpsr;
+    tmp = vcpu->arch.fp->fpsr;
     asm volatile("msr FPSR, %0" : : "r"(tmp));
 }
 
@@ -183,7 +136,7 @@ static void save_sve(vcpu_t *vcpu)
     if (!vcpu)
         return;
 
-    vcpu->arch.sve.used = 0; // SVE save not yet implemented.
+    vcpu->arch.sve->used = 0; // SVE save not yet implemented.
 }
 
 static void restore_sve(vcpu_t *vcpu)
@@ -197,61 +150,37 @@ static void save_pauth(vcpu_t *vcpu)
         return;
 
 #ifdef __ARM_FEATURE_PAUTH
-    asm volatile("mrs %0, APIAKEY_EL1" : "=r"(vcpu->arch.pauth.apia));
-    asm volatile("mrs %0, APIBKEY_EL1" : "=r"(vcpu->arch.pauth.apib));
-    asm volatile("mrs %0, APDAKEY_EL1" : "=r"(vcpu->arch.pauth.apda));
-    asm volatile("mrs %0, APDBKEY_EL1" : "=r"(vcpu->arch.pauth.apdb));
+    asm volatile("mrs %0, APIAKEY_EL1" : "=r"(vcpu->arch.pauth->apia));
+    asm volatile("mrs %0, APIBKEY_EL1" : "=r"(vcpu->arch.pauth->apib));
+    asm volatile("mrs %0, APDAKEY_EL1" : "=r"(vcpu->arch.pauth->apda));
+    asm volatile("mrs %0, APDBKEY_EL1" : "=r"(vcpu->arch.pauth->apdb));
 
     asm volatile("msr APIAKEY_EL1, xzr"); // Clear keys from registers after saving
     asm volatile("msr APIBKEY_EL1, xzr");
     asm volatile("msr APDAKEY_EL1, xzr");
     asm volatile("msr APDBKEY_EL1, xzr");
     asm volatile("isb");
-    vcpu->arch.pauth.used = 1;
+    vcpu->arch.pauth->used = 1;
 #else
-    vcpu->arch.pauth.used = 0;
+    vcpu->arch.pauth->used = 0;
 #endif
 }
 
 static void restore_pauth(vcpu_t *vcpu)
 {
-    if (!vcpu || !vcpu->arch.pauth.used)
+    if (!vcpu || !vcpu->arch.pauth->used)
         return;
 
 #ifdef __ARM_FEATURE_PAUTH
-    asm volatile("msr APIAKEY_EL1, %0" : : "r"(vcpu->arch.pauth.apia));
-    asm volatile("msr APIBKEY_EL1, %0" : : "r"(vcpu->arch.pauth.apib));
-    asm volatile("msr APDAKEY_EL1, %0" : : "r"(vcpu->arch.pauth.apda));
-    asm volatile("msr APDBKEY_EL1, %0" : : "r"(vcpu->arch.pauth.apdb));
+    asm volatile("msr APIAKEY_EL1, %0" : : "r"(vcpu->arch.pauth->apia));
+    asm volatile("msr APIBKEY_EL1, %0" : : "r"(vcpu->arch.pauth->apib));
+    asm volatile("msr APDAKEY_EL1, %0" : : "r"(vcpu->arch.pauth->apda));
+    asm volatile("msr APDBKEY_EL1, %0" : : "r"(vcpu->arch.pauth->apdb));
 #else
     (void)vcpu;
 #endif
 }
 
-#define ICH_LR_SYSREG(n) ICH_LR_SYSREG_##n
-#define ICH_LR_SYSREG_0  "S3_4_C12_C12_0"
-#define ICH_LR_SYSREG_1  "S3_4_C12_C12_1"
-#define ICH_LR_SYSREG_2  "S3_4_C12_C12_2"
-#define ICH_LR_SYSREG_3  "S3_4_C12_C12_3"
-#define ICH_LR_SYSREG_4  "S3_4_C12_C12_4"
-#define ICH_LR_SYSREG_5  "S3_4_C12_C12_5"
-#define ICH_LR_SYSREG_6  "S3_4_C12_C12_6"
-#define ICH_LR_SYSREG_7  "S3_4_C12_C12_7"
-#define ICH_LR_SYSREG_8  "S3_4_C12_C13_0"
-#define ICH_LR_SYSREG_9  "S3_4_C12_C13_1"
-#define ICH_LR_SYSREG_10 "S3_4_C12_C13_2"
-#define ICH_LR_SYSREG_11 "S3_4_C12_C13_3"
-#define ICH_LR_SYSREG_12 "S3_4_C12_C13_4"
-#define ICH_LR_SYSREG_13 "S3_4_C12_C13_5"
-#define ICH_LR_SYSREG_14 "S3_4_C12_C13_6"
-#define ICH_LR_SYSREG_15 "S3_4_C12_C13_7"
-#define ICH_VTR_SYSREG   "S3_4_C12_C11_1"
-#define ICH_VMCR_SYSREG    "S3_4_C12_C11_7"
-#define ICH_AP0R0_SYSREG   "S3_4_C12_C8_0"
-
-#define VGIC_LR_CAPACITY \
-    (sizeof(((vcpu_arch_t *)0)->vgic.lrs) / sizeof(((vcpu_arch_t *)0)->vgic.lrs[0]))
-
 #define SAVE_VGIC_LR_N(n) \
     asm volatile("mrs %0, " ICH_LR_SYSREG(n) : "=r"(vcpu->arch.vgic.lrs[n]))
 
@@ -264,28 +193,6 @@ static void restore_pauth(vcpu_t *vcpu)
 #define RESTORE_VGIC_LR_IF(n, count) \
     do { if ((count) > (n)) { RESTORE_VGIC_LR_N(n); } } while (0)
 
-static size_t vgic_detect_lr_count(void)
-{
-    u64 vtr;
-    asm volatile("mrs %0, " ICH_VTR_SYSREG : "=r"(vtr));
-    size_t count = (size_t)((vtr & 0xfu) + 1u);
-    if (count > VGIC_LR_CAPACITY)
-        count = VGIC_LR_CAPACITY;
-    return count;
-}
-
-static size_t vgic_lr_count(void)
-{
-    static size_t cached;
-    if (!cached)
-    {
-        cached = vgic_detect_lr_count();
-        if (!cached)
-            cached = 1; // hardware must implement >=1, but guard anyway
-    }
-    return cached;
-}
-
 static void save_vgic(vcpu_t *vcpu)
 {
     if (!vcpu)
@@ -315,6 +222,8 @@ static void save_vgic(vcpu_t *vcpu)
     vcpu->arch.vgic.vmcr = (u32)tmp;
     asm volatile("mrs %0, " ICH_AP0R0_SYSREG : "=r"(tmp)); // Read APR (Active Priority Register 0)
     vcpu->arch.vgic.apr = (u32)tmp;
+    asm volatile("mrs %0, " ICH_AP1R0_SYSREG : "=r"(tmp)); // Group 1 active priorities
+    vcpu->arch.vgic.apr1 = (u32)tmp;
 }
 
 static void restore_vgic(vcpu_t *vcpu)
@@ -343,52 +252,198 @@ static void restore_vgic(vcpu_t *vcpu)
 
     asm volatile("msr " ICH_VMCR_SYSREG ", %0" : : "r"((u64)vcpu->arch.vgic.vmcr)); // Restore VMCR
     asm volatile("msr " ICH_AP0R0_SYSREG ", %0" : : "r"((u64)vcpu->arch.vgic.apr)); // Restore APR
+    asm volatile("msr " ICH_AP1R0_SYSREG ", %0" : : "r"((u64)vcpu->arch.vgic.apr1));
     asm volatile("isb");
 }
 
-void world_switch(vcpu_t *from, vcpu_t *to)
+#define CPTR_EL2_TZ  (1ull << 8)  // trap SVE
+#define CPTR_EL2_TFP (1ull << 10) // trap FP/SIMD and SVE, EL2 included
+
+static u64 cptr_traps = ~0ull; // TZ/TFP as last written
+static bool ich_enabled = true; // ICH_HCR_EL2.En, set by gic_init()
+
+static void cptr_set_traps(u64 traps)
 {
-    // Disable interrupts to harden the switch
-    asm volatile("msr daifset, #2"); // Mask IRQs while switching
+    if (traps == cptr_traps)
+        return;
+    u64 cptr;
+    asm volatile("mrs %0, CPTR_EL2" : "=r"(cptr));
+    cptr = (cptr & ~(CPTR_EL2_TZ | CPTR_EL2_TFP)) | traps;
+    asm volatile("msr CPTR_EL2, %0" : : "r"(cptr));
     asm volatile("isb");
-    
-    if (from) {
+    cptr_traps = traps;
+}
+
+// A vCPU without a vGIC must not see the list registers of the one before.
+static void ich_enable(bool enable)
+{
+    if (enable == ich_enabled)
+        return;
+    u64 hcr;
+    asm volatile("mrs %0, " ICH_HCR_SYSREG : "=r"(hcr));
+    hcr = enable ? (hcr | ICH_HCR_EN) : (hcr & ~ICH_HCR_EN);
+    asm volatile("msr " ICH_HCR_SYSREG ", %0" : : "r"(hcr));
+    asm volatile("isb");
+    ich_enabled = enable;
+}
+
+// The halves of world_switch() that depend on the vCPU's features. `f` is a
+// constant in every instance below, so each variant keeps only the steps for
+// the features it names and tests nothing at run time.
+static inline __attribute__((always_inline)) void switch_put_state(vcpu_t *vcpu, u32 f)
+{
+    if (f & VCPU_FEAT_FP)
+        save_fp(vcpu);
+    if (f & VCPU_FEAT_SVE)
+        save_sve(vcpu);
+    if (f & VCPU_FEAT_PAUTH)
+        save_pauth(vcpu);
+    if (f & VCPU_FEAT_VGIC)
+        save_vgic(vcpu);
+    vtimer_put(vcpu);
+    if (f & VCPU_FEAT_PMU)
+        vpmu_put(vcpu);
+}
+
+static inline __attribute__((always_inline)) void switch_load_state(vcpu_t *vcpu, u32 f)
+{
+    ich_enable((f & VCPU_FEAT_VGIC) != 0);
+    if (f & VCPU_FEAT_VGIC)
+        restore_vgic(vcpu);
+    if (f & VCPU_FEAT_PMU)
+        vpmu_load(vcpu);
+    else
+        vpmu_block();
+    if (f & VCPU_FEAT_PAUTH)
+        restore_pauth(vcpu);
+    cptr_set_traps(((f & VCPU_FEAT_SVE) ? 0 : CPTR_EL2_TZ) |
+                   ((f & VCPU_FEAT_FP) ? 0 : CPTR_EL2_TFP));
+    if (f & VCPU_FEAT_SVE)
+        restore_sve(vcpu);
+    if (f & VCPU_FEAT_FP)
+        restore_fp(vcpu);
+}
+
+#define SWITCH_VARIANT(f)                                                       \
+    static void switch_put_##f(vcpu_t *vcpu) { switch_put_state(vcpu, f); }    \
+    static void switch_load_##f(vcpu_t *vcpu) { switch_load_state(vcpu, f); }
+#define SWITCH_ENTRY(f) [f] = { switch_put_##f, switch_load_##f },
+
+// Every subset of VCPU_FEAT_ALL.
+#define SWITCH_FEATURE_SETS(X)                                                  \
+    X(0)  X(1)  X(2)  X(3)  X(4)  X(5)  X(6)  X(7)                              \
+    X(8)  X(9)  X(10) X(11) X(12) X(13) X(14) X(15)                             \
+    X(16) X(17) X(18) X(19) X(20) X(21) X(22) X(23)                             \
+    X(24) X(25) X(26) X(27) X(28) X(29) X(30) X(31)
+
+_Static_assert(VCPU_FEAT_ALL == 31u, "SWITCH_FEATURE_SETS must list every feature subset");
+
+SWITCH_FEATURE_SETS(SWITCH_VARIANT)
+
+static const struct
+{
+    void (*put)(vcpu_t *);
+    void (*load)(vcpu_t *);
+} switch_variants[VCPU_FEAT_ALL + 1] = {
+    SWITCH_FEATURE_SETS(SWITCH_ENTRY)
+};
+
+// SVE registers are not saved yet, and the PAuth keys only when the
+// toolchain targets FEAT_PAuth (save_pauth()).
+static u32 switch_supported_features(void)
+{
+    u32 f = VCPU_FEAT_FP | VCPU_FEAT_VGIC | VCPU_FEAT_PMU;
+#ifdef __ARM_FEATURE_PAUTH
+    f |= VCPU_FEAT_PAUTH;
+#endif
+    return f;
+}
+
+void vcpu_set_features(vcpu_t *vcpu, u32 features)
+{
+    features &= switch_supported_features();
+    vcpu->features = features;
+    vcpu->switch_put = switch_variants[features].put;
+    vcpu->switch_load = switch_variants[features].load;
+}
+
+// Move the loaded vCPU's hardware state back into its vcpu_t.
+static void vcpu_put(vcpu_t *vcpu)
+{
+    // A preempted VCPU's clock freezes; a blocked one keeps running so
+    // its timer deadline on the EL2 queue stays meaningful.
+    if (!vcpu->blocked) {
         u64 vct;
         asm volatile("mrs %0, CNTVCT_EL0" : "=r"(vct));
-        from->arch.cntvct_el0 = vct;
-        save_fp(from);
-        save_sve(from);
-        save_pauth(from);
-        save_vgic(from);
+        vcpu->arch.cntvct_el0 = vct;
+    }
+    vcpu->switch_put(vcpu);
+    hw_loaded = NULL;
+}
+
+void vcpu_put_loaded(void)
+{
+    if (hw_loaded)
+        vcpu_put(hw_loaded);
+}
+
+// Enter `to`. `from` is the VCPU being descheduled, or NULL when re-entering
+// after an exit. State that EL2 never touches (FP, PAuth keys, VGIC, counter
+// offset) stays in hardware across exits and is only swapped, by the vCPUs'
+// feature-specialized switch_put/switch_load, when the loaded VCPU changes.
+void world_switch(vcpu_t *from, vcpu_t *to)
+{
+    // EL2 runs with IRQs masked: they are taken as exits from the guest, or
+    // dispatched directly by vtimer_idle(). PROFILE builds leave FIQs open
+    // for the sampler.
+    asm volatile("msr daifset, #2");
+    asm volatile("isb");
+
+    if (from && from == hw_loaded) {
+        vcpu_acct_set(from, from->blocked ? VCPU_ACCT_BLOCKED : VCPU_ACCT_RUNNABLE);
+        vcpu_put(from);
     }
 
     // Switch Stage-2 translation context
     // This register holds the base address of the Stage-2 translation tables
     asm volatile("msr VTTBR_EL2, %0" : : "r"(to->arch.vttbr_el2) : "memory");
     isb(); // ensure new VMID/TTBR selection takes effect
+    s2_activate(to->arch.vttbr_el2);
+
+    if (to != hw_loaded) {
+        // Rebase the counter offset so the target resumes from its saved
+        // count. Re-entering the loaded VCPU keeps the live offset;
+        // recomputing it would rewind guest time on every exit.
+        u64 phys_cnt;
+        asm volatile("mrs %0, CNTPCT_EL0" : "=r"(phys_cnt));
+        u64 offset = phys_cnt - to->arch.cntvct_el0; // CNTVCT = CNTPCT - CNTVOFF
+        to->arch.cntvoff_el2 = offset;
+        timer_load_offset(offset);
+        pvclock_update(to);
+        poll_ring_publish_offset(to);
+        to->switch_load(to);
+        hw_loaded = to;
+
+        console_puts("Switching to VCPU ");
+        console_hex64(to->vcpu_id);
+        console_puts(" run=");
+        console_hex64(to->acct.run);
+        console_puts(" wait=");
+        console_hex64(to->acct.wait);
+        console_puts(" blocked=");
+        console_hex64(to->acct.blocked);
+        console_puts("\n");
+    }
+    vcpu_acct_set(to, VCPU_ACCT_RUNNING);
+    to->preempted = false;
 
-    // Update CNTVOFF_EL2 for the target VCPU
-    // This register holds the offset to be applied to the virtual timer
-    u64 phys_cnt;
-    asm volatile("mrs %0, CNTPCT_EL0" : "=r"(phys_cnt));
-    u64 offset = to->arch.cntvct_el0 - phys_cnt;
-    to->arch.cntvoff_el2 = offset;
-    asm volatile("msr CNTVOFF_EL2, %0" : : "r"(offset) : "memory");
-    restore_vgic(to);
-    restore_pauth(to);
-    restore_sve(to);
-    restore_fp(to);
+    // Deliver timer expiries and other pending virtual interrupts.
+    vpmu_sync(to);
+    vtimer_sync(to);
 
     asm volatile("msr VBAR_EL1, %0" :: "r"(guest_el1_vectors) : "memory");
 
     current_trapframe = &to->arch.tf; // mark target frame for capture on next exit
-    console_puts("Switching to VCPU ");
-    console_hex64(to->vcpu_id);
-    console_puts("\n");
 
     vcpu_switch_asm(&to->arch.tf); // restores EL1 regs + GPRs and eret
-    // Re-enable interrupts after switch
-    asm volatile("msr daifclr, #2"); // Re-enable IRQs
-    asm volatile("isb");
-
 }
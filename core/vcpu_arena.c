@@ -0,0 +1,37 @@
+#include <stddef.h>
+#include "memops.h"
+#include "vcpu.h"
+
+// One arena per CPU so a CPU's vCPUs share neither cache lines nor pages with
+// another CPU's. The hot array is walked by the scheduler and written by
+// every exit; the cold array is only touched when world_switch() changes the
+// loaded vCPU.
+typedef struct
+{
+    vcpu_t vcpus[VCPU_ARENA_SLOTS];
+    vcpu_cold_t cold[VCPU_ARENA_SLOTS];
+    u32 used;
+} __attribute__((aligned(4096))) vcpu_arena_t;
+
+static vcpu_arena_t vcpu_arenas[VCPU_ARENA_CPUS];
+
+vcpu_t *vcpu_alloc(u32 cpu)
+{
+    if (cpu >= VCPU_ARENA_CPUS || vcpu_arenas[cpu].used >= VCPU_ARENA_SLOTS)
+        return NULL;
+    vcpu_arena_t *arena = &vcpu_arenas[cpu];
+    const u32 slot = arena->used++;
+    vcpu_t *vcpu = &arena->vcpus[slot];
+    vcpu_cold_t *cold = &arena->cold[slot];
+    hyp_memset(vcpu, 0, sizeof(*vcpu));
+    hyp_memset(cold, 0, sizeof(*cold));
+    vcpu->arch.fp = &cold->fp;
+    vcpu->arch.sve = &cold->sve;
+    vcpu->arch.pauth = &cold->pauth;
+    return vcpu;
+}
+
+u32 vcpu_arena_free(u32 cpu)
+{
+    return cpu < VCPU_ARENA_CPUS ? VCPU_ARENA_SLOTS - vcpu_arenas[cpu].used : 0;
+}
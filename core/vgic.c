@@ -0,0 +1,384 @@
+#include "vgic.h"
+#include "gic.h"
+#include "irq.h"
+#include "timer.h"
+#include "vm.h"
+
+#define VGIC_LR_CAPACITY \
+    (sizeof(((vcpu_arch_t *)0)->vgic.lrs) / sizeof(((vcpu_arch_t *)0)->vgic.lrs[0]))
+
+
+static size_t vgic_detect_lr_count(void)
+{
+    u64 vtr;
+    asm volatile("mrs %0, " ICH_VTR_SYSREG : "=r"(vtr));
+    size_t count = (size_t)((vtr & 0xfu) + 1u);
+    if (count > VGIC_LR_CAPACITY)
+        count = VGIC_LR_CAPACITY;
+    return count;
+}
+
+size_t vgic_lr_count(void)
+{
+    static size_t cached;
+    if (!cached)
+    {
+        cached = vgic_detect_lr_count();
+        if (!cached)
+            cached = 1; // hardware must implement >=1, but guard anyway
+    }
+    return cached;
+}
+
+#define VGIC_LR_CASE_READ(n) case n: asm volatile("mrs %0, " ICH_LR_SYSREG(n) : "=r"(v)); break
+#define VGIC_LR_CASE_WRITE(n) case n: asm volatile("msr " ICH_LR_SYSREG(n) ", %0" : : "r"(v)); break
+
+static u64 vgic_read_lr(u32 n)
+{
+    u64 v = 0;
+    switch (n)
+    {
+        VGIC_LR_CASE_READ(0);  VGIC_LR_CASE_READ(1);  VGIC_LR_CASE_READ(2);  VGIC_LR_CASE_READ(3);
+        VGIC_LR_CASE_READ(4);  VGIC_LR_CASE_READ(5);  VGIC_LR_CASE_READ(6);  VGIC_LR_CASE_READ(7);
+        VGIC_LR_CASE_READ(8);  VGIC_LR_CASE_READ(9);  VGIC_LR_CASE_READ(10); VGIC_LR_CASE_READ(11);
+        VGIC_LR_CASE_READ(12); VGIC_LR_CASE_READ(13); VGIC_LR_CASE_READ(14); VGIC_LR_CASE_READ(15);
+    }
+    return v;
+}
+
+static void vgic_write_lr(u32 n, u64 v)
+{
+    switch (n)
+    {
+        VGIC_LR_CASE_WRITE(0);  VGIC_LR_CASE_WRITE(1);  VGIC_LR_CASE_WRITE(2);  VGIC_LR_CASE_WRITE(3);
+        VGIC_LR_CASE_WRITE(4);  VGIC_LR_CASE_WRITE(5);  VGIC_LR_CASE_WRITE(6);  VGIC_LR_CASE_WRITE(7);
+        VGIC_LR_CASE_WRITE(8);  VGIC_LR_CASE_WRITE(9);  VGIC_LR_CASE_WRITE(10); VGIC_LR_CASE_WRITE(11);
+        VGIC_LR_CASE_WRITE(12); VGIC_LR_CASE_WRITE(13); VGIC_LR_CASE_WRITE(14); VGIC_LR_CASE_WRITE(15);
+    }
+}
+
+// List registers the guest is done with: ICH_ELRSR_EL2 marks invalid ones,
+// ICH_EISR_EL2 those that went invalid with ICH_LR.EOI set.
+static u32 vgic_completed_lrs(void)
+{
+    u64 elrsr, eisr;
+    asm volatile("mrs %0, " ICH_ELRSR_SYSREG : "=r"(elrsr));
+    asm volatile("mrs %0, " ICH_EISR_SYSREG : "=r"(eisr));
+    return (u32)(elrsr | eisr) & (u32)((1ull << vgic_lr_count()) - 1u);
+}
+
+static inline u32 vgic_bit(u32 intid)
+{
+    return 1u << (intid & 31u);
+}
+
+u32 *vgic_state_word(vcpu_t *vcpu, u32 field, u32 intid)
+{
+    if (intid < VGIC_NR_PRIVATE)
+        return &vcpu->arch.vgic.priv[field];
+    if (intid >= VGIC_NR_IRQS || !vcpu->vm)
+        return NULL;
+    return &vcpu->vm->vgic.spi[field][(intid - VGIC_NR_PRIVATE) / 32u];
+}
+
+u8 *vgic_priority(vcpu_t *vcpu, u32 intid)
+{
+    if (intid < VGIC_NR_PRIVATE)
+        return &vcpu->arch.vgic.priority[intid];
+    if (intid >= VGIC_NR_IRQS || !vcpu->vm)
+        return NULL;
+    return &vcpu->vm->vgic.priority[intid - VGIC_NR_PRIVATE];
+}
+
+static bool vgic_test(vcpu_t *vcpu, u32 field, u32 intid)
+{
+    const u32 *w = vgic_state_word(vcpu, field, intid);
+    return w && (*w & vgic_bit(intid));
+}
+
+static void vgic_assign(vcpu_t *vcpu, u32 field, u32 intid, bool on)
+{
+    u32 *w = vgic_state_word(vcpu, field, intid);
+    if (!w)
+        return;
+    if (on)
+        *w |= vgic_bit(intid);
+    else
+        *w &= ~vgic_bit(intid);
+}
+
+vcpu_t *vgic_target(vcpu_t *vcpu, u32 intid)
+{
+    if (intid < VGIC_NR_PRIVATE)
+        return vcpu;
+    const struct sch_vm *vm = vcpu->vm;
+    if (!vm || intid >= VGIC_NR_IRQS || !vm->nr_vcpus)
+        return NULL;
+    const u32 idx = vm->vgic.target[intid - VGIC_NR_PRIVATE];
+    return vm->vcpus[idx < vm->nr_vcpus ? idx : 0];
+}
+
+// Priority queue: a binary min-heap of (priority << 16) | INTID, so the most
+// urgent interrupt (lowest priority value, then lowest INTID) is on top.
+// VGIC_STATE_QUEUED keeps an INTID in at most one heap, which bounds the heap
+// at VGIC_NR_IRQS entries. Entries are invalidated lazily: whatever changed
+// since the push is re-checked when the entry is popped.
+static void queue_push(vcpu_t *vcpu, u32 key)
+{
+    u32 *q = vcpu->arch.vgic.queue;
+    u32 i = vcpu->arch.vgic.queue_len++;
+    while (i > 0) {
+        const u32 parent = (i - 1u) / 2u;
+        if (q[parent] <= key)
+            break;
+        q[i] = q[parent];
+        i = parent;
+    }
+    q[i] = key;
+}
+
+static u32 queue_pop(vcpu_t *vcpu)
+{
+    u32 *q = vcpu->arch.vgic.queue;
+    const u32 top = q[0];
+    const u32 last = q[--vcpu->arch.vgic.queue_len];
+    const u32 len = vcpu->arch.vgic.queue_len;
+    u32 i = 0;
+    for (;;) {
+        u32 child = 2u * i + 1u;
+        if (child >= len)
+            break;
+        if (child + 1u < len && q[child + 1u] < q[child])
+            child++;
+        if (last <= q[child])
+            break;
+        q[i] = q[child];
+        i = child;
+    }
+    if (len)
+        q[i] = last;
+    return top;
+}
+
+void vgic_update(vcpu_t *vcpu, u32 intid)
+{
+    vcpu_t *target = vgic_target(vcpu, intid);
+    if (!target)
+        return;
+    if (!vgic_test(target, VGIC_STATE_PENDING, intid) ||
+        !vgic_test(target, VGIC_STATE_ENABLED, intid) ||
+        vgic_test(target, VGIC_STATE_QUEUED, intid))
+        return;
+    vgic_assign(target, VGIC_STATE_QUEUED, intid, true);
+    queue_push(target, ((u32)*vgic_priority(target, intid) << 16) | intid);
+    if (target->blocked)
+        vtimer_unblock(target); // a pending interrupt ends WFI
+}
+
+void vgic_requeue_all(struct sch_vm *vm)
+{
+    for (u32 v = 0; v < vm->nr_vcpus; ++v)
+        for (u32 intid = 0; intid < VGIC_NR_PRIVATE; ++intid)
+            vgic_update(vm->vcpus[v], intid);
+    if (vm->nr_vcpus)
+        for (u32 intid = VGIC_NR_PRIVATE; intid < VGIC_NR_IRQS; ++intid)
+            vgic_update(vm->vcpus[0], intid);
+}
+
+void vgic_dist_init(vgic_dist_t *dist)
+{
+    dist->ctlr = 0;
+    for (u32 f = 0; f < VGIC_NR_STATES; ++f)
+        for (u32 w = 0; w < VGIC_SPI_WORDS; ++w)
+            dist->spi[f][w] = 0;
+    // Single security state: everything defaults to the non-secure group.
+    for (u32 w = 0; w < VGIC_SPI_WORDS; ++w)
+        dist->spi[VGIC_STATE_GROUP1][w] = ~0u;
+    for (u32 i = 0; i < VGIC_NR_SPIS; ++i) {
+        dist->priority[i] = 0;
+        dist->target[i] = 0;
+    }
+}
+
+void vgic_vcpu_reset(vcpu_t *vcpu)
+{
+    for (u32 f = 0; f < VGIC_NR_STATES; ++f)
+        vcpu->arch.vgic.priv[f] = 0;
+    vcpu->arch.vgic.priv[VGIC_STATE_GROUP1] = ~0u;
+    vcpu->arch.vgic.priv[VGIC_STATE_EDGE] = 0xFFFFu; // SGIs are always edge
+    for (u32 i = 0; i < VGIC_NR_PRIVATE; ++i)
+        vcpu->arch.vgic.priority[i] = 0;
+    vcpu->arch.vgic.lr_used = 0;
+    vcpu->arch.vgic.queue_len = 0;
+    vcpu->arch.vgic.redist_waker = 1u << 1; // ProcessorSleep
+}
+
+void vgic_set_pending(vcpu_t *vcpu, u32 intid)
+{
+    if (!vcpu || intid >= VGIC_NR_PRIVATE)
+        return;
+    vcpu->arch.vgic.priv[VGIC_STATE_PENDING] |= vgic_bit(intid);
+    vgic_update(vcpu, intid);
+}
+
+void vgic_set_pending_hw(vcpu_t *vcpu, u32 intid)
+{
+    if (!vcpu || intid >= VGIC_NR_PRIVATE)
+        return;
+    vcpu->arch.vgic.priv[VGIC_STATE_HW] |= vgic_bit(intid);
+    vgic_set_pending(vcpu, intid);
+}
+
+void vgic_set_spi_level(struct sch_vm *vm, u32 intid, bool level)
+{
+    if (!vm->nr_vcpus || intid < VGIC_NR_PRIVATE || intid >= VGIC_NR_IRQS)
+        return;
+    vcpu_t *any = vm->vcpus[0];
+    if (!vgic_test(any, VGIC_STATE_EDGE, intid)) {
+        vgic_assign(any, VGIC_STATE_LEVEL, intid, level);
+        if (!level) {
+            vgic_assign(any, VGIC_STATE_PENDING, intid, false);
+            return;
+        }
+    } else if (!level) {
+        return;
+    }
+    vgic_assign(any, VGIC_STATE_PENDING, intid, true);
+    vgic_update(any, intid);
+}
+
+static bool vgic_group_enabled(vcpu_t *vcpu, u32 intid)
+{
+    const u32 ctlr = vcpu->vm ? vcpu->vm->vgic.ctlr : 0;
+    return vgic_test(vcpu, VGIC_STATE_GROUP1, intid) ? (ctlr & VGIC_DIST_CTLR_ENGRP1) != 0
+                                                     : (ctlr & VGIC_DIST_CTLR_ENGRP0) != 0;
+}
+
+// Fold list registers the guest has finished with back into the bitmaps.
+// A level-sensitive interrupt whose line is still high becomes pending again.
+static void vgic_retire_lrs(vcpu_t *vcpu)
+{
+    u32 used = vcpu->arch.vgic.lr_used;
+    if (!used)
+        return;
+    u32 done = used & vgic_completed_lrs();
+    while (done) {
+        const u32 n = (u32)__builtin_ctz(done);
+        done &= done - 1u;
+        const u64 lr = vgic_read_lr(n);
+        const u32 intid = (u32)(lr & ICH_LR_VINTID_MASK);
+        if (lr & ICH_LR_EOI)
+            vgic_write_lr(n, 0); // drop the EOI request so EISR clears
+        used &= ~(1u << n);
+        vgic_assign(vcpu, VGIC_STATE_IN_LR, intid, false);
+        vgic_assign(vcpu, VGIC_STATE_ACTIVE, intid, false);
+        vgic_assign(vcpu, VGIC_STATE_HW, intid, false);
+        if (!vgic_test(vcpu, VGIC_STATE_EDGE, intid) && vgic_test(vcpu, VGIC_STATE_LEVEL, intid))
+            vgic_assign(vcpu, VGIC_STATE_PENDING, intid, true);
+        vgic_update(vcpu, intid);
+    }
+    vcpu->arch.vgic.lr_used = (u16)used;
+}
+
+// `intid` became pending again while a list register still holds it. The GIC
+// forbids a second LR for the same vINTID, so ask for an EOI maintenance
+// interrupt and re-deliver once that LR retires.
+static void vgic_request_eoi(vcpu_t *vcpu, u32 intid)
+{
+    u32 used = vcpu->arch.vgic.lr_used;
+    while (used) {
+        const u32 n = (u32)__builtin_ctz(used);
+        used &= used - 1u;
+        const u64 lr = vgic_read_lr(n);
+        if ((lr & ICH_LR_VINTID_MASK) != intid)
+            continue;
+        if (!(lr & (ICH_LR_HW | ICH_LR_EOI)))
+            vgic_write_lr(n, lr | ICH_LR_EOI);
+        return;
+    }
+}
+
+static void vgic_set_underflow(bool enable)
+{
+    static bool uie;
+    if (enable == uie)
+        return;
+    u64 hcr;
+    asm volatile("mrs %0, " ICH_HCR_SYSREG : "=r"(hcr));
+    hcr = enable ? (hcr | ICH_HCR_UIE) : (hcr & ~ICH_HCR_UIE);
+    asm volatile("msr " ICH_HCR_SYSREG ", %0" : : "r"(hcr));
+    uie = enable;
+}
+
+void vgic_flush(vcpu_t *vcpu)
+{
+    vgic_retire_lrs(vcpu);
+
+    const u32 all = (u32)((1ull << vgic_lr_count()) - 1u);
+    u32 free = all & ~(u32)vcpu->arch.vgic.lr_used;
+    while (free && vcpu->arch.vgic.queue_len) {
+        const u32 key = queue_pop(vcpu);
+        const u32 intid = key & 0xFFFFu;
+        vgic_assign(vcpu, VGIC_STATE_QUEUED, intid, false);
+
+        if (vgic_target(vcpu, intid) != vcpu) {
+            vgic_update(vcpu, intid); // SPI was re-routed while queued
+            continue;
+        }
+        if (!vgic_test(vcpu, VGIC_STATE_PENDING, intid) ||
+            !vgic_test(vcpu, VGIC_STATE_ENABLED, intid) ||
+            !vgic_group_enabled(vcpu, intid))
+            continue; // re-queued by whatever makes it deliverable again
+        const u8 prio = *vgic_priority(vcpu, intid);
+        if ((key >> 16) != prio) {
+            vgic_update(vcpu, intid); // priority changed while queued
+            continue;
+        }
+        if (vgic_test(vcpu, VGIC_STATE_IN_LR, intid)) {
+            vgic_request_eoi(vcpu, intid);
+            continue;
+        }
+
+        u64 v = ICH_LR_STATE_PENDING | ICH_LR_PRIORITY(prio) | intid;
+        if (vgic_test(vcpu, VGIC_STATE_GROUP1, intid))
+            v |= ICH_LR_GROUP1;
+        if (vgic_test(vcpu, VGIC_STATE_HW, intid))
+            v |= ICH_LR_HW | ICH_LR_PINTID(intid);
+        else if (!vgic_test(vcpu, VGIC_STATE_EDGE, intid))
+            v |= ICH_LR_EOI; // resample the line when the guest is done
+        const u32 lr = (u32)__builtin_ctz(free);
+        vgic_write_lr(lr, v);
+        free &= free - 1u;
+        vcpu->arch.vgic.lr_used |= (u16)(1u << lr);
+        vgic_assign(vcpu, VGIC_STATE_PENDING, intid, false);
+        vgic_assign(vcpu, VGIC_STATE_IN_LR, intid, true);
+    }
+
+    // More waiting than fits: come back when the guest has drained the LRs.
+    vgic_set_underflow(vcpu->arch.vgic.queue_len != 0);
+    asm volatile("isb");
+}
+
+// Underflow and EOI maintenance only need EL2 to run vgic_flush() again,
+// which happens on the way back into the guest. EOI requests are dropped here
+// so the level-sensitive maintenance line does not outlive the exit.
+static irq_result_t vgic_maintenance_irq(vcpu_t *vcpu, u32 intid)
+{
+    (void)vcpu;
+    (void)intid;
+    vgic_set_underflow(false);
+    u64 eisr;
+    asm volatile("mrs %0, " ICH_EISR_SYSREG : "=r"(eisr));
+    u32 pending_eoi = (u32)eisr & (u32)((1ull << vgic_lr_count()) - 1u);
+    while (pending_eoi) {
+        const u32 n = (u32)__builtin_ctz(pending_eoi);
+        pending_eoi &= pending_eoi - 1u;
+        vgic_write_lr(n, vgic_read_lr(n) & ~ICH_LR_EOI);
+    }
+    return IRQ_HANDLED;
+}
+
+void vgic_init(void)
+{
+    irq_register(GIC_PPI_MAINTENANCE, vgic_maintenance_irq);
+}
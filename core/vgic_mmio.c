@@ -0,0 +1,318 @@
+#include <stddef.h>
+#include "vgic.h"
+#include "vm.h"
+#include "mmio_bus.h"
+#include "platform.h"
+
+// Guest view of the GICv3 distributor and redistributors. The guest sees the
+// same addresses as the host (QEMU virt), one security state (GICD_CTLR.DS)
+// and affinity routing always on. Register state is the VGIC bitmaps, so
+// these handlers only translate offsets into INTID ranges.
+
+#define VGICD_CTLR        0x0000u
+#define VGICD_TYPER       0x0004u
+#define VGICD_IIDR        0x0008u
+#define VGICD_TYPER2      0x000Cu
+#define VGICD_IGROUPR     0x0080u
+#define VGICD_ISENABLER   0x0100u
+#define VGICD_ICENABLER   0x0180u
+#define VGICD_ISPENDR     0x0200u
+#define VGICD_ICPENDR     0x0280u
+#define VGICD_ISACTIVER   0x0300u
+#define VGICD_ICACTIVER   0x0380u
+#define VGICD_IPRIORITYR  0x0400u
+#define VGICD_ICFGR       0x0C00u
+#define VGICD_IROUTER     0x6000u
+#define VGIC_PIDR2        0xFFE8u
+
+#define VGICD_CTLR_ARE    (1u << 4)
+#define VGICD_CTLR_DS     (1u << 6)
+
+#define VGICR_CTLR        0x0000u
+#define VGICR_IIDR        0x0004u
+#define VGICR_TYPER       0x0008u
+#define VGICR_WAKER       0x0014u
+#define VGICR_SGI_BASE    0x10000u
+#define VGICR_FRAME_SIZE  ((u32)GICR_STRIDE)
+
+#define VGICR_TYPER_LAST  (1ull << 4)
+#define VGICR_WAKER_PSLEEP  (1u << 1)
+#define VGICR_WAKER_CASLEEP (1u << 2)
+
+#define VGIC_IIDR_VALUE   0x0000043Bu // implementer Arm
+#define VGIC_PIDR2_VALUE  0x3Bu       // ArchRev 3: GICv3
+
+// Bitmap register blocks, one bit per INTID.
+typedef enum vgic_bits_op
+{
+    VGIC_BITS_ASSIGN, // IGROUPR
+    VGIC_BITS_SET,    // IS*R
+    VGIC_BITS_CLEAR,  // IC*R
+} vgic_bits_op_t;
+
+static u32 vgic_bits_read(vcpu_t *vcpu, u32 field, u32 first)
+{
+    const u32 *w = vgic_state_word(vcpu, field, first);
+    if (!w)
+        return 0;
+    u32 v = *w;
+    if (field == VGIC_STATE_ACTIVE) {
+        // Interrupts held by list registers are reported as active.
+        const u32 *in_lr = vgic_state_word(vcpu, VGIC_STATE_IN_LR, first);
+        v |= *in_lr;
+    }
+    return v;
+}
+
+static void vgic_bits_write(vcpu_t *vcpu, u32 field, u32 first, vgic_bits_op_t op, u32 val)
+{
+    u32 *w = vgic_state_word(vcpu, field, first);
+    if (!w)
+        return;
+    u32 changed;
+    switch (op) {
+    case VGIC_BITS_ASSIGN: changed = *w ^ val; *w = val; break;
+    case VGIC_BITS_SET:    changed = val & ~*w; *w |= val; break;
+    default:               changed = val & *w; *w &= ~val; break;
+    }
+    if (op != VGIC_BITS_SET || (field != VGIC_STATE_ENABLED && field != VGIC_STATE_PENDING))
+        return;
+    while (changed) {
+        const u32 bit = (u32)__builtin_ctz(changed);
+        changed &= changed - 1u;
+        vgic_update(vcpu, first + bit);
+    }
+}
+
+// Shared by GICD (SPIs) and the GICR SGI frame (private INTIDs): the register
+// layout from 0x80 to 0xCFF is identical. Returns false for other offsets.
+static bool vgic_irq_regs(vcpu_t *vcpu, u32 off, u32 size, bool is_write, u64 *val,
+                          u32 min_intid, u32 max_intid)
+{
+    static const struct { u32 base; u32 field; vgic_bits_op_t op; } blocks[] = {
+        { VGICD_IGROUPR,   VGIC_STATE_GROUP1,  VGIC_BITS_ASSIGN },
+        { VGICD_ISENABLER, VGIC_STATE_ENABLED, VGIC_BITS_SET },
+        { VGICD_ICENABLER, VGIC_STATE_ENABLED, VGIC_BITS_CLEAR },
+        { VGICD_ISPENDR,   VGIC_STATE_PENDING, VGIC_BITS_SET },
+        { VGICD_ICPENDR,   VGIC_STATE_PENDING, VGIC_BITS_CLEAR },
+        { VGICD_ISACTIVER, VGIC_STATE_ACTIVE,  VGIC_BITS_SET },
+        { VGICD_ICACTIVER, VGIC_STATE_ACTIVE,  VGIC_BITS_CLEAR },
+    };
+
+    if (off >= VGICD_IGROUPR && off < VGICD_IPRIORITYR) {
+        const u32 blk = (off - VGICD_IGROUPR) / 0x80u;
+        const u32 first = ((off & 0x7Fu) / 4u) * 32u;
+        if (blk >= sizeof(blocks) / sizeof(blocks[0]) || size != 4u)
+            return false;
+        if (first < min_intid || first >= max_intid) { // RAZ/WI
+            if (!is_write)
+                *val = 0;
+            return true;
+        }
+        if (is_write)
+            vgic_bits_write(vcpu, blocks[blk].field, first, blocks[blk].op, (u32)*val);
+        else
+            *val = vgic_bits_read(vcpu, blocks[blk].field, first);
+        return true;
+    }
+
+    if (off >= VGICD_IPRIORITYR && off < VGICD_IPRIORITYR + VGIC_NR_IRQS) {
+        const u32 first = off - VGICD_IPRIORITYR;
+        u64 v = is_write ? *val : 0;
+        for (u32 i = 0; i < size; ++i) {
+            const u32 intid = first + i;
+            u8 *prio = (intid >= min_intid && intid < max_intid) ? vgic_priority(vcpu, intid) : NULL;
+            if (is_write && prio) {
+                *prio = (u8)(v >> (8u * i));
+                vgic_update(vcpu, intid);
+            } else if (!is_write && prio) {
+                v |= (u64)*prio << (8u * i);
+            }
+        }
+        if (!is_write)
+            *val = v;
+        return true;
+    }
+
+    if (off >= VGICD_ICFGR && off < VGICD_ICFGR + VGIC_NR_IRQS / 4u) {
+        if (size != 4u)
+            return false;
+        const u32 first = ((off - VGICD_ICFGR) / 4u) * 16u;
+        if (first < min_intid || first >= max_intid || first < 16u) { // SGIs: fixed edge
+            if (!is_write)
+                *val = (first < 16u && min_intid == 0) ? 0xAAAAAAAAull : 0;
+            return true;
+        }
+        u32 *edge = vgic_state_word(vcpu, VGIC_STATE_EDGE, first);
+        const u32 shift = first & 16u;
+        if (is_write) {
+            u32 bits = 0;
+            for (u32 i = 0; i < 16u; ++i)
+                if (*val & (2ull << (2u * i)))
+                    bits |= 1u << i;
+            *edge = (*edge & ~(0xFFFFu << shift)) | (bits << shift);
+        } else {
+            u64 v = 0;
+            for (u32 i = 0; i < 16u; ++i)
+                if (*edge & (1u << (shift + i)))
+                    v |= 2ull << (2u * i);
+            *val = v;
+        }
+        return true;
+    }
+    return false;
+}
+
+static bool vgicd_access(vcpu_t *vcpu, u64 offset, u32 size, bool is_write, u64 *val)
+{
+    struct sch_vm *vm = vcpu->vm;
+    const u32 off = (u32)offset;
+
+    switch (off) {
+    case VGICD_CTLR:
+        if (is_write) {
+            const u32 old = vm->vgic.ctlr;
+            vm->vgic.ctlr = (u32)*val & (VGIC_DIST_CTLR_ENGRP0 | VGIC_DIST_CTLR_ENGRP1);
+            if (vm->vgic.ctlr & ~old)
+                vgic_requeue_all(vm);
+        } else {
+            *val = vm->vgic.ctlr | VGICD_CTLR_ARE | VGICD_CTLR_DS;
+        }
+        return true;
+    case VGICD_TYPER:
+        if (!is_write)
+            *val = (9ull << 19) |                    // IDbits: 10-bit INTIDs
+                   (u64)(VGIC_NR_IRQS / 32u - 1u);  // ITLinesNumber
+        return true;
+    case VGICD_IIDR:
+        if (!is_write)
+            *val = VGIC_IIDR_VALUE;
+        return true;
+    case VGICD_TYPER2:
+        if (!is_write)
+            *val = 0;
+        return true;
+    case VGIC_PIDR2:
+        if (!is_write)
+            *val = VGIC_PIDR2_VALUE;
+        return true;
+    default:
+        break;
+    }
+
+    if (off >= VGICD_IROUTER + 8u * VGIC_NR_PRIVATE && off < VGICD_IROUTER + 8u * VGIC_NR_IRQS) {
+        const u32 spi = (off - VGICD_IROUTER) / 8u - VGIC_NR_PRIVATE;
+        if (off & 4u) { // upper word holds Aff3 only
+            if (!is_write)
+                *val = 0;
+            return true;
+        }
+        if (is_write) {
+            // Aff0 names the vCPU; IRM (1 of N) is treated as "vCPU 0".
+            const int aff0 = (int)(*val & 0xFFu);
+            u8 idx = 0;
+            for (u32 i = 0; i < vm->nr_vcpus; ++i)
+                if (vm->vcpus[i]->vcpu_id == aff0)
+                    idx = (u8)i;
+            vm->vgic.target[spi] = idx;
+            vgic_update(vcpu, VGIC_NR_PRIVATE + spi);
+        } else {
+            const u8 idx = vm->vgic.target[spi];
+            *val = idx < vm->nr_vcpus ? (u64)vm->vcpus[idx]->vcpu_id : 0;
+        }
+        return true;
+    }
+
+    // Private INTIDs are banked in the redistributors once ARE is set.
+    if (vgic_irq_regs(vcpu, off, size, is_write, val, VGIC_NR_PRIVATE, VGIC_NR_IRQS))
+        return true;
+
+    if (!is_write) // reserved and unimplemented registers read as zero
+        *val = 0;
+    return true;
+}
+
+static bool vgicd_read(vcpu_t *vcpu, void *opaque, u64 offset, u32 size, u64 *val)
+{
+    (void)opaque;
+    return vgicd_access(vcpu, offset, size, false, val);
+}
+
+static bool vgicd_write(vcpu_t *vcpu, void *opaque, u64 offset, u32 size, u64 val)
+{
+    (void)opaque;
+    return vgicd_access(vcpu, offset, size, true, &val);
+}
+
+static bool vgicr_access(vcpu_t *vcpu, u64 offset, u32 size, bool is_write, u64 *val)
+{
+    struct sch_vm *vm = vcpu->vm;
+    const u32 idx = (u32)(offset / VGICR_FRAME_SIZE);
+    if (idx >= vm->nr_vcpus)
+        return false;
+    vcpu_t *owner = vm->vcpus[idx];
+    const u32 off = (u32)(offset % VGICR_FRAME_SIZE);
+
+    if (off >= VGICR_SGI_BASE) {
+        if (vgic_irq_regs(owner, off - VGICR_SGI_BASE, size, is_write, val, 0, VGIC_NR_PRIVATE))
+            return true;
+        if (!is_write)
+            *val = 0;
+        return true;
+    }
+
+    switch (off) {
+    case VGICR_TYPER:
+    case VGICR_TYPER + 4u: {
+        u64 typer = ((u64)(u32)owner->vcpu_id << 32) | ((u64)idx << 8);
+        if (idx + 1u == vm->nr_vcpus)
+            typer |= VGICR_TYPER_LAST;
+        if (!is_write)
+            *val = (off == VGICR_TYPER) ? (size == 8u ? typer : (u32)typer) : typer >> 32;
+        return true;
+    }
+    case VGICR_WAKER:
+        if (is_write) {
+            owner->arch.vgic.redist_waker = (u32)*val & VGICR_WAKER_PSLEEP;
+        } else {
+            const u32 w = owner->arch.vgic.redist_waker;
+            *val = w | ((w & VGICR_WAKER_PSLEEP) ? VGICR_WAKER_CASLEEP : 0);
+        }
+        return true;
+    case VGICR_IIDR:
+        if (!is_write)
+            *val = VGIC_IIDR_VALUE;
+        return true;
+    case VGIC_PIDR2:
+        if (!is_write)
+            *val = VGIC_PIDR2_VALUE;
+        return true;
+    default: // GICR_CTLR and the rest: RAZ/WI
+        if (!is_write)
+            *val = 0;
+        return true;
+    }
+}
+
+static bool vgicr_read(vcpu_t *vcpu, void *opaque, u64 offset, u32 size, u64 *val)
+{
+    (void)opaque;
+    return vgicr_access(vcpu, offset, size, false, val);
+}
+
+static bool vgicr_write(vcpu_t *vcpu, void *opaque, u64 offset, u32 size, u64 val)
+{
+    (void)opaque;
+    return vgicr_access(vcpu, offset, size, true, &val);
+}
+
+static const mmio_ops_t vgicd_ops = { .read = vgicd_read, .write = vgicd_write };
+static const mmio_ops_t vgicr_ops = { .read = vgicr_read, .write = vgicr_write };
+
+bool vgic_mmio_attach(struct sch_vm *vm)
+{
+    if (!mmio_bus_register(&vm->mmio, GICD_BASE, GICD_SIZE, &vgicd_ops, NULL, "gicd"))
+        return false;
+    return mmio_bus_register(&vm->mmio, GICR_BASE, (u64)VGICR_FRAME_SIZE * vm->nr_vcpus,
+                             &vgicr_ops, NULL, "gicr");
+}
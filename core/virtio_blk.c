@@ -0,0 +1,144 @@
+#include <stddef.h>
+#include "virtio_mmio.h"
+#include "memops.h"
+
+// virtio-blk over a RAM disk. A notification drains the whole available ring
+// before anything is published, so a driver that queues a batch pays one
+// exit, one used-index update and at most one interrupt for all of it. The
+// image lives outside guest RAM: only EL2 maps it.
+//
+// Requests are expected in the usual framing: a read-only header, the data
+// buffers, and a device-writable status byte as the last buffer.
+
+#define BLK_QUEUE_REQ 0u
+
+typedef struct virtio_blk
+{
+    virtio_dev_t dev;
+    u8 *image;
+    u64 bytes;
+    u64 capacity;           // in VIRTIO_BLK_SECTOR_SIZE units
+} virtio_blk_t;
+
+static virtio_blk_t blk_pool[2];
+static u32 blk_used;
+
+static const char blk_id[VIRTIO_BLK_ID_BYTES] = "schism-ramdisk";
+
+// Copy between the image and the data buffers of an IN/OUT request. Returns
+// the number of bytes the device wrote into the chain, or ~0u on error.
+static u32 blk_rw(virtio_blk_t *blk, const virtq_chain_t *c, u64 sector, bool in)
+{
+    if (sector >= blk->capacity)
+        return ~0u;
+    u64 off = sector * VIRTIO_BLK_SECTOR_SIZE;
+    u32 written = 0;
+    for (u32 i = 1; i + 1 < c->nr_segs; ++i) {
+        const virtq_seg_t *seg = &c->segs[i];
+        if (seg->write != in || seg->len > blk->bytes - off)
+            return ~0u;
+        if (in) {
+            hyp_memcpy(seg->ptr, blk->image + off, seg->len);
+            written += seg->len;
+        } else {
+            hyp_memcpy(blk->image + off, seg->ptr, seg->len);
+        }
+        off += seg->len;
+    }
+    return written;
+}
+
+// Execute one request; returns the used length (data written plus status).
+static u32 blk_request(virtio_blk_t *blk, const virtq_chain_t *c)
+{
+    if (c->nr_segs < 2)
+        return 0;
+    const virtq_seg_t *hseg = &c->segs[0];
+    const virtq_seg_t *sseg = &c->segs[c->nr_segs - 1];
+    if (!sseg->write || !sseg->len)
+        return 0; // nowhere to report the outcome
+    if (hseg->write || hseg->len < sizeof(struct virtio_blk_req_hdr)) {
+        *(u8 *)sseg->ptr = VIRTIO_BLK_S_IOERR;
+        return 1;
+    }
+
+    const struct virtio_blk_req_hdr hdr = *(const struct virtio_blk_req_hdr *)hseg->ptr;
+    u8 status = VIRTIO_BLK_S_OK;
+    u32 written = 0;
+    switch (hdr.type) {
+    case VIRTIO_BLK_T_IN:
+    case VIRTIO_BLK_T_OUT:
+        written = blk_rw(blk, c, hdr.sector, hdr.type == VIRTIO_BLK_T_IN);
+        if (written == ~0u) {
+            status = VIRTIO_BLK_S_IOERR;
+            written = 0;
+        }
+        break;
+    case VIRTIO_BLK_T_FLUSH:
+        break; // writes land in the image synchronously
+    case VIRTIO_BLK_T_GET_ID:
+        if (c->nr_segs < 3 || !c->segs[1].write) {
+            status = VIRTIO_BLK_S_IOERR;
+            break;
+        }
+        written = c->segs[1].len < VIRTIO_BLK_ID_BYTES ? c->segs[1].len : VIRTIO_BLK_ID_BYTES;
+        hyp_memcpy(c->segs[1].ptr, blk_id, written);
+        break;
+    default:
+        status = VIRTIO_BLK_S_UNSUPP;
+        break;
+    }
+    *(u8 *)sseg->ptr = status;
+    return written + 1;
+}
+
+static void blk_notify(virtio_dev_t *dev, vcpu_t *vcpu, u32 queue)
+{
+    (void)vcpu;
+    virtio_blk_t *blk = dev->opaque;
+    virtq_t *vq = &dev->vq[queue];
+    virtq_chain_t chain;
+    do {
+        while (virtq_pop(dev, vq, &chain))
+            virtq_push(vq, chain.head, blk_request(blk, &chain));
+    } while (virtq_complete(dev, vq));
+}
+
+static u64 blk_config_read(virtio_dev_t *dev, u64 offset, u32 size)
+{
+    const virtio_blk_t *blk = dev->opaque;
+    if (offset + size > sizeof(u64) || size > sizeof(u64))
+        return 0;
+    const u64 v = blk->capacity >> (8 * offset);
+    return size == sizeof(u64) ? v : v & ((1ull << (8 * size)) - 1ull);
+}
+
+static const virtio_dev_ops_t blk_ops = {
+    .notify = blk_notify,
+    .config_read = blk_config_read,
+};
+
+bool virtio_blk_attach(struct sch_vm *vm, u64 base, u32 intid, void *image, u64 bytes)
+{
+    if (blk_used >= sizeof(blk_pool) / sizeof(blk_pool[0]) || !image ||
+        bytes < VIRTIO_BLK_SECTOR_SIZE)
+        return false;
+    virtio_blk_t *blk = &blk_pool[blk_used];
+    blk->image = image;
+    blk->capacity = bytes / VIRTIO_BLK_SECTOR_SIZE;
+    blk->bytes = blk->capacity * VIRTIO_BLK_SECTOR_SIZE;
+
+    virtio_dev_t *dev = &blk->dev;
+    dev->ops = &blk_ops;
+    dev->opaque = blk;
+    dev->name = "virtio-blk";
+    dev->device_id = VIRTIO_ID_BLOCK;
+    dev->nr_queues = 1;
+    dev->device_features = (1ull << VIRTIO_RING_F_INDIRECT_DESC) |
+                           (1ull << VIRTIO_RING_F_EVENT_IDX) |
+                           (1ull << VIRTIO_BLK_F_FLUSH);
+    if (!virtio_mmio_attach(dev, vm, base, intid))
+        return false;
+    blk_used++;
+    return true;
+}
@@ -0,0 +1,342 @@
+#include <stddef.h>
+#include "virtio_mmio.h"
+#include "guest_mem.h"
+#include "mmio_bus.h"
+#include "vgic.h"
+#include "vm.h"
+
+extern void console_puts(const char*);
+extern void console_hex64(u64);
+
+// virtio-mmio version 2 transport. Device models (core/virtio_blk.c) only see
+// popped chains: everything the guest wrote to the rings has been bounds
+// checked and translated by the time it reaches them.
+
+bool virtio_has_feature(const virtio_dev_t *dev, u32 bit)
+{
+    return (dev->driver_features & (1ull << bit)) != 0;
+}
+
+static void virtio_update_irq(virtio_dev_t *dev)
+{
+    vgic_set_spi_level(dev->vm, dev->intid, dev->interrupt_status != 0);
+}
+
+static bool virtq_fail(virtio_dev_t *dev)
+{
+    dev->status |= VIRTIO_STATUS_NEEDS_RESET;
+    dev->interrupt_status |= VIRTIO_MMIO_INT_CONFIG;
+    virtio_update_irq(dev);
+    return false;
+}
+
+bool virtq_pop(virtio_dev_t *dev, virtq_t *vq, virtq_chain_t *chain)
+{
+    if (!vq->ready || (dev->status & VIRTIO_STATUS_NEEDS_RESET))
+        return false;
+
+    volatile struct virtq_avail *avail = vq->avail;
+    const u16 avail_idx = avail->idx;
+    if (avail_idx == vq->last_avail)
+        return false;
+    if ((u16)(avail_idx - vq->last_avail) > vq->num)
+        return virtq_fail(dev);
+    asm volatile("dmb ishld" ::: "memory"); // ring entries are valid once idx is
+
+    const u16 head = avail->ring[vq->last_avail % vq->num];
+    if (head >= vq->num)
+        return virtq_fail(dev);
+    vq->last_avail++;
+
+    const struct virtq_desc *table = vq->desc;
+    u32 table_len = vq->num;
+    u32 i = head;
+    if (table[i].flags & VIRTQ_DESC_F_INDIRECT) {
+        const struct virtq_desc ind = table[i];
+        if (!virtio_has_feature(dev, VIRTIO_RING_F_INDIRECT_DESC) ||
+            (ind.flags & VIRTQ_DESC_F_NEXT) || !ind.len ||
+            (ind.len % sizeof(struct virtq_desc)) != 0 || (ind.addr & 0xFull) != 0)
+            return virtq_fail(dev);
+        table = guest_ipa_to_ptr(ind.addr, ind.len);
+        if (!table)
+            return virtq_fail(dev);
+        table_len = ind.len / sizeof(struct virtq_desc);
+        i = 0;
+    }
+
+    chain->head = head;
+    chain->nr_segs = 0;
+    for (;;) {
+        // A chain can visit each descriptor at most once; anything longer loops.
+        if (i >= table_len || chain->nr_segs >= table_len || chain->nr_segs >= VIRTQ_MAX_SEGS)
+            return virtq_fail(dev);
+        const struct virtq_desc d = table[i];
+        if (d.flags & VIRTQ_DESC_F_INDIRECT)
+            return virtq_fail(dev);
+        void *ptr = guest_ipa_to_ptr(d.addr, d.len);
+        if (!ptr)
+            return virtq_fail(dev);
+        virtq_seg_t *seg = &chain->segs[chain->nr_segs++];
+        seg->ptr = ptr;
+        seg->ipa = d.addr;
+        seg->len = d.len;
+        seg->write = (d.flags & VIRTQ_DESC_F_WRITE) != 0;
+        if (!(d.flags & VIRTQ_DESC_F_NEXT))
+            break;
+        i = d.next;
+    }
+    dev->chains++;
+    return true;
+}
+
+void virtq_unpop(virtio_dev_t *dev, virtq_t *vq)
+{
+    vq->last_avail--;
+    dev->chains--;
+}
+
+void virtq_push(virtq_t *vq, u16 head, u32 len)
+{
+    struct virtq_used_elem *e = &vq->used->ring[vq->used_idx % vq->num];
+    e->id = head;
+    e->len = len;
+    vq->used_idx++;
+}
+
+bool virtq_complete(virtio_dev_t *dev, virtq_t *vq)
+{
+    if (!vq->ready)
+        return false;
+
+    const bool event_idx = virtio_has_feature(dev, VIRTIO_RING_F_EVENT_IDX);
+    volatile struct virtq_used *used = vq->used;
+    asm volatile("dmb ishst" ::: "memory"); // elements before the index
+    used->idx = vq->used_idx;
+    if (event_idx)
+        *virtq_avail_event(vq->used, vq->num) = vq->last_avail;
+    asm volatile("dmb ish" ::: "memory");
+
+    // The driver may have added buffers before it saw avail_event; without
+    // this re-check they would wait for a notification it will not send.
+    volatile struct virtq_avail *avail = vq->avail;
+    const bool more = avail->idx != vq->last_avail && !(dev->status & VIRTIO_STATUS_NEEDS_RESET);
+
+    const u16 old = vq->signalled_used;
+    const u16 now = vq->used_idx;
+    if (old == now)
+        return more;
+    vq->signalled_used = now;
+
+    bool notify;
+    if (event_idx)
+        notify = virtq_need_event(*virtq_used_event(vq->avail, vq->num), now, old);
+    else
+        notify = (avail->flags & VIRTQ_AVAIL_F_NO_INTERRUPT) == 0;
+    if (!notify) {
+        dev->irqs_suppressed++;
+        return more;
+    }
+    dev->irqs++;
+    dev->interrupt_status |= VIRTIO_MMIO_INT_VRING;
+    virtio_update_irq(dev);
+    return more;
+}
+
+static void virtio_reset(virtio_dev_t *dev)
+{
+    if (dev->notifies) {
+        console_puts("EL2: ");
+        console_puts(dev->name);
+        console_puts(" reset notifies=");
+        console_hex64(dev->notifies);
+        console_puts(" chains=");
+        console_hex64(dev->chains);
+        console_puts(" irqs/suppressed=");
+        console_hex64(dev->irqs);
+        console_puts("/");
+        console_hex64(dev->irqs_suppressed);
+        console_puts("\n");
+    }
+
+    dev->driver_features = 0;
+    dev->device_features_sel = 0;
+    dev->driver_features_sel = 0;
+    dev->queue_sel = 0;
+    dev->status = 0;
+    dev->interrupt_status = 0;
+    dev->notifies = 0;
+    dev->chains = 0;
+    dev->irqs = 0;
+    dev->irqs_suppressed = 0;
+    for (u32 q = 0; q < VIRTIO_MAX_QUEUES; ++q) {
+        virtq_t *vq = &dev->vq[q];
+        vq->num = VIRTQ_NUM_MAX;
+        vq->ready = false;
+        vq->desc_ipa = vq->avail_ipa = vq->used_ipa = 0;
+        vq->desc = NULL;
+        vq->avail = NULL;
+        vq->used = NULL;
+        vq->last_avail = vq->used_idx = vq->signalled_used = 0;
+    }
+    if (dev->ops->reset)
+        dev->ops->reset(dev);
+    virtio_update_irq(dev);
+}
+
+// QueueReady: translate the three rings once so the data path never has to.
+static void virtq_set_ready(virtio_dev_t *dev, virtq_t *vq, bool ready)
+{
+    if (!ready) {
+        vq->ready = false;
+        return;
+    }
+    const u64 extra = virtio_has_feature(dev, VIRTIO_RING_F_EVENT_IDX) ? sizeof(u16) : 0;
+    const u64 desc_len = (u64)vq->num * sizeof(struct virtq_desc);
+    const u64 avail_len = sizeof(struct virtq_avail) + (u64)vq->num * sizeof(u16) + extra;
+    const u64 used_len = sizeof(struct virtq_used) +
+                         (u64)vq->num * sizeof(struct virtq_used_elem) + extra;
+    if ((vq->desc_ipa & 0xFull) || (vq->avail_ipa & 0x1ull) || (vq->used_ipa & 0x3ull))
+        return;
+    vq->desc = guest_ipa_to_ptr(vq->desc_ipa, desc_len);
+    vq->avail = guest_ipa_to_ptr(vq->avail_ipa, avail_len);
+    vq->used = guest_ipa_to_ptr(vq->used_ipa, used_len);
+    vq->ready = vq->desc && vq->avail && vq->used;
+}
+
+static void virtio_write_status(virtio_dev_t *dev, u32 val)
+{
+    if (!val) {
+        virtio_reset(dev);
+        return;
+    }
+    if ((val & VIRTIO_STATUS_FEATURES_OK) && !(dev->status & VIRTIO_STATUS_FEATURES_OK) &&
+        ((dev->driver_features & ~dev->device_features) ||
+         !virtio_has_feature(dev, VIRTIO_F_VERSION_1)))
+        val &= ~VIRTIO_STATUS_FEATURES_OK; // the driver re-reads Status to find out
+    dev->status = (dev->status & VIRTIO_STATUS_NEEDS_RESET) | (val & ~VIRTIO_STATUS_NEEDS_RESET);
+}
+
+static void virtq_set_addr(u64 *addr, bool high, u32 val)
+{
+    if (high)
+        *addr = (*addr & 0xFFFFFFFFull) | ((u64)val << 32);
+    else
+        *addr = (*addr & ~0xFFFFFFFFull) | val;
+}
+
+static bool virtio_mmio_read(vcpu_t *vcpu, void *opaque, u64 offset, u32 size, u64 *val)
+{
+    (void)vcpu;
+    virtio_dev_t *dev = opaque;
+    if (offset >= VIRTIO_MMIO_CONFIG) {
+        *val = dev->ops->config_read ? dev->ops->config_read(dev, offset - VIRTIO_MMIO_CONFIG, size) : 0;
+        return true;
+    }
+    if (size != 4)
+        return false;
+
+    virtq_t *vq = dev->queue_sel < dev->nr_queues ? &dev->vq[dev->queue_sel] : NULL;
+    switch (offset) {
+    case VIRTIO_MMIO_MAGIC_VALUE:     *val = VIRTIO_MMIO_MAGIC; break;
+    case VIRTIO_MMIO_VERSION:         *val = VIRTIO_MMIO_VERSION_2; break;
+    case VIRTIO_MMIO_DEVICE_ID:       *val = dev->device_id; break;
+    case VIRTIO_MMIO_VENDOR_ID:       *val = VIRTIO_MMIO_VENDOR_SCHISM; break;
+    case VIRTIO_MMIO_DEVICE_FEATURES:
+        *val = dev->device_features_sel < 2 ? (u32)(dev->device_features >> (32 * dev->device_features_sel)) : 0;
+        break;
+    case VIRTIO_MMIO_QUEUE_NUM_MAX:   *val = vq ? VIRTQ_NUM_MAX : 0; break;
+    case VIRTIO_MMIO_QUEUE_READY:     *val = vq ? vq->ready : 0; break;
+    case VIRTIO_MMIO_INTERRUPT_STATUS:*val = dev->interrupt_status; break;
+    case VIRTIO_MMIO_STATUS:          *val = dev->status; break;
+    case VIRTIO_MMIO_QUEUE_DESC_LOW:  *val = vq ? (u32)vq->desc_ipa : 0; break;
+    case VIRTIO_MMIO_QUEUE_DESC_HIGH: *val = vq ? (u32)(vq->desc_ipa >> 32) : 0; break;
+    case VIRTIO_MMIO_QUEUE_DRIVER_LOW:  *val = vq ? (u32)vq->avail_ipa : 0; break;
+    case VIRTIO_MMIO_QUEUE_DRIVER_HIGH: *val = vq ? (u32)(vq->avail_ipa >> 32) : 0; break;
+    case VIRTIO_MMIO_QUEUE_DEVICE_LOW:  *val = vq ? (u32)vq->used_ipa : 0; break;
+    case VIRTIO_MMIO_QUEUE_DEVICE_HIGH: *val = vq ? (u32)(vq->used_ipa >> 32) : 0; break;
+    case VIRTIO_MMIO_CONFIG_GENERATION: *val = 0; break; // config space is static
+    default:                          *val = 0; break;
+    }
+    return true;
+}
+
+static bool virtio_mmio_write(vcpu_t *vcpu, void *opaque, u64 offset, u32 size, u64 val64)
+{
+    virtio_dev_t *dev = opaque;
+    if (offset >= VIRTIO_MMIO_CONFIG)
+        return true; // no writable config fields
+    if (size != 4)
+        return false;
+
+    const u32 val = (u32)val64;
+    virtq_t *vq = dev->queue_sel < dev->nr_queues ? &dev->vq[dev->queue_sel] : NULL;
+    switch (offset) {
+    case VIRTIO_MMIO_DEVICE_FEATURES_SEL: dev->device_features_sel = val; break;
+    case VIRTIO_MMIO_DRIVER_FEATURES_SEL: dev->driver_features_sel = val; break;
+    case VIRTIO_MMIO_DRIVER_FEATURES:
+        if (dev->driver_features_sel < 2 && !(dev->status & VIRTIO_STATUS_FEATURES_OK)) {
+            const u32 shift = 32 * dev->driver_features_sel;
+            dev->driver_features = (dev->driver_features & ~(0xFFFFFFFFull << shift)) |
+                                   ((u64)val << shift);
+        }
+        break;
+    case VIRTIO_MMIO_QUEUE_SEL:          dev->queue_sel = val; break;
+    case VIRTIO_MMIO_QUEUE_NUM:
+        if (vq && !vq->ready && val && val <= VIRTQ_NUM_MAX)
+            vq->num = (u16)val;
+        break;
+    case VIRTIO_MMIO_QUEUE_READY:
+        if (vq)
+            virtq_set_ready(dev, vq, val & 1u);
+        break;
+    case VIRTIO_MMIO_QUEUE_NOTIFY:
+        if (val < dev->nr_queues && dev->vq[val].ready &&
+            (dev->status & VIRTIO_STATUS_DRIVER_OK) && !(dev->status & VIRTIO_STATUS_NEEDS_RESET)) {
+            dev->notifies++;
+            dev->ops->notify(dev, vcpu, val);
+        }
+        break;
+    case VIRTIO_MMIO_INTERRUPT_ACK:
+        dev->interrupt_status &= ~val;
+        virtio_update_irq(dev);
+        break;
+    case VIRTIO_MMIO_STATUS:
+        virtio_write_status(dev, val);
+        break;
+    case VIRTIO_MMIO_QUEUE_DESC_LOW:
+    case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+        if (vq && !vq->ready)
+            virtq_set_addr(&vq->desc_ipa, offset == VIRTIO_MMIO_QUEUE_DESC_HIGH, val);
+        break;
+    case VIRTIO_MMIO_QUEUE_DRIVER_LOW:
+    case VIRTIO_MMIO_QUEUE_DRIVER_HIGH:
+        if (vq && !vq->ready)
+            virtq_set_addr(&vq->avail_ipa, offset == VIRTIO_MMIO_QUEUE_DRIVER_HIGH, val);
+        break;
+    case VIRTIO_MMIO_QUEUE_DEVICE_LOW:
+    case VIRTIO_MMIO_QUEUE_DEVICE_HIGH:
+        if (vq && !vq->ready)
+            virtq_set_addr(&vq->used_ipa, offset == VIRTIO_MMIO_QUEUE_DEVICE_HIGH, val);
+        break;
+    default:
+        break;
+    }
+    return true;
+}
+
+static const mmio_ops_t virtio_mmio_ops = {
+    .read = virtio_mmio_read,
+    .write = virtio_mmio_write,
+};
+
+bool virtio_mmio_attach(virtio_dev_t *dev, struct sch_vm *vm, u64 base, u32 intid)
+{
+    if (!dev->ops || !dev->ops->notify || dev->nr_queues > VIRTIO_MAX_QUEUES)
+        return false;
+    dev->vm = vm;
+    dev->intid = intid;
+    dev->device_features |= 1ull << VIRTIO_F_VERSION_1;
+    dev->notifies = 0;
+    virtio_reset(dev);
+    return mmio_bus_register(&vm->mmio, base, VIRTIO_MMIO_SIZE, &virtio_mmio_ops, dev, dev->name);
+}
@@ -0,0 +1,339 @@
+#include <stddef.h>
+#include "virtio_mmio.h"
+#include "memops.h"
+#include "s2_mmu.h"
+#include "guest_layout.h"
+
+extern void console_puts(const char*);
+extern void console_hex64(u64);
+
+// EL2 packet switch. Every port is a virtio-net device with a fixed MAC; a TX
+// notification drains the sender's TX ring in one batch and delivers each
+// frame straight into a receive buffer of the destination port, so a packet
+// is touched once. A frame that fills a page-aligned page, received into a
+// page-aligned page, is not copied at all: the two pages swap places at
+// stage-2. Used rings are published once per batch on both sides.
+//
+// A unicast frame whose destination has no receive buffer stays on the
+// sender's TX ring (backpressure); it is retried when any port posts RX
+// buffers. Broadcast frames are copied to every port that has room.
+
+#define NETSW_MAX_PORTS 4u
+#define NETSW_PAGE_SIZE 0x1000ull
+#define NETSW_HDR_LEN   ((u32)sizeof(struct virtio_net_hdr))
+#define NETSW_ETH_HLEN  14u
+// Shorter frames are cheaper to copy than the TLB maintenance of a flip.
+#define NETSW_FLIP_MIN  2048u
+
+typedef struct netsw_port
+{
+    virtio_dev_t dev;
+    u8 mac[VIRTIO_NET_ETH_ALEN];
+    bool tx_stalled;           // a unicast frame waits for receive buffers
+    u64 tx_packets;
+    u64 rx_packets;
+    u64 copied;
+    u64 flipped;
+    u64 dropped;
+    u64 stalls;
+} netsw_port_t;
+
+static netsw_port_t netsw_ports[NETSW_MAX_PORTS];
+static u32 netsw_nr_ports;
+
+// Position inside the buffers of a chain.
+typedef struct sg_cursor
+{
+    const virtq_chain_t *c;
+    u32 seg;
+    u32 off;
+} sg_cursor_t;
+
+static void sg_advance(sg_cursor_t *cur, u32 n)
+{
+    cur->off += n;
+    while (cur->seg < cur->c->nr_segs && cur->off >= cur->c->segs[cur->seg].len) {
+        cur->off -= cur->c->segs[cur->seg].len;
+        cur->seg++;
+    }
+}
+
+static void sg_init(sg_cursor_t *cur, const virtq_chain_t *c, u32 skip)
+{
+    cur->c = c;
+    cur->seg = 0;
+    cur->off = 0;
+    sg_advance(cur, skip);
+}
+
+static void sg_peek(sg_cursor_t cur, u8 *out, u32 n)
+{
+    for (u32 i = 0; i < n && cur.seg < cur.c->nr_segs; ++i) {
+        out[i] = ((const u8 *)cur.c->segs[cur.seg].ptr)[cur.off];
+        sg_advance(&cur, 1);
+    }
+}
+
+// Scatter-gather copy of `n` bytes from `src` to `dst` in one pass.
+static void sg_copy(sg_cursor_t *dst, sg_cursor_t *src, u32 n)
+{
+    while (n && dst->seg < dst->c->nr_segs && src->seg < src->c->nr_segs) {
+        const virtq_seg_t *d = &dst->c->segs[dst->seg];
+        const virtq_seg_t *s = &src->c->segs[src->seg];
+        u32 chunk = n;
+        if (chunk > d->len - dst->off)
+            chunk = d->len - dst->off;
+        if (chunk > s->len - src->off)
+            chunk = s->len - src->off;
+        hyp_memcpy((u8 *)d->ptr + dst->off, (const u8 *)s->ptr + src->off, chunk);
+        sg_advance(dst, chunk);
+        sg_advance(src, chunk);
+        n -= chunk;
+    }
+}
+
+// Total length of a chain, or 0 if any buffer has the wrong direction.
+static u64 chain_bytes(const virtq_chain_t *c, bool write)
+{
+    u64 total = 0;
+    for (u32 i = 0; i < c->nr_segs; ++i) {
+        if (c->segs[i].write != write)
+            return 0;
+        total += c->segs[i].len;
+    }
+    return total;
+}
+
+static bool netsw_flippable(u64 ipa)
+{
+    if ((ipa & (NETSW_PAGE_SIZE - 1ull)) || ipa < GUEST_NET_BASE ||
+        ipa >= GUEST_NET_BASE + GUEST_NET_PORTS * GUEST_NET_STRIDE)
+        return false;
+    return (ipa - GUEST_NET_BASE) % GUEST_NET_STRIDE >= GUEST_NET_PAGES_OFF;
+}
+
+// Header-only first buffer plus one data page on both sides.
+static bool netsw_can_flip(const virtq_chain_t *tx, const virtq_chain_t *rx, u32 pkt_len)
+{
+    if (pkt_len < NETSW_FLIP_MIN || tx->nr_segs != 2 || rx->nr_segs != 2 ||
+        tx->segs[0].len != NETSW_HDR_LEN || rx->segs[0].len != NETSW_HDR_LEN)
+        return false;
+    return tx->segs[1].len <= NETSW_PAGE_SIZE && rx->segs[1].len == NETSW_PAGE_SIZE &&
+           netsw_flippable(tx->segs[1].ipa) && netsw_flippable(rx->segs[1].ipa);
+}
+
+static u32 netsw_bit(const netsw_port_t *port)
+{
+    return 1u << (u32)(port - netsw_ports);
+}
+
+// Deliver one frame into a receive buffer of `dst`. Returns false if `dst`
+// has none; otherwise the frame was delivered or dropped and `dst`'s RX ring
+// needs publishing (recorded in `touched`).
+static bool netsw_deliver(netsw_port_t *dst, const virtq_chain_t *tx, u32 pkt_len,
+                          bool allow_flip, u32 *touched)
+{
+    virtio_dev_t *dev = &dst->dev;
+    virtq_t *rxq = &dev->vq[VIRTIO_NET_Q_RX];
+    if (!(dev->status & VIRTIO_STATUS_DRIVER_OK))
+        return false;
+    virtq_chain_t rx;
+    if (!virtq_pop(dev, rxq, &rx))
+        return false;
+    *touched |= netsw_bit(dst);
+
+    const u64 room = chain_bytes(&rx, true);
+    if (!room || rx.segs[0].len < NETSW_HDR_LEN || room - NETSW_HDR_LEN < pkt_len) {
+        virtq_push(rxq, rx.head, 0);
+        dst->dropped++;
+        return true;
+    }
+
+    struct virtio_net_hdr *hdr = rx.segs[0].ptr;
+    hyp_memset(hdr, 0, NETSW_HDR_LEN);
+    hdr->num_buffers = 1;
+    if (allow_flip && netsw_can_flip(tx, &rx, pkt_len) &&
+        s2_swap_pages(tx->segs[1].ipa, rx.segs[1].ipa)) {
+        dst->flipped++;
+    } else {
+        sg_cursor_t from, to;
+        sg_init(&from, tx, NETSW_HDR_LEN);
+        sg_init(&to, &rx, NETSW_HDR_LEN);
+        sg_copy(&to, &from, pkt_len);
+        dst->copied++;
+    }
+    virtq_push(rxq, rx.head, NETSW_HDR_LEN + pkt_len);
+    dst->rx_packets++;
+    return true;
+}
+
+static netsw_port_t *netsw_lookup(const u8 *mac)
+{
+    for (u32 i = 0; i < netsw_nr_ports; ++i) {
+        u32 j = 0;
+        while (j < VIRTIO_NET_ETH_ALEN && netsw_ports[i].mac[j] == mac[j])
+            ++j;
+        if (j == VIRTIO_NET_ETH_ALEN)
+            return &netsw_ports[i];
+    }
+    return NULL;
+}
+
+// Switch one frame. Returns the port it is waiting on, or NULL once the TX
+// buffer can be completed.
+static netsw_port_t *netsw_forward(netsw_port_t *src, const virtq_chain_t *tx, u32 *touched)
+{
+    const u64 len = chain_bytes(tx, false);
+    if (len < NETSW_HDR_LEN + NETSW_ETH_HLEN || len > 0xFFFFFFFFull) {
+        src->dropped++;
+        return NULL;
+    }
+    const u32 pkt_len = (u32)(len - NETSW_HDR_LEN);
+
+    sg_cursor_t cur;
+    sg_init(&cur, tx, NETSW_HDR_LEN);
+    u8 dst_mac[VIRTIO_NET_ETH_ALEN];
+    sg_peek(cur, dst_mac, VIRTIO_NET_ETH_ALEN);
+
+    if (dst_mac[0] & 1u) { // broadcast/multicast: flood, never wait
+        for (u32 i = 0; i < netsw_nr_ports; ++i) {
+            netsw_port_t *port = &netsw_ports[i];
+            if (port != src && !netsw_deliver(port, tx, pkt_len, false, touched))
+                port->dropped++;
+        }
+        return NULL;
+    }
+
+    netsw_port_t *dst = netsw_lookup(dst_mac);
+    if (!dst || dst == src) {
+        src->dropped++;
+        return NULL;
+    }
+    return netsw_deliver(dst, tx, pkt_len, true, touched) ? NULL : dst;
+}
+
+static void netsw_publish_rx(u32 touched)
+{
+    for (u32 i = 0; i < netsw_nr_ports; ++i)
+        if (touched & (1u << i)) {
+            virtio_dev_t *dev = &netsw_ports[i].dev;
+            (void)virtq_complete(dev, &dev->vq[VIRTIO_NET_Q_RX]);
+        }
+}
+
+static void netsw_tx(netsw_port_t *src)
+{
+    virtio_dev_t *dev = &src->dev;
+    virtq_t *txq = &dev->vq[VIRTIO_NET_Q_TX];
+    virtq_chain_t tx;
+    src->tx_stalled = false;
+    for (;;) {
+        u32 touched = 0;
+        netsw_port_t *blocked = NULL;
+        while (virtq_pop(dev, txq, &tx)) {
+            blocked = netsw_forward(src, &tx, &touched);
+            if (blocked) {
+                virtq_unpop(dev, txq);
+                break;
+            }
+            virtq_push(txq, tx.head, 0);
+            src->tx_packets++;
+        }
+        netsw_publish_rx(touched);
+
+        if (blocked) {
+            // Publishing the empty RX ring sets avail_event, so the peer
+            // notifies on its next buffer. It may already have posted one.
+            virtio_dev_t *peer = &blocked->dev;
+            if (virtq_complete(peer, &peer->vq[VIRTIO_NET_Q_RX]))
+                continue;
+            src->tx_stalled = true;
+            src->stalls++;
+            (void)virtq_complete(dev, txq);
+            return;
+        }
+        if (!virtq_complete(dev, txq))
+            return;
+    }
+}
+
+static void netsw_notify(virtio_dev_t *dev, vcpu_t *vcpu, u32 queue)
+{
+    (void)vcpu;
+    if (queue == VIRTIO_NET_Q_TX) {
+        netsw_tx(dev->opaque);
+        return;
+    }
+    // New receive buffers: retry senders held back by backpressure.
+    for (u32 i = 0; i < netsw_nr_ports; ++i)
+        if (netsw_ports[i].tx_stalled)
+            netsw_tx(&netsw_ports[i]);
+}
+
+static u64 netsw_config_read(virtio_dev_t *dev, u64 offset, u32 size)
+{
+    const netsw_port_t *port = dev->opaque;
+    u64 v = 0;
+    for (u32 i = 0; i < size && i < sizeof(u64); ++i)
+        if (offset + i < VIRTIO_NET_ETH_ALEN)
+            v |= (u64)port->mac[offset + i] << (8 * i);
+    return v;
+}
+
+static void netsw_reset(virtio_dev_t *dev)
+{
+    netsw_port_t *port = dev->opaque;
+    if (port->tx_packets || port->rx_packets) {
+        console_puts("EL2: vswitch port ");
+        console_hex64((u64)(port - netsw_ports));
+        console_puts(" tx=");
+        console_hex64(port->tx_packets);
+        console_puts(" rx=");
+        console_hex64(port->rx_packets);
+        console_puts(" copied/flipped=");
+        console_hex64(port->copied);
+        console_puts("/");
+        console_hex64(port->flipped);
+        console_puts(" dropped=");
+        console_hex64(port->dropped);
+        console_puts(" stalls=");
+        console_hex64(port->stalls);
+        console_puts("\n");
+    }
+    port->tx_stalled = false;
+    port->tx_packets = 0;
+    port->rx_packets = 0;
+    port->copied = 0;
+    port->flipped = 0;
+    port->dropped = 0;
+    port->stalls = 0;
+}
+
+static const virtio_dev_ops_t netsw_ops = {
+    .notify = netsw_notify,
+    .config_read = netsw_config_read,
+    .reset = netsw_reset,
+};
+
+bool virtio_net_attach(struct sch_vm *vm, u64 base, u32 intid, const u8 *mac)
+{
+    if (netsw_nr_ports >= NETSW_MAX_PORTS)
+        return false;
+    netsw_port_t *port = &netsw_ports[netsw_nr_ports];
+    for (u32 i = 0; i < VIRTIO_NET_ETH_ALEN; ++i)
+        port->mac[i] = mac[i];
+
+    virtio_dev_t *dev = &port->dev;
+    dev->ops = &netsw_ops;
+    dev->opaque = port;
+    dev->name = "virtio-net";
+    dev->device_id = VIRTIO_ID_NET;
+    dev->nr_queues = 2;
+    dev->device_features = (1ull << VIRTIO_RING_F_INDIRECT_DESC) |
+                           (1ull << VIRTIO_RING_F_EVENT_IDX) |
+                           (1ull << VIRTIO_NET_F_MAC);
+    if (!virtio_mmio_attach(dev, vm, base, intid))
+        return false;
+    netsw_nr_ports++;
+    return true;
+}
@@ -0,0 +1,37 @@
+#include <stddef.h>
+#include "vm.h"
+#include "arch_ops.h"
+
+void vm_init(sch_vm_t *vm, int vm_id, u64 vttbr_el2)
+{
+    vm->vm_id = vm_id;
+    vm->vttbr_el2 = vttbr_el2;
+    vm->nr_vcpus = 0;
+    mmio_bus_init(&vm->mmio);
+    vgic_dist_init(&vm->vgic);
+    vm->created = read_sysreg(CNTPCT_EL0);
+    vm->records = GUEST_REPORT_RING_BASE;
+    for (u32 i = 0; i < VM_MAX_VCPUS; ++i)
+        vm->vcpus[i] = NULL;
+}
+
+bool vm_add_vcpu(sch_vm_t *vm, vcpu_t *vcpu)
+{
+    if (!vm || !vcpu || vm->nr_vcpus >= VM_MAX_VCPUS)
+        return false;
+    vm->vcpus[vm->nr_vcpus++] = vcpu;
+    vcpu->vm = vm;
+    vcpu->arch.vttbr_el2 = vm->vttbr_el2;
+    vgic_vcpu_reset(vcpu);
+    return true;
+}
+
+vcpu_t *vm_find_vcpu(const sch_vm_t *vm, int vcpu_id)
+{
+    if (!vm)
+        return NULL;
+    for (u32 i = 0; i < vm->nr_vcpus; ++i)
+        if (vm->vcpus[i]->vcpu_id == vcpu_id)
+            return vm->vcpus[i];
+    return NULL;
+}
@@ -0,0 +1,246 @@
+#include <stddef.h>
+#include "vm_snapshot.h"
+#include "arch_ops.h"
+#include "guest_layout.h"
+#include "mmio_bus.h"
+#include "s2_mmu.h"
+#include "steal_time.h"
+#include "trap.h"
+#include "vgic.h"
+
+extern void console_puts(const char*);
+extern void console_hex64(u64);
+
+// Guest memory EL2 reads and writes without going through stage-2, so it must
+// never turn copy-on-write under it. The first SNAPSHOT_PRIVATE_RANGES are
+// per VM: a clone repeats the template's vCPU and guest indexes, so it gets
+// copies of its own (s2_copy_range()) and EL2 finds its records through
+// sch_vm_t.records. The packet buffers stay one set of pages.
+static const s2_range_t snapshot_direct[] = {
+    { GUEST_SHARED_BASE, GUEST_POLL_RING_BASE + GUEST_POLL_RING_COUNT * GUEST_POLL_RING_STRIDE -
+                         GUEST_SHARED_BASE },
+    { GUEST_REPORT_RING_BASE, GUEST_LOCK_BASE - GUEST_REPORT_RING_BASE },
+    { GUEST_NET_BASE, GUEST_NET_PORTS * GUEST_NET_STRIDE }, // flipped by s2_swap_pages()
+};
+#define SNAPSHOT_DIRECT_RANGES (sizeof(snapshot_direct) / sizeof(snapshot_direct[0]))
+#define SNAPSHOT_PAGE_SIZE      0x1000ull
+#define SNAPSHOT_PRIVATE_RANGES 2u
+#define SNAPSHOT_SHARED_RANGE   0u // telemetry and poll rings
+#define SNAPSHOT_RECORDS_RANGE  1u
+#define SNAPSHOT_PRIVATE_PAGES \
+    ((snapshot_direct[0].size + snapshot_direct[1].size) / SNAPSHOT_PAGE_SIZE)
+
+static sch_vm_t clone_vms[VM_SNAPSHOT_MAX_CLONES];
+static u32 clone_vms_used;
+
+u32 vm_snapshot_room(const sch_vm_t *vm)
+{
+    if (!vm || !vm->nr_vcpus)
+        return 0;
+    // The snapshot takes a stage-2 root of its own, as large as the VM's.
+    const u32 roots = s2_clone_room(vm->vttbr_el2);
+    u32 room = VM_SNAPSHOT_MAX_CLONES - clone_vms_used;
+    if (vcpu_arena_free(0) / vm->nr_vcpus < room)
+        room = vcpu_arena_free(0) / vm->nr_vcpus;
+    if (roots < room + 1u)
+        room = roots ? roots - 1u : 0u;
+    if (s2_frames_contiguous() / SNAPSHOT_PRIVATE_PAGES < room)
+        room = s2_frames_contiguous() / SNAPSHOT_PRIVATE_PAGES;
+    return room;
+}
+
+bool vm_snapshot_take(vm_snapshot_t *snap, sch_vm_t *vm)
+{
+    if (!vm || !vm->nr_vcpus)
+        return false;
+    // The running vCPU's FP, vGIC, PMU and counter state is still in hardware.
+    vcpu_put_loaded();
+    const u64 vttbr = s2_clone(vm->vttbr_el2, snapshot_direct, SNAPSHOT_DIRECT_RANGES);
+    if (!vttbr)
+        return false;
+
+    snap->vm = vm;
+    snap->vttbr_el2 = vttbr;
+    snap->taken = read_sysreg(CNTPCT_EL0);
+    snap->nr_vcpus = vm->nr_vcpus;
+    for (u32 i = 0; i < vm->nr_vcpus; ++i)
+    {
+        const vcpu_t *vcpu = vm->vcpus[i];
+        snap->vcpus[i].vcpu_id = vcpu->vcpu_id;
+        snap->vcpus[i].features = vcpu->features;
+        snap->vcpus[i].wait = vcpu->acct.wait;
+        snap->vcpus[i].arch = vcpu->arch;
+        snap->vcpus[i].cold.fp = *vcpu->arch.fp;
+        snap->vcpus[i].cold.sve = *vcpu->arch.sve;
+        snap->vcpus[i].cold.pauth = *vcpu->arch.pauth;
+    }
+    snap->vgic = vm->vgic;
+    return true;
+}
+
+// Give a fresh vCPU the snapshot's state for one vCPU, keeping its own cold
+// blocks and EL2 queue links.
+static void clone_vcpu_state(vcpu_t *vcpu, const vm_snapshot_t *snap, u32 i, u64 vttbr)
+{
+    struct vcpu_fp *fp = vcpu->arch.fp;
+    struct vcpu_sve *sve = vcpu->arch.sve;
+    struct vcpu_pauth *pauth = vcpu->arch.pauth;
+
+    vcpu->arch = snap->vcpus[i].arch;
+    vcpu->arch.fp = fp;
+    vcpu->arch.sve = sve;
+    vcpu->arch.pauth = pauth;
+    *fp = snap->vcpus[i].cold.fp;
+    *sve = snap->vcpus[i].cold.sve;
+    *pauth = snap->vcpus[i].cold.pauth;
+
+    vcpu->arch.vttbr_el2 = vttbr;
+    vcpu->arch.vtimer.next = NULL;
+    vcpu->arch.vtimer.deadline = 0;
+    // The physical PPIs belong to whichever vCPU the template had loaded.
+    vcpu->arch.vtimer.phys_active = false;
+    vcpu->arch.pmu.phys_active = false;
+    vcpu->vcpu_id = snap->vcpus[i].vcpu_id;
+    // The steal-time record the clone copied already counts it.
+    vcpu->acct.wait = snap->vcpus[i].wait;
+    vcpu_set_features(vcpu, snap->vcpus[i].features);
+}
+
+// The polling core serves the boot VM's rings only (poll_ring_bind()). With
+// `online` cleared in its copies, a clone's guests fall back to hypercalls
+// instead of waiting on a ring nobody drains.
+static void clone_poll_rings_offline(u64 shared_pa)
+{
+    for (u32 i = 0; i < GUEST_POLL_RING_COUNT; ++i)
+    {
+        struct guest_poll_ring *ring = (struct guest_poll_ring *)
+            (shared_pa + (GUEST_POLL_RING_BASE - GUEST_SHARED_BASE) + i * GUEST_POLL_RING_STRIDE);
+        ring->online = 0;
+    }
+}
+
+void vm_snapshot_release(vm_snapshot_t *snap)
+{
+    s2_release(snap->vttbr_el2);
+    snap->vttbr_el2 = 0;
+}
+
+sch_vm_t *vm_snapshot_clone(const vm_snapshot_t *snap)
+{
+    if (clone_vms_used >= VM_SNAPSHOT_MAX_CLONES || vcpu_arena_free(0) < snap->nr_vcpus)
+        return NULL;
+    const u64 vttbr = s2_clone(snap->vttbr_el2, snapshot_direct, SNAPSHOT_DIRECT_RANGES);
+    if (!vttbr)
+        return NULL;
+    u64 records = 0;
+    for (u32 r = 0; r < SNAPSHOT_PRIVATE_RANGES; ++r)
+    {
+        const u64 pa = s2_copy_range(vttbr, snapshot_direct[r].ipa, snapshot_direct[r].size);
+        if (!pa)
+        {
+            s2_release(vttbr);
+            return NULL;
+        }
+        if (r == SNAPSHOT_SHARED_RANGE)
+            clone_poll_rings_offline(pa);
+        else if (r == SNAPSHOT_RECORDS_RANGE)
+            records = pa;
+    }
+
+    sch_vm_t *vm = &clone_vms[clone_vms_used];
+    vm_init(vm, (int)(1u + clone_vms_used), vttbr); // vm0 is the boot VM
+    vm->records = records;
+    clone_vms_used++;
+    vm->vgic = snap->vgic;
+    for (u32 i = 0; i < snap->nr_vcpus; ++i)
+    {
+        vcpu_t *vcpu = vcpu_alloc(0);
+        vm_add_vcpu(vm, vcpu);
+        clone_vcpu_state(vcpu, snap, i, vttbr);
+    }
+    vgic_mmio_attach(vm);
+    mmio_scratch_attach(vm, GUEST_MMIO_SCRATCH_BASE);
+
+    for (u32 i = 0; i < vm->nr_vcpus; ++i)
+    {
+        vcpu_scheduler_register(vm->vcpus[i]);
+        vcpu_acct_set(vm->vcpus[i], VCPU_ACCT_RUNNABLE);
+    }
+    return vm;
+}
+
+// Reused by every call: the snapshot only lives until its clones exist.
+static vm_snapshot_t clone_snapshot;
+
+// SCHISM_HYP_VM_CLONE: snapshot the caller's VM and clone it x1 times, or as
+// often as vm_snapshot_room() allows. Like fork(), the call returns twice.
+// The caller gets x1 = clones made, x2 = CNTPCT ticks per clone and x3 =
+// ticks from the VM's creation to the call, the boot a clone skips. The
+// calling vCPU of each clone gets x1 = 0 and x2 = its clone number, from 1.
+// With no room for a single clone nothing is snapshotted.
+static void hyp_vm_clone(vcpu_t *vcpu, smccc_args_t *args)
+{
+    // A clone resumes after the trapping instruction, which a multicall
+    // entry is not.
+    if (vcpu->arch.tf.regs[0] != SCHISM_HYP_VM_CLONE || !vcpu->vm || !args->a[1]) {
+        args->a[0] = SMCCC_RET_INVALID_PARAM;
+        return;
+    }
+    sch_vm_t *vm = vcpu->vm;
+    const u64 room = vm_snapshot_room(vm);
+    const u64 requested = args->a[1] < room ? args->a[1] : room;
+    const u64 t0 = read_sysreg(CNTPCT_EL0);
+    if (!requested || !vm_snapshot_take(&clone_snapshot, vm)) {
+        args->a[0] = SMCCC_RET_NOT_SUPPORTED;
+        return;
+    }
+    const u64 t1 = read_sysreg(CNTPCT_EL0);
+
+    // HVC leaves ELR past the call; SMC is retired only after this returns.
+    const u64 resume = vcpu->arch.tf.elr_el1 +
+                       (esr_ec(read_sysreg(ESR_EL2)) == ESR_EC_SMC64 ? 4u : 0u);
+    u64 made = 0;
+    while (made < requested)
+    {
+        sch_vm_t *clone = vm_snapshot_clone(&clone_snapshot);
+        if (!clone)
+            break;
+        made++;
+        vcpu_t *twin = vm_find_vcpu(clone, vcpu->vcpu_id);
+        twin->arch.tf.regs[0] = SMCCC_RET_SUCCESS;
+        twin->arch.tf.regs[1] = 0;
+        twin->arch.tf.regs[2] = made;
+        twin->arch.tf.regs[3] = 0;
+        twin->arch.tf.elr_el1 = resume;
+    }
+    const u64 t2 = read_sysreg(CNTPCT_EL0);
+    // The clones hold their own copies of the snapshot's tables; dropping
+    // its root leaves each shared page one sharer fewer.
+    vm_snapshot_release(&clone_snapshot);
+
+    console_puts("EL2: VM ");
+    console_hex64((u64)vm->vm_id);
+    console_puts(" snapshot ticks=");
+    console_hex64(t1 - t0);
+    console_puts(" clones=");
+    console_hex64(made);
+    console_puts(" clone ticks=");
+    console_hex64(made ? (t2 - t1) / made : 0);
+    console_puts(" cold boot ticks=");
+    console_hex64(t0 - vm->created);
+    console_puts("\n");
+
+    if (!made) {
+        args->a[0] = SMCCC_RET_NOT_SUPPORTED;
+        return;
+    }
+    args->a[0] = SMCCC_RET_SUCCESS;
+    args->a[1] = made;
+    args->a[2] = (t2 - t1) / made;
+    args->a[3] = t0 - vm->created;
+}
+
+void vm_snapshot_init(void)
+{
+    trap_register_smccc(SCHISM_HYP_VM_CLONE, hyp_vm_clone);
+}
@@ -0,0 +1,242 @@
+#include <stddef.h>
+#include "arch_ops.h"
+#include "gic.h"
+#include "irq.h"
+#include "prof.h"
+#include "vgic.h"
+#include "vpmu.h"
+
+extern void console_puts(const char*);
+extern void console_hex64(u64);
+
+static bool pmu_present;
+static u32 pmu_counters;  // PMCR_EL0.N: event counters implemented
+static u32 guest_counters;
+static u64 mdcr_base;     // HPMN plus HPMD where supported
+static u64 mdcr_live;     // last value written to MDCR_EL2
+static vcpu_t *pmu_owner; // vCPU whose counters are live in hardware
+static bool overflow_held; // vpmu_overflow() without `sync`, not yet injected
+
+static void mdcr_write(u64 val)
+{
+    if (val == mdcr_live)
+        return;
+    write_sysreg(MDCR_EL2, val);
+    isb();
+    mdcr_live = val;
+}
+
+static u32 counter_mask(void)
+{
+    return (1u << PMU_CYCLE_BIT) | ((1u << guest_counters) - 1u);
+}
+
+u32 vpmu_guest_counters(void)
+{
+    return guest_counters;
+}
+
+int vpmu_el2_counter(void)
+{
+    return guest_counters < pmu_counters ? (int)guest_counters : -1;
+}
+
+// PMU registers live at op0=3, CRn=9, CRm=12..14 (PMCR_EL0 .. PMOVSSET_EL0,
+// PMINTEN*_EL1) and op0=3, op1=3, CRn=14, CRm>=8 (PMEVCNTR<n>, PMEVTYPER<n>,
+// PMCCFILTR).
+bool vpmu_is_pmu_sysreg(u32 encoding)
+{
+    const u32 op0 = (encoding >> 14) & 0x3u;
+    const u32 op1 = (encoding >> 10) & 0x7u;
+    const u32 crn = (encoding >> 6) & 0xFu;
+    const u32 crm = (encoding >> 2) & 0xFu;
+    if (op0 != 3)
+        return false;
+    if (crn == 9)
+        return crm >= 12 && crm <= 14;
+    return crn == 14 && op1 == 3 && crm >= 8;
+}
+
+// Stop counting first, then read everything through PMSELR so the loop works
+// for any number of counters. The overflow and interrupt enables are cleared
+// last so PPI 23 drops while another vCPU runs.
+static void pmu_save(vcpu_t *vcpu)
+{
+    const u64 pmcr = read_sysreg(PMCR_EL0);
+    write_sysreg(PMCR_EL0, pmcr & PMCR_WRITABLE & ~PMCR_E);
+    isb();
+    vcpu->arch.pmu.pmcr = pmcr & PMCR_WRITABLE & ~(PMCR_P | PMCR_C);
+    vcpu->arch.pmu.pmselr = read_sysreg(PMSELR_EL0);
+    vcpu->arch.pmu.pmuserenr = read_sysreg(PMUSERENR_EL0);
+    vcpu->arch.pmu.pmccfiltr = read_sysreg(PMCCFILTR_EL0);
+    vcpu->arch.pmu.pmccntr = read_sysreg(PMCCNTR_EL0);
+    vcpu->arch.pmu.cnten = (u32)read_sysreg(PMCNTENSET_EL0);
+    vcpu->arch.pmu.inten = (u32)read_sysreg(PMINTENSET_EL1);
+    vcpu->arch.pmu.ovs = (u32)read_sysreg(PMOVSSET_EL0);
+    for (u32 i = 0; i < guest_counters; ++i)
+    {
+        write_sysreg(PMSELR_EL0, i);
+        isb();
+        vcpu->arch.pmu.evtyper[i] = read_sysreg(PMXEVTYPER_EL0);
+        vcpu->arch.pmu.evcntr[i] = read_sysreg(PMXEVCNTR_EL0);
+    }
+    const u64 all = counter_mask();
+    write_sysreg(PMCNTENCLR_EL0, all);
+    write_sysreg(PMINTENCLR_EL1, all);
+    write_sysreg(PMOVSCLR_EL0, all);
+    isb();
+}
+
+static void pmu_restore(const vcpu_t *vcpu)
+{
+    const u64 all = counter_mask();
+    for (u32 i = 0; i < guest_counters; ++i)
+    {
+        write_sysreg(PMSELR_EL0, i);
+        isb();
+        write_sysreg(PMXEVTYPER_EL0, vcpu->arch.pmu.evtyper[i]);
+        write_sysreg(PMXEVCNTR_EL0, vcpu->arch.pmu.evcntr[i]);
+    }
+    write_sysreg(PMSELR_EL0, vcpu->arch.pmu.pmselr);
+    write_sysreg(PMUSERENR_EL0, vcpu->arch.pmu.pmuserenr);
+    write_sysreg(PMCCFILTR_EL0, vcpu->arch.pmu.pmccfiltr);
+    write_sysreg(PMCCNTR_EL0, vcpu->arch.pmu.pmccntr);
+    write_sysreg(PMOVSSET_EL0, vcpu->arch.pmu.ovs & all);
+    write_sysreg(PMINTENSET_EL1, vcpu->arch.pmu.inten & all);
+    write_sysreg(PMCNTENSET_EL0, vcpu->arch.pmu.cnten & all);
+    isb();
+    write_sysreg(PMCR_EL0, vcpu->arch.pmu.pmcr); // E last: counting resumes here
+}
+
+void vpmu_put(vcpu_t *vcpu)
+{
+    if (!vcpu->arch.pmu.used)
+        return;
+    vpmu_sync(vcpu);
+    const u64 daif = prof_fiq_save();
+    pmu_save(vcpu);
+    pmu_owner = NULL;
+    vcpu->arch.pmu.phys_active = gic_ppi_active(GIC_PPI_PMU);
+    gic_ppi_set_active(GIC_PPI_PMU, false);
+    prof_fiq_restore(daif);
+}
+
+void vpmu_load(vcpu_t *vcpu)
+{
+    if (!vcpu->arch.pmu.used)
+    {
+        vpmu_block();
+        return;
+    }
+    const u64 daif = prof_fiq_save();
+    mdcr_write(mdcr_base);
+    pmu_restore(vcpu);
+    pmu_owner = vcpu;
+    if (vcpu->arch.pmu.phys_active)
+    {
+        gic_ppi_set_active(GIC_PPI_PMU, true);
+        vcpu->arch.pmu.phys_active = false;
+    }
+    prof_fiq_restore(daif);
+}
+
+void vpmu_block(void)
+{
+    mdcr_write(mdcr_base | MDCR_EL2_TPM | MDCR_EL2_TPMCR);
+}
+
+void vpmu_sync(vcpu_t *vcpu)
+{
+    if (!overflow_held || vcpu != pmu_owner)
+        return;
+    overflow_held = false;
+    vcpu->arch.pmu.overflows++;
+    vgic_set_pending_hw(vcpu, GIC_PPI_PMU);
+}
+
+bool vpmu_trap(vcpu_t *vcpu)
+{
+    if (!pmu_present || vcpu->arch.pmu.used || !(vcpu->features & VCPU_FEAT_PMU))
+        return false;
+    // Reset state: everything zero, as the architecture leaves it at reset
+    // apart from PMCR.LC, which AArch64-only guests expect set.
+    vcpu->arch.pmu.used = 1;
+    vcpu->arch.pmu.pmcr = PMCR_LC;
+    vpmu_load(vcpu);
+
+    console_puts("EL2: vPMU enabled for vCPU ");
+    console_hex64((u64)vcpu->vcpu_id);
+    console_puts(" counters=");
+    console_hex64(guest_counters);
+    console_puts("\n");
+    return true;
+}
+
+// PPI 23 is level-triggered on (PMOVSSET & PMINTENSET): forward it with the
+// HW bit like the virtual timer, and the guest's EOI after clearing the
+// overflow retires it without another exit.
+bool vpmu_overflow(bool sync)
+{
+    const u64 mask = counter_mask();
+    if (!pmu_owner)
+    {
+        write_sysreg(PMINTENCLR_EL1, mask); // nobody owns the counters
+        isb();
+        return false;
+    }
+    if (!(read_sysreg(PMOVSSET_EL0) & read_sysreg(PMINTENSET_EL1) & mask))
+        return false;
+    if (sync)
+    {
+        pmu_owner->arch.pmu.overflows++;
+        vgic_set_pending_hw(pmu_owner, GIC_PPI_PMU);
+    }
+    else
+    {
+        // EL2 may be halfway through this vCPU's vGIC state.
+        overflow_held = true;
+    }
+    return true;
+}
+
+static irq_result_t vpmu_irq(vcpu_t *vcpu, u32 intid)
+{
+    (void)vcpu;
+    (void)intid;
+    return vpmu_overflow(true) ? IRQ_FORWARDED : IRQ_HANDLED;
+}
+
+void vpmu_init(void)
+{
+    const u64 dfr0 = read_sysreg(ID_AA64DFR0_EL1);
+    const u32 pmuver = (u32)((dfr0 >> 8) & 0xFu);
+    pmu_present = pmuver != 0 && pmuver != 0xF;
+
+    if (pmu_present)
+    {
+        pmu_counters = (u32)((read_sysreg(PMCR_EL0) >> PMCR_N_SHIFT) & PMCR_N_MASK);
+        guest_counters = pmu_counters;
+        if (CONFIG_PROFILE && pmu_counters >= 2)
+            guest_counters--; // the last one samples EL2 (core/prof.c)
+        mdcr_base = guest_counters & MDCR_EL2_HPMN_MASK;
+        if (guest_counters < pmu_counters)
+            mdcr_base |= MDCR_EL2_HPME;
+        if (pmuver >= 4) // FEAT_PMUv3p1: keep EL2 out of guest counts
+            mdcr_base |= MDCR_EL2_HPMD;
+
+        write_sysreg(PMCR_EL0, PMCR_P | PMCR_C);
+        write_sysreg(PMCNTENCLR_EL0, ~0ull);
+        write_sysreg(PMINTENCLR_EL1, ~0ull);
+        write_sysreg(PMOVSCLR_EL0, ~0ull);
+        irq_register(GIC_PPI_PMU, vpmu_irq);
+        gic_ppi_enable(GIC_PPI_PMU, true);
+    }
+    mdcr_live = ~0ull;
+    mdcr_write(mdcr_base | MDCR_EL2_TPM | MDCR_EL2_TPMCR);
+
+    console_puts("EL2: PMU version=");
+    console_hex64(pmuver);
+    console_puts(" counters=");
+    console_hex64(pmu_counters);
+    console_puts("\n");
+}
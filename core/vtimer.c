@@ -0,0 +1,204 @@
+#include <stddef.h>
+#include "timer.h"
+#include "gic.h"
+#include "vgic.h"
+#include "irq.h"
+#include "steal_time.h"
+
+// Blocked vCPUs ordered by CNTPCT deadline. The head is what CNTHP_EL2 is
+// programmed for; an empty queue leaves the EL2 timer disabled.
+static vcpu_t *vtimer_queue;
+// Whether PPI 27 is currently enabled at the redistributor; only EL2's idle
+// loop turns it off.
+static bool vtimer_line_enabled = true;
+// End of the running vCPU's time slice (CNTPCT), 0 when none is armed.
+static u64 slice_deadline;
+
+// Scheduling quantum; short enough that a preempted lock holder is visible.
+#define VCPU_TIME_SLICE_US 2000ull
+
+static inline u64 read_cntpct(void)
+{
+    u64 v;
+    asm volatile("isb; mrs %0, CNTPCT_EL0" : "=r"(v));
+    return v;
+}
+
+// CNTHP_EL2 serves both the blocked-vCPU queue and the time slice.
+static void hyp_timer_program(void)
+{
+    u64 deadline = slice_deadline;
+    if (vtimer_queue && (!deadline ||
+                         (s64)(vtimer_queue->arch.vtimer.deadline - deadline) < 0))
+        deadline = vtimer_queue->arch.vtimer.deadline;
+
+    if (!deadline)
+    {
+        asm volatile("msr CNTHP_CTL_EL2, xzr");
+        return;
+    }
+    asm volatile("msr CNTHP_CVAL_EL2, %0" : : "r"(deadline));
+    asm volatile("msr CNTHP_CTL_EL2, %0" : : "r"(CNT_CTL_ENABLE));
+    asm volatile("isb");
+}
+
+static void queue_insert(vcpu_t *vcpu)
+{
+    vcpu_t **link = &vtimer_queue;
+    while (*link && (s64)((*link)->arch.vtimer.deadline - vcpu->arch.vtimer.deadline) <= 0)
+        link = &(*link)->arch.vtimer.next;
+    vcpu->arch.vtimer.next = *link;
+    *link = vcpu;
+}
+
+static void vtimer_line_set(bool enable)
+{
+    if (enable == vtimer_line_enabled)
+        return;
+    gic_ppi_enable(GIC_PPI_VTIMER, enable);
+    vtimer_line_enabled = enable;
+}
+
+// Whether an expiry is queued, in a list register or still active at the GIC.
+// Only meaningful for the loaded vCPU.
+static bool vtimer_outstanding(const vcpu_t *vcpu)
+{
+    return (vcpu->arch.vgic.priv[VGIC_STATE_PENDING] & (1u << GIC_PPI_VTIMER)) ||
+           vcpu->arch.vtimer.phys_active || gic_ppi_active(GIC_PPI_VTIMER);
+}
+
+bool vtimer_block(vcpu_t *vcpu)
+{
+    const u64 ctl = vcpu->arch.tf.cntv_ctl_el0;
+    if ((ctl & (CNT_CTL_ENABLE | CNT_CTL_IMASK)) != CNT_CTL_ENABLE)
+        return false;
+    if (vtimer_outstanding(vcpu))
+        return false; // an expiry is already on its way
+
+    // CNTVCT = CNTPCT - CNTVOFF, so CNTV fires once CNTPCT reaches CVAL + offset.
+    const u64 deadline = vcpu->arch.tf.cntv_cval_el0 + vcpu->arch.cntvoff_el2;
+    if ((s64)(deadline - read_cntpct()) <= 0)
+        return false; // PPI 27 is already pending and exits on guest entry
+
+    vcpu->arch.vtimer.deadline = deadline;
+    vcpu->blocked = true;
+    vcpu_acct_set(vcpu, VCPU_ACCT_BLOCKED);
+    queue_insert(vcpu);
+    hyp_timer_program();
+    return true;
+}
+
+// Wake every blocked vCPU whose deadline has passed. A woken vCPU's clock kept
+// running while it slept; from here on it is only runnable, so it freezes at
+// the current count until it is scheduled again. The expiry is injected as a
+// hardware interrupt that is already active, exactly as if PPI 27 had been
+// taken and forwarded, so entering the vCPU costs no extra exit.
+static void vtimer_expire(void)
+{
+    const u64 now = read_cntpct();
+    while (vtimer_queue && (s64)(vtimer_queue->arch.vtimer.deadline - now) <= 0)
+    {
+        vcpu_t *vcpu = vtimer_queue;
+        vtimer_queue = vcpu->arch.vtimer.next;
+        vcpu->arch.vtimer.next = NULL;
+        vcpu->blocked = false;
+        vcpu_acct_set(vcpu, VCPU_ACCT_RUNNABLE);
+        vcpu->arch.cntvct_el0 = now - vcpu->arch.cntvoff_el2;
+        irq_note_latency(GIC_PPI_VTIMER, now - vcpu->arch.vtimer.deadline);
+        vcpu->arch.vtimer.phys_active = true;
+        vgic_set_pending_hw(vcpu, GIC_PPI_VTIMER);
+    }
+    hyp_timer_program();
+}
+
+void vtimer_unblock(vcpu_t *vcpu)
+{
+    if (!vcpu->blocked)
+        return;
+    vcpu_t **link = &vtimer_queue;
+    while (*link && *link != vcpu)
+        link = &(*link)->arch.vtimer.next;
+    if (*link)
+        *link = vcpu->arch.vtimer.next;
+    vcpu->arch.vtimer.next = NULL;
+    vcpu->blocked = false;
+    vcpu_acct_set(vcpu, VCPU_ACCT_RUNNABLE);
+    vcpu->arch.cntvct_el0 = read_cntpct() - vcpu->arch.cntvoff_el2;
+    hyp_timer_program();
+}
+
+// PPI 27 belongs to the loaded vCPU's CNTV: forward it with the HW bit and
+// leave it active, so the guest's EOI retires it without another exit.
+static irq_result_t vtimer_irq(vcpu_t *vcpu, u32 intid)
+{
+    if (!vcpu)
+    {
+        vtimer_line_set(false); // idle: the expiry is covered by the EL2 queue
+        return IRQ_HANDLED;
+    }
+    const u64 fired = vcpu->arch.tf.cntv_cval_el0 + vcpu->arch.cntvoff_el2;
+    irq_note_latency(intid, read_cntpct() - fired);
+    vgic_set_pending_hw(vcpu, intid);
+    return IRQ_FORWARDED;
+}
+
+static irq_result_t hyp_timer_irq(vcpu_t *vcpu, u32 intid)
+{
+    (void)intid;
+    if (slice_deadline && (s64)(read_cntpct() - slice_deadline) >= 0)
+    {
+        slice_deadline = 0;
+        if (vcpu && !vcpu->blocked)
+        {
+            vcpu->preempted = true;
+            vcpu->request_yield = true;
+        }
+    }
+    vtimer_expire();
+    return IRQ_HANDLED;
+}
+
+void vtimer_init(void)
+{
+    irq_register(GIC_PPI_VTIMER, vtimer_irq);
+    irq_register(GIC_PPI_HYP_TIMER, hyp_timer_irq);
+}
+
+void vtimer_put(vcpu_t *vcpu)
+{
+    // Stop the outgoing CNTV (already saved at exit) and carry its claim on
+    // PPI 27 with the vCPU, leaving the line free for the next one.
+    asm volatile("msr CNTV_CTL_EL0, xzr; isb");
+    vcpu->arch.vtimer.phys_active = gic_ppi_active(GIC_PPI_VTIMER);
+    gic_ppi_set_active(GIC_PPI_VTIMER, false);
+}
+
+void vtimer_sync(vcpu_t *vcpu)
+{
+    if (vcpu->arch.vtimer.phys_active)
+    {
+        gic_ppi_set_active(GIC_PPI_VTIMER, true);
+        vcpu->arch.vtimer.phys_active = false;
+    }
+    vtimer_line_set(true);
+    vgic_flush(vcpu);
+}
+
+void vtimer_slice_start(void)
+{
+    u64 frq;
+    asm volatile("mrs %0, CNTFRQ_EL0" : "=r"(frq));
+    slice_deadline = read_cntpct() + (frq / 1000000ull) * VCPU_TIME_SLICE_US;
+    if (!slice_deadline)
+        slice_deadline = 1;
+    hyp_timer_program();
+}
+
+void vtimer_idle(void)
+{
+    // The loaded vCPU's CNTV is still live in hardware; keep it from waking
+    // us; its expiry is covered by the EL2 timer queue.
+    vtimer_line_set(false);
+    asm volatile("dsb sy; wfi" ::: "memory");
+    irq_dispatch(NULL);
+}
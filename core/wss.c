@@ -0,0 +1,174 @@
+#include <stddef.h>
+#include "wss.h"
+#include "arch_ops.h"
+#include "platform.h"
+#include "s2_mmu.h"
+#include "vm.h"
+
+#if CONFIG_WSS
+
+extern void console_puts(const char*);
+extern void console_hex64(u64);
+
+#define WSS_RAM_PAGES  ((u32)(GUEST_RAM_SIZE / 0x1000ull))
+#define WSS_AGE_MAX    0xFFu
+
+typedef struct
+{
+    const sch_vm_t *vm;
+    u32 cursor;                // next page of guest RAM to scan
+    u32 mapped;                // mapped pages seen so far this sweep
+    u32 building[WSS_BUCKETS]; // histogram of the sweep in progress
+    wss_histogram_t last;      // last complete sweep
+    u64 scan_max;              // longest window, in CNTPCT ticks
+    u8 age[WSS_RAM_PAGES];     // sweeps since the page was last accessed
+} wss_vm_t;
+
+static wss_vm_t wss_vms[WSS_MAX_VMS];
+static u64 wss_period; // CNTPCT ticks between windows
+static u64 wss_next;
+static bool wss_hw_af;
+
+static wss_vm_t *wss_slot(const sch_vm_t *vm)
+{
+    for (u32 i = 0; i < WSS_MAX_VMS; ++i)
+    {
+        if (wss_vms[i].vm == vm)
+            return &wss_vms[i];
+        if (!wss_vms[i].vm)
+        {
+            wss_vms[i].vm = vm;
+            return &wss_vms[i];
+        }
+    }
+    return NULL;
+}
+
+// 0 for a page accessed during the last sweep, then one bucket per power of
+// two of idle sweeps.
+static inline u32 wss_bucket(u32 age)
+{
+    if (!age)
+        return 0;
+    const u32 b = 1u + (31u - (u32)__builtin_clz(age));
+    return b < WSS_BUCKETS ? b : WSS_BUCKETS - 1u;
+}
+
+// "WSS vm=<id> sweep=<n> mapped=<pages> hw_af=<0|1> h=<b0> <b1> ... scan_max=<ticks>
+// af_faults=<n>"
+static void wss_print(const wss_vm_t *w)
+{
+    console_puts("WSS vm=");
+    console_hex64((u64)w->vm->vm_id);
+    console_puts(" sweep=");
+    console_hex64(w->last.sweeps);
+    console_puts(" mapped=");
+    console_hex64(w->last.mapped);
+    console_puts(" hw_af=");
+    console_hex64(wss_hw_af);
+    console_puts(" h=");
+    for (u32 b = 0; b < WSS_BUCKETS; ++b)
+    {
+        console_hex64(w->last.pages[b]);
+        console_puts(b + 1u < WSS_BUCKETS ? " " : "");
+    }
+    console_puts(" scan_max=");
+    console_hex64(w->scan_max);
+    console_puts(" af_faults=");
+    console_hex64(s2_access_faults());
+    console_puts("\n");
+}
+
+static void wss_scan(wss_vm_t *w)
+{
+    u64 accessed[(WSS_SCAN_PAGES + 63u) / 64u];
+    u64 mapped[(WSS_SCAN_PAGES + 63u) / 64u];
+    const u64 t0 = read_sysreg(CNTPCT_EL0);
+
+    const u32 first = w->cursor;
+    const u32 pages = WSS_RAM_PAGES - first < WSS_SCAN_PAGES ? WSS_RAM_PAGES - first
+                                                             : WSS_SCAN_PAGES;
+    w->mapped += s2_age_pages(GUEST_RAM_BASE + (u64)first * 0x1000ull, pages, accessed, mapped);
+    for (u32 i = 0; i < pages; ++i)
+    {
+        const u64 bit = 1ull << (i % 64u);
+        u8 *age = &w->age[first + i];
+        if (!(mapped[i / 64u] & bit))
+        {
+            *age = 0;
+            continue;
+        }
+        if (accessed[i / 64u] & bit)
+            *age = 0;
+        else if (*age < WSS_AGE_MAX)
+            (*age)++;
+        w->building[wss_bucket(*age)]++;
+    }
+    w->cursor = first + pages;
+
+    const u64 ticks = read_sysreg(CNTPCT_EL0) - t0;
+    if (ticks > w->scan_max)
+        w->scan_max = ticks;
+    if (w->cursor < WSS_RAM_PAGES)
+        return;
+
+    w->last.sweeps++;
+    w->last.mapped = w->mapped;
+    for (u32 b = 0; b < WSS_BUCKETS; ++b)
+    {
+        w->last.pages[b] = w->building[b];
+        w->building[b] = 0;
+    }
+    w->cursor = 0;
+    w->mapped = 0;
+    wss_print(w);
+}
+
+void wss_poll(vcpu_t *vcpu)
+{
+    if (!vcpu || !vcpu->vm || !wss_period)
+        return;
+    const u64 now = read_sysreg(CNTPCT_EL0);
+    if (now < wss_next)
+        return;
+    wss_next = now + wss_period;
+
+    // TLB maintenance by VMID goes to the VMID in VTTBR_EL2; only age the VM
+    // the hardware still points at.
+    if (read_sysreg(VTTBR_EL2) != vcpu->arch.vttbr_el2)
+        return;
+    wss_vm_t *w = wss_slot(vcpu->vm);
+    if (!w)
+        return;
+    s2_activate(vcpu->arch.vttbr_el2);
+    wss_scan(w);
+}
+
+bool wss_histogram(const sch_vm_t *vm, wss_histogram_t *out)
+{
+    for (u32 i = 0; i < WSS_MAX_VMS; ++i)
+    {
+        if (wss_vms[i].vm != vm || !wss_vms[i].last.sweeps)
+            continue;
+        *out = wss_vms[i].last;
+        return true;
+    }
+    return false;
+}
+
+void wss_init(void)
+{
+    wss_hw_af = s2_hw_access_flag();
+    wss_period = read_sysreg(CNTFRQ_EL0) * WSS_PERIOD_US / 1000000u;
+    if (!wss_period)
+        wss_period = 1;
+    console_puts("EL2: working-set sampler period_us=");
+    console_hex64(WSS_PERIOD_US);
+    console_puts(" pages=");
+    console_hex64(WSS_SCAN_PAGES);
+    console_puts(" hw_af=");
+    console_hex64(wss_hw_af);
+    console_puts("\n");
+}
+
+#endif /* CONFIG_WSS */
@@ -0,0 +1,125 @@
+#include "gic.h"
+#include "mmio.h"
+#include "platform.h"
+
+#define GICD_CTLR          0x0000
+#define GICD_CTLR_ENGRP0   (1u << 0)
+#define GICD_CTLR_ENGRP1   (1u << 1)  // EnableGrp1 (EnableGrp1NS with security)
+#define GICD_CTLR_ARE      (1u << 4)  // affinity routing (ARE_NS with security)
+#define GICD_CTLR_RWP      (1u << 31)
+
+#define GICR_CTLR          0x0000
+#define GICR_CTLR_RWP      (1u << 3)
+#define GICR_WAKER         0x0014
+#define GICR_WAKER_PSLEEP  (1u << 1)  // ProcessorSleep
+#define GICR_WAKER_CASLEEP (1u << 2)  // ChildrenAsleep
+#define GICR_SGI_BASE      0x10000
+#define GICR_IGROUPR0      (GICR_SGI_BASE + 0x0080)
+#define GICR_ISENABLER0    (GICR_SGI_BASE + 0x0100)
+#define GICR_ICENABLER0    (GICR_SGI_BASE + 0x0180)
+#define GICR_ISACTIVER0    (GICR_SGI_BASE + 0x0300)
+#define GICR_ICACTIVER0    (GICR_SGI_BASE + 0x0380)
+#define GICR_IPRIORITYR    (GICR_SGI_BASE + 0x0400)
+
+#define GIC_PPI_PRIORITY   0x80u
+
+// Only the boot CPU takes interrupts; the polling core runs with them off.
+static const u64 gicr = GICR_BASE;
+
+static void gicd_wait_rwp(void)
+{
+    while (mmio_read32(GICD_BASE + GICD_CTLR) & GICD_CTLR_RWP) { }
+}
+
+static void gicr_wait_rwp(void)
+{
+    while (mmio_read32(gicr + GICR_CTLR) & GICR_CTLR_RWP) { }
+}
+
+void gic_ppi_enable(u32 intid, bool enable)
+{
+    if (intid >= 32)
+        return;
+    if (enable)
+    {
+        mmio_write32(gicr + GICR_ISENABLER0, 1u << intid);
+    }
+    else
+    {
+        mmio_write32(gicr + GICR_ICENABLER0, 1u << intid);
+        gicr_wait_rwp(); // the line is guaranteed quiet once RWP clears
+    }
+}
+
+bool gic_ppi_active(u32 intid)
+{
+    return intid < 32 && (mmio_read32(gicr + GICR_ISACTIVER0) & (1u << intid)) != 0;
+}
+
+void gic_ppi_set_active(u32 intid, bool active)
+{
+    if (intid >= 32)
+        return;
+    mmio_write32(gicr + (active ? GICR_ISACTIVER0 : GICR_ICACTIVER0), 1u << intid);
+}
+
+static void gic_ppi_configure(u32 intid)
+{
+    const u64 prio = gicr + GICR_IPRIORITYR + (intid & ~3u);
+    const u32 shift = (intid & 3u) * 8u;
+    u32 v = mmio_read32(prio);
+    v = (v & ~(0xFFu << shift)) | (GIC_PPI_PRIORITY << shift);
+    mmio_write32(prio, v);
+    mmio_write32(gicr + GICR_IGROUPR0, mmio_read32(gicr + GICR_IGROUPR0) | (1u << intid));
+}
+
+void gic_ppi_set_fiq(u32 intid)
+{
+    if (intid >= 32)
+        return;
+    mmio_write32(gicr + GICR_IGROUPR0, mmio_read32(gicr + GICR_IGROUPR0) & ~(1u << intid));
+    const u32 ctlr = mmio_read32(GICD_BASE + GICD_CTLR) & ~GICD_CTLR_RWP;
+    mmio_write32(GICD_BASE + GICD_CTLR, ctlr | GICD_CTLR_ENGRP0);
+    gicd_wait_rwp();
+    asm volatile("msr " ICC_IGRPEN0_EL1_SYSREG ", %0" : : "r"(1ull));
+    asm volatile("isb");
+}
+
+void gic_init(void)
+{
+    // Distributor: affinity routing first, then group 1.
+    mmio_write32(GICD_BASE + GICD_CTLR, GICD_CTLR_ARE);
+    gicd_wait_rwp();
+    mmio_write32(GICD_BASE + GICD_CTLR, GICD_CTLR_ARE | GICD_CTLR_ENGRP1);
+    gicd_wait_rwp();
+
+    // Wake this CPU's redistributor.
+    mmio_write32(gicr + GICR_WAKER, mmio_read32(gicr + GICR_WAKER) & ~GICR_WAKER_PSLEEP);
+    while (mmio_read32(gicr + GICR_WAKER) & GICR_WAKER_CASLEEP) { }
+
+    // Timer and PMU PPIs: group 1. The virtual timer and PMU overflow are
+    // forwarded to the loaded vCPU and stay active until it deactivates them.
+    gic_ppi_configure(GIC_PPI_HYP_TIMER);
+    gic_ppi_configure(GIC_PPI_VTIMER);
+    gic_ppi_configure(GIC_PPI_MAINTENANCE);
+    gic_ppi_configure(GIC_PPI_PMU); // enabled by vpmu_init()
+    gic_ppi_enable(GIC_PPI_HYP_TIMER, true);
+    gic_ppi_enable(GIC_PPI_VTIMER, true);
+    gic_ppi_enable(GIC_PPI_MAINTENANCE, true);
+
+    // EL2 system register interface; Enable lets EL1 use ICC_SRE_EL1.
+    u64 sre;
+    asm volatile("mrs %0, " ICC_SRE_EL2_SYSREG : "=r"(sre));
+    sre |= (1ull << 0) | (1ull << 3); // SRE, Enable
+    asm volatile("msr " ICC_SRE_EL2_SYSREG ", %0" : : "r"(sre));
+    asm volatile("isb");
+
+    asm volatile("msr " ICC_PMR_EL1_SYSREG ", %0" : : "r"(0xFFull));
+    asm volatile("msr " ICC_CTLR_EL1_SYSREG ", %0" : : "r"(ICC_CTLR_EOIMODE));
+    asm volatile("msr " ICC_IGRPEN1_EL1_SYSREG ", %0" : : "r"(1ull));
+
+    u64 hcr;
+    asm volatile("mrs %0, " ICH_HCR_SYSREG : "=r"(hcr));
+    asm volatile("msr " ICH_HCR_SYSREG ", %0" : : "r"(hcr | ICH_HCR_EN));
+    asm volatile("isb");
+}
@@ -1,6 +1,8 @@
+#include <stdbool.h>
 #include "types.h"
 #include "mmio.h"
 #include "platform.h"
+#include "spinlock.h"
 
 #define UART_DR      (UART0_BASE + 0x000)
 #define UART_FR      (UART0_BASE + 0x018)
@@ -48,12 +50,24 @@ static void uart_init(void){
     mmio_write32(UART_CR, CR_UARTEN | CR_TXE);
 }
 
+/* Serialize output once a second CPU prints (see console_enable_smp()). */
+static spinlock_t console_lock;
+static volatile bool console_smp;
+
+static void console_emit(const char* s){
+    if (!console_smp) { uart_puts(s); return; }
+    spin_lock(&console_lock);
+    uart_puts(s);
+    spin_unlock(&console_lock);
+}
+
 /* Expose a tiny interface for core/ */
 void console_init(void){ uart_init(); }
-void console_puts(const char* s){ uart_puts(s); }
+void console_enable_smp(void){ console_smp = true; }
+void console_puts(const char* s){ console_emit(s); }
 void console_hex64(u64 x){
     const char* H="0123456789abcdef";
     char buf[2+16+1]; buf[0]='0'; buf[1]='x';
     for(int i=0;i<16;i++){ buf[2+15-i]=H[(x>>(i*4))&0xF]; }
-    buf[18]='\0'; uart_puts(buf);
+    buf[18]='\0'; console_emit(buf);
 }
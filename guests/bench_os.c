@@ -0,0 +1,251 @@
+#include <stddef.h>
+#include "guest_stubs.h"
+#include "guest_tasks.h"
+
+/*
+ * Benchmark guest, booted instead of counter_os/memwalk_os when the
+ * hypervisor is built with BENCH=1 (`make bench`). vCPU 0 runs the suite and
+ * reports one "bench <name> <unit>" record per result, with the value in
+ * data0 and the raw counter ticks behind it in data1; tools/bench_parse.awk
+ * turns the serial log into a results file. vCPU 1 only bounces directed
+ * yields back for the world-switch measurement. Last, the suite forks the VM
+ * and compares the cost of a clone with a cold boot. The run ends with PSCI
+ * SYSTEM_OFF so QEMU exits by itself.
+ */
+
+#ifndef BENCH_WS_KB
+#define BENCH_WS_KB 16384u // largest TLB working set, KiB
+#endif
+
+#define BENCH_HVC_ROUNDS    1024u
+#define BENCH_SWITCH_ROUNDS 256u
+#define BENCH_SYSREG_ROUNDS 1024u
+#define BENCH_FAULT_ROUNDS  256u
+#define BENCH_TLB_MIN_KB    16u
+#define BENCH_TLB_ACCESSES  65536u
+#define BENCH_BW_BYTES      (4u << 20)
+#define BENCH_PAGE          4096u
+#define BENCH_CLONES        2u
+#define BENCH_COW_PAGES     64u
+
+static u64 bench_freq;
+
+static void bench_desc(struct guest_task_result *out, const char *name, u64 size_kb,
+                       const char *unit)
+{
+    static const char prefix[] = "bench ";
+    char *d = out->desc;
+    char *const end = out->desc + sizeof(out->desc) - 1;
+    for (const char *p = prefix; *p && d < end; ++p)
+        *d++ = *p;
+    for (const char *p = name; *p && d < end; ++p)
+        *d++ = *p;
+    if (size_kb)
+    {
+        char digits[20];
+        u32 n = 0;
+        for (u64 v = size_kb; v; v /= 10u)
+            digits[n++] = (char)('0' + v % 10u);
+        if (d < end)
+            *d++ = '_';
+        while (n && d < end)
+            *d++ = digits[--n];
+        if (d < end)
+            *d++ = 'K';
+    }
+    if (d < end)
+        *d++ = ' ';
+    for (const char *p = unit; *p && d < end; ++p)
+        *d++ = *p;
+    *d = '\0';
+}
+
+static void bench_result(const char *name, u64 size_kb, const char *unit, u64 value, u64 ticks)
+{
+    struct guest_task_result out;
+    guest_task_counter(0, &out);
+    bench_desc(&out, name, size_kb, unit);
+    out.data0 = value;
+    out.data1 = ticks;
+    guest_task_report(0, &out);
+}
+
+// Average nanoseconds per operation.
+static void bench_latency(const char *name, u64 size_kb, u64 ticks, u64 ops)
+{
+    bench_result(name, size_kb, "ns", ticks * 1000000000ull / bench_freq / ops, ticks);
+}
+
+static void bench_bandwidth(const char *name, u64 ticks, u64 bytes)
+{
+    bench_result(name, 0, "MiB/s", ticks ? bytes * bench_freq / ticks >> 20 : 0, ticks);
+}
+
+// SMCCC_VERSION does no work in EL2: the cost is the exit and dispatch.
+static u64 bench_hvc_null(void)
+{
+    const u64 t0 = guest_read_counter();
+    for (u32 i = 0; i < BENCH_HVC_ROUNDS; ++i)
+        (void)guest_smccc(SMCCC_VERSION, 0, 0, 0);
+    const u64 ticks = guest_read_counter() - t0;
+    bench_latency("hvc_null", 0, ticks, BENCH_HVC_ROUNDS);
+    return ticks / BENCH_HVC_ROUNDS;
+}
+
+// A directed yield to vCPU 1, which yields straight back: two hypercalls and
+// two world switches per round. The per-switch figure takes out the two
+// null-hypercall costs.
+static void bench_world_switch(u64 hvc_ticks)
+{
+    const u64 t0 = guest_read_counter();
+    for (u32 i = 0; i < BENCH_SWITCH_ROUNDS; ++i)
+        guest_yield_to(1);
+    const u64 ticks = guest_read_counter() - t0;
+    bench_latency("yield_roundtrip", 0, ticks, BENCH_SWITCH_ROUNDS);
+
+    const u64 per_round = ticks / BENCH_SWITCH_ROUNDS;
+    const u64 switch_ticks = per_round > 2u * hvc_ticks ? (per_round - 2u * hvc_ticks) / 2u : 0;
+    bench_latency("world_switch", 0, switch_ticks * BENCH_SWITCH_ROUNDS, BENCH_SWITCH_ROUNDS);
+}
+
+// CNTPCT_EL0 traps to core/sysreg.c unless the CPU has FEAT_ECV; the
+// "sysreg_trapped" result says which of the two was measured.
+static void bench_sysreg(void)
+{
+    const u64 t0 = guest_read_counter();
+    for (u32 i = 0; i < BENCH_SYSREG_ROUNDS; ++i)
+        (void)guest_read_phys_counter();
+    const u64 ticks = guest_read_counter() - t0;
+    bench_latency("sysreg_cntpct", 0, ticks, BENCH_SYSREG_ROUNDS);
+    const bool native = (guest_pvclock(0)->flags & GUEST_PVCLOCK_F_ECV) != 0;
+    bench_result("sysreg_trapped", 0, "bool", native ? 0 : 1, 0);
+}
+
+// Loads from the MMIO scratch device: a stage-2 translation fault that EL2
+// decodes from the syndrome and emulates.
+static void bench_s2_fault(void)
+{
+    volatile u32 *reg = (volatile u32 *)GUEST_MMIO_SCRATCH_BASE;
+    const u64 t0 = guest_read_counter();
+    for (u32 i = 0; i < BENCH_FAULT_ROUNDS; ++i)
+        (void)reg[0];
+    const u64 ticks = guest_read_counter() - t0;
+    bench_latency("s2_fault_mmio", 0, ticks, BENCH_FAULT_ROUNDS);
+}
+
+// One load per page across working sets from 16 KiB up to BENCH_WS_KB. The
+// guest runs with its MMU off, so once the set outgrows the TLB every load
+// pays a stage-2 walk. The offset within the page rotates so the loads do not
+// all land in one cache set.
+static void bench_tlb(void)
+{
+    u64 max_kb = BENCH_WS_KB;
+    if (max_kb > GUEST_BENCH_SIZE / 1024u)
+        max_kb = GUEST_BENCH_SIZE / 1024u;
+
+    for (u64 kb = BENCH_TLB_MIN_KB; kb <= max_kb; kb *= 2u)
+    {
+        const u64 pages = kb * 1024u / BENCH_PAGE;
+        const u64 passes = pages >= BENCH_TLB_ACCESSES ? 1u : BENCH_TLB_ACCESSES / pages;
+        u64 sum = 0;
+        for (u64 p = 0; p < pages; ++p) // warm the caches
+            sum += *(volatile u64 *)(GUEST_BENCH_BASE + p * BENCH_PAGE + (p % 64u) * 64u);
+
+        const u64 t0 = guest_read_counter();
+        for (u64 pass = 0; pass < passes; ++pass)
+            for (u64 p = 0; p < pages; ++p)
+                sum += *(volatile u64 *)(GUEST_BENCH_BASE + p * BENCH_PAGE + (p % 64u) * 64u);
+        const u64 ticks = guest_read_counter() - t0;
+        (void)sum;
+        bench_latency("tlb", kb, ticks, passes * pages);
+    }
+}
+
+static void bench_memory(void)
+{
+    volatile u64 *buf = (volatile u64 *)GUEST_BENCH_BASE;
+    volatile u64 *dst = (volatile u64 *)(GUEST_BENCH_BASE + BENCH_BW_BYTES);
+    const u64 words = BENCH_BW_BYTES / sizeof(u64);
+
+    u64 t0 = guest_read_counter();
+    for (u64 i = 0; i < words; i += 4)
+    {
+        buf[i] = i;
+        buf[i + 1] = i;
+        buf[i + 2] = i;
+        buf[i + 3] = i;
+    }
+    bench_bandwidth("mem_write", guest_read_counter() - t0, BENCH_BW_BYTES);
+
+    u64 sum = 0;
+    t0 = guest_read_counter();
+    for (u64 i = 0; i < words; i += 4)
+        sum += buf[i] + buf[i + 1] + buf[i + 2] + buf[i + 3];
+    bench_bandwidth("mem_read", guest_read_counter() - t0, BENCH_BW_BYTES);
+    (void)sum;
+
+    t0 = guest_read_counter();
+    for (u64 i = 0; i < words; i += 4)
+    {
+        dst[i] = buf[i];
+        dst[i + 1] = buf[i + 1];
+        dst[i + 2] = buf[i + 2];
+        dst[i + 3] = buf[i + 3];
+    }
+    bench_bandwidth("mem_copy", guest_read_counter() - t0, BENCH_BW_BYTES);
+}
+
+// Fork the VM, both vCPUs, from its warm state: the cost per clone against
+// the time the VM took to get here from its creation. Every page the suite
+// writes afterwards is copy-on-write, so the first store to each takes a
+// stage-2 permission fault. The clones' suite vCPU sleeps for good.
+static void bench_vm_clone(void)
+{
+    const struct guest_smccc_res res = guest_vm_clone(BENCH_CLONES);
+    if (res.a0 == SMCCC_RET_SUCCESS && res.a1 == 0)
+        for (;;)
+            guest_yield();
+    if (res.a0 != SMCCC_RET_SUCCESS)
+    {
+        bench_result("vm_clones", 0, "count", 0, 0);
+        return;
+    }
+    bench_result("vm_clones", 0, "count", res.a1, 0);
+    bench_latency("vm_clone", 0, res.a2, 1);
+    bench_latency("vm_cold_boot", 0, res.a3, 1);
+
+    volatile u64 *buf = (volatile u64 *)GUEST_BENCH_BASE;
+    const u64 t0 = guest_read_counter();
+    for (u64 p = 0; p < BENCH_COW_PAGES; ++p)
+        buf[p * (BENCH_PAGE / sizeof(u64))] = p;
+    bench_latency("cow_fault", 0, guest_read_counter() - t0, BENCH_COW_PAGES);
+}
+
+void guest_bench_os(u64 guest_id)
+{
+    (void)guest_id;
+    bench_freq = guest_read_frequency();
+    bench_result("cntfrq", 0, "Hz", bench_freq, 0);
+
+    const u64 hvc_ticks = bench_hvc_null();
+    bench_world_switch(hvc_ticks);
+    bench_sysreg();
+    bench_s2_fault();
+    bench_tlb();
+    bench_memory();
+    bench_vm_clone();
+
+    bench_result("done", 0, "-", 1, 0);
+    guest_task_flush(0);
+    guest_smccc(PSCI_SYSTEM_OFF, 0, 0, 0);
+    for (;;)
+        guest_yield();
+}
+
+// vCPU 1: hand the CPU straight back to the suite whenever it gets it.
+void guest_bench_peer(u64 guest_id)
+{
+    (void)guest_id;
+    for (;;)
+        guest_yield_to(0);
+}
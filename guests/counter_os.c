@@ -1,25 +1,31 @@
+#include <stddef.h>
 #include "guest_stubs.h"
 #include "guest_tasks.h"
+#include "guest_poll.h"
 
+// Fields of this guest's telemetry record.
 enum
 {
-    COUNTER_SLOT_ID = 0,
-    COUNTER_SLOT_EL = 1,
-    COUNTER_SLOT_SP = 2,
-    COUNTER_SLOT_REGION = 3,
-    COUNTER_SLOT_COUNTER = 4,
-    COUNTER_SLOT_ITER = 5,
-    COUNTER_SLOT_TIME_BEFORE = 12,
-    COUNTER_SLOT_TIME_AFTER = 13,
-    COUNTER_SLOT_TIME_TARGET = 14,
+    COUNTER_FIELD_ID = 0,
+    COUNTER_FIELD_EL = 1,
+    COUNTER_FIELD_SP = 2,
+    COUNTER_FIELD_REGION = 3,
+    COUNTER_FIELD_COUNTER = 4,
+    COUNTER_FIELD_ITER = 5,
+    COUNTER_FIELD_TIME_BEFORE = 6,
+    COUNTER_FIELD_TIME_AFTER = 7,
+    COUNTER_FIELD_TIME_TARGET = 8,
 };
 
 static void run_isolation_tests(u64 guest_id)
 {
-    guest_log_value(COUNTER_SLOT_ID, guest_id);
-    guest_log_value(COUNTER_SLOT_EL, guest_read_current_el());
-    guest_log_value(COUNTER_SLOT_SP, guest_read_sp());
-    guest_log_value(COUNTER_SLOT_REGION, (u64)guest_private_region(guest_id));
+    volatile struct guest_telemetry *t = guest_telemetry(guest_id);
+    guest_telemetry_begin(t);
+    t->field[COUNTER_FIELD_ID] = guest_id;
+    t->field[COUNTER_FIELD_EL] = guest_read_current_el();
+    t->field[COUNTER_FIELD_SP] = guest_read_sp();
+    t->field[COUNTER_FIELD_REGION] = (u64)guest_private_region(guest_id);
+    guest_telemetry_end(t);
 
     volatile u64 *region = guest_private_region(guest_id);
     const u64 pattern = 0xC0DE0000ull | guest_id;
@@ -28,34 +34,53 @@ static void run_isolation_tests(u64 guest_id)
 
 void guest_counter_os(u64 guest_id)
 {
+    guest_irq_init(guest_id);
     run_isolation_tests(guest_id);
+    guest_task_report_bench(guest_id);
+    guest_task_timer_bench(guest_id);
+    guest_task_lock_bench(guest_id);
+    guest_task_irq_bench(guest_id);
+    guest_task_pmu_profile(guest_id);
+    guest_task_mmio_bench(guest_id);
+    guest_task_net_bench(guest_id);
+    guest_task_chan_bench(guest_id);
+    guest_poll_puts(guest_id, "counter_os: exit-less console via polling core\n");
 
+    volatile struct pv_time_stolen *steal = guest_steal_time();
+    volatile struct guest_telemetry *tlm = guest_telemetry(guest_id);
     struct guest_task_result result;
     u64 iteration = 0;
     while (1)
     {
         guest_task_counter(guest_id, &result);
-        guest_log_value(COUNTER_SLOT_COUNTER, result.data0);
-        guest_log_value(COUNTER_SLOT_ITER, iteration);
+        guest_telemetry_begin(tlm);
+        tlm->field[COUNTER_FIELD_COUNTER] = result.data0;
+        tlm->field[COUNTER_FIELD_ITER] = iteration;
+        guest_telemetry_end(tlm);
 
         if (iteration == 8)
         {
+            // One update, so the sampler never sees before/target without after.
+            guest_telemetry_begin(tlm);
             u64 before = guest_read_counter();
             u64 target = before + 0x100000ull;
-            guest_log_value(COUNTER_SLOT_TIME_BEFORE, before);
-            guest_log_value(COUNTER_SLOT_TIME_TARGET, target);
+            tlm->field[COUNTER_FIELD_TIME_BEFORE] = before;
+            tlm->field[COUNTER_FIELD_TIME_TARGET] = target;
+            // One exit to rebase; the read-back goes through the clock page.
             guest_set_virtual_time(target);
-            u64 after = guest_read_counter();
-            guest_log_value(COUNTER_SLOT_TIME_AFTER, after);
+            u64 after = guest_pvclock_read(guest_id, NULL);
+            tlm->field[COUNTER_FIELD_TIME_AFTER] = after;
+            guest_telemetry_end(tlm);
             result.time_before = before;
             result.time_target = target;
             result.time_after = after;
         }
 
+        if (steal)
+            result.stolen_ns = steal->stolen_time;
         guest_task_report(guest_id, &result);
 
         iteration++;
-        guest_delay(10000);
-        guest_yield();
+        guest_sleep_ticks(guest_read_frequency() / 100); // 10 ms; blocks instead of spinning
     }
 }
@@ -0,0 +1,183 @@
+#include <stddef.h>
+#include "guest_blk.h"
+
+// Layout of GUEST_BLK_BASE. The guest runs with its MMU off, so every access
+// here is Device memory: keep fields naturally aligned.
+#define BLK_DESC_OFF     0x00000ull
+#define BLK_AVAIL_OFF    0x00400ull
+#define BLK_USED_OFF     0x01000ull
+#define BLK_INDIRECT_OFF 0x02000ull  // 3 descriptors per batch slot
+#define BLK_HDR_OFF      0x03000ull  // struct virtio_blk_req_hdr per slot
+#define BLK_STATUS_OFF   0x03400ull  // one status byte per slot
+#define BLK_BUF_OFF      0x10000ull  // GUEST_BLK_BUF_BYTES per slot
+
+#define BLK_REG(off) (blk->regs[(off) / sizeof(u32)])
+
+static inline void *blk_area(u64 off)
+{
+    return (void *)(GUEST_BLK_BASE + off);
+}
+
+void *guest_blk_buffer(u32 slot)
+{
+    return blk_area(BLK_BUF_OFF + (u64)slot * GUEST_BLK_BUF_BYTES);
+}
+
+static void blk_set_addr(struct guest_blk *blk, u32 low, u32 high, u64 addr)
+{
+    BLK_REG(low) = (u32)addr;
+    BLK_REG(high) = (u32)(addr >> 32);
+}
+
+bool guest_blk_init(struct guest_blk *blk)
+{
+    blk->regs = (volatile u32 *)GUEST_VIRTIO_BLK_BASE;
+    if (BLK_REG(VIRTIO_MMIO_MAGIC_VALUE) != VIRTIO_MMIO_MAGIC ||
+        BLK_REG(VIRTIO_MMIO_VERSION) != VIRTIO_MMIO_VERSION_2 ||
+        BLK_REG(VIRTIO_MMIO_DEVICE_ID) != VIRTIO_ID_BLOCK)
+        return false;
+
+    BLK_REG(VIRTIO_MMIO_STATUS) = 0;
+    BLK_REG(VIRTIO_MMIO_STATUS) = VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER;
+
+    BLK_REG(VIRTIO_MMIO_DEVICE_FEATURES_SEL) = 0;
+    u64 offered = BLK_REG(VIRTIO_MMIO_DEVICE_FEATURES);
+    BLK_REG(VIRTIO_MMIO_DEVICE_FEATURES_SEL) = 1;
+    offered |= (u64)BLK_REG(VIRTIO_MMIO_DEVICE_FEATURES) << 32;
+    const u64 wanted = (1ull << VIRTIO_F_VERSION_1) | (1ull << VIRTIO_RING_F_INDIRECT_DESC) |
+                       (1ull << VIRTIO_RING_F_EVENT_IDX);
+    const u64 features = offered & wanted;
+    if (!(features & (1ull << VIRTIO_F_VERSION_1)))
+        return false;
+    BLK_REG(VIRTIO_MMIO_DRIVER_FEATURES_SEL) = 0;
+    BLK_REG(VIRTIO_MMIO_DRIVER_FEATURES) = (u32)features;
+    BLK_REG(VIRTIO_MMIO_DRIVER_FEATURES_SEL) = 1;
+    BLK_REG(VIRTIO_MMIO_DRIVER_FEATURES) = (u32)(features >> 32);
+    BLK_REG(VIRTIO_MMIO_STATUS) = VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER |
+                                  VIRTIO_STATUS_FEATURES_OK;
+    if (!(BLK_REG(VIRTIO_MMIO_STATUS) & VIRTIO_STATUS_FEATURES_OK))
+        return false;
+    blk->indirect = (features & (1ull << VIRTIO_RING_F_INDIRECT_DESC)) != 0;
+    blk->event_idx = (features & (1ull << VIRTIO_RING_F_EVENT_IDX)) != 0;
+
+    BLK_REG(VIRTIO_MMIO_QUEUE_SEL) = 0;
+    if (BLK_REG(VIRTIO_MMIO_QUEUE_NUM_MAX) < GUEST_BLK_QUEUE_NUM)
+        return false;
+    blk->desc = blk_area(BLK_DESC_OFF);
+    blk->avail = blk_area(BLK_AVAIL_OFF);
+    blk->used = blk_area(BLK_USED_OFF);
+    volatile u64 *ring = blk_area(0);
+    for (u64 i = 0; i < BLK_INDIRECT_OFF / sizeof(u64); ++i)
+        ring[i] = 0;
+    BLK_REG(VIRTIO_MMIO_QUEUE_NUM) = GUEST_BLK_QUEUE_NUM;
+    blk_set_addr(blk, VIRTIO_MMIO_QUEUE_DESC_LOW, VIRTIO_MMIO_QUEUE_DESC_HIGH,
+                 GUEST_BLK_BASE + BLK_DESC_OFF);
+    blk_set_addr(blk, VIRTIO_MMIO_QUEUE_DRIVER_LOW, VIRTIO_MMIO_QUEUE_DRIVER_HIGH,
+                 GUEST_BLK_BASE + BLK_AVAIL_OFF);
+    blk_set_addr(blk, VIRTIO_MMIO_QUEUE_DEVICE_LOW, VIRTIO_MMIO_QUEUE_DEVICE_HIGH,
+                 GUEST_BLK_BASE + BLK_USED_OFF);
+    BLK_REG(VIRTIO_MMIO_QUEUE_READY) = 1;
+    if (!BLK_REG(VIRTIO_MMIO_QUEUE_READY))
+        return false;
+
+    blk->capacity = BLK_REG(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_CAPACITY) |
+                    ((u64)BLK_REG(VIRTIO_MMIO_CONFIG + VIRTIO_BLK_CFG_CAPACITY + 4) << 32);
+    blk->avail_idx = 0;
+    blk->kicked_idx = 0;
+    blk->batch = 0;
+    blk->kicks = 0;
+    BLK_REG(VIRTIO_MMIO_STATUS) = VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER |
+                                  VIRTIO_STATUS_FEATURES_OK | VIRTIO_STATUS_DRIVER_OK;
+    return true;
+}
+
+static void blk_set_desc(volatile struct virtq_desc *d, u64 addr, u32 len, u16 flags, u16 next)
+{
+    d->addr = addr;
+    d->len = len;
+    d->flags = flags;
+    d->next = next;
+}
+
+bool guest_blk_queue(struct guest_blk *blk, u32 type, u64 sector, u32 len)
+{
+    const u32 slot = blk->batch;
+    if (slot >= GUEST_BLK_BATCH_MAX || len > GUEST_BLK_BUF_BYTES)
+        return false;
+
+    volatile struct virtio_blk_req_hdr *hdr = blk_area(BLK_HDR_OFF + slot * sizeof(*hdr));
+    hdr->type = type;
+    hdr->reserved = 0;
+    hdr->sector = sector;
+    volatile u8 *status = blk_area(BLK_STATUS_OFF + slot);
+    *status = 0xFF;
+
+    const u16 data_flags = type == VIRTIO_BLK_T_OUT ? 0 : VIRTQ_DESC_F_WRITE;
+    const u64 hdr_pa = (u64)hdr;
+    const u64 buf_pa = (u64)guest_blk_buffer(slot);
+    const u64 st_pa = (u64)status;
+    u16 head;
+    if (blk->indirect) {
+        volatile struct virtq_desc *t = blk_area(BLK_INDIRECT_OFF + slot * 3 * sizeof(*t));
+        blk_set_desc(&t[0], hdr_pa, sizeof(*hdr), VIRTQ_DESC_F_NEXT, 1);
+        blk_set_desc(&t[1], buf_pa, len, data_flags | VIRTQ_DESC_F_NEXT, 2);
+        blk_set_desc(&t[2], st_pa, 1, VIRTQ_DESC_F_WRITE, 0);
+        head = (u16)slot;
+        blk_set_desc(&blk->desc[head], (u64)t, 3 * sizeof(*t), VIRTQ_DESC_F_INDIRECT, 0);
+    } else {
+        head = (u16)(slot * 3);
+        volatile struct virtq_desc *d = &blk->desc[head];
+        blk_set_desc(&d[0], hdr_pa, sizeof(*hdr), VIRTQ_DESC_F_NEXT, head + 1);
+        blk_set_desc(&d[1], buf_pa, len, data_flags | VIRTQ_DESC_F_NEXT, head + 2);
+        blk_set_desc(&d[2], st_pa, 1, VIRTQ_DESC_F_WRITE, 0);
+    }
+    volatile u16 *ring = blk->avail->ring;
+    ring[blk->avail_idx % GUEST_BLK_QUEUE_NUM] = head;
+    blk->avail_idx++;
+    blk->batch++;
+    return true;
+}
+
+u32 guest_blk_submit(struct guest_blk *blk)
+{
+    if (!blk->batch)
+        return 0;
+
+    volatile struct virtq_avail *avail = blk->avail;
+    volatile struct virtq_used *used = blk->used;
+    const u16 old = blk->kicked_idx;
+    const u16 now = blk->avail_idx;
+    // One interrupt when the last request of the batch completes.
+    if (blk->event_idx)
+        *virtq_used_event(blk->avail, GUEST_BLK_QUEUE_NUM) = (u16)(now - 1u);
+    asm volatile("dmb ishst" ::: "memory"); // descriptors before the index
+    avail->idx = now;
+    asm volatile("dmb ish" ::: "memory");
+
+    bool kick;
+    if (blk->event_idx)
+        kick = virtq_need_event(*virtq_avail_event(blk->used, GUEST_BLK_QUEUE_NUM), now, old);
+    else
+        kick = (used->flags & VIRTQ_USED_F_NO_NOTIFY) == 0;
+    blk->kicked_idx = now;
+    if (kick) {
+        BLK_REG(VIRTIO_MMIO_QUEUE_NOTIFY) = 0;
+        blk->kicks++;
+    }
+
+    while (used->idx != now)
+        guest_yield();
+    asm volatile("dmb ishld" ::: "memory");
+
+    u32 failed = 0;
+    for (u32 slot = 0; slot < blk->batch; ++slot)
+        if (*(volatile u8 *)blk_area(BLK_STATUS_OFF + slot) != VIRTIO_BLK_S_OK)
+            failed++;
+    blk->batch = 0;
+    return failed;
+}
+
+void guest_blk_reset(struct guest_blk *blk)
+{
+    BLK_REG(VIRTIO_MMIO_STATUS) = 0;
+}
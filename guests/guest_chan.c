@@ -0,0 +1,116 @@
+#include <stddef.h>
+#include "guest_chan.h"
+
+// Backstop for a doorbell lost to a race with the peer's flag check.
+#define CHAN_WAIT_HZ 100u
+
+void guest_chan_init(struct guest_chan *ch, u64 guest_id)
+{
+    ch->tx = guest_chan_ring(guest_id);
+    ch->rx = guest_chan_ring(guest_id ^ 1u);
+    ch->peer = guest_id ^ 1u;
+    ch->head = ch->tx->head;
+    ch->tail = ch->rx->tail;
+    ch->rx_rung = ch->tx->tail - 1u;
+    ch->tx_rung = ch->rx->head - 1u;
+    ch->doorbells = 0;
+    ch->waits = 0;
+}
+
+static void chan_copy(volatile struct guest_chan_msg *dst, const volatile struct guest_chan_msg *src)
+{
+    for (u32 i = 0; i < 8; ++i)
+        dst->w[i] = src->w[i];
+}
+
+bool guest_chan_send(struct guest_chan *ch, const struct guest_chan_msg *msg)
+{
+    if (ch->head - ch->tx->tail >= GUEST_CHAN_ENTRIES)
+        return false;
+    chan_copy(&ch->tx->entries[ch->head % GUEST_CHAN_ENTRIES], msg);
+    ch->head++;
+    return true;
+}
+
+void guest_chan_flush(struct guest_chan *ch)
+{
+    struct guest_chan_ring *ring = ch->tx;
+    asm volatile("dmb ishst" ::: "memory"); // messages before the index
+    ring->head = ch->head;
+    asm volatile("dmb ish" ::: "memory");   // index before the consumer's flag
+    if (!ring->consumer_wait)
+        return;
+    // Once rung, the consumer must move tail before it can sleep again.
+    const u32 tail = ring->tail;
+    if (tail == ch->rx_rung)
+        return;
+    ch->rx_rung = tail;
+    guest_chan_doorbell(ch->peer);
+    ch->doorbells++;
+}
+
+bool guest_chan_recv(struct guest_chan *ch, struct guest_chan_msg *msg)
+{
+    if (ch->rx->head == ch->tail)
+        return false;
+    asm volatile("dmb ishld" ::: "memory");
+    chan_copy(msg, &ch->rx->entries[ch->tail % GUEST_CHAN_ENTRIES]);
+    ch->tail++;
+    return true;
+}
+
+void guest_chan_release(struct guest_chan *ch)
+{
+    struct guest_chan_ring *ring = ch->rx;
+    asm volatile("dmb ish" ::: "memory");   // finish reading slots before handing them back
+    ring->tail = ch->tail;
+    asm volatile("dmb ish" ::: "memory");
+    if (!ring->producer_wait)
+        return;
+    const u32 head = ring->head;
+    if (head == ch->tx_rung)
+        return;
+    ch->tx_rung = head;
+    guest_chan_doorbell(ch->peer);
+    ch->doorbells++;
+}
+
+// Raise `flag`, then re-check `ready` so a publish racing with the flag store
+// is never missed: the peer stores its index before it loads the flag.
+static void chan_sleep(struct guest_chan *ch, volatile u32 *flag,
+                       bool (*ready)(const struct guest_chan *))
+{
+    const u64 timeout = guest_read_frequency() / CHAN_WAIT_HZ;
+    while (!ready(ch))
+    {
+        *flag = 1;
+        asm volatile("dmb ish" ::: "memory");
+        if (ready(ch))
+            break;
+        ch->waits++;
+        guest_wait_doorbell(timeout);
+    }
+    *flag = 0;
+}
+
+static bool chan_rx_ready(const struct guest_chan *ch)
+{
+    return ch->rx->head != ch->tail;
+}
+
+static bool chan_tx_ready(const struct guest_chan *ch)
+{
+    return ch->head - ch->tx->tail < GUEST_CHAN_ENTRIES;
+}
+
+void guest_chan_wait_rx(struct guest_chan *ch)
+{
+    guest_chan_release(ch); // a producer waiting for space must hear of it first
+    chan_sleep(ch, &ch->rx->consumer_wait, chan_rx_ready);
+}
+
+void guest_chan_wait_tx(struct guest_chan *ch)
+{
+    guest_chan_flush(ch);
+    chan_sleep(ch, &ch->tx->producer_wait, chan_tx_ready);
+}
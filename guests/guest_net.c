@@ -0,0 +1,206 @@
+#include <stddef.h>
+#include "guest_net.h"
+
+// Layout of this guest's GUEST_NET_STRIDE slot. Everything the switch may
+// flip sits at or above GUEST_NET_PAGES_OFF.
+#define NET_RX_DESC_OFF  0x00000ull
+#define NET_RX_AVAIL_OFF 0x00400ull
+#define NET_RX_USED_OFF  0x01000ull
+#define NET_TX_DESC_OFF  0x02000ull
+#define NET_TX_AVAIL_OFF 0x02400ull
+#define NET_TX_USED_OFF  0x03000ull
+#define NET_RX_HDR_OFF   0x04000ull  // 16 bytes per buffer
+#define NET_TX_HDR_OFF   0x04200ull
+#define NET_RX_PAGE_OFF  GUEST_NET_PAGES_OFF
+#define NET_TX_PAGE_OFF  (GUEST_NET_PAGES_OFF + GUEST_NET_BUFS * GUEST_NET_BUF_BYTES)
+
+#define NET_REG(off) (net->regs[(off) / sizeof(u32)])
+#define NET_HDR_LEN  ((u32)sizeof(struct virtio_net_hdr))
+
+static inline void *net_area(const struct guest_net *net, u64 off)
+{
+    return (void *)(net->base + off);
+}
+
+void *guest_net_tx_buffer(struct guest_net *net, u32 slot)
+{
+    return net_area(net, NET_TX_PAGE_OFF + (u64)slot * GUEST_NET_BUF_BYTES);
+}
+
+static void *net_rx_buffer(struct guest_net *net, u32 slot)
+{
+    return net_area(net, NET_RX_PAGE_OFF + (u64)slot * GUEST_NET_BUF_BYTES);
+}
+
+static void net_set_addr(struct guest_net *net, u32 low, u64 addr)
+{
+    NET_REG(low) = (u32)addr;
+    NET_REG(low + 4u) = (u32)(addr >> 32);
+}
+
+static bool net_setup_queue(struct guest_net *net, struct guest_net_queue *q, u32 index,
+                            u64 desc_off, u64 avail_off, u64 used_off)
+{
+    NET_REG(VIRTIO_MMIO_QUEUE_SEL) = index;
+    if (NET_REG(VIRTIO_MMIO_QUEUE_NUM_MAX) < GUEST_NET_QUEUE_NUM)
+        return false;
+    q->desc = net_area(net, desc_off);
+    q->avail = net_area(net, avail_off);
+    q->used = net_area(net, used_off);
+    q->avail_idx = 0;
+    q->kicked_idx = 0;
+    q->last_used = 0;
+    NET_REG(VIRTIO_MMIO_QUEUE_NUM) = GUEST_NET_QUEUE_NUM;
+    net_set_addr(net, VIRTIO_MMIO_QUEUE_DESC_LOW, net->base + desc_off);
+    net_set_addr(net, VIRTIO_MMIO_QUEUE_DRIVER_LOW, net->base + avail_off);
+    net_set_addr(net, VIRTIO_MMIO_QUEUE_DEVICE_LOW, net->base + used_off);
+    NET_REG(VIRTIO_MMIO_QUEUE_READY) = 1;
+    return NET_REG(VIRTIO_MMIO_QUEUE_READY) != 0;
+}
+
+static void net_set_desc(volatile struct virtq_desc *d, u64 addr, u32 len, u16 flags, u16 next)
+{
+    d->addr = addr;
+    d->len = len;
+    d->flags = flags;
+    d->next = next;
+}
+
+// Buffer `buf` of a queue: descriptor 2*buf is the header, 2*buf+1 the page.
+static void net_add_buf(struct guest_net_queue *q, u32 buf, u64 hdr, u64 page, u32 len, u16 dir)
+{
+    volatile struct virtq_desc *d = &q->desc[2u * buf];
+    net_set_desc(&d[0], hdr, NET_HDR_LEN, dir | VIRTQ_DESC_F_NEXT, (u16)(2u * buf + 1u));
+    net_set_desc(&d[1], page, len, dir, 0);
+    volatile u16 *ring = q->avail->ring;
+    ring[q->avail_idx % GUEST_NET_QUEUE_NUM] = (u16)(2u * buf);
+    q->avail_idx++;
+}
+
+bool guest_net_init(struct guest_net *net, u64 guest_id)
+{
+    net->regs = (volatile u32 *)(GUEST_VIRTIO_NET_BASE + guest_id * GUEST_VIRTIO_NET_STRIDE);
+    net->base = GUEST_NET_BASE + guest_id * GUEST_NET_STRIDE;
+    net->kicks = 0;
+    if (guest_id >= GUEST_NET_PORTS ||
+        NET_REG(VIRTIO_MMIO_MAGIC_VALUE) != VIRTIO_MMIO_MAGIC ||
+        NET_REG(VIRTIO_MMIO_VERSION) != VIRTIO_MMIO_VERSION_2 ||
+        NET_REG(VIRTIO_MMIO_DEVICE_ID) != VIRTIO_ID_NET)
+        return false;
+
+    NET_REG(VIRTIO_MMIO_STATUS) = 0;
+    NET_REG(VIRTIO_MMIO_STATUS) = VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER;
+    NET_REG(VIRTIO_MMIO_DEVICE_FEATURES_SEL) = 0;
+    u64 offered = NET_REG(VIRTIO_MMIO_DEVICE_FEATURES);
+    NET_REG(VIRTIO_MMIO_DEVICE_FEATURES_SEL) = 1;
+    offered |= (u64)NET_REG(VIRTIO_MMIO_DEVICE_FEATURES) << 32;
+    const u64 features = offered & ((1ull << VIRTIO_F_VERSION_1) |
+                                    (1ull << VIRTIO_RING_F_EVENT_IDX) |
+                                    (1ull << VIRTIO_NET_F_MAC));
+    if (!(features & (1ull << VIRTIO_F_VERSION_1)))
+        return false;
+    NET_REG(VIRTIO_MMIO_DRIVER_FEATURES_SEL) = 0;
+    NET_REG(VIRTIO_MMIO_DRIVER_FEATURES) = (u32)features;
+    NET_REG(VIRTIO_MMIO_DRIVER_FEATURES_SEL) = 1;
+    NET_REG(VIRTIO_MMIO_DRIVER_FEATURES) = (u32)(features >> 32);
+    NET_REG(VIRTIO_MMIO_STATUS) = VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER |
+                                  VIRTIO_STATUS_FEATURES_OK;
+    if (!(NET_REG(VIRTIO_MMIO_STATUS) & VIRTIO_STATUS_FEATURES_OK))
+        return false;
+    net->event_idx = (features & (1ull << VIRTIO_RING_F_EVENT_IDX)) != 0;
+
+    if (features & (1ull << VIRTIO_NET_F_MAC)) {
+        volatile u8 *cfg = (volatile u8 *)net->regs + VIRTIO_MMIO_CONFIG + VIRTIO_NET_CFG_MAC;
+        for (u32 i = 0; i < VIRTIO_NET_ETH_ALEN; ++i)
+            net->mac[i] = cfg[i];
+    } else {
+        guest_net_mac(guest_id, net->mac);
+    }
+
+    volatile u64 *rings = net_area(net, 0);
+    for (u64 i = 0; i < NET_RX_HDR_OFF / sizeof(u64); ++i)
+        rings[i] = 0;
+    if (!net_setup_queue(net, &net->rx, VIRTIO_NET_Q_RX,
+                         NET_RX_DESC_OFF, NET_RX_AVAIL_OFF, NET_RX_USED_OFF) ||
+        !net_setup_queue(net, &net->tx, VIRTIO_NET_Q_TX,
+                         NET_TX_DESC_OFF, NET_TX_AVAIL_OFF, NET_TX_USED_OFF))
+        return false;
+    NET_REG(VIRTIO_MMIO_STATUS) = VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER |
+                                  VIRTIO_STATUS_FEATURES_OK | VIRTIO_STATUS_DRIVER_OK;
+
+    for (u32 buf = 0; buf < GUEST_NET_BUFS; ++buf)
+        guest_net_recycle(net, buf);
+    guest_net_kick(net, &net->rx, VIRTIO_NET_Q_RX);
+    return true;
+}
+
+void guest_net_queue_tx(struct guest_net *net, u32 slot, u32 len)
+{
+    volatile struct virtio_net_hdr *hdr = net_area(net, NET_TX_HDR_OFF + slot * 16u);
+    hdr->flags = 0;
+    hdr->gso_type = 0;
+    hdr->hdr_len = 0;
+    hdr->gso_size = 0;
+    hdr->csum_start = 0;
+    hdr->csum_offset = 0;
+    hdr->num_buffers = 0;
+    net_add_buf(&net->tx, slot, (u64)hdr, (u64)guest_net_tx_buffer(net, slot), len, 0);
+}
+
+void guest_net_recycle(struct guest_net *net, u32 buf)
+{
+    net_add_buf(&net->rx, buf, net->base + NET_RX_HDR_OFF + buf * 16u,
+                (u64)net_rx_buffer(net, buf), GUEST_NET_BUF_BYTES, VIRTQ_DESC_F_WRITE);
+}
+
+void guest_net_kick(struct guest_net *net, struct guest_net_queue *q, u32 queue)
+{
+    const u16 old = q->kicked_idx;
+    const u16 now = q->avail_idx;
+    if (old == now)
+        return;
+    // Polling driver: keep used_event one behind so no interrupt is due.
+    if (net->event_idx)
+        *virtq_used_event(q->avail, GUEST_NET_QUEUE_NUM) = (u16)(q->last_used - 1u);
+    asm volatile("dmb ishst" ::: "memory"); // descriptors before the index
+    ((volatile struct virtq_avail *)q->avail)->idx = now;
+    asm volatile("dmb ish" ::: "memory");
+
+    bool kick;
+    if (net->event_idx)
+        kick = virtq_need_event(*virtq_avail_event(q->used, GUEST_NET_QUEUE_NUM), now, old);
+    else
+        kick = (((volatile struct virtq_used *)q->used)->flags & VIRTQ_USED_F_NO_NOTIFY) == 0;
+    q->kicked_idx = now;
+    if (kick) {
+        NET_REG(VIRTIO_MMIO_QUEUE_NOTIFY) = queue;
+        net->kicks++;
+    }
+}
+
+bool guest_net_tx_done(struct guest_net *net)
+{
+    const u16 used = ((volatile struct virtq_used *)net->tx.used)->idx;
+    net->tx.last_used = used;
+    return used == net->tx.avail_idx;
+}
+
+void *guest_net_recv(struct guest_net *net, u32 *len, u32 *buf)
+{
+    struct guest_net_queue *q = &net->rx;
+    if (((volatile struct virtq_used *)q->used)->idx == q->last_used)
+        return NULL;
+    asm volatile("dmb ishld" ::: "memory");
+    volatile struct virtq_used_elem *e = &q->used->ring[q->last_used % GUEST_NET_QUEUE_NUM];
+    const u32 id = e->id;
+    const u32 total = e->len;
+    q->last_used++;
+    *buf = id / 2u;
+    *len = total > NET_HDR_LEN ? total - NET_HDR_LEN : 0;
+    return net_rx_buffer(net, id / 2u);
+}
+
+void guest_net_reset(struct guest_net *net)
+{
+    NET_REG(VIRTIO_MMIO_STATUS) = 0;
+}
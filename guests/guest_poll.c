@@ -0,0 +1,72 @@
+#include <stddef.h>
+#include "guest_poll.h"
+
+// Wait for a free slot; the polling core drains continuously so this only
+// spins when more than GUEST_POLL_RING_ENTRIES requests are in flight.
+static struct guest_poll_req* poll_reserve(struct guest_poll_ring *ring)
+{
+    while (ring->head - ring->tail >= GUEST_POLL_RING_ENTRIES)
+        asm volatile("yield" ::: "memory");
+    return &ring->entries[ring->head % GUEST_POLL_RING_ENTRIES];
+}
+
+static u32 poll_submit(struct guest_poll_ring *ring, struct guest_poll_req *req, u32 op)
+{
+    req->op = op;
+    req->submit_time = guest_read_counter();
+    asm volatile("dmb ish" ::: "memory"); // publish the request before the index
+    u32 idx = ring->head;
+    ring->head = idx + 1;
+    return idx;
+}
+
+static void poll_wait(struct guest_poll_ring *ring, u32 idx)
+{
+    while ((s32)(ring->tail - (idx + 1)) < 0)
+        asm volatile("yield" ::: "memory");
+    asm volatile("dmb ish" ::: "memory"); // read results after seeing completion
+}
+
+bool guest_poll_report(u64 guest_id, const struct guest_task_result *res)
+{
+    struct guest_poll_ring *ring = guest_poll_ring(guest_id);
+    if (!ring->online)
+        return false;
+
+    struct guest_poll_req *req = poll_reserve(ring);
+    req->payload.report = *res;
+    poll_submit(ring, req, GUEST_POLL_OP_TASK_REPORT);
+    return true;
+}
+
+bool guest_poll_puts(u64 guest_id, const char *text)
+{
+    struct guest_poll_ring *ring = guest_poll_ring(guest_id);
+    if (!ring->online)
+        return false;
+
+    struct guest_poll_req *req = poll_reserve(ring);
+    size_t i = 0;
+    for (; text[i] && i + 1 < sizeof(req->payload.text); ++i)
+        req->payload.text[i] = text[i];
+    req->payload.text[i] = '\0';
+    req->len = (u32)i;
+    poll_submit(ring, req, GUEST_POLL_OP_CONSOLE);
+    return true;
+}
+
+bool guest_poll_time(u64 guest_id, u64 *counter, u64 *frequency)
+{
+    struct guest_poll_ring *ring = guest_poll_ring(guest_id);
+    if (!ring->online)
+        return false;
+
+    struct guest_poll_req *req = poll_reserve(ring);
+    u32 idx = poll_submit(ring, req, GUEST_POLL_OP_TIME_QUERY);
+    poll_wait(ring, idx);
+    if (counter)
+        *counter = req->ret[0];
+    if (frequency)
+        *frequency = req->ret[1];
+    return true;
+}
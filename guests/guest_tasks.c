@@ -1,5 +1,9 @@
 #include <stddef.h>
 #include "guest_tasks.h"
+#include "guest_poll.h"
+#include "guest_blk.h"
+#include "guest_net.h"
+#include "guest_chan.h"
 
 static void copy_desc(struct guest_task_result *out, const char *msg)
 {
@@ -19,6 +23,7 @@ void guest_task_counter(u64 guest_id, struct guest_task_result *out)
     out->time_after = 0;
     out->time_target = 0;
     out->memwalk_time = 0;
+    out->stolen_ns = 0;
     copy_desc(out, "counter task");
 }
 
@@ -39,13 +44,788 @@ void guest_task_memwalk(u64 guest_id, struct guest_task_result *out)
     out->time_after = 0;
     out->time_target = 0;
     out->memwalk_time = guest_read_counter();
+    out->stolen_ns = 0;
 
     copy_desc(out, "memwalk task");
 }
 
+// Synchronous path: one SMCCC fast call (and exit) per report.
+void guest_task_report_sync(u64 guest_id, const struct guest_task_result *out)
+{
+    (void)guest_id;
+    guest_smccc(SCHISM_HYP_TASK_REPORT, (u64)out, 0, 0);
+}
+
+// Ask EL2 to drain everything queued in our report ring.
+void guest_task_flush(u64 guest_id)
+{
+    struct guest_report_ring *ring = guest_report_ring(guest_id);
+    if (ring->head == ring->tail)
+        return;
+
+    guest_smccc(SCHISM_HYP_RING_DOORBELL, 0, 0, 0);
+}
+
+// Hand the report to the polling core if one is online (no exit at all);
+// otherwise queue it in the shared ring and only exit past the watermark.
 void guest_task_report(u64 guest_id, const struct guest_task_result *out)
 {
-    register u64 x0 asm("x0") = guest_id;
-    register u64 x1 asm("x1") = (u64)out;
-    asm volatile("hvc #0x60" : "+r"(x0), "+r"(x1) :: "memory");
+    if (guest_poll_report(guest_id, out))
+        return;
+
+    struct guest_report_ring *ring = guest_report_ring(guest_id);
+
+    if (ring->head - ring->tail >= GUEST_REPORT_RING_ENTRIES)
+        guest_task_flush(guest_id); // full: EL2 drains before we overwrite a slot
+
+    u32 head = ring->head;
+    ring->entries[head % GUEST_REPORT_RING_ENTRIES] = *out;
+    asm volatile("dmb ish" ::: "memory"); // publish the record before the index
+    ring->head = head + 1;
+
+    if (ring->head - ring->tail >= GUEST_REPORT_RING_WATERMARK)
+        guest_task_flush(guest_id);
+}
+
+#define REPORT_BENCH_ROUNDS 32u
+
+// Give a polling core that is still booting a short grace period (~10 ms).
+static bool wait_poll_online(u64 guest_id)
+{
+    const u64 start = guest_read_counter();
+    const u64 grace = guest_read_frequency() / 100;
+    while (!guest_poll_online(guest_id))
+    {
+        if (guest_read_counter() - start > grace)
+            return false;
+    }
+    return true;
+}
+
+// Compare the per-report cost of the HVC-per-report path with the ring, and
+// with the exit-less polling core when one is online. EL2 prints its
+// exit/record counters on every drain and the polling core its latency, so the
+// exit reduction can be read straight from the log next to these cycle numbers.
+void guest_task_report_bench(u64 guest_id)
+{
+    struct guest_task_result res;
+    guest_task_counter(guest_id, &res);
+    const bool poll = wait_poll_online(guest_id);
+
+    guest_task_flush(guest_id);
+    u64 t0 = guest_read_counter();
+    for (u32 i = 0; i < REPORT_BENCH_ROUNDS; ++i)
+        guest_task_report_sync(guest_id, &res);
+    u64 t1 = guest_read_counter();
+    struct guest_report_ring *ring = guest_report_ring(guest_id);
+    for (u32 i = 0; i < REPORT_BENCH_ROUNDS; ++i)
+    {
+        // Exercise the ring even with a polling core online.
+        u32 head = ring->head;
+        ring->entries[head % GUEST_REPORT_RING_ENTRIES] = res;
+        asm volatile("dmb ish" ::: "memory");
+        ring->head = head + 1;
+        if (ring->head - ring->tail >= GUEST_REPORT_RING_WATERMARK)
+            guest_task_flush(guest_id);
+    }
+    guest_task_flush(guest_id);
+    u64 t2 = guest_read_counter();
+
+    // Same batch as one multicall: one exit for all REPORT_BENCH_ROUNDS reports.
+    struct smccc_multicall_op ops[REPORT_BENCH_ROUNDS];
+    for (u32 i = 0; i < REPORT_BENCH_ROUNDS; ++i)
+    {
+        ops[i].fid = SCHISM_HYP_TASK_REPORT;
+        ops[i].args[0] = (u64)&res;
+        for (u32 a = 1; a < 6; ++a)
+            ops[i].args[a] = 0;
+    }
+    u64 t2m = guest_read_counter();
+    guest_multicall(ops, REPORT_BENCH_ROUNDS);
+    u64 t3m = guest_read_counter();
+
+    struct guest_task_result out = res;
+    out.data0 = (t1 - t0) / REPORT_BENCH_ROUNDS; // ticks per report, HVC path
+    out.data1 = (t2 - t1) / REPORT_BENCH_ROUNDS; // ticks per report, ring path
+    out.time_target = (t3m - t2m) / REPORT_BENCH_ROUNDS; // ticks per report, multicall
+    copy_desc(&out, "report bench hvc/ring/mcall");
+    guest_task_report(guest_id, &out);
+    guest_task_flush(guest_id);
+    out.time_target = 0;
+
+    if (!poll)
+        return;
+
+    u64 t3 = guest_read_counter();
+    for (u32 i = 0; i < REPORT_BENCH_ROUNDS; ++i)
+        guest_poll_report(guest_id, &res);
+    u64 t4 = guest_read_counter();
+    for (u32 i = 0; i < REPORT_BENCH_ROUNDS; ++i)
+        guest_poll_time(guest_id, NULL, NULL);
+    u64 t5 = guest_read_counter();
+
+    out.data0 = (t4 - t3) / REPORT_BENCH_ROUNDS; // ticks per report, polling core
+    out.data1 = (t5 - t4) / REPORT_BENCH_ROUNDS; // ticks per time-query round trip
+    copy_desc(&out, "report bench poll/time");
+    guest_task_report(guest_id, &out);
+}
+
+#define TIMER_BENCH_ROUNDS 64u
+
+// Cost of the physical counter and timer registers, which trap to EL2 without
+// FEAT_ECV and run natively with it, against the host count derived from the
+// paravirtual clock page, which never exits. EL2 logs its sysreg exit count on
+// each yield, so the trap reduction shows up next to these per-access numbers.
+void guest_task_timer_bench(u64 guest_id)
+{
+    struct guest_task_result out;
+    guest_task_counter(guest_id, &out);
+
+    u64 t0 = guest_read_counter();
+    for (u32 i = 0; i < TIMER_BENCH_ROUNDS; ++i)
+        (void)guest_read_phys_counter();
+    u64 t1 = guest_read_counter();
+    for (u32 i = 0; i < TIMER_BENCH_ROUNDS; ++i)
+    {
+        u64 cval;
+        asm volatile("mrs %0, cntp_cval_el0" : "=r"(cval));
+        (void)cval;
+    }
+    u64 t2 = guest_read_counter();
+    for (u32 i = 0; i < TIMER_BENCH_ROUNDS; ++i)
+        (void)guest_read_host_counter(guest_id);
+    u64 t3 = guest_read_counter();
+
+    out.data0 = (t1 - t0) / TIMER_BENCH_ROUNDS; // ticks per CNTPCT read
+    out.data1 = (t2 - t1) / TIMER_BENCH_ROUNDS; // ticks per CNTP_CVAL read
+    out.time_target = (t3 - t2) / TIMER_BENCH_ROUNDS; // ticks per clock-page read
+    copy_desc(&out, "timer bench pct/pcval/pvclk");
+    guest_task_report(guest_id, &out);
+    guest_task_flush(guest_id);
+}
+
+#define LOCK_BENCH_PARTIES  2u    // counter_os and memwalk_os
+#define LOCK_BENCH_ROUNDS   128u
+#define LOCK_BENCH_HOLD     4000u // critical section, in delay-loop iterations
+#define LOCK_PV_SPIN_BATCH  64u   // spins before the PV path names the holder
+#define LOCK_NO_HOLDER      0u    // holder field is vCPU id + 1
+
+enum lock_bench_mode
+{
+    LOCK_MODE_SPIN,
+    LOCK_MODE_WFE,
+    LOCK_MODE_PV,
+    LOCK_MODE_COUNT,
+};
+
+// Lives at GUEST_LOCK_BASE so both guests contend on the same ticket lock.
+struct guest_lock_page
+{
+    u32 next;      // next ticket to hand out
+    u32 owner;     // ticket currently allowed in
+    u32 holder;    // vCPU id + 1 inside the critical section, 0 if free
+    u32 arrived;   // phase barrier
+};
+
+static inline volatile struct guest_lock_page* guest_lock_page(void)
+{
+    return (volatile struct guest_lock_page*)GUEST_LOCK_BASE;
+}
+
+// Both guests run every phase together. Waiting is a plain WFI yield so the
+// other guest gets to reach the barrier.
+static void lock_bench_barrier(volatile struct guest_lock_page *lk, u32 phase)
+{
+    __atomic_fetch_add(&lk->arrived, 1u, __ATOMIC_ACQ_REL);
+    while (__atomic_load_n(&lk->arrived, __ATOMIC_ACQUIRE) < (phase + 1u) * LOCK_BENCH_PARTIES)
+        guest_yield();
+}
+
+// Ticket lock acquire; returns the number of spin iterations.
+static u64 lock_bench_acquire(volatile struct guest_lock_page *lk, u64 guest_id,
+                              enum lock_bench_mode mode)
+{
+    const u32 ticket = __atomic_fetch_add(&lk->next, 1u, __ATOMIC_RELAXED);
+    u64 spins = 0;
+    while (__atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE) != ticket)
+    {
+        ++spins;
+        switch (mode)
+        {
+        case LOCK_MODE_SPIN:
+            asm volatile("yield" ::: "memory");
+            break;
+        case LOCK_MODE_WFE:
+            asm volatile("wfe" ::: "memory");
+            break;
+        case LOCK_MODE_PV:
+            if (spins % LOCK_PV_SPIN_BATCH == 0)
+            {
+                const u32 holder = __atomic_load_n(&lk->holder, __ATOMIC_RELAXED);
+                if (holder != LOCK_NO_HOLDER)
+                    guest_yield_to(holder - 1u);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    __atomic_store_n(&lk->holder, (u32)guest_id + 1u, __ATOMIC_RELAXED);
+    return spins;
+}
+
+static void lock_bench_release(volatile struct guest_lock_page *lk)
+{
+    __atomic_store_n(&lk->holder, LOCK_NO_HOLDER, __ATOMIC_RELAXED);
+    __atomic_store_n(&lk->owner, lk->owner + 1u, __ATOMIC_RELEASE);
+    asm volatile("sev" ::: "memory");
+}
+
+// Lock-holder preemption: both guests hammer one ticket lock while the EL2
+// time slice preempts whoever holds it. Waiters spin, wait in WFE (EL2 turns
+// repeated WFE exits into a directed yield to the preempted holder) or name
+// the holder through SCHISM_HYP_YIELD_TO. Reports the average wait in the
+// waiter's own virtual ticks and the average spin count per acquisition.
+void guest_task_lock_bench(u64 guest_id)
+{
+    volatile struct guest_lock_page *lk = guest_lock_page();
+    u64 wait[LOCK_MODE_COUNT];
+    u64 spins[LOCK_MODE_COUNT];
+
+    for (u32 mode = 0; mode < LOCK_MODE_COUNT; ++mode)
+    {
+        lock_bench_barrier(lk, mode);
+
+        wait[mode] = 0;
+        spins[mode] = 0;
+        for (u32 i = 0; i < LOCK_BENCH_ROUNDS; ++i)
+        {
+            const u64 t0 = guest_read_counter();
+            spins[mode] += lock_bench_acquire(lk, guest_id, (enum lock_bench_mode)mode);
+            wait[mode] += guest_read_counter() - t0;
+            guest_delay(LOCK_BENCH_HOLD);
+            lock_bench_release(lk);
+        }
+    }
+    lock_bench_barrier(lk, LOCK_MODE_COUNT);
+
+    struct guest_task_result out;
+    guest_task_counter(guest_id, &out);
+    out.data0 = wait[LOCK_MODE_SPIN] / LOCK_BENCH_ROUNDS;
+    out.data1 = wait[LOCK_MODE_WFE] / LOCK_BENCH_ROUNDS;
+    out.time_target = wait[LOCK_MODE_PV] / LOCK_BENCH_ROUNDS;
+    copy_desc(&out, "lock bench wait spin/wfe/pv");
+    guest_task_report(guest_id, &out);
+
+    out.data0 = spins[LOCK_MODE_SPIN] / LOCK_BENCH_ROUNDS;
+    out.data1 = spins[LOCK_MODE_WFE] / LOCK_BENCH_ROUNDS;
+    out.time_target = spins[LOCK_MODE_PV] / LOCK_BENCH_ROUNDS;
+    copy_desc(&out, "lock bench spins spin/wfe/pv");
+    guest_task_report(guest_id, &out);
+    guest_task_flush(guest_id);
+}
+
+#define IRQ_BENCH_ROUNDS 32u
+
+// End-to-end latency of a forwarded interrupt: arm the virtual timer, block
+// in WFI and measure how late the expiry is acknowledged through the virtual
+// CPU interface. EL2 logs its side (source to list register) with its IRQ
+// statistics.
+void guest_task_irq_bench(u64 guest_id)
+{
+    const u64 period = guest_read_frequency() / 10000u; // 100 us
+    u64 sum = 0, max = 0;
+    for (u32 i = 0; i < IRQ_BENCH_ROUNDS; ++i)
+    {
+        const u64 late = guest_sleep_ticks(period);
+        sum += late;
+        if (late > max)
+            max = late;
+    }
+
+    struct guest_task_result out;
+    guest_task_counter(guest_id, &out);
+    out.data0 = sum / IRQ_BENCH_ROUNDS; // avg virtual ticks from deadline to IAR
+    out.data1 = max;
+    out.time_target = period;
+    copy_desc(&out, "irq bench avg/max/period");
+    guest_task_report(guest_id, &out);
+    guest_task_flush(guest_id);
+}
+
+#define PMU_PROFILE_LOOPS     100000u
+#define PMU_OVF_HEADROOM      4096u     // events before counter 0 wraps
+#define PMU_OVF_POLLS         (1u << 20)
+#define PMU_EVT_INST_RETIRED  0x08ull
+#define PMU_PMCR_ENABLE       0x47ull   // E, P, C, LC
+
+// Self-profiling through the virtual PMU: cycles and retired instructions of
+// a fixed loop, then event counter 0 preloaded just below overflow with its
+// interrupt enabled. The first PMU access traps once and hands this vCPU the
+// PMU; the overflow comes back as PPI 23 through the vGIC.
+void guest_task_pmu_profile(u64 guest_id)
+{
+    volatile u32 *isenabler0 = (volatile u32 *)(GUEST_GICR_BASE + guest_id * GUEST_GICR_STRIDE +
+                                                GUEST_GICR_ISENABLER0);
+    *isenabler0 = 1u << GUEST_PMU_INTID;
+
+    asm volatile("msr pmcr_el0, %0" : : "r"(PMU_PMCR_ENABLE));
+    asm volatile("msr pmevtyper0_el0, %0" : : "r"(PMU_EVT_INST_RETIRED));
+    asm volatile("msr pmccfiltr_el0, xzr");
+    asm volatile("msr pmcntenset_el0, %0; isb" : : "r"((1ull << 31) | 1ull));
+
+    u64 cyc0, ins0, cyc1, ins1;
+    asm volatile("mrs %0, pmccntr_el0" : "=r"(cyc0));
+    asm volatile("mrs %0, pmevcntr0_el0" : "=r"(ins0));
+    for (u32 i = 0; i < PMU_PROFILE_LOOPS; ++i)
+        asm volatile("" ::: "memory");
+    asm volatile("mrs %0, pmccntr_el0" : "=r"(cyc1));
+    asm volatile("mrs %0, pmevcntr0_el0" : "=r"(ins1));
+
+    asm volatile("msr pmevcntr0_el0, %0" : : "r"(0xFFFFFFFFull - PMU_OVF_HEADROOM));
+    asm volatile("msr pmintenset_el1, %0; isb" : : "r"(1ull));
+    u32 polls = 0;
+    bool fired = false;
+    while (!fired && polls++ < PMU_OVF_POLLS)
+    {
+        u64 iar;
+        asm volatile("mrs %0, " GUEST_ICC_IAR1_EL1 : "=r"(iar));
+        const u32 intid = (u32)(iar & 0xFFFFFFu);
+        if (intid >= 1020)
+            continue;
+        if (intid == GUEST_PMU_INTID)
+        {
+            asm volatile("msr pmovsclr_el0, %0; isb" : : "r"(1ull)); // drop the level before EOI
+            fired = true;
+        }
+        asm volatile("msr " GUEST_ICC_EOIR1_EL1 ", %0" : : "r"(iar));
+    }
+    asm volatile("msr pmintenclr_el1, %0" : : "r"(~0ull));
+    asm volatile("msr pmcntenclr_el0, %0" : : "r"(~0ull));
+    asm volatile("msr pmcr_el0, xzr; isb");
+
+    struct guest_task_result out;
+    guest_task_counter(guest_id, &out);
+    out.data0 = cyc1 - cyc0;
+    out.data1 = (u32)(ins1 - ins0);
+    out.time_target = fired ? polls : 0; // IAR polls until the overflow arrived
+    copy_desc(&out, "pmu cycles/insts/ovf polls");
+    guest_task_report(guest_id, &out);
+    guest_task_flush(guest_id);
+}
+
+#define MMIO_BENCH_ROUNDS 64u
+
+// Cost of one emulated MMIO access on the scratch device: a plain load, which
+// the hardware describes in the syndrome (ISV=1), and a post-indexed load,
+// which it does not, so EL2 fetches and decodes the instruction. An SMCCC
+// round trip with no work is the baseline exit cost.
+void guest_task_mmio_bench(u64 guest_id)
+{
+    volatile u32 *reg = (volatile u32 *)GUEST_MMIO_SCRATCH_BASE;
+
+    u64 t0 = guest_read_counter();
+    for (u32 i = 0; i < MMIO_BENCH_ROUNDS; ++i)
+        (void)reg[0];
+    u64 t1 = guest_read_counter();
+    for (u32 i = 0; i < MMIO_BENCH_ROUNDS; ++i)
+    {
+        u64 p = GUEST_MMIO_SCRATCH_BASE;
+        u32 v;
+        asm volatile("ldr %w0, [%1], #4" : "=r"(v), "+r"(p) : : "memory");
+        (void)v;
+    }
+    u64 t2 = guest_read_counter();
+    for (u32 i = 0; i < MMIO_BENCH_ROUNDS; ++i)
+        (void)guest_smccc(SCHISM_HYP_TIME_GET, 0, 0, 0);
+    u64 t3 = guest_read_counter();
+
+    struct guest_task_result out;
+    guest_task_counter(guest_id, &out);
+    out.data0 = (t1 - t0) / MMIO_BENCH_ROUNDS; // ticks per ISV=1 access
+    out.data1 = (t2 - t1) / MMIO_BENCH_ROUNDS; // ticks per decoded access
+    out.time_target = (t3 - t2) / MMIO_BENCH_ROUNDS; // ticks per empty hypercall
+    copy_desc(&out, "mmio bench isv/decode/hvc");
+    guest_task_report(guest_id, &out);
+    guest_task_flush(guest_id);
+}
+
+#define BLK_BENCH_BYTES (4u << 20)
+
+// One sequential pass over the start of the disk in GUEST_BLK_BUF_BYTES
+// requests, GUEST_BLK_BATCH_MAX per notification. Writes tag each block with
+// its index and reads check the tag.
+static void blk_bench_pass(u64 guest_id, struct guest_blk *blk, u32 type, const char *desc)
+{
+    const u64 sectors_per_req = GUEST_BLK_BUF_BYTES / VIRTIO_BLK_SECTOR_SIZE;
+    u64 reqs = BLK_BENCH_BYTES / GUEST_BLK_BUF_BYTES;
+    if (reqs > blk->capacity / sectors_per_req)
+        reqs = blk->capacity / sectors_per_req;
+
+    u64 errors = 0;
+    const u64 t0 = guest_read_counter();
+    for (u64 r = 0; r < reqs;)
+    {
+        u32 n = 0;
+        for (; n < GUEST_BLK_BATCH_MAX && r + n < reqs; ++n)
+        {
+            if (type == VIRTIO_BLK_T_OUT)
+                *(volatile u64 *)guest_blk_buffer(n) = r + n;
+            guest_blk_queue(blk, type, (r + n) * sectors_per_req, GUEST_BLK_BUF_BYTES);
+        }
+        errors += guest_blk_submit(blk);
+        if (type == VIRTIO_BLK_T_IN)
+            for (u32 i = 0; i < n; ++i)
+                if (*(volatile u64 *)guest_blk_buffer(i) != r + i)
+                    errors++;
+        r += n;
+    }
+    const u64 ticks = guest_read_counter() - t0;
+    const u64 freq = guest_read_frequency();
+
+    struct guest_task_result out;
+    guest_task_counter(guest_id, &out);
+    out.data0 = ticks ? reqs * GUEST_BLK_BUF_BYTES / 1024u * freq / ticks : 0; // KiB/s
+    out.data1 = ticks ? reqs * freq / ticks : 0;                              // IOPS
+    out.time_target = errors;
+    copy_desc(&out, desc);
+    guest_task_report(guest_id, &out);
+}
+
+// Sequential write then read throughput of the virtio-blk RAM disk.
+void guest_task_blk_bench(u64 guest_id)
+{
+    struct guest_blk blk;
+    if (!guest_blk_init(&blk))
+    {
+        struct guest_task_result out;
+        guest_task_counter(guest_id, &out);
+        copy_desc(&out, "blk bench: no device");
+        guest_task_report(guest_id, &out);
+        guest_task_flush(guest_id);
+        return;
+    }
+
+    blk_bench_pass(guest_id, &blk, VIRTIO_BLK_T_OUT, "blk write KiB/s iops errors");
+    blk_bench_pass(guest_id, &blk, VIRTIO_BLK_T_IN, "blk read KiB/s iops errors");
+    guest_task_flush(guest_id);
+    guest_blk_reset(&blk);
+}
+
+// Inter-guest traffic over the EL2 packet switch. Guest 0 is the client: it
+// streams small frames (copied by the switch), then page-sized frames
+// (flipped at stage-2), then measures ping-pong round trips. Guest 1 counts
+// and checks what arrives and echoes the pings. Every frame carries a
+// (phase, sequence) tag after the Ethernet header.
+#define NET_BENCH_BATCH   16u
+#define NET_SMALL_FRAMES  2048u
+#define NET_SMALL_BYTES   64u
+#define NET_PAGE_FRAMES   512u
+#define NET_PINGS         128u
+#define NET_ETHERTYPE     0x88B5u  // IEEE local experimental
+#define NET_TAG_OFF       16u
+
+enum
+{
+    NET_PHASE_SMALL = 0,
+    NET_PHASE_PAGE = 1,
+    NET_PHASE_PING = 2,
+    NET_PHASE_DONE = 3,
+};
+
+static void net_frame(struct guest_net *net, u32 slot, const u8 *dst, u32 phase, u32 seq)
+{
+    // Rebuilt every time: a flip hands the sender's page to the receiver.
+    volatile u8 *f = guest_net_tx_buffer(net, slot);
+    for (u32 i = 0; i < VIRTIO_NET_ETH_ALEN; ++i)
+    {
+        f[i] = dst[i];
+        f[VIRTIO_NET_ETH_ALEN + i] = net->mac[i];
+    }
+    f[12] = (u8)(NET_ETHERTYPE >> 8);
+    f[13] = (u8)NET_ETHERTYPE;
+    *(volatile u64 *)(f + NET_TAG_OFF) = ((u64)phase << 32) | seq;
+}
+
+static void net_wait_tx(struct guest_net *net, u64 peer)
+{
+    while (!guest_net_tx_done(net))
+        guest_yield_to(peer);
+}
+
+static void net_send(struct guest_net *net, u64 peer, const u8 *dst, u32 phase, u32 seq)
+{
+    net_frame(net, 0, dst, phase, seq);
+    guest_net_queue_tx(net, 0, NET_SMALL_BYTES);
+    guest_net_kick(net, &net->tx, VIRTIO_NET_Q_TX);
+    net_wait_tx(net, peer);
+}
+
+// Stream `frames` frames of `len` bytes, one kick per batch. Returns ticks
+// until the last one was delivered.
+static u64 net_stream(struct guest_net *net, u64 peer, const u8 *dst, u32 phase,
+                      u32 frames, u32 len)
+{
+    const u64 t0 = guest_read_counter();
+    for (u32 sent = 0; sent < frames;)
+    {
+        u32 n = 0;
+        for (; n < NET_BENCH_BATCH && sent + n < frames; ++n)
+        {
+            net_frame(net, n, dst, phase, sent + n);
+            guest_net_queue_tx(net, n, len);
+        }
+        guest_net_kick(net, &net->tx, VIRTIO_NET_Q_TX);
+        net_wait_tx(net, peer);
+        sent += n;
+    }
+    return guest_read_counter() - t0;
+}
+
+static void net_report_stream(u64 guest_id, u64 ticks, u32 frames, u32 len, const char *desc)
+{
+    const u64 freq = guest_read_frequency();
+    struct guest_task_result out;
+    guest_task_counter(guest_id, &out);
+    out.data0 = ticks ? (u64)frames * freq / ticks : 0;               // packets/s
+    out.data1 = ticks ? (u64)frames * len / 1024u * freq / ticks : 0; // KiB/s
+    out.time_target = frames;
+    copy_desc(&out, desc);
+    guest_task_report(guest_id, &out);
+}
+
+static void net_client(u64 guest_id, struct guest_net *net, u64 peer)
+{
+    u8 dst[VIRTIO_NET_ETH_ALEN];
+    guest_net_mac(peer, dst);
+
+    u64 ticks = net_stream(net, peer, dst, NET_PHASE_SMALL, NET_SMALL_FRAMES, NET_SMALL_BYTES);
+    net_report_stream(guest_id, ticks, NET_SMALL_FRAMES, NET_SMALL_BYTES, "net copy 64B pps KiB/s n");
+    ticks = net_stream(net, peer, dst, NET_PHASE_PAGE, NET_PAGE_FRAMES, GUEST_NET_BUF_BYTES);
+    net_report_stream(guest_id, ticks, NET_PAGE_FRAMES, GUEST_NET_BUF_BYTES, "net flip 4K pps KiB/s n");
+
+    u64 sum = 0, max = 0, errors = 0;
+    for (u32 i = 0; i < NET_PINGS; ++i)
+    {
+        const u64 t0 = guest_read_counter();
+        net_send(net, peer, dst, NET_PHASE_PING, i);
+        u32 len, buf;
+        void *frame;
+        while (!(frame = guest_net_recv(net, &len, &buf)))
+            guest_yield_to(peer);
+        const u64 rtt = guest_read_counter() - t0;
+        if (*(volatile u64 *)((u8 *)frame + NET_TAG_OFF) != (((u64)NET_PHASE_PING << 32) | i))
+            errors++;
+        guest_net_recycle(net, buf);
+        guest_net_kick(net, &net->rx, VIRTIO_NET_Q_RX);
+        sum += rtt;
+        if (rtt > max)
+            max = rtt;
+    }
+    net_send(net, peer, dst, NET_PHASE_DONE, 0);
+
+    struct guest_task_result out;
+    guest_task_counter(guest_id, &out);
+    out.data0 = sum / NET_PINGS; // average round trip, virtual ticks
+    out.data1 = max;
+    out.time_target = errors;
+    copy_desc(&out, "net ping rtt avg/max errors");
+    guest_task_report(guest_id, &out);
+}
+
+static void net_server(u64 guest_id, struct guest_net *net, u64 peer)
+{
+    u8 dst[VIRTIO_NET_ETH_ALEN];
+    guest_net_mac(peer, dst);
+
+    u64 seen[NET_PHASE_PING] = { 0, 0 };
+    u64 errors = 0;
+    bool done = false;
+    while (!done)
+    {
+        u32 got = 0, len, buf;
+        void *frame;
+        while ((frame = guest_net_recv(net, &len, &buf)))
+        {
+            const u64 tag = *(volatile u64 *)((u8 *)frame + NET_TAG_OFF);
+            const u32 phase = (u32)(tag >> 32);
+            const u32 seq = (u32)tag;
+            guest_net_recycle(net, buf);
+            ++got;
+            if (phase == NET_PHASE_PING)
+                net_send(net, peer, dst, NET_PHASE_PING, seq);
+            else if (phase == NET_PHASE_DONE)
+                done = true;
+            else if (phase < NET_PHASE_PING && seq == seen[phase])
+                seen[phase]++;
+            else
+                errors++;
+        }
+        if (got)
+            guest_net_kick(net, &net->rx, VIRTIO_NET_Q_RX);
+        else
+            guest_yield_to(peer);
+    }
+
+    struct guest_task_result out;
+    guest_task_counter(guest_id, &out);
+    out.data0 = seen[NET_PHASE_SMALL];
+    out.data1 = seen[NET_PHASE_PAGE];
+    out.time_target = errors;
+    copy_desc(&out, "net rx small/page/errors");
+    guest_task_report(guest_id, &out);
+}
+
+void guest_task_net_bench(u64 guest_id)
+{
+    struct guest_net net;
+    if (!guest_net_init(&net, guest_id))
+    {
+        struct guest_task_result out;
+        guest_task_counter(guest_id, &out);
+        copy_desc(&out, "net bench: no device");
+        guest_task_report(guest_id, &out);
+        guest_task_flush(guest_id);
+        return;
+    }
+
+    const u64 peer = guest_id ^ 1u;
+    if (guest_id == 0)
+        net_client(guest_id, &net, peer);
+    else
+        net_server(guest_id, &net, peer);
+    guest_task_flush(guest_id);
+    guest_net_reset(&net);
+}
+
+// Raw inter-guest channel: shared-memory rings with SGI doorbells. Guest 0
+// measures ping-pong round trips, then streams messages in batches until the
+// ring fills; guest 1 echoes the pings and counts and checks the stream.
+// Both sides sleep in WFI whenever their ring is empty or full, so every
+// wakeup is a doorbell.
+#define CHAN_PINGS      256u
+#define CHAN_BULK_MSGS  8192u
+#define CHAN_BATCH      8u
+
+enum
+{
+    CHAN_PHASE_PING = 1,
+    CHAN_PHASE_BULK = 2,
+    CHAN_PHASE_DONE = 3,
+};
+
+static void chan_put(struct guest_chan *ch, u32 phase, u32 seq)
+{
+    struct guest_chan_msg msg;
+    msg.w[0] = ((u64)phase << 32) | seq;
+    for (u32 i = 1; i < 8; ++i)
+        msg.w[i] = msg.w[0] ^ i;
+    while (!guest_chan_send(ch, &msg))
+        guest_chan_wait_tx(ch);
+}
+
+static void chan_get(struct guest_chan *ch, struct guest_chan_msg *msg)
+{
+    while (!guest_chan_recv(ch, msg))
+        guest_chan_wait_rx(ch);
+}
+
+static void chan_client(u64 guest_id, struct guest_chan *ch)
+{
+    u64 sum = 0, max = 0, errors = 0;
+    struct guest_chan_msg msg;
+    for (u32 i = 0; i < CHAN_PINGS; ++i)
+    {
+        const u64 t0 = guest_read_counter();
+        chan_put(ch, CHAN_PHASE_PING, i);
+        guest_chan_flush(ch);
+        chan_get(ch, &msg);
+        const u64 rtt = guest_read_counter() - t0;
+        guest_chan_release(ch);
+        if (msg.w[0] != (((u64)CHAN_PHASE_PING << 32) | i))
+            errors++;
+        sum += rtt;
+        if (rtt > max)
+            max = rtt;
+    }
+
+    struct guest_task_result out;
+    guest_task_counter(guest_id, &out);
+    out.data0 = sum / CHAN_PINGS; // average round trip, virtual ticks
+    out.data1 = max;
+    out.time_target = errors;
+    copy_desc(&out, "chan ping rtt avg/max errors");
+    guest_task_report(guest_id, &out);
+
+    const u64 doorbells = ch->doorbells;
+    const u64 t0 = guest_read_counter();
+    for (u32 sent = 0; sent < CHAN_BULK_MSGS; ++sent)
+    {
+        chan_put(ch, CHAN_PHASE_BULK, sent);
+        if ((sent + 1u) % CHAN_BATCH == 0)
+            guest_chan_flush(ch);
+    }
+    chan_put(ch, CHAN_PHASE_DONE, CHAN_BULK_MSGS);
+    guest_chan_flush(ch);
+    chan_get(ch, &msg); // the server's tally doubles as the completion
+    const u64 ticks = guest_read_counter() - t0;
+    guest_chan_release(ch);
+
+    const u64 freq = guest_read_frequency();
+    out.data0 = ticks ? (u64)CHAN_BULK_MSGS * freq / ticks : 0;                       // msgs/s
+    out.data1 = ticks ? (u64)CHAN_BULK_MSGS * sizeof(msg) / 1024u * freq / ticks : 0; // KiB/s
+    out.time_target = ch->doorbells - doorbells;
+    copy_desc(&out, "chan bulk msg/s KiB/s doorbells");
+    guest_task_report(guest_id, &out);
+}
+
+static void chan_server(u64 guest_id, struct guest_chan *ch)
+{
+    u64 seen = 0, errors = 0;
+    struct guest_chan_msg msg;
+    for (;;)
+    {
+        chan_get(ch, &msg);
+        const u32 phase = (u32)(msg.w[0] >> 32);
+        const u32 seq = (u32)msg.w[0];
+        if (msg.w[7] != (msg.w[0] ^ 7u))
+            errors++;
+        if (phase == CHAN_PHASE_PING)
+        {
+            guest_chan_release(ch);
+            chan_put(ch, CHAN_PHASE_PING, seq);
+            guest_chan_flush(ch);
+        }
+        else if (phase == CHAN_PHASE_BULK && seq == seen)
+        {
+            if (++seen % CHAN_BATCH == 0)
+                guest_chan_release(ch);
+        }
+        else if (phase == CHAN_PHASE_DONE)
+            break;
+        else
+            errors++;
+    }
+    guest_chan_release(ch);
+    chan_put(ch, CHAN_PHASE_DONE, (u32)seen);
+    guest_chan_flush(ch);
+
+    struct guest_task_result out;
+    guest_task_counter(guest_id, &out);
+    out.data0 = seen;
+    out.data1 = errors;
+    out.time_target = ch->waits;
+    copy_desc(&out, "chan rx bulk/errors/waits");
+    guest_task_report(guest_id, &out);
+}
+
+void guest_task_chan_bench(u64 guest_id)
+{
+    struct guest_chan ch;
+    guest_chan_init(&ch, guest_id);
+    if (guest_id == 0)
+        chan_client(guest_id, &ch);
+    else
+        chan_server(guest_id, &ch);
+    guest_task_flush(guest_id);
 }
@@ -2,23 +2,27 @@
 #include "guest_stubs.h"
 #include "guest_tasks.h"
 
+// Fields of this guest's telemetry record.
 enum
 {
-    MEMWALK_SLOT_ID = 6,
-    MEMWALK_SLOT_EL = 7,
-    MEMWALK_SLOT_SP = 8,
-    MEMWALK_SLOT_REGION = 9,
-    MEMWALK_SLOT_CHECKSUM = 10,
-    MEMWALK_SLOT_SEED = 11,
-    MEMWALK_SLOT_TIME = 15,
+    MEMWALK_FIELD_ID = 0,
+    MEMWALK_FIELD_EL = 1,
+    MEMWALK_FIELD_SP = 2,
+    MEMWALK_FIELD_REGION = 3,
+    MEMWALK_FIELD_CHECKSUM = 4,
+    MEMWALK_FIELD_SEED = 5,
+    MEMWALK_FIELD_TIME = 6,
 };
 
 static void run_isolation_tests(u64 guest_id, volatile u64 *region)
 {
-    guest_log_value(MEMWALK_SLOT_ID, guest_id);
-    guest_log_value(MEMWALK_SLOT_EL, guest_read_current_el());
-    guest_log_value(MEMWALK_SLOT_SP, guest_read_sp());
-    guest_log_value(MEMWALK_SLOT_REGION, (u64)region);
+    volatile struct guest_telemetry *t = guest_telemetry(guest_id);
+    guest_telemetry_begin(t);
+    t->field[MEMWALK_FIELD_ID] = guest_id;
+    t->field[MEMWALK_FIELD_EL] = guest_read_current_el();
+    t->field[MEMWALK_FIELD_SP] = guest_read_sp();
+    t->field[MEMWALK_FIELD_REGION] = (u64)region;
+    guest_telemetry_end(t);
 
     region[0] = 0xBEEF0000ull | guest_id;
 }
@@ -30,7 +34,14 @@ void guest_memwalk_os(u64 guest_id)
     const size_t words = GUEST_WORK_SIZE / sizeof(u64);
     u64 seed = 0xfeed000000000000ull;
 
+    guest_irq_init(guest_id);
     run_isolation_tests(guest_id, region);
+    guest_task_lock_bench(guest_id);
+    guest_task_blk_bench(guest_id);
+    guest_task_net_bench(guest_id);
+    guest_task_chan_bench(guest_id);
+    volatile struct pv_time_stolen *steal = guest_steal_time();
+    volatile struct guest_telemetry *tlm = guest_telemetry(guest_id);
 
     while (1)
     {
@@ -44,13 +55,16 @@ void guest_memwalk_os(u64 guest_id)
 
         struct guest_task_result result;
         guest_task_memwalk(guest_id, &result);
-        guest_log_value(MEMWALK_SLOT_CHECKSUM, checksum);
-        guest_log_value(MEMWALK_SLOT_SEED, seed);
-        guest_log_value(MEMWALK_SLOT_TIME, result.memwalk_time);
+        guest_telemetry_begin(tlm);
+        tlm->field[MEMWALK_FIELD_CHECKSUM] = checksum;
+        tlm->field[MEMWALK_FIELD_SEED] = seed;
+        tlm->field[MEMWALK_FIELD_TIME] = result.memwalk_time;
+        guest_telemetry_end(tlm);
+        if (steal)
+            result.stolen_ns = steal->stolen_time;
         guest_task_report(guest_id, &result);
         
         seed += 0x111111111ull;
-        guest_delay(200);
-        guest_yield();
+        guest_sleep_ticks(guest_read_frequency() / 1000); // 1 ms
     }
 }
@@ -0,0 +1,66 @@
+#pragma once
+#include "types.h"
+
+/*
+ * System-register, barrier, TLB- and cache-maintenance accessors for the parts of
+ * EL2 that are otherwise plain table and queue logic (core/s2_mmu.c,
+ * core/el2_mmu.c, core/sched.c). On the target they are the bare
+ * instructions. With SCHISM_HOST defined, as `make host-bench` builds those
+ * files for Linux, they call into a mock (host/mock.c) that keeps a register
+ * file and counts barriers and invalidations.
+ *
+ * Registers are named as the assembler spells them: read_sysreg(HCR_EL2).
+ */
+
+#ifndef SCHISM_HOST
+
+#define read_sysreg(reg) ({                                    \
+    u64 __val;                                                  \
+    asm volatile("mrs %0, " #reg : "=r"(__val) :: "memory");    \
+    __val;                                                      \
+})
+#define write_sysreg(reg, val) \
+    asm volatile("msr " #reg ", %0" :: "r"((u64)(val)) : "memory")
+
+#define dsb(opt)     asm volatile("dsb " #opt ::: "memory")
+#define tlbi(op)     asm volatile("tlbi " #op ::: "memory")
+#define tlbi_va(op, arg) asm volatile("tlbi " #op ", %0" :: "r"((u64)(arg)) : "memory")
+#define dc_va(op, arg)   asm volatile("dc " #op ", %0" :: "r"((u64)(arg)) : "memory")
+#define ic(op)           asm volatile("ic " #op ::: "memory")
+
+// Park the CPU for good; used when a fixed-size pool runs dry.
+static inline __attribute__((noreturn)) void cpu_halt(void)
+{
+    for (;;)
+        asm volatile("wfi");
+}
+
+// Drop to EL1 at ELR_EL2/SPSR_EL2 as already programmed.
+static inline __attribute__((noreturn)) void cpu_eret(void)
+{
+    asm volatile("isb; eret" ::: "memory");
+    __builtin_unreachable();
+}
+
+#else /* SCHISM_HOST */
+
+u64 host_read_sysreg(const char *reg);
+void host_write_sysreg(const char *reg, u64 val);
+void host_barrier(const char *op);
+void host_tlbi(const char *op, u64 arg);
+__attribute__((noreturn)) void host_halt(const char *why);
+
+#define read_sysreg(reg)       host_read_sysreg(#reg)
+#define write_sysreg(reg, val) host_write_sysreg(#reg, (u64)(val))
+#define dsb(opt)               host_barrier("dsb " #opt)
+#define tlbi(op)               host_tlbi(#op, 0)
+#define tlbi_va(op, arg)       host_tlbi(#op, (u64)(arg))
+#define dc_va(op, arg)         ((void)(arg), host_barrier("dc " #op))
+#define ic(op)                 host_barrier("ic " #op)
+#define cpu_halt()             host_halt("cpu_halt")
+#define cpu_eret()             host_halt("eret")
+
+#undef isb
+#define isb() host_barrier("isb")
+
+#endif /* SCHISM_HOST */
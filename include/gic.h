@@ -0,0 +1,109 @@
+#pragma once
+#include <stdbool.h>
+#include "types.h"
+
+// GICv3 CPU interface (ICC_*) and virtualization control (ICH_*) registers,
+// spelled by encoding so the assembler needs no GIC support.
+#define ICC_PMR_EL1_SYSREG     "S3_0_C4_C6_0"
+#define ICC_IAR0_EL1_SYSREG    "S3_0_C12_C8_0"
+#define ICC_EOIR0_EL1_SYSREG   "S3_0_C12_C8_1"
+#define ICC_IAR1_EL1_SYSREG    "S3_0_C12_C12_0"
+#define ICC_EOIR1_EL1_SYSREG   "S3_0_C12_C12_1"
+#define ICC_DIR_EL1_SYSREG     "S3_0_C12_C11_1"
+#define ICC_CTLR_EL1_SYSREG    "S3_0_C12_C12_4"
+#define ICC_IGRPEN0_EL1_SYSREG "S3_0_C12_C12_6"
+#define ICC_IGRPEN1_EL1_SYSREG "S3_0_C12_C12_7"
+#define ICC_SRE_EL2_SYSREG     "S3_4_C12_C9_5"
+
+#define ICH_AP0R0_SYSREG   "S3_4_C12_C8_0"
+#define ICH_AP1R0_SYSREG   "S3_4_C12_C9_0"
+#define ICH_HCR_SYSREG     "S3_4_C12_C11_0"
+#define ICH_VTR_SYSREG     "S3_4_C12_C11_1"
+#define ICH_MISR_SYSREG    "S3_4_C12_C11_2"
+#define ICH_EISR_SYSREG    "S3_4_C12_C11_3"
+#define ICH_ELRSR_SYSREG   "S3_4_C12_C11_5"
+#define ICH_VMCR_SYSREG    "S3_4_C12_C11_7"
+
+#define ICH_LR_SYSREG(n) ICH_LR_SYSREG_##n
+#define ICH_LR_SYSREG_0  "S3_4_C12_C12_0"
+#define ICH_LR_SYSREG_1  "S3_4_C12_C12_1"
+#define ICH_LR_SYSREG_2  "S3_4_C12_C12_2"
+#define ICH_LR_SYSREG_3  "S3_4_C12_C12_3"
+#define ICH_LR_SYSREG_4  "S3_4_C12_C12_4"
+#define ICH_LR_SYSREG_5  "S3_4_C12_C12_5"
+#define ICH_LR_SYSREG_6  "S3_4_C12_C12_6"
+#define ICH_LR_SYSREG_7  "S3_4_C12_C12_7"
+#define ICH_LR_SYSREG_8  "S3_4_C12_C13_0"
+#define ICH_LR_SYSREG_9  "S3_4_C12_C13_1"
+#define ICH_LR_SYSREG_10 "S3_4_C12_C13_2"
+#define ICH_LR_SYSREG_11 "S3_4_C12_C13_3"
+#define ICH_LR_SYSREG_12 "S3_4_C12_C13_4"
+#define ICH_LR_SYSREG_13 "S3_4_C12_C13_5"
+#define ICH_LR_SYSREG_14 "S3_4_C12_C13_6"
+#define ICH_LR_SYSREG_15 "S3_4_C12_C13_7"
+
+#define ICH_HCR_EN       (1ull << 0)
+#define ICH_HCR_UIE      (1ull << 1) // maintenance IRQ when at most one LR is valid
+
+#define ICC_CTLR_EOIMODE (1ull << 1) // EOIR drops priority only; DIR deactivates
+
+// ICH_LR<n>_EL2 fields.
+#define ICH_LR_VINTID_MASK  0xFFFFFFFFull
+#define ICH_LR_PRIORITY(p)  ((u64)(p) << 48)
+#define ICH_LR_PINTID(x)    (((u64)(x) & 0x3FFull) << 32) // valid with ICH_LR_HW
+#define ICH_LR_EOI          (1ull << 41) // without HW: maintenance IRQ on guest EOI
+#define ICH_LR_GROUP1       (1ull << 60)
+#define ICH_LR_HW           (1ull << 61) // guest deactivation deactivates pINTID
+#define ICH_LR_STATE_PENDING (1ull << 62)
+#define ICH_LR_STATE_ACTIVE (1ull << 63)
+#define ICH_LR_STATE_MASK   (3ull << 62)
+
+#define GIC_INTID_SPURIOUS  1020u // IAR values >= 1020 are special/spurious
+#define GIC_PPI_PMU         23u   // PMU overflow
+#define GIC_PPI_MAINTENANCE 25u   // virtual CPU interface maintenance
+#define GIC_PPI_HYP_TIMER   26u   // CNTHP_EL2, EL2 physical timer
+#define GIC_PPI_VTIMER      27u   // CNTV, EL1 virtual timer
+
+// Bring up the distributor, this CPU's redistributor and the EL2 system
+// register interface, and enable the virtual CPU interface (ICH_HCR_EL2.En).
+void gic_init(void);
+// Enable or disable one of this CPU's SGIs/PPIs at the redistributor.
+void gic_ppi_enable(u32 intid, bool enable);
+// Active state of one of this CPU's SGIs/PPIs. A forwarded PPI stays active
+// while its guest owns it, so it is saved and restored with the vCPU.
+bool gic_ppi_active(u32 intid);
+void gic_ppi_set_active(u32 intid, bool active);
+// Move one of this CPU's PPIs to group 0, which the CPU interface signals as
+// FIQ, and enable group 0. Disable the PPI around the call.
+void gic_ppi_set_fiq(u32 intid);
+
+static inline u64 gic_ack(void)
+{
+    u64 iar;
+    asm volatile("mrs %0, " ICC_IAR1_EL1_SYSREG : "=r"(iar));
+    return iar;
+}
+
+// Priority drop (EOImode 1).
+static inline void gic_eoi(u64 iar)
+{
+    asm volatile("msr " ICC_EOIR1_EL1_SYSREG ", %0" : : "r"(iar));
+}
+
+// Group 0 (FIQ) counterparts of gic_ack()/gic_eoi().
+static inline u64 gic_ack0(void)
+{
+    u64 iar;
+    asm volatile("mrs %0, " ICC_IAR0_EL1_SYSREG : "=r"(iar));
+    return iar;
+}
+
+static inline void gic_eoi0(u64 iar)
+{
+    asm volatile("msr " ICC_EOIR0_EL1_SYSREG ", %0" : : "r"(iar));
+}
+
+static inline void gic_deactivate(u64 iar)
+{
+    asm volatile("msr " ICC_DIR_EL1_SYSREG ", %0" : : "r"(iar));
+}
@@ -2,6 +2,7 @@
 #define GUEST_API_H
 
 #include "types.h"
+#include "smccc.h"
 
 struct guest_task_result
 {
@@ -13,6 +14,132 @@ struct guest_task_result
     u64 time_after;
     u64 time_target;
     u64 memwalk_time;
+    u64 stolen_ns; // steal time seen by the guest when it built the record
+};
+
+// Per-guest telemetry record (see GUEST_SHARED_BASE), versioned by a seqlock:
+// the guest makes `seq` odd, stores any number of fields and makes it even
+// again, so a reader that sees the same even value before and after copying
+// has a consistent set. The guest is the only writer.
+#define GUEST_TELEMETRY_FIELDS 15u
+
+struct guest_telemetry
+{
+    volatile u32 seq;
+    u32 reserved;
+    volatile u64 field[GUEST_TELEMETRY_FIELDS];
+} __attribute__((aligned(64)));
+
+// Shared-memory report ring (one per guest, see GUEST_REPORT_RING_BASE).
+// The guest is the only producer and advances `head` after filling a slot;
+// EL2 is the only consumer and advances `tail` once a record is processed.
+// Both indices are free-running, the slot is index % GUEST_REPORT_RING_ENTRIES.
+// The guest rings the doorbell (SCHISM_HYP_RING_DOORBELL) once `head - tail` reaches the
+// watermark or the ring is full; WFI exits drain the ring as well, so a guest
+// that yields never needs an explicit doorbell.
+#define GUEST_REPORT_RING_ENTRIES   32u
+#define GUEST_REPORT_RING_WATERMARK 24u
+
+struct guest_report_ring
+{
+    volatile u32 head; // submission index (written by the guest)
+    u32 pad0[15];      // keep head and tail on separate cache lines
+    volatile u32 tail; // completion index (written by EL2)
+    u32 pad1[15];
+    struct guest_task_result entries[GUEST_REPORT_RING_ENTRIES];
+};
+
+// Exit-less request ring (one per guest, see GUEST_POLL_RING_BASE) serviced by
+// the dedicated EL2 polling core when the hypervisor is built with
+// CONFIG_POLL_CORE. The guest produces at `head`; the polling core completes
+// requests in order and publishes its progress in `tail`, so request i is done
+// (and its `ret` values valid) once tail > i. EL2 sets `online` when a polling
+// core owns the ring; guests fall back to hypercalls while it reads zero.
+#define GUEST_POLL_RING_ENTRIES 16u
+
+enum guest_poll_op
+{
+    GUEST_POLL_OP_NOP = 0,
+    GUEST_POLL_OP_TASK_REPORT = 1, // payload.report, printed like HVC #0x60
+    GUEST_POLL_OP_TIME_QUERY = 2,  // ret[0] = virtual counter, ret[1] = CNTFRQ
+    GUEST_POLL_OP_CONSOLE = 3,     // payload.text (NUL terminated) printed as-is
+};
+
+struct guest_poll_req
+{
+    u32 op;
+    u32 len;
+    u64 submit_time; // guest virtual counter when the request was queued
+    u64 ret[2];
+    union
+    {
+        struct guest_task_result report;
+        char text[96];
+    } payload;
+};
+
+struct guest_poll_ring
+{
+    volatile u32 head;   // submission index (written by the guest)
+    volatile u32 online; // non-zero while a polling core services this ring
+    u32 pad0[14];
+    volatile u32 tail;   // completion index (written by the polling core)
+    u32 pad1[15];
+    struct guest_poll_req entries[GUEST_POLL_RING_ENTRIES];
+};
+
+// Paravirtual clock page (one per vCPU, see GUEST_PVCLOCK_BASE). EL2 rewrites
+// it whenever the vCPU's counter offset changes: when the vCPU is scheduled in
+// and on SCHISM_HYP_TIME_SET. `seq` is odd while an update is in progress;
+// readers retry until they see the same even value before and after. Since the
+// offset only changes while the vCPU is out of the guest, a consistent read
+// pairs it with a CNTVCT sample without any exit.
+#define GUEST_PVCLOCK_F_ECV (1u << 0) // CNTPCT/CNTP_* run without trapping
+
+struct guest_pvclock
+{
+    volatile u32 seq;
+    volatile u32 flags;        // GUEST_PVCLOCK_F_*
+    volatile u64 cntvoff;      // host count = CNTVCT + cntvoff
+    volatile u64 cntfrq;       // counter frequency in Hz
+    volatile u64 rebase_count; // time overrides applied to this vCPU
+};
+
+// Stolen-time record in the layout of Arm DEN0057 (PV_TIME_ST returns its
+// IPA). `stolen_time` is the time in nanoseconds the vCPU spent runnable but
+// not running; EL2 updates it with a single 64-bit store.
+struct pv_time_stolen
+{
+    u32 revision;              // 0
+    u32 attributes;            // 0
+    volatile u64 stolen_time;
+    u8 pad[48];
+} __attribute__((aligned(64)));
+
+// Shared-memory channel between the two guests (see GUEST_CHAN_BASE): one
+// single-producer single-consumer ring per direction of fixed 64-byte
+// messages. Indices are free-running, the slot is index % GUEST_CHAN_ENTRIES.
+// Each side owns one cache line holding its index and the flag it raises
+// before it sleeps in WFI; the other side rings SCHISM_HYP_CHAN_DOORBELL after
+// publishing only when it sees that flag, and EL2 answers with SGI
+// GUEST_CHAN_SGI at the sleeper.
+#define GUEST_CHAN_ENTRIES 32u
+#define GUEST_CHAN_SGI     1u
+
+struct guest_chan_msg
+{
+    u64 w[8];
+};
+
+struct guest_chan_ring
+{
+    volatile u32 head;          // submission index (written by the producer)
+    volatile u32 producer_wait; // producer sleeps until tail moves
+    u32 pad0[14];
+    volatile u32 tail;          // completion index (written by the consumer)
+    volatile u32 consumer_wait; // consumer sleeps until head moves
+    u32 pad1[14];
+    struct guest_chan_msg entries[GUEST_CHAN_ENTRIES];
 };
 
 #endif /* GUEST_API_H */
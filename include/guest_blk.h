@@ -0,0 +1,47 @@
+#ifndef GUEST_BLK_H
+#define GUEST_BLK_H
+
+#include <stdbool.h>
+#include "guest_stubs.h"
+#include "virtio.h"
+
+/*
+ * Minimal guest driver for the EL2 virtio-blk device (guests/guest_blk.c).
+ * Requests are queued in batches and the device is kicked once per batch;
+ * each request is one indirect descriptor (header, data, status) when the
+ * device offers VIRTIO_RING_F_INDIRECT_DESC and a three-descriptor chain
+ * otherwise. All ring memory lives in GUEST_BLK_BASE.
+ */
+
+#define GUEST_BLK_QUEUE_NUM 64u
+#define GUEST_BLK_BATCH_MAX 16u
+#define GUEST_BLK_BUF_BYTES 4096u
+
+struct guest_blk
+{
+    volatile u32 *regs;
+    struct virtq_desc *desc;
+    struct virtq_avail *avail;
+    struct virtq_used *used;
+    u64 capacity;      // sectors
+    bool indirect;
+    bool event_idx;
+    u16 avail_idx;     // next avail->idx to publish
+    u16 kicked_idx;    // avail->idx at the last notification decision
+    u16 batch;         // requests queued since the last submit
+    u64 kicks;         // QueueNotify writes actually issued
+};
+
+bool guest_blk_init(struct guest_blk *blk);
+// Data buffer of batch slot `slot` (GUEST_BLK_BUF_BYTES long).
+void *guest_blk_buffer(u32 slot);
+// Queue a request using the next batch slot's header, buffer and status byte.
+// Returns false once GUEST_BLK_BATCH_MAX requests are waiting.
+bool guest_blk_queue(struct guest_blk *blk, u32 type, u64 sector, u32 len);
+// Publish the batch, notify the device if it wants to hear about it, and wait
+// for every request to complete. Returns the number of failed requests.
+u32 guest_blk_submit(struct guest_blk *blk);
+// Write 0 to Status; the device drops all queue state.
+void guest_blk_reset(struct guest_blk *blk);
+
+#endif /* GUEST_BLK_H */
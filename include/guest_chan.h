@@ -0,0 +1,48 @@
+#ifndef GUEST_CHAN_H
+#define GUEST_CHAN_H
+
+#include <stdbool.h>
+#include "guest_stubs.h"
+#include "guest_api.h"
+
+/*
+ * Guest end of the shared-memory channel (guests/guest_chan.c). Sends and
+ * receives only touch the rings; guest_chan_flush() and guest_chan_release()
+ * publish the local index and ring the peer's doorbell if, and only if, the
+ * peer said it is asleep on that ring and has not been rung for the same
+ * state already. The waits sleep in WFI until the doorbell SGI comes.
+ */
+
+struct guest_chan
+{
+    struct guest_chan_ring *tx;  // produced by this guest
+    struct guest_chan_ring *rx;  // produced by the peer
+    u64 peer;
+    u32 head;                    // next tx slot, published by flush
+    u32 tail;                    // next rx slot, published by release
+    u32 rx_rung;                 // tx->tail when we last woke the consumer
+    u32 tx_rung;                 // rx->head when we last woke the producer
+    u64 doorbells;
+    u64 waits;
+};
+
+static inline struct guest_chan_ring* guest_chan_ring(u64 guest_id)
+{
+    return (struct guest_chan_ring*)(GUEST_CHAN_BASE + guest_id * GUEST_CHAN_STRIDE);
+}
+
+void guest_chan_init(struct guest_chan *ch, u64 guest_id);
+// Copy `msg` into the next tx slot; false if the ring is full.
+bool guest_chan_send(struct guest_chan *ch, const struct guest_chan_msg *msg);
+// Publish sent messages and wake a sleeping consumer.
+void guest_chan_flush(struct guest_chan *ch);
+// Copy out the next rx message; false if the ring is empty.
+bool guest_chan_recv(struct guest_chan *ch, struct guest_chan_msg *msg);
+// Hand consumed slots back and wake a producer waiting for space.
+void guest_chan_release(struct guest_chan *ch);
+// Release, then sleep until the peer has published something to receive.
+void guest_chan_wait_rx(struct guest_chan *ch);
+// Flush, then sleep until the tx ring has a free slot.
+void guest_chan_wait_tx(struct guest_chan *ch);
+
+#endif /* GUEST_CHAN_H */
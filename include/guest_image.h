@@ -0,0 +1,23 @@
+#pragma once
+#include <stdbool.h>
+#include "types.h"
+
+// Where a guest image ended up and how its pages are backed.
+typedef struct guest_image
+{
+    u64 entry;        // IPA of the first instruction
+    u64 ipa_start;    // page-aligned span of the loaded segments
+    u64 ipa_end;
+    u32 shared_pages; // read-only, mapped straight from the staged image
+    u32 cow_pages;    // writable or .bss, copied on the first write
+    u32 copied_pages; // shared by file data and .bss, copied at load
+} guest_image_t;
+
+// Map a staged guest image into stage-2 inside [ipa_base, ipa_base + ipa_size)
+// without copying it. An ELF64 AArch64 executable has its PT_LOAD segments
+// placed at their physical addresses, which must fall in the window; anything
+// else is a raw image loaded at ipa_base and entered there. `image` must be
+// page aligned and must stay in place and unmodified while any guest runs it:
+// loading it again, for another guest, shares the same pages.
+bool guest_image_load(const void *image, u64 size, u64 ipa_base, u64 ipa_size,
+                      guest_image_t *out);
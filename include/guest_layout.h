@@ -1,14 +1,92 @@
 #ifndef GUEST_LAYOUT_H
 #define GUEST_LAYOUT_H
 
+// Telemetry page: one struct guest_telemetry (two cache lines) per guest,
+// sampled by the EL2 monitor.
 #define GUEST_SHARED_BASE        0x41000000ull
-#define GUEST_SHARED_STRIDE      0x00001000ull
-#define GUEST_SHARED_SLOT_COUNT  16
+#define GUEST_SHARED_SIZE        0x00001000ull
+#define GUEST_TELEMETRY_STRIDE   0x00000080ull
+#define GUEST_TELEMETRY_COUNT    2
+
+// Exit-less request rings polled by the EL2 service core, one page per guest,
+// directly behind the telemetry page.
+#define GUEST_POLL_RING_BASE     (GUEST_SHARED_BASE + GUEST_SHARED_SIZE)
+#define GUEST_POLL_RING_STRIDE   0x00001000ull
+#define GUEST_POLL_RING_COUNT    2
 
 #define GUEST_WORK_BASE          0x42000000ull
 #define GUEST_WORK_SIZE          0x00001000ull
 #define GUEST_WORK_STRIDE        0x00002000ull
 
+// Per-vCPU records from here to GUEST_LOCK_BASE, indexed by vcpu_id: the two
+// demo guests and the vCPU of a staged image (GUEST_IMG=, vcpu_id 2).
+#define GUEST_REPORT_RING_BASE   0x43000000ull
+#define GUEST_REPORT_RING_STRIDE 0x00001000ull
+#define GUEST_REPORT_RING_COUNT  3
+
+// Paravirtual clock pages (struct guest_pvclock), one per vCPU, after the rings.
+#define GUEST_PVCLOCK_BASE       (GUEST_REPORT_RING_BASE + \
+                                  GUEST_REPORT_RING_COUNT * GUEST_REPORT_RING_STRIDE)
+#define GUEST_PVCLOCK_STRIDE     0x00001000ull
+#define GUEST_PVCLOCK_COUNT      3
+
+// Steal-time records (struct pv_time_stolen), 64 bytes per vCPU in one page.
+#define GUEST_STEAL_TIME_BASE    (GUEST_PVCLOCK_BASE + \
+                                  GUEST_PVCLOCK_COUNT * GUEST_PVCLOCK_STRIDE)
+#define GUEST_STEAL_TIME_STRIDE  0x40ull
+#define GUEST_STEAL_TIME_COUNT   3
+
+// Lock-contention benchmark page, shared by both guests; EL2 zeroes it at boot.
+#define GUEST_LOCK_BASE          (GUEST_STEAL_TIME_BASE + 0x1000ull)
+#define GUEST_LOCK_SIZE          0x00001000ull
+
+// Inter-guest channel (struct guest_chan_ring), one page per direction; ring i
+// is produced by guest i. EL2 zeroes it at boot and rings the doorbells.
+#define GUEST_CHAN_BASE          (GUEST_LOCK_BASE + GUEST_LOCK_SIZE)
+#define GUEST_CHAN_STRIDE        0x00001000ull
+#define GUEST_CHAN_RINGS         2
+
+// Emulated devices sit outside guest RAM so every access faults at stage 2
+// and is handled by the EL2 MMIO bus.
+#define GUEST_MMIO_SCRATCH_BASE  0x0B000000ull
+
+// Emulated GICv3 at the QEMU virt addresses: one 128KB redistributor frame
+// per vCPU, in vCPU order.
+#define GUEST_GICD_BASE          0x08000000ull
+#define GUEST_GICR_BASE          0x080A0000ull
+#define GUEST_GICR_STRIDE        0x00020000ull
+
+// virtio-mmio block device in the first QEMU virt virtio-mmio slot, with the
+// SPI QEMU would give it. The driver's rings and buffers sit in GUEST_BLK_*.
+#define GUEST_VIRTIO_BLK_BASE    0x0A000000ull
+#define GUEST_VIRTIO_BLK_INTID   48u
+#define GUEST_BLK_BASE           0x44000000ull
+#define GUEST_BLK_SIZE           0x00100000ull
+
+// One virtio-net port of the EL2 packet switch per guest, in the virtio-mmio
+// slots after the block device; port i has MAC 52:54:00:5c:00:<i>. Each
+// guest keeps its rings and headers at the start of its GUEST_NET_STRIDE
+// slot and its packet pages from GUEST_NET_PAGES_OFF on; only those pages
+// may be flipped between guests at stage-2.
+#define GUEST_VIRTIO_NET_BASE    0x0A000200ull
+#define GUEST_VIRTIO_NET_STRIDE  0x00000200ull
+#define GUEST_VIRTIO_NET_INTID   49u
+#define GUEST_NET_PORTS          2
+#define GUEST_NET_BASE           0x45000000ull
+#define GUEST_NET_STRIDE         0x00100000ull
+#define GUEST_NET_PAGES_OFF      0x00010000ull
+
+// Scratch memory for the benchmark guest (guests/bench_os.c): TLB working
+// sets and bandwidth buffers.
+#define GUEST_BENCH_BASE         0x46000000ull
+#define GUEST_BENCH_SIZE         0x02000000ull
+
+// Load window for a staged guest image (GUEST_IMG=): ELF segments must be
+// linked inside it, a raw image starts at its base. Pages the image does not
+// cover stay ordinary guest RAM.
+#define GUEST_LOAD_BASE          0x48000000ull
+#define GUEST_LOAD_SIZE          0x01000000ull
+
 #define GUEST_VUART_BASE         0x4F000000ull
 #define GUEST_VUART_SIZE         0x00001000ull
 
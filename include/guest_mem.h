@@ -0,0 +1,19 @@
+#pragma once
+#include "types.h"
+#include "platform.h"
+#include "s2_mmu.h"
+
+// Translate a guest IPA range into an EL2 pointer, or NULL if any part of it
+// falls outside guest RAM. EL2 maps guest RAM 1:1 (see el2_main()) and
+// stage-2 is an identity map until the packet switch flips a page or a page
+// becomes shared (image loading, VM clones), so until then a valid IPA is
+// directly usable.
+static inline void* guest_ipa_to_ptr(u64 ipa, u64 len)
+{
+    if (ipa < GUEST_RAM_BASE || len > GUEST_RAM_SIZE ||
+        ipa - GUEST_RAM_BASE > GUEST_RAM_SIZE - len)
+        return 0;
+    if (s2_remapped_pages)
+        return s2_ipa_to_ptr(ipa, len);
+    return (void*)ipa;
+}
@@ -1,6 +1,21 @@
 #ifndef GUEST_MONITOR_H
 #define GUEST_MONITOR_H
 
-void guest_shared_dump(void);
+#include "types.h"
+
+/*
+ * EL2 telemetry sampler (core/guest_monitor.c). Every period it takes a
+ * seqlock-consistent snapshot of each guest's struct guest_telemetry and
+ * appends the fields that changed, delta-encoded, to a per-guest history
+ * ring. Snapshots are only taken between guest runs, so a guest caught inside
+ * an update is skipped for that period rather than waited for.
+ */
+
+// Zero the telemetry page and the histories; set the sampling period.
+void guest_monitor_init(void);
+// Scheduler hook: sample every guest if a period has elapsed.
+void guest_monitor_sample(void);
+// Print a guest's current record and its decoded history, oldest first.
+void guest_telemetry_dump(u64 guest_id);
 
 #endif /* GUEST_MONITOR_H */
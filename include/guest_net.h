@@ -0,0 +1,70 @@
+#ifndef GUEST_NET_H
+#define GUEST_NET_H
+
+#include <stdbool.h>
+#include "guest_stubs.h"
+#include "virtio.h"
+
+/*
+ * Guest driver for this guest's port on the EL2 packet switch
+ * (guests/guest_net.c). Every buffer is two descriptors, the virtio-net
+ * header and one page-aligned data page, which is the layout the switch can
+ * deliver by flipping pages instead of copying. The driver polls: it keeps
+ * used_event behind the used index so the device never interrupts, and only
+ * kicks when avail_event asks for it.
+ */
+
+#define GUEST_NET_QUEUE_NUM 64u
+#define GUEST_NET_BUFS      (GUEST_NET_QUEUE_NUM / 2u)
+#define GUEST_NET_BUF_BYTES 4096u
+
+struct guest_net_queue
+{
+    struct virtq_desc *desc;
+    struct virtq_avail *avail;
+    struct virtq_used *used;
+    u16 avail_idx;     // next avail->idx to publish
+    u16 kicked_idx;    // avail->idx at the last notification decision
+    u16 last_used;     // next used entry to consume
+};
+
+struct guest_net
+{
+    volatile u32 *regs;
+    u64 base;          // this guest's GUEST_NET_STRIDE slot
+    u8 mac[VIRTIO_NET_ETH_ALEN];
+    bool event_idx;
+    struct guest_net_queue rx;
+    struct guest_net_queue tx;
+    u64 kicks;
+};
+
+// Bring up the port of guest `guest_id` and post every receive buffer.
+bool guest_net_init(struct guest_net *net, u64 guest_id);
+// Data page of transmit buffer `slot` (< GUEST_NET_BUFS).
+void *guest_net_tx_buffer(struct guest_net *net, u32 slot);
+// Queue the frame in transmit buffer `slot`; nothing is sent before the kick.
+void guest_net_queue_tx(struct guest_net *net, u32 slot, u32 len);
+// Publish queued buffers and notify the device if it wants to hear about it.
+void guest_net_kick(struct guest_net *net, struct guest_net_queue *q, u32 queue);
+// True once the device has consumed every queued transmit buffer.
+bool guest_net_tx_done(struct guest_net *net);
+// Next received frame, or NULL. `buf` identifies the buffer for recycling.
+void *guest_net_recv(struct guest_net *net, u32 *len, u32 *buf);
+// Give a receive buffer back; it is posted at the next RX kick.
+void guest_net_recycle(struct guest_net *net, u32 buf);
+// Write 0 to Status; the device drops all queue state.
+void guest_net_reset(struct guest_net *net);
+
+// MAC of the switch port that belongs to guest `guest_id`.
+static inline void guest_net_mac(u64 guest_id, u8 *mac)
+{
+    mac[0] = 0x52;
+    mac[1] = 0x54;
+    mac[2] = 0x00;
+    mac[3] = 0x5c;
+    mac[4] = 0x00;
+    mac[5] = (u8)guest_id;
+}
+
+#endif /* GUEST_NET_H */
@@ -0,0 +1,29 @@
+#ifndef GUEST_POLL_H
+#define GUEST_POLL_H
+
+#include <stdbool.h>
+#include "guest_stubs.h"
+#include "guest_api.h"
+
+/*
+ * Exit-less requests serviced by the EL2 polling core (POLL_CORE=1). Every
+ * helper returns false when no polling core owns the ring so callers can fall
+ * back to the hypercall path.
+ */
+
+static inline struct guest_poll_ring* guest_poll_ring(u64 guest_id)
+{
+    return (struct guest_poll_ring*)(GUEST_POLL_RING_BASE +
+                                     guest_id * GUEST_POLL_RING_STRIDE);
+}
+
+static inline bool guest_poll_online(u64 guest_id)
+{
+    return guest_poll_ring(guest_id)->online != 0;
+}
+
+bool guest_poll_report(u64 guest_id, const struct guest_task_result *res);
+bool guest_poll_puts(u64 guest_id, const char *text);
+bool guest_poll_time(u64 guest_id, u64 *counter, u64 *frequency);
+
+#endif /* GUEST_POLL_H */
@@ -1,8 +1,11 @@
 #ifndef GUEST_STUBS_H
 #define GUEST_STUBS_H
 
+#include <stdbool.h>
 #include "types.h"
 #include "guest_layout.h"
+#include "smccc.h"
+#include "guest_api.h"
 
 /*
  * The guest stubs run inside the same flat address space that starts at
@@ -10,14 +13,32 @@
  * the tiny OSes can exchange state or interact with virtual devices.
  */
 
-static inline volatile u64* guest_shared_slot(u32 slot)
+static inline volatile struct guest_telemetry* guest_telemetry(u64 guest_id)
 {
-    return (volatile u64*)(GUEST_SHARED_BASE + (u64)slot * GUEST_SHARED_STRIDE);
+    return (volatile struct guest_telemetry*)(GUEST_SHARED_BASE +
+                                              guest_id * GUEST_TELEMETRY_STRIDE);
 }
 
-static inline void guest_log_value(u32 slot, u64 value)
+// Open and close a telemetry update; fields stored in between are sampled
+// together or not at all.
+static inline void guest_telemetry_begin(volatile struct guest_telemetry *t)
 {
-    *guest_shared_slot(slot) = value;
+    t->seq = t->seq + 1u;
+    asm volatile("dmb ishst" ::: "memory");
+}
+
+static inline void guest_telemetry_end(volatile struct guest_telemetry *t)
+{
+    asm volatile("dmb ishst" ::: "memory");
+    t->seq = t->seq + 1u;
+}
+
+static inline void guest_log_value(u64 guest_id, u32 field, u64 value)
+{
+    volatile struct guest_telemetry *t = guest_telemetry(guest_id);
+    guest_telemetry_begin(t);
+    t->field[field] = value;
+    guest_telemetry_end(t);
 }
 
 static inline void guest_yield(void)
@@ -39,6 +60,141 @@ static inline u64 guest_read_counter(void)
     return val;
 }
 
+static inline volatile struct guest_pvclock* guest_pvclock(u64 guest_id)
+{
+    return (volatile struct guest_pvclock*)(GUEST_PVCLOCK_BASE +
+                                            guest_id * GUEST_PVCLOCK_STRIDE);
+}
+
+// Sample the virtual counter together with the offset EL2 published for it,
+// retrying while the page is being rewritten. Never exits.
+static inline u64 guest_pvclock_read(u64 guest_id, u64 *host_cnt)
+{
+    volatile struct guest_pvclock *pv = guest_pvclock(guest_id);
+    u32 seq;
+    u64 virt, off;
+    do
+    {
+        seq = pv->seq;
+        asm volatile("dmb ishld" ::: "memory");
+        off = pv->cntvoff;
+        asm volatile("isb; mrs %0, cntvct_el0" : "=r"(virt));
+        asm volatile("dmb ishld" ::: "memory");
+    } while ((seq & 1u) || pv->seq != seq);
+
+    if (host_cnt)
+        *host_cnt = virt + off;
+    return virt;
+}
+
+// Host (physical) counter computed from the clock page instead of CNTPCT.
+static inline u64 guest_read_host_counter(u64 guest_id)
+{
+    u64 host;
+    guest_pvclock_read(guest_id, &host);
+    return host;
+}
+
+// Physical counter: traps to EL2 unless the CPU has FEAT_ECV.
+static inline u64 guest_read_phys_counter(void)
+{
+    u64 val;
+    asm volatile("mrs %0, cntpct_el0" : "=r"(val));
+    return val;
+}
+
+static inline u64 guest_read_frequency(void)
+{
+    u64 val;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(val));
+    return val;
+}
+
+// Virtual CPU interface (HCR_EL2.IMO routes these ICC_* accesses to the VGIC).
+#define GUEST_ICC_PMR_EL1     "S3_0_C4_C6_0"
+#define GUEST_ICC_IAR1_EL1    "S3_0_C12_C12_0"
+#define GUEST_ICC_EOIR1_EL1   "S3_0_C12_C12_1"
+#define GUEST_ICC_IGRPEN1_EL1 "S3_0_C12_C12_7"
+#define GUEST_VTIMER_INTID    27u
+#define GUEST_PMU_INTID       23u
+
+// Emulated distributor/redistributor registers used by guest_irq_init().
+#define GUEST_GICD_CTLR_ENGRP1 (1u << 1)
+#define GUEST_GICR_ISENABLER0  0x10100u
+
+// Enable group 1 at the distributor and the virtual timer PPI and channel
+// doorbell SGI at this vCPU's redistributor, then unmask all priorities at the
+// CPU interface.
+static inline void guest_irq_init(u64 guest_id)
+{
+    volatile u32 *gicd_ctlr = (volatile u32 *)GUEST_GICD_BASE;
+    *gicd_ctlr = *gicd_ctlr | GUEST_GICD_CTLR_ENGRP1;
+    volatile u32 *isenabler0 = (volatile u32 *)(GUEST_GICR_BASE + guest_id * GUEST_GICR_STRIDE +
+                                                GUEST_GICR_ISENABLER0);
+    *isenabler0 = (1u << GUEST_VTIMER_INTID) | (1u << GUEST_CHAN_SGI);
+
+    asm volatile("msr " GUEST_ICC_PMR_EL1 ", %0" : : "r"(0xFFull));
+    asm volatile("msr " GUEST_ICC_IGRPEN1_EL1 ", %0" : : "r"(1ull));
+    asm volatile("isb");
+}
+
+// Sleep for `ticks` of the virtual counter. The guest keeps PSTATE.I masked
+// and polls ICC_IAR1_EL1 after each WFI; EL2 blocks the vCPU until the timer
+// fires and delivers the expiry through a list register. Returns how many
+// virtual ticks after the deadline the expiry was acknowledged.
+static inline u64 guest_sleep_ticks(u64 ticks)
+{
+    asm volatile("msr cntv_tval_el0, %0" : : "r"(ticks));
+    asm volatile("msr cntv_ctl_el0, %0; isb" : : "r"(1ull)); // ENABLE, IMASK clear
+    for (;;)
+    {
+        asm volatile("wfi" ::: "memory");
+        u64 iar;
+        asm volatile("mrs %0, " GUEST_ICC_IAR1_EL1 : "=r"(iar));
+        const u32 intid = (u32)(iar & 0xFFFFFFu);
+        if (intid >= 1020)
+            continue; // spurious: woken for another reason
+        u64 late = 0;
+        if (intid == GUEST_VTIMER_INTID)
+        {
+            u64 now, cval;
+            asm volatile("mrs %0, cntvct_el0" : "=r"(now));
+            asm volatile("mrs %0, cntv_cval_el0" : "=r"(cval));
+            late = now - cval;
+            asm volatile("msr cntv_ctl_el0, xzr; isb"); // drop the level before EOI
+        }
+        asm volatile("msr " GUEST_ICC_EOIR1_EL1 ", %0" : : "r"(iar));
+        if (intid == GUEST_VTIMER_INTID)
+            return late;
+    }
+}
+
+// Sleep until the channel doorbell SGI arrives, at most `timeout` virtual
+// ticks. The armed timer is what lets EL2 block the vCPU in WFI rather than
+// merely yield it; the doorbell ends the block early. Returns true for a
+// doorbell, false on timeout.
+static inline bool guest_wait_doorbell(u64 timeout)
+{
+    asm volatile("msr cntv_tval_el0, %0" : : "r"(timeout));
+    asm volatile("msr cntv_ctl_el0, %0; isb" : : "r"(1ull));
+    for (;;)
+    {
+        asm volatile("wfi" ::: "memory");
+        u64 iar;
+        asm volatile("mrs %0, " GUEST_ICC_IAR1_EL1 : "=r"(iar));
+        const u32 intid = (u32)(iar & 0xFFFFFFu);
+        if (intid >= 1020)
+            continue;
+        if (intid == GUEST_VTIMER_INTID || intid == GUEST_CHAN_SGI)
+            asm volatile("msr cntv_ctl_el0, xzr; isb");
+        asm volatile("msr " GUEST_ICC_EOIR1_EL1 ", %0" : : "r"(iar));
+        if (intid == GUEST_CHAN_SGI)
+            return true;
+        if (intid == GUEST_VTIMER_INTID)
+            return false;
+    }
+}
+
 static inline u64 guest_read_current_el(void)
 {
     u64 val;
@@ -58,13 +214,71 @@ static inline volatile u64* guest_private_region(u64 guest_id)
     return (volatile u64*)(GUEST_WORK_BASE + guest_id * GUEST_WORK_STRIDE);
 }
 
+// SMCCC 1.1 fast call through HVC #0: arguments in x1-x3, results in x0-x3.
+struct guest_smccc_res
+{
+    u64 a0, a1, a2, a3;
+};
+
+static inline struct guest_smccc_res guest_smccc(u32 fid, u64 a1, u64 a2, u64 a3)
+{
+    register u64 x0 asm("x0") = fid;
+    register u64 x1 asm("x1") = a1;
+    register u64 x2 asm("x2") = a2;
+    register u64 x3 asm("x3") = a3;
+    asm volatile("hvc #0" : "+r"(x0), "+r"(x1), "+r"(x2), "+r"(x3) :: "memory");
+    struct guest_smccc_res res = { x0, x1, x2, x3 };
+    return res;
+}
+
 static inline void guest_set_virtual_time(u64 virtual_cnt)
 {
-    register u64 x0 asm("x0") = virtual_cnt;
-    asm volatile("hvc #0x61" : "+r"(x0) :: "memory");
+    guest_smccc(SCHISM_HYP_TIME_SET, virtual_cnt, 0, 0);
+}
+
+// Run `count` SMCCC operations in a single exit; returns how many completed.
+static inline u64 guest_multicall(struct smccc_multicall_op *ops, u64 count)
+{
+    return guest_smccc(SCHISM_HYP_MULTICALL, (u64)ops, count, 0).a1;
+}
+
+// Paravirtual spinlock slow path: ask EL2 to run the lock holder's vCPU.
+// Returns SMCCC_RET_NOT_REQUIRED if the holder cannot run right now.
+static inline u64 guest_yield_to(u64 vcpu_id)
+{
+    return guest_smccc(SCHISM_HYP_YIELD_TO, vcpu_id, 0, 0).a0;
+}
+
+// Fork the whole VM, every vCPU, into `count` clones. Returns in the caller
+// with a1 = clones made (a2 = CNTPCT ticks per clone, a3 = ticks since the VM
+// was created) and in each clone with a1 = 0 (a2 = its clone number).
+static inline struct guest_smccc_res guest_vm_clone(u64 count)
+{
+    return guest_smccc(SCHISM_HYP_VM_CLONE, count, 0, 0);
+}
+
+// Tell the peer at the other end of the channel that a ring it sleeps on
+// moved. Returns true if that woke it from a blocking WFI.
+static inline bool guest_chan_doorbell(u64 peer)
+{
+    return guest_smccc(SCHISM_HYP_CHAN_DOORBELL, peer, 0, 0).a1 != 0;
+}
+
+// Discover this vCPU's stolen-time record through PV_TIME_FEATURES/PV_TIME_ST.
+// Returns NULL if the hypervisor does not provide one.
+static inline volatile struct pv_time_stolen* guest_steal_time(void)
+{
+    if (guest_smccc(PV_TIME_FEATURES, PV_TIME_ST, 0, 0).a0 != SMCCC_RET_SUCCESS)
+        return (volatile struct pv_time_stolen*)0;
+    const u64 ipa = guest_smccc(PV_TIME_ST, 0, 0, 0).a0;
+    if ((s64)ipa < 0)
+        return (volatile struct pv_time_stolen*)0;
+    return (volatile struct pv_time_stolen*)ipa;
 }
 
 extern void guest_counter_os(u64 guest_id);
 extern void guest_memwalk_os(u64 guest_id);
+extern void guest_bench_os(u64 guest_id);
+extern void guest_bench_peer(u64 guest_id);
 
 #endif /* GUEST_STUBS_H */
@@ -4,8 +4,25 @@
 #include "guest_stubs.h"
 #include "guest_api.h"
 
+static inline struct guest_report_ring* guest_report_ring(u64 guest_id)
+{
+    return (struct guest_report_ring*)(GUEST_REPORT_RING_BASE +
+                                       guest_id * GUEST_REPORT_RING_STRIDE);
+}
+
 void guest_task_counter(u64 guest_id, struct guest_task_result *out);
 void guest_task_memwalk(u64 guest_id, struct guest_task_result *out);
 void guest_task_report(u64 guest_id, const struct guest_task_result *out);
+void guest_task_report_sync(u64 guest_id, const struct guest_task_result *out);
+void guest_task_flush(u64 guest_id);
+void guest_task_report_bench(u64 guest_id);
+void guest_task_timer_bench(u64 guest_id);
+void guest_task_lock_bench(u64 guest_id);
+void guest_task_irq_bench(u64 guest_id);
+void guest_task_pmu_profile(u64 guest_id);
+void guest_task_mmio_bench(u64 guest_id);
+void guest_task_blk_bench(u64 guest_id);
+void guest_task_net_bench(u64 guest_id);
+void guest_task_chan_bench(u64 guest_id);
 
 #endif /* GUEST_TASKS_H */
@@ -0,0 +1,33 @@
+#pragma once
+#include <stdbool.h>
+#include "types.h"
+#include "vcpu.h"
+
+// Physical interrupts at EL2 (core/irq.c). The CPU interface runs in EOImode 1:
+// ICC_EOIR1_EL1 only drops the running priority and ICC_DIR_EL1 deactivates.
+// That lets a handler forward an interrupt to a guest through a list register
+// with the HW bit set, leaving it active until the guest's own EOI deactivates
+// the physical interrupt, with no second exit.
+
+// INTIDs with a handler slot: SGIs, PPIs and the first SPIs.
+#define IRQ_NR_INTIDS 128u
+
+typedef enum irq_result
+{
+    IRQ_UNHANDLED = 0, // no owner; EL2 deactivates it and logs
+    IRQ_HANDLED,       // serviced at EL2; EL2 deactivates it
+    IRQ_FORWARDED,     // injected with ICH_LR.HW; the guest deactivates it
+} irq_result_t;
+
+// `vcpu` is the vCPU loaded in hardware when the IRQ was taken, or NULL when
+// EL2 was idle.
+typedef irq_result_t (*irq_handler_t)(vcpu_t *vcpu, u32 intid);
+
+bool irq_register(u32 intid, irq_handler_t fn);
+
+// Acknowledge and dispatch everything pending at the physical CPU interface.
+void irq_dispatch(vcpu_t *vcpu);
+
+// Record how long a forwarded interrupt took from its source firing (`ticks`
+// of CNTPCT) to reaching its list register; logged with the IRQ statistics.
+void irq_note_latency(u32 intid, u64 ticks);
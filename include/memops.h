@@ -0,0 +1,17 @@
+#pragma once
+#include <stddef.h>
+#include "types.h"
+
+// Bulk memory primitives for EL2 (arch/arm64/memops.S). With FEAT_MOPS they
+// run the CPYF*/SET* instruction triples and let the CPU choose its own block
+// size; otherwise they fall back to 64-byte ldp/stp loops. Both need Normal
+// memory, i.e. call them only once the EL2 MMU is on.
+
+// Set from ID_AA64ISAR2_EL1.MOPS by memops_init(); read by the assembly.
+extern u8 memops_mops_enabled;
+
+void memops_init(void);
+// Forward copy; `dst` and `src` must not overlap. Returns `dst`.
+void *hyp_memcpy(void *dst, const void *src, size_t bytes);
+// Fill with the low byte of `c`. Returns `dst`.
+void *hyp_memset(void *dst, int c, size_t bytes);
@@ -0,0 +1,52 @@
+#pragma once
+#include <stdbool.h>
+#include "types.h"
+#include "vcpu.h"
+
+// Trap-and-emulate MMIO (core/mmio_bus.c). Each VM owns a bus: a table of
+// non-overlapping IPA regions kept sorted by base, so a stage-2 fault is
+// resolved by binary search. Each vCPU remembers the region it hit last;
+// device drivers in a guest tend to hammer one device at a time.
+
+#define MMIO_BUS_MAX_REGIONS 16u
+
+// Device callbacks. `offset` is relative to the region base and `size` is the
+// access width in bytes (1, 2, 4 or 8). Return false to fail the access.
+typedef struct mmio_ops
+{
+    bool (*read)(vcpu_t *vcpu, void *opaque, u64 offset, u32 size, u64 *val);
+    bool (*write)(vcpu_t *vcpu, void *opaque, u64 offset, u32 size, u64 val);
+} mmio_ops_t;
+
+typedef struct mmio_region
+{
+    u64 base;
+    u64 size;
+    const mmio_ops_t *ops;
+    void *opaque;
+    const char *name;
+    u64 accesses;
+} mmio_region_t;
+
+typedef struct mmio_bus
+{
+    mmio_region_t regions[MMIO_BUS_MAX_REGIONS];
+    u32 count;
+} mmio_bus_t;
+
+void mmio_bus_init(mmio_bus_t *bus);
+// Insert a region, keeping the table sorted. Fails if it overlaps another
+// region or the table is full.
+bool mmio_bus_register(mmio_bus_t *bus, u64 base, u64 size, const mmio_ops_t *ops,
+                       void *opaque, const char *name);
+// Binary search for the region containing `ipa`; NULL if none.
+mmio_region_t *mmio_bus_find(mmio_bus_t *bus, u64 ipa);
+
+// Emulate the data abort the loaded vCPU took at `ipa`. Returns false if no
+// region claims the address or the access cannot be decoded; on success the
+// faulting instruction has been completed and only ELR remains to advance.
+bool mmio_emulate(vcpu_t *vcpu, u64 esr, u64 ipa, u64 elr);
+
+// Scratch device used to benchmark the emulation path (core/mmio_scratch.c).
+struct sch_vm;
+bool mmio_scratch_attach(struct sch_vm *vm, u64 base);
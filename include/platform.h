@@ -5,5 +5,28 @@
 #define UART_SIZE       0x1000ull
 #define UART_PA         UART0_BASE
 
-#define VIRT_PMU_BASE   0x09010000ull
-#define VIRT_PMU_SIZE   0x1000ull
+// GICv3: distributor and one 128 KiB redistributor frame per CPU.
+#define GICD_BASE       0x08000000ull
+#define GICD_SIZE       0x10000ull
+#define GICR_BASE       0x080A0000ull
+#define GICR_STRIDE     0x20000ull
+#define GICR_MAP_CPUS   2ull
+
+// The PMU has no MMIO frame: it is the PMU system registers plus overflow
+// PPI 23 (GIC_PPI_PMU), virtualized per vCPU by core/vpmu.c.
+
+// Guest RAM window: the first 256MB of DRAM, identity-mapped at stage-2 and
+// 1:1 at EL2.
+#define GUEST_RAM_BASE  0x40000000ull
+#define GUEST_RAM_SIZE  0x10000000ull
+
+// RAM disk behind the virtio-blk device, placed right after guest RAM by
+// QEMU's generic loader (see `make run`). EL2 maps it; stage-2 does not.
+#define DISK_IMAGE_BASE 0x50000000ull
+#define DISK_IMAGE_SIZE 0x01000000ull
+
+// Guest image staged by QEMU's generic loader right after the RAM disk
+// (`make run GUEST_IMG=...`). EL2 maps it read-only; stage-2 maps its pages
+// into the guest in place (core/guest_image.c).
+#define GUEST_IMAGE_BASE 0x51000000ull
+#define GUEST_IMAGE_SIZE 0x01000000ull
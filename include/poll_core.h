@@ -0,0 +1,24 @@
+#pragma once
+#include <stdbool.h>
+#include "types.h"
+#include "vcpu.h"
+
+// Build with POLL_CORE=1 (see Makefile) to dedicate CPU1 to servicing the
+// guests' exit-less request rings at GUEST_POLL_RING_BASE.
+#ifndef CONFIG_POLL_CORE
+#define CONFIG_POLL_CORE 0
+#endif
+
+// Zero the request rings; must run before any guest starts.
+void poll_rings_reset(void);
+// Serve ring `idx` on behalf of `vcpu` from now on; bind every ring before
+// poll_core_start(). The binding is fixed: clones of a VM have vCPUs with the
+// same IDs but their own rings, which the polling core does not serve.
+void poll_ring_bind(u32 idx, const vcpu_t *vcpu);
+// Tell the polling core that `vcpu`'s CNTVOFF_EL2 changed. Called on CPU0
+// wherever the offset is rewritten; a no-op for vCPUs bound to no ring.
+void poll_ring_publish_offset(const vcpu_t *vcpu);
+// Bring the polling core up through PSCI CPU_ON. Returns false if firmware refused.
+bool poll_core_start(void);
+// C entry point of the polling core (called from _secondary_start).
+void el2_poll_core_main(u64 context_id);
@@ -0,0 +1,68 @@
+#pragma once
+#include <stdbool.h>
+#include "types.h"
+
+// Build with PROFILE=1 (see Makefile) for the EL2 sampling profiler
+// (core/prof.c). core/vpmu.c then hides the last PMU event counter from the
+// guests (MDCR_EL2.HPMN) and the profiler runs it on CPU cycles at every EL,
+// reloading it to overflow every PROF_PERIOD cycles. PPI 23 is moved to group
+// 0 so the overflow arrives as FIQ, which EL2 keeps unmasked while it runs
+// with IRQs masked. Each sample records ELR, SPSR.M's exception level and the
+// scheduled vCPU in a per-CPU buffer that is printed as "PROF" lines from the
+// scheduler's yield path; tools/prof_report.sh symbolizes them against
+// schism.elf.
+#ifndef CONFIG_PROFILE
+#define CONFIG_PROFILE 0
+#endif
+
+#ifndef PROF_PERIOD
+#define PROF_PERIOD 1000000u // cycles between samples
+#endif
+
+#define PROF_MAX_CPUS 2u     // boot CPU and the polling core
+#define PROF_SAMPLES  2048u  // per buffer; two buffers per CPU
+#define PROF_NO_VCPU  0xFFFFu
+
+#if CONFIG_PROFILE
+
+// Program the reserved counter, route PPI 23 as FIQ and unmask FIQs at EL2.
+// Runs after vpmu_init().
+void prof_init(void);
+// FIQ taken from a guest (el2_exception_common) or from EL2 itself
+// (el2_fiq_current in arch/arm64/vectors_el2.S).
+void prof_fiq(u64 elr, u64 spsr);
+void prof_fiq_el2(u64 elr, u64 spsr);
+// Scheduler hook: print this CPU's buffer once it is half full.
+void prof_poll(void);
+// Print whatever is buffered and the totals; called before powering off.
+void prof_dump(void);
+
+// Exception entry masks FIQs again; EL2 lifts the mask once it is in C.
+static inline void prof_el2_unmask(void)
+{
+    asm volatile("msr daifclr, #1" ::: "memory");
+}
+
+// Keep the sampler out of code that walks the PMU through PMSELR_EL0.
+static inline u64 prof_fiq_save(void)
+{
+    u64 daif;
+    asm volatile("mrs %0, DAIF\n\tmsr daifset, #1" : "=r"(daif) : : "memory");
+    return daif;
+}
+
+static inline void prof_fiq_restore(u64 daif)
+{
+    asm volatile("msr DAIF, %0" : : "r"(daif) : "memory");
+}
+
+#else
+
+static inline void prof_init(void) { }
+static inline void prof_poll(void) { }
+static inline void prof_dump(void) { }
+static inline void prof_el2_unmask(void) { }
+static inline u64 prof_fiq_save(void) { return 0; }
+static inline void prof_fiq_restore(u64 daif) { (void)daif; }
+
+#endif
@@ -1,4 +1,5 @@
 #pragma once
+#include <stdbool.h>
 #include <stdint.h>
 #include "types.h"
 #include "mem_attrs.h"
@@ -8,7 +9,8 @@
 #define IPA_BITS 39 // IPA width used by Stage-2 (guest-physical) addresses
 
 // VMID used in VTTBR_EL2 to tag Stage-2 translations for a given guest VM.
-// Multiple guests can coexist by using different VMIDs to avoid TLB conflicts.
+// Multiple guests can coexist by using different VMIDs to avoid TLB conflicts;
+// each root s2_clone() creates takes the next one up.
 #define VMID 1      // Virtual Machine Identifier used in VTTBR_EL2.VMID
 
 // Table/page/block common:
@@ -22,6 +24,10 @@
 #define S2AP_R               (1ull << 6)          // S2AP[0] (read)
 #define S2AP_W               (1ull << 7)          // S2AP[1] (write)
 #define S2_XN                (1ull << 54)         // XN bit at [54] for S2 blocks/pages
+// Software-defined bits [58:55], ignored by the walker:
+#define S2_SW_COW            (1ull << 55)         // read-only for now, private copy on first write
+#define S2_SW_SHARED         (1ull << 56)         // backed by a page other mappings share
+#define S2_SW_COUNTED        (1ull << 57)         // copy-on-write, sharers counted per page
 
 // AttrIndx values we use when building Stage-2 entries (map to MAIR_EL2 bytes):
 #define S2_ATTRIDX_NORMAL    NORMAL_WB    // AttrIndx 0 -> MAIR_EL2[7:0]  (Normal WB WA)
@@ -36,3 +42,83 @@ void s2_build_tables_identity(u64 ipa_base, u64 pa_base, u64 vm_size,
 void s2_program_regs_and_enable(void);
 // Switch from EL2 to EL1 at the given PC/SP with the current trap/s2 configuration.
 void enter_el1_at(void (*el1_pc)(void), u64 sp_el1);
+
+// Pages, across all stage-2 roots, whose output address currently differs
+// from their IPA or which are shared (copy-on-write included). While it is
+// zero the guest RAM map is a pure identity map EL2 may write through.
+extern u32 s2_remapped_pages;
+// Walk stage-2 for [ipa, ipa + len); NULL unless it is mapped to physically
+// contiguous memory, which EL2 reaches 1:1.
+void* s2_ipa_to_ptr(u64 ipa, u64 len);
+// Exchange the physical pages behind two page-aligned IPAs and invalidate
+// their TLB entries; the packet switch flips buffers this way.
+bool s2_swap_pages(u64 ipa_a, u64 ipa_b);
+
+// Take a zeroed page from the stage-2 frame pool, which backs copy-on-write
+// copies and partially filled image pages; NULL once it is exhausted.
+void* s2_frame_alloc(void);
+// Point the guest page at `ipa` to `pa`, replacing a live entry with
+// break-before-make. With `cow`, `pa` is shared: the page is mapped read-only
+// and s2_cow_fault() gives the guest a private copy on its first write.
+// Shared pages are never written through s2_ipa_to_ptr(), which breaks COW
+// first and refuses read-only shared pages.
+bool s2_map_guest_page(u64 ipa, u64 pa, bool write, bool exec, bool cow);
+// Resolve a stage-2 write fault on a copy-on-write page. The last root still
+// sharing a page s2_clone() made copy-on-write gets it back writable without
+// a copy. False if the page at `ipa` is not copy-on-write or the frame pool is
+// empty; s2_cow_pending() tells the two apart.
+bool s2_cow_fault(u64 ipa);
+// Whether the page at `ipa` is mapped copy-on-write.
+bool s2_cow_pending(u64 ipa);
+// Frames handed out by s2_frame_alloc() so far.
+u32 s2_frames_used(void);
+// Make a page EL2 just wrote visible to the guest's instruction fetches.
+void s2_sync_icache(const void* page);
+
+// An IPA range, [ipa, ipa + size).
+typedef struct s2_range
+{
+    u64 ipa;
+    u64 size;
+} s2_range_t;
+
+// Make the stage-2 root behind `vttbr` the one the calls above walk and
+// modify; world_switch() follows the vCPU it enters. Unknown values are
+// ignored.
+void s2_activate(u64 vttbr);
+// Copy the stage-2 root behind `src_vttbr` into a new root under a VMID of
+// its own and return the new VTTBR_EL2 value, or 0 if the roots or table
+// pools are exhausted. Writable pages become copy-on-write in both roots,
+// except inside the `direct` ranges, which stay writable and shared (memory
+// EL2 itself reads and writes at fixed addresses). Pages in guest RAM or the
+// frame pool are counted (S2_SW_COUNTED), so the last root to write one keeps
+// it; any other shared page is copied by every root that writes it.
+u64 s2_clone(u64 src_vttbr, const s2_range_t* direct, u32 ndirect);
+// How many more s2_clone() calls on `src_vttbr` the free roots and tables
+// allow.
+u32 s2_clone_room(u64 src_vttbr);
+// Give root `vttbr`, which s2_clone() made and no vCPU has run on yet, a
+// private writable copy of the page-aligned range at `ipa`, in consecutive
+// pool frames. Returns the physical base of the copy; 0 if a page of the range
+// is unmapped or s2_frames_contiguous() is too small.
+u64 s2_copy_range(u64 vttbr, u64 ipa, u64 size);
+// Frames s2_copy_range() can still take in one piece.
+u32 s2_frames_contiguous(void);
+// Give a root s2_clone() made back, with its tables. Its share of every
+// copy-on-write page goes, so another root may now be the last writer; frames
+// it was the last to share return to the pool. No vCPU may still run on it.
+void s2_release(u64 vttbr);
+
+// Whether the CPU sets stage-2 access flags itself (FEAT_HAFDBS); if so
+// VTCR_EL2.HA is enabled and a cleared flag costs no exit.
+bool s2_hw_access_flag(void);
+// Clear the access flag of the `pages` pages from `ipa` in the active root.
+// Bit i of `mapped` says page i is mapped and of `accessed` that its flag
+// was set, i.e. it was used since the last call; both hold (pages + 63) / 64
+// words. Returns the number of mapped pages.
+u32 s2_age_pages(u64 ipa, u32 pages, u64* accessed, u64* mapped);
+// Resolve a stage-2 access-flag fault at `ipa` by setting the flag again.
+// False if the page is not mapped.
+bool s2_access_fault(u64 ipa);
+// Access-flag faults s2_access_fault() has resolved.
+u64 s2_access_faults(void);
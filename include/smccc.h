@@ -0,0 +1,70 @@
+#ifndef SMCCC_H
+#define SMCCC_H
+
+#include "types.h"
+
+/*
+ * SMC Calling Convention (Arm DEN0028) function IDs shared by EL2 and the
+ * guests. Bit 31 marks a fast call, bit 30 the SMC64 convention, bits[29:24]
+ * the owning entity and bits[15:0] the function number.
+ */
+#define SMCCC_FAST_CALL          (1u << 31)
+#define SMCCC_SMC64              (1u << 30)
+#define SMCCC_OWNER_SHIFT        24
+#define SMCCC_OWNER_MASK         0x3Fu
+#define SMCCC_OWNER_ARCH         0u
+#define SMCCC_OWNER_STD          4u
+#define SMCCC_OWNER_STD_HYP      5u
+#define SMCCC_OWNER_VENDOR_HYP   6u
+
+#define SMCCC_CALL(smc64, owner, fn) \
+    (SMCCC_FAST_CALL | ((smc64) ? SMCCC_SMC64 : 0u) | \
+     ((u32)(owner) << SMCCC_OWNER_SHIFT) | (u32)(fn))
+
+// Arm architecture calls.
+#define SMCCC_VERSION            SMCCC_CALL(0, SMCCC_OWNER_ARCH, 0x0000)
+#define SMCCC_ARCH_FEATURES      SMCCC_CALL(0, SMCCC_OWNER_ARCH, 0x0001)
+#define SMCCC_VERSION_1_1        0x10001u
+
+// Vendor-specific hypervisor service queries.
+#define SMCCC_VENDOR_HYP_CALL_UID SMCCC_CALL(0, SMCCC_OWNER_VENDOR_HYP, 0xFF01)
+#define SMCCC_VENDOR_HYP_REVISION SMCCC_CALL(0, SMCCC_OWNER_VENDOR_HYP, 0xFF03)
+
+// Schism vendor hypervisor calls (SMC64 fast calls, results in x0-x3).
+#define SCHISM_HYP_TASK_REPORT   SMCCC_CALL(1, SMCCC_OWNER_VENDOR_HYP, 0x0001) // x1 = struct guest_task_result*
+#define SCHISM_HYP_TIME_SET      SMCCC_CALL(1, SMCCC_OWNER_VENDOR_HYP, 0x0002) // x1 = virtual counter -> x1 = applied
+#define SCHISM_HYP_TIME_GET      SMCCC_CALL(1, SMCCC_OWNER_VENDOR_HYP, 0x0003) // -> x1 = virtual counter, x2 = CNTFRQ
+#define SCHISM_HYP_RING_DOORBELL SMCCC_CALL(1, SMCCC_OWNER_VENDOR_HYP, 0x0004) // -> x1 = records drained
+#define SCHISM_HYP_YIELD_TO      SMCCC_CALL(1, SMCCC_OWNER_VENDOR_HYP, 0x0005) // x1 = target vcpu_id
+#define SCHISM_HYP_CHAN_DOORBELL SMCCC_CALL(1, SMCCC_OWNER_VENDOR_HYP, 0x0006) // x1 = peer vcpu_id -> x1 = woken
+#define SCHISM_HYP_VM_CLONE      SMCCC_CALL(1, SMCCC_OWNER_VENDOR_HYP, 0x0007) // x1 = clones -> x1 = made (0 in a clone), x2, x3
+#define SCHISM_HYP_MULTICALL     SMCCC_CALL(1, SMCCC_OWNER_VENDOR_HYP, 0x0010) // x1 = ops*, x2 = count -> x1 = executed
+
+// Standard secure service: PSCI (Arm DEN0022).
+#define PSCI_SYSTEM_OFF          SMCCC_CALL(0, SMCCC_OWNER_STD, 0x0008)
+
+// Standard hypervisor service: paravirtualized time (Arm DEN0057).
+#define PV_TIME_FEATURES         SMCCC_CALL(1, SMCCC_OWNER_STD_HYP, 0x0020) // x1 = function -> x0 = 0 if supported
+#define PV_TIME_ST               SMCCC_CALL(1, SMCCC_OWNER_STD_HYP, 0x0021) // -> x0 = IPA of struct pv_time_stolen
+
+#define SCHISM_HYP_REVISION_MAJOR 1u
+#define SCHISM_HYP_REVISION_MINOR 0u
+
+// Standard return codes (w0).
+#define SMCCC_RET_SUCCESS        0ull
+#define SMCCC_RET_NOT_SUPPORTED  ((u64)-1)
+#define SMCCC_RET_NOT_REQUIRED   ((u64)-2)
+#define SMCCC_RET_INVALID_PARAM  ((u64)-3)
+
+// One operation of a SCHISM_HYP_MULTICALL vector. EL2 runs the entries in
+// order within a single exit and stops at the first one returning an error.
+#define SCHISM_MULTICALL_MAX     32u
+
+struct smccc_multicall_op
+{
+    u64 fid;     // function ID (nested multicalls are rejected)
+    u64 args[6]; // x1-x6
+    u64 ret[4];  // x0-x3 on completion
+};
+
+#endif /* SMCCC_H */
@@ -0,0 +1,29 @@
+#pragma once
+#include "types.h"
+
+// Minimal test-and-set lock for EL2 code shared between physical CPUs. Only
+// valid once the EL2 stage-1 MMU is on: exclusives need Normal cacheable memory.
+typedef struct spinlock
+{
+    volatile u32 locked;
+} spinlock_t;
+
+static inline void spin_lock(spinlock_t *lock)
+{
+    u32 tmp;
+    asm volatile(
+        "   sevl\n"
+        "1: wfe\n"
+        "2: ldaxr %w0, [%1]\n"
+        "   cbnz  %w0, 1b\n"
+        "   stxr  %w0, %w2, [%1]\n"
+        "   cbnz  %w0, 2b\n"
+        : "=&r"(tmp)
+        : "r"(&lock->locked), "r"(1u)
+        : "memory");
+}
+
+static inline void spin_unlock(spinlock_t *lock)
+{
+    asm volatile("stlr wzr, [%0]" : : "r"(&lock->locked) : "memory");
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include "types.h"
+#include "vcpu.h"
+
+// Zero the steal-time records and register the PV_TIME SMCCC services.
+void steal_time_init(void);
+
+// Move a vCPU to a new accounting state (VCPU_ACCT_*) at the current CNTPCT,
+// charging the elapsed time to the state it leaves. Leaving the runnable
+// state publishes the updated steal time to the guest.
+void vcpu_acct_set(vcpu_t *vcpu, u8 state);
+
+// Convert CNTPCT ticks to nanoseconds.
+u64 counter_ticks_to_ns(u64 ticks);
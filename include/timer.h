@@ -0,0 +1,76 @@
+#pragma once
+#include <stdbool.h>
+#include "types.h"
+#include "vcpu.h"
+
+// CNTHCTL_EL2 fields (HCR_EL2.E2H == 0 layout).
+#define CNTHCTL_EL1PCTEN (1ull << 0)  // EL1/EL0 read CNTPCT_EL0 without trapping
+#define CNTHCTL_EL1PCEN  (1ull << 1)  // EL1/EL0 access CNTP_* without trapping
+#define CNTHCTL_ECV      (1ull << 12) // apply CNTPOFF_EL2 to the EL1 physical counter/timer
+
+// FEAT_ECV physical offset; spelled by encoding for pre-v8.6 assemblers.
+#define CNTPOFF_EL2_SYSREG "S3_4_C14_C0_6"
+
+// Offsets follow the architecture: guest count = host count - offset. The
+// same offset goes into CNTVOFF_EL2 and, with ECV, CNTPOFF_EL2, so the guest
+// sees one clock through both counters.
+
+// Non-zero when CNTPOFF_EL2 is live and physical timer accesses run natively.
+// Read by the world-switch and vector assembly to skip the CVAL conversion.
+extern u8 timer_ecv_enabled;
+
+// Probe FEAT_ECV (ID_AA64MMFR0_EL1.ECV >= 2) and return the CNTHCTL_EL2 value
+// to program: physical counter/timer passthrough with ECV, full traps without.
+u64 timer_cnthctl_init(void);
+
+// Load a vCPU's counter offset into CNTVOFF_EL2 (and CNTPOFF_EL2 with ECV).
+void timer_load_offset(u64 offset);
+
+// CNTV_CTL_EL0 / CNTP_CTL_EL0 bits.
+#define CNT_CTL_ENABLE  (1ull << 0)
+#define CNT_CTL_IMASK   (1ull << 1)
+#define CNT_CTL_ISTATUS (1ull << 2)
+
+// Virtual timer delivery (core/vtimer.c). An expiry of the loaded vCPU's CNTV
+// arrives as physical PPI 27 and is forwarded through a list register with the
+// HW bit; the physical interrupt stays active until the guest EOIs it. vCPUs
+// blocked in WFI sit on an EL2 queue ordered by deadline and are woken by the
+// EL2 physical timer.
+
+// Register the timer PPI handlers with the EL2 IRQ layer.
+void vtimer_init(void);
+
+// Block a vCPU that executed WFI with its virtual timer armed. Returns false
+// (the WFI completes immediately) if the timer is off or already due.
+bool vtimer_block(vcpu_t *vcpu);
+// Wake a blocked vCPU early because an interrupt became pending for it.
+void vtimer_unblock(vcpu_t *vcpu);
+// Deschedule hook: park the vCPU's CNTV and save the active state of PPI 27.
+void vtimer_put(vcpu_t *vcpu);
+// Entry hook: restore the active state of PPI 27, then flush pending virtual
+// interrupts to the list registers.
+void vtimer_sync(vcpu_t *vcpu);
+// Sleep in WFI until an interrupt arrives; called when no vCPU is runnable.
+void vtimer_idle(void);
+// Start a new scheduling time slice. When it runs out, CNTHP_EL2 preempts the
+// running vCPU (request_yield + preempted).
+void vtimer_slice_start(void);
+
+// Paravirtual clock pages (core/pvclock.c).
+void pvclock_reset(void);
+// Publish the vCPU's current counter offset to its clock page.
+void pvclock_update(const vcpu_t *vcpu);
+// Count a time override and publish the new offset.
+void pvclock_rebased(const vcpu_t *vcpu);
+
+// Convert a guest CNTP_CVAL to the value held in hardware and back. With ECV
+// the hardware compares against the offset count, so no conversion is needed.
+static inline u64 timer_cval_to_hw(const vcpu_t *vcpu, u64 virt_cval)
+{
+    return timer_ecv_enabled ? virt_cval : virt_cval + vcpu->arch.cntvoff_el2;
+}
+
+static inline u64 timer_cval_from_hw(const vcpu_t *vcpu, u64 hw_cval)
+{
+    return timer_ecv_enabled ? hw_cval : hw_cval - vcpu->arch.cntvoff_el2;
+}
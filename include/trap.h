@@ -0,0 +1,94 @@
+#pragma once
+#include <stdbool.h>
+#include "vcpu.h"
+#include "guest_api.h"
+#include "smccc.h"
+
+// ESR_EL2 exception classes (EC, bits[31:26]) the dispatcher routes.
+#define ESR_EC_SHIFT     26
+#define ESR_EC_MASK      0x3Fu
+#define ESR_EC_COUNT     64u
+#define ESR_EC_WFX       0x01u // WFI/WFE
+#define ESR_EC_FP        0x07u // FP/SIMD trapped by CPTR_EL2.TFP
+#define ESR_EC_HVC64     0x16u // HVC from AArch64 (ELR already past the HVC)
+#define ESR_EC_SMC64     0x17u // SMC from AArch64 trapped by HCR_EL2.TSC
+#define ESR_EC_SYS64     0x18u // MSR/MRS/system instruction
+#define ESR_EC_SVE       0x19u // SVE trapped by CPTR_EL2.TZ
+#define ESR_EC_IABT_LOW  0x20u
+#define ESR_EC_IABT_CUR  0x21u
+#define ESR_EC_DABT_LOW  0x24u
+#define ESR_EC_DABT_CUR  0x25u
+
+static inline u32 esr_ec(u64 esr)
+{
+    return (u32)((esr >> ESR_EC_SHIFT) & ESR_EC_MASK);
+}
+
+// Everything a handler may need about the exit being serviced.
+typedef struct trap_ctx
+{
+    u64 esr;
+    u64 elr;
+    u64 spsr;
+    u64 far;
+    u64 code;     // vector slot code pushed by vectors_el2.S
+    vcpu_t *vcpu; // vCPU that trapped (NULL if none is scheduled)
+} trap_ctx_t;
+
+// What the common exit path should do once a handler returns.
+typedef enum trap_result
+{
+    TRAP_UNHANDLED = 0, // dump state and hang
+    TRAP_RESUME,        // resume at ELR untouched (HVC, or retry after a fixup)
+    TRAP_ADVANCE,       // retire the trapped instruction: ELR += 4, then ISB
+} trap_result_t;
+
+typedef trap_result_t (*trap_handler_t)(trap_ctx_t *ctx);
+
+// Hypercall immediates below this bound dispatch through a direct-indexed table.
+#define TRAP_HVC_IMM_SLOTS 0x80u
+
+// SMCCC arguments/results: a[0] holds the function ID on entry and the result
+// x0 on return; a[1..7] mirror x1-x7. Handlers only touch this array, so the
+// same handler serves HVC, SMC and any batching front end.
+#define SMCCC_NR_ARGS 8u
+typedef struct smccc_args
+{
+    u64 a[SMCCC_NR_ARGS];
+} smccc_args_t;
+
+typedef void (*smccc_handler_t)(vcpu_t *vcpu, smccc_args_t *args);
+
+// Trapped system register handlers, keyed by SYS_REG_ENCODE(). `val` holds the
+// value written by the guest, or receives the value a read returns.
+#define SYS_REG_ENCODE(op0, op1, crn, crm, op2) \
+    ((u32)(((op0) << 14) | ((op1) << 10) | ((crn) << 6) | ((crm) << 2) | (op2)))
+
+typedef bool (*sysreg_handler_t)(vcpu_t *vcpu, bool is_read, u64 *val);
+
+typedef struct sysreg_trap
+{
+    u32 encoding;
+    sysreg_handler_t fn;
+} sysreg_trap_t;
+
+// Sorted-table lookup (core/sysreg.c); NULL when the register is not emulated.
+const sysreg_trap_t *sysreg_trap_find(u32 encoding);
+// Verify the sysreg table ordering; returns false if it was mis-sorted.
+bool sysreg_table_check(void);
+
+bool trap_register_hvc(u16 imm16, trap_handler_t fn);
+bool trap_register_smccc(u32 function_id, smccc_handler_t fn);
+smccc_handler_t trap_smccc_lookup(u32 function_id);
+// Run one SMCCC call against the registered services (also used by multicall).
+void smccc_dispatch(vcpu_t *vcpu, smccc_args_t *args);
+u64 trap_exit_count(u32 ec);
+void trap_init(void);
+
+// Guest hypercall handlers (core/hypercall.c).
+void hypercall_init(void);
+u32 guest_report_ring_drain(vcpu_t *vcpu);
+
+// Log one guest task report on the console (shared by the HVC, ring and
+// polling-core paths so every transport prints the same format).
+void guest_report_print(const vcpu_t *vcpu, const struct guest_task_result *res);
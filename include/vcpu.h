@@ -1,4 +1,6 @@
+#pragma once
 #include <stdbool.h>
+#include <stddef.h>
 #include "types.h"
 
 // This structure holds the CPU state for a virtual CPU (VCPU) in the hypervisor.
@@ -21,58 +23,193 @@ typedef struct trapframe
 } trapframe_t;
 
 
-// Architecture-specific state for a VCPU
+// Emulated GIC interrupt space: 32 private INTIDs (SGIs/PPIs) per vCPU plus
+// VGIC_NR_SPIS shared ones per VM.
+#define VGIC_NR_PRIVATE 32u
+#define VGIC_NR_SPIS    256u
+#define VGIC_NR_IRQS    (VGIC_NR_PRIVATE + VGIC_NR_SPIS)
+
+// Per-interrupt state bits (core/vgic.c), one bitmap per field. Private
+// interrupts keep one 32-bit word per field in the vCPU; SPIs live in the
+// VM's distributor.
+enum {
+    VGIC_STATE_ENABLED = 0,
+    VGIC_STATE_PENDING,  // waiting for a list register
+    VGIC_STATE_ACTIVE,
+    VGIC_STATE_GROUP1,
+    VGIC_STATE_EDGE,     // ICFGR: edge-triggered
+    VGIC_STATE_LEVEL,    // input line of a level-sensitive interrupt
+    VGIC_STATE_HW,       // forwarded from the same physical INTID
+    VGIC_STATE_QUEUED,   // has an entry in the target vCPU's priority queue
+    VGIC_STATE_IN_LR,    // held by a list register
+    VGIC_NR_STATES,
+};
+
+// Cold per-vCPU state: only world_switch() touches it, and only when the
+// loaded vCPU changes. It lives outside vcpu_t, in the vCPU arena's cold
+// array (vcpu_alloc()).
+struct vcpu_fp
+{
+    u8 used;               // Non-zero once the SIMD state is captured
+    u32 fpcr;              // Floating-point control register (FPCR)
+    u32 fpsr;              // Floating-point status register (FPSR)
+    u64 vregs[32][2];      // Q0-Q31, two 64-bit lanes per 128-bit register
+};
+
+struct vcpu_sve
+{
+    u8 used;
+};
+
+struct vcpu_pauth
+{
+    u8 used;
+    u64 apia, apib, apda, apdb; // Pointer Authentication Keys
+};
+
+typedef struct vcpu_cold
+{
+    struct vcpu_fp fp;
+    struct vcpu_sve sve;
+    struct vcpu_pauth pauth;
+} __attribute__((aligned(64))) vcpu_cold_t;
+
+// Architecture-specific state for a VCPU. The trapframe opens it on a cache
+// line boundary; the exit vector stores all of it on every exit. What each
+// exit also reads or writes follows directly, switch-only state after that.
 typedef struct vcpu_arch
 {
+    trapframe_t tf; // Guest register state
     u64 vttbr_el2;   // Virtualization Translation Table Base Register for EL2
+
+    struct {
+        u64 deadline;       // CNTPCT at which CNTV fires while the vCPU is blocked
+        struct vcpu *next;  // EL2 timer queue link
+        bool phys_active;   // PPI 27 is to be made active again when the vCPU enters
+    } vtimer; // Virtual timer delivery
+
     u64 cntvoff_el2; // Counter-timer Virtual Offset Register for EL2
     u64 cntvct_el0;  // Last virtual counter snapshot to freeze time when descheduled
 
     // Feature blocks
-    struct
-    {
-        u8 used;               // Non-zero once the SIMD state is captured
-        u32 fpcr;              // Floating-point control register (FPCR)
-        u32 fpsr;              // Floating-point status register (FPSR)
-        u64 vregs[32][2];      // Q0-Q31, two 64-bit lanes per 128-bit register
-    } fp; // Floating Point and SIMD state
-    struct {
-        u8 used;
-    } sve; // Scalable Vector Extension
-
-    struct {
-        u8 used;
-        u64 apia, apib, apda, apdb; // Pointer Authentication Keys
-    } pauth; // Pointer Authentication
+    struct vcpu_fp *fp;       // Floating Point and SIMD state
+    struct vcpu_sve *sve;     // Scalable Vector Extension
+    struct vcpu_pauth *pauth; // Pointer Authentication
 
     struct {
+        u16 lr_used;   // list registers holding an interrupt put there by EL2
+        u16 queue_len;
+        u32 priv[VGIC_NR_STATES];    // SGI/PPI state bitmaps, bit = INTID
+        u8 priority[VGIC_NR_PRIVATE];
+        u32 redist_waker;        // GICR_WAKER.ProcessorSleep
         u64 lrs[16]; // List Registers for Virtualization
         u32 vmcr;   // Virtualization Miscellaneous Control Register
         u32 apr;   // Active Priority Register (AP0R0) for the VGIC
+        u32 apr1;  // Group 1 Active Priority Register (AP1R0)
+        u32 queue[VGIC_NR_IRQS]; // min-heap of (priority << 16) | INTID
     } vgic; // Virtual Generic Interrupt Controller
 
-    trapframe_t tf; // Guest register state
-} vcpu_arch_t;
+    struct {
+        u8 used;            // guest touched the PMU; its registers are context switched
+        bool phys_active;   // PPI 23 is to be made active again when the vCPU enters
+        u64 pmcr, pmselr, pmuserenr, pmccfiltr, pmccntr;
+        u32 cnten, inten, ovs; // PMCNTENSET/PMINTENSET/PMOVSSET, bit 31 = cycle counter
+        u64 evtyper[31], evcntr[31];
+        u64 overflows;      // overflow interrupts forwarded
+    } pmu; // Virtual PMU (core/vpmu.c)
+} __attribute__((aligned(64))) vcpu_arch_t;
+
 
+// Optional hardware state a vCPU is configured with (vcpu_set_features()).
+// world_switch() runs the put/load pair generated for exactly that set, so a
+// vCPU pays nothing per switch for a feature it lacks. Without FP, FP/SIMD
+// and SVE instructions trap to EL2 (CPTR_EL2.TFP); without VGIC the virtual
+// CPU interface is off; without PMU every PMU access traps. A trapped
+// instruction is injected back as UNDEFINED.
+#define VCPU_FEAT_FP    (1u << 0)
+#define VCPU_FEAT_SVE   (1u << 1)
+#define VCPU_FEAT_PAUTH (1u << 2)
+#define VCPU_FEAT_VGIC  (1u << 3)
+#define VCPU_FEAT_PMU   (1u << 4)
+#define VCPU_FEAT_ALL   0x1Fu
 
-// Main VCPU structure
+// Main VCPU structure. The first cache line holds the scheduler state every
+// exit reads or writes; the trapframe starts on the next one. Per-exit-type
+// and per-switch state follows `arch`.
 typedef struct vcpu
 {
-    vcpu_arch_t arch;
-    struct sch_vm *vm; // Back-reference to parent VM
+    bool request_yield; // Flag to request a yield after a trap
+    bool blocked;       // Waiting in WFI for its virtual timer; not runnable
+    bool preempted;     // Descheduled by time-slice expiry while runnable
+    u32 features;       // VCPU_FEAT_* in effect
     int vcpu_id;   // VCPU identifier within the VM
+    struct sch_vm *vm; // Back-reference to parent VM
+    struct {
+        u8 state;       // VCPU_ACCT_*
+        u64 since;      // CNTPCT of the last transition (0: not started)
+        u64 run, wait, blocked; // CNTPCT ticks spent in each state
+    } acct; // Run/steal accounting (core/steal_time.c)
+
+    vcpu_arch_t arch;
+
+    struct vcpu *yield_to; // Directed-yield target for the next scheduling decision
+    void (*switch_put)(struct vcpu*);   // world_switch() halves for `features`
+    void (*switch_load)(struct vcpu*);
     void (*kresume)(struct vcpu*); // Kernel resume function pointer
     u64 kresume_arg0, kresume_arg1; // Arguments for kresume
-    bool request_yield; // Flag to request a yield after a trap
-} vcpu_t;
+    struct {
+        struct mmio_region *last; // region of the previous MMIO exit
+        u64 exits, cache_hits, decoded;
+    } mmio; // Trap-and-emulate MMIO (core/mmio_bus.c)
+    struct {
+        u64 last_pc;    // ELR of the previous WFE exit
+        u64 last_time;  // CNTPCT of the previous WFE exit
+        u32 streak;     // consecutive WFE exits at last_pc within the window
+        u64 wfe_exits, spins_detected, directed_yields;
+        u64 yield_to_calls, yield_to_misses;
+    } spin; // Spin-loop detection and directed-yield counters
+} __attribute__((aligned(64))) vcpu_t;
+
+_Static_assert(offsetof(vcpu_t, arch.tf) == 64,
+               "the trapframe must start the second cache line of vcpu_t");
+
+enum {
+    VCPU_ACCT_RUNNABLE = 0, // waiting for a CPU: counted as steal time
+    VCPU_ACCT_RUNNING  = 1,
+    VCPU_ACCT_BLOCKED  = 2, // idle in WFI by its own choice
+};
 
 extern trapframe_t *current_trapframe;
 
 void vcpu_scheduler_register(vcpu_t* vcpu);
 void vcpu_scheduler_set_current(vcpu_t* vcpu);
 vcpu_t* vcpu_scheduler_current(void);
+vcpu_t* vcpu_scheduler_find(int vcpu_id);
 bool vcpu_scheduler_yield(void);
+// WFE exit policy: directed yield to a preempted sibling, or a plain yield
+// once the vCPU is detected spinning at the same PC.
+void vcpu_wfe_exit(vcpu_t* vcpu, u64 pc);
+// Paravirtual yield_to: give the CPU to vCPU `target_id` of the same VM.
+// Returns 0 on success, -1 for an invalid target, -2 if it cannot run.
+int vcpu_yield_to(vcpu_t* vcpu, int target_id);
 void vcpu_run(vcpu_t* vcpu);
 void world_switch(vcpu_t *from, vcpu_t *to);
+// Save the state the loaded vCPU keeps in hardware (FP, vGIC, PMU, counter)
+// into its vcpu_t, so all of it can be read there; the next world_switch()
+// loads it again.
+void vcpu_put_loaded(void);
+// Per-CPU vCPU arenas (core/vcpu_arena.c): each CPU's vcpu_t blocks sit back
+// to back, and their cold blocks in a separate array behind them.
+#define VCPU_ARENA_CPUS  2u   // boot CPU and the polling core
+#define VCPU_ARENA_SLOTS 8u
+
+// A zeroed vCPU from `cpu`'s arena with its cold blocks attached, or NULL.
+// Needs the EL2 MMU on (hyp_memset()).
+vcpu_t *vcpu_alloc(u32 cpu);
+// Slots left in `cpu`'s arena.
+u32 vcpu_arena_free(u32 cpu);
+// Give `vcpu` the VCPU_FEAT_* set `features`, less what EL2 cannot switch,
+// and select its world_switch() variant. Call before the vCPU first runs.
+void vcpu_set_features(vcpu_t *vcpu, u32 features);
 
 extern void guest_el1_vectors(void);
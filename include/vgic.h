@@ -0,0 +1,62 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include "types.h"
+#include "vcpu.h"
+
+struct sch_vm;
+
+// Emulated GICv3 (core/vgic.c, core/vgic_mmio.c). Interrupt state lives in
+// bitmaps (VGIC_STATE_*): private INTIDs in the vCPU, SPIs in the VM's
+// distributor. Every vCPU has a min-heap of pending interrupts keyed by
+// priority; on entry the highest-priority ones go into free list registers,
+// and if more are waiting than fit, the underflow maintenance interrupt
+// brings EL2 back to refill them once the guest has drained the LRs.
+
+#define VGIC_SPI_WORDS (VGIC_NR_SPIS / 32u)
+
+typedef struct vgic_dist
+{
+    u32 ctlr;                                  // GICD_CTLR.EnableGrp0/1
+    u32 spi[VGIC_NR_STATES][VGIC_SPI_WORDS];   // SPI state bitmaps
+    u8 priority[VGIC_NR_SPIS];
+    u8 target[VGIC_NR_SPIS];                   // vCPU index from GICD_IROUTER
+} vgic_dist_t;
+
+#define VGIC_DIST_CTLR_ENGRP0 (1u << 0)
+#define VGIC_DIST_CTLR_ENGRP1 (1u << 1)
+
+// Number of implemented list registers (ICH_VTR_EL2.ListRegs + 1).
+size_t vgic_lr_count(void);
+
+void vgic_dist_init(vgic_dist_t *dist);
+// Reset a vCPU's private interrupts: all disabled, group 1, priority 0.
+void vgic_vcpu_reset(vcpu_t *vcpu);
+// Register the maintenance interrupt handler with the EL2 IRQ layer.
+void vgic_init(void);
+// Map the emulated GICD and one GICR frame per vCPU on the VM's MMIO bus.
+bool vgic_mmio_attach(struct sch_vm *vm);
+
+// State word holding `intid`'s bit for `field` as seen from `vcpu`, or NULL
+// if the INTID does not exist.
+u32 *vgic_state_word(vcpu_t *vcpu, u32 field, u32 intid);
+u8 *vgic_priority(vcpu_t *vcpu, u32 intid);
+// vCPU that receives `intid` when raised from `vcpu`'s point of view.
+vcpu_t *vgic_target(vcpu_t *vcpu, u32 intid);
+// Re-evaluate `intid` after a state change: queue it on its target if it is
+// now pending and enabled.
+void vgic_update(vcpu_t *vcpu, u32 intid);
+// Re-queue every pending interrupt, e.g. after a distributor enable.
+void vgic_requeue_all(struct sch_vm *vm);
+
+// Mark an SGI/PPI (INTID < 32) pending for a vCPU.
+void vgic_set_pending(vcpu_t *vcpu, u32 intid);
+// As vgic_set_pending(), for a physical PPI EL2 acknowledged but left active:
+// the list register gets ICH_LR.HW, so the guest's EOI deactivates it.
+void vgic_set_pending_hw(vcpu_t *vcpu, u32 intid);
+// Drive the input line of a level-sensitive SPI (or pulse an edge one).
+void vgic_set_spi_level(struct sch_vm *vm, u32 intid, bool level);
+
+// Entry hook for the loaded vCPU: retire list registers the guest has
+// completed, then refill free ones from the priority queue.
+void vgic_flush(vcpu_t *vcpu);
@@ -0,0 +1,159 @@
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include <stdbool.h>
+#include "types.h"
+
+/*
+ * virtio 1.x definitions shared by the EL2 device models (core/virtio_*.c)
+ * and the guest drivers: the virtio-mmio register map, split virtqueue
+ * layout and the block request format. All fields are little-endian.
+ */
+
+#define VIRTIO_MMIO_MAGIC               0x74726976u // "virt"
+#define VIRTIO_MMIO_VERSION_2           2u
+#define VIRTIO_MMIO_VENDOR_SCHISM       0x4D484353u // "SCHM"
+
+#define VIRTIO_MMIO_MAGIC_VALUE         0x000u
+#define VIRTIO_MMIO_VERSION             0x004u
+#define VIRTIO_MMIO_DEVICE_ID           0x008u
+#define VIRTIO_MMIO_VENDOR_ID           0x00Cu
+#define VIRTIO_MMIO_DEVICE_FEATURES     0x010u
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL 0x014u
+#define VIRTIO_MMIO_DRIVER_FEATURES     0x020u
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL 0x024u
+#define VIRTIO_MMIO_QUEUE_SEL           0x030u
+#define VIRTIO_MMIO_QUEUE_NUM_MAX       0x034u
+#define VIRTIO_MMIO_QUEUE_NUM           0x038u
+#define VIRTIO_MMIO_QUEUE_READY         0x044u
+#define VIRTIO_MMIO_QUEUE_NOTIFY        0x050u
+#define VIRTIO_MMIO_INTERRUPT_STATUS    0x060u
+#define VIRTIO_MMIO_INTERRUPT_ACK       0x064u
+#define VIRTIO_MMIO_STATUS              0x070u
+#define VIRTIO_MMIO_QUEUE_DESC_LOW      0x080u
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH     0x084u
+#define VIRTIO_MMIO_QUEUE_DRIVER_LOW    0x090u
+#define VIRTIO_MMIO_QUEUE_DRIVER_HIGH   0x094u
+#define VIRTIO_MMIO_QUEUE_DEVICE_LOW    0x0A0u
+#define VIRTIO_MMIO_QUEUE_DEVICE_HIGH   0x0A4u
+#define VIRTIO_MMIO_CONFIG_GENERATION   0x0FCu
+#define VIRTIO_MMIO_CONFIG              0x100u
+#define VIRTIO_MMIO_SIZE                0x200u
+
+#define VIRTIO_MMIO_INT_VRING           (1u << 0)
+#define VIRTIO_MMIO_INT_CONFIG          (1u << 1)
+
+#define VIRTIO_STATUS_ACKNOWLEDGE       1u
+#define VIRTIO_STATUS_DRIVER            2u
+#define VIRTIO_STATUS_DRIVER_OK         4u
+#define VIRTIO_STATUS_FEATURES_OK       8u
+#define VIRTIO_STATUS_NEEDS_RESET       64u
+#define VIRTIO_STATUS_FAILED            128u
+
+#define VIRTIO_RING_F_INDIRECT_DESC     28u
+#define VIRTIO_RING_F_EVENT_IDX         29u
+#define VIRTIO_F_VERSION_1              32u
+
+#define VIRTIO_ID_NET                   1u
+#define VIRTIO_ID_BLOCK                 2u
+
+// Split virtqueue (virtio 1.x section 2.7).
+#define VIRTQ_DESC_F_NEXT               1u
+#define VIRTQ_DESC_F_WRITE              2u  // device writes the buffer
+#define VIRTQ_DESC_F_INDIRECT           4u  // buffer is a table of descriptors
+#define VIRTQ_AVAIL_F_NO_INTERRUPT      1u
+#define VIRTQ_USED_F_NO_NOTIFY          1u
+
+struct virtq_desc
+{
+    u64 addr;
+    u32 len;
+    u16 flags;
+    u16 next;
+};
+
+// Followed by `u16 used_event` when VIRTIO_RING_F_EVENT_IDX is negotiated.
+struct virtq_avail
+{
+    u16 flags;
+    u16 idx;
+    u16 ring[];
+};
+
+struct virtq_used_elem
+{
+    u32 id;
+    u32 len;
+};
+
+// Followed by `u16 avail_event` when VIRTIO_RING_F_EVENT_IDX is negotiated.
+struct virtq_used
+{
+    u16 flags;
+    u16 idx;
+    struct virtq_used_elem ring[];
+};
+
+static inline volatile u16 *virtq_used_event(struct virtq_avail *avail, u16 num)
+{
+    return (volatile u16 *)&avail->ring[num];
+}
+
+static inline volatile u16 *virtq_avail_event(struct virtq_used *used, u16 num)
+{
+    return (volatile u16 *)&used->ring[num];
+}
+
+// True if moving an index from `old_idx` to `new_idx` passes `event`, i.e. the
+// other side asked to be told about entry `event`.
+static inline bool virtq_need_event(u16 event, u16 new_idx, u16 old_idx)
+{
+    return (u16)(new_idx - event - 1u) < (u16)(new_idx - old_idx);
+}
+
+// virtio-blk (virtio 1.x section 5.2). A request is a header, zero or more
+// data buffers and a one-byte status the device writes last.
+#define VIRTIO_BLK_F_FLUSH              9u
+#define VIRTIO_BLK_SECTOR_SIZE          512u
+#define VIRTIO_BLK_ID_BYTES             20u
+
+#define VIRTIO_BLK_T_IN                 0u
+#define VIRTIO_BLK_T_OUT                1u
+#define VIRTIO_BLK_T_FLUSH              4u
+#define VIRTIO_BLK_T_GET_ID             8u
+
+#define VIRTIO_BLK_S_OK                 0u
+#define VIRTIO_BLK_S_IOERR              1u
+#define VIRTIO_BLK_S_UNSUPP             2u
+
+struct virtio_blk_req_hdr
+{
+    u32 type;
+    u32 reserved;
+    u64 sector;
+};
+
+// Device configuration space at VIRTIO_MMIO_CONFIG; only capacity is used.
+#define VIRTIO_BLK_CFG_CAPACITY         0x00u  // u64, in 512-byte sectors
+
+// virtio-net (virtio 1.x section 5.1). Every buffer starts with the header;
+// with VIRTIO_F_VERSION_1 it always carries num_buffers.
+#define VIRTIO_NET_F_MAC                5u
+#define VIRTIO_NET_Q_RX                 0u
+#define VIRTIO_NET_Q_TX                 1u
+#define VIRTIO_NET_ETH_ALEN             6u
+
+struct virtio_net_hdr
+{
+    u8 flags;
+    u8 gso_type;
+    u16 hdr_len;
+    u16 gso_size;
+    u16 csum_start;
+    u16 csum_offset;
+    u16 num_buffers;
+};
+
+#define VIRTIO_NET_CFG_MAC              0x00u  // u8[6]
+
+#endif /* VIRTIO_H */
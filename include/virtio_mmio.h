@@ -0,0 +1,108 @@
+#pragma once
+#include <stdbool.h>
+#include "types.h"
+#include "vcpu.h"
+#include "virtio.h"
+
+struct sch_vm;
+
+// EL2 virtio-mmio transport (core/virtio_mmio.c). It owns the register file,
+// feature negotiation and the split virtqueues; a device model supplies its
+// feature bits, config space and a notify hook. Rings and buffers live in
+// guest RAM and are reached through guest_ipa_to_ptr().
+
+#define VIRTIO_MAX_QUEUES 2u
+#define VIRTQ_NUM_MAX     128u
+// Most buffers one chain may carry, direct or through an indirect table.
+#define VIRTQ_MAX_SEGS    16u
+
+typedef struct virtq
+{
+    u16 num;
+    bool ready;
+    u64 desc_ipa;
+    u64 avail_ipa;
+    u64 used_ipa;
+    struct virtq_desc *desc;   // EL2 pointers, valid while ready
+    struct virtq_avail *avail;
+    struct virtq_used *used;
+    u16 last_avail;            // next available entry to consume
+    u16 used_idx;              // used->idx as it will next be published
+    u16 signalled_used;        // used->idx when the driver was last considered for an interrupt
+} virtq_t;
+
+// One buffer of a popped chain, already translated for EL2.
+typedef struct virtq_seg
+{
+    void *ptr;
+    u64 ipa;
+    u32 len;
+    bool write;                // device-writable
+} virtq_seg_t;
+
+typedef struct virtq_chain
+{
+    u16 head;
+    u16 nr_segs;
+    virtq_seg_t segs[VIRTQ_MAX_SEGS];
+} virtq_chain_t;
+
+typedef struct virtio_dev virtio_dev_t;
+
+typedef struct virtio_dev_ops
+{
+    // QueueNotify: consume everything available on `queue`.
+    void (*notify)(virtio_dev_t *dev, vcpu_t *vcpu, u32 queue);
+    // Read from the device config space; `offset` is relative to VIRTIO_MMIO_CONFIG.
+    u64 (*config_read)(virtio_dev_t *dev, u64 offset, u32 size);
+    // Optional: the driver wrote 0 to Status.
+    void (*reset)(virtio_dev_t *dev);
+} virtio_dev_ops_t;
+
+struct virtio_dev
+{
+    struct sch_vm *vm;
+    const virtio_dev_ops_t *ops;
+    void *opaque;
+    const char *name;
+    u32 device_id;
+    u32 intid;                 // level-sensitive SPI
+    u32 nr_queues;
+    u64 device_features;
+    u64 driver_features;
+    u32 device_features_sel;
+    u32 driver_features_sel;
+    u32 queue_sel;
+    u32 status;
+    u32 interrupt_status;
+    virtq_t vq[VIRTIO_MAX_QUEUES];
+
+    u64 notifies;
+    u64 chains;
+    u64 irqs;
+    u64 irqs_suppressed;
+};
+
+// Map the transport at `base` on the VM's MMIO bus. The caller fills in ops,
+// opaque, name, device_id, nr_queues and device_features beforehand.
+bool virtio_mmio_attach(virtio_dev_t *dev, struct sch_vm *vm, u64 base, u32 intid);
+bool virtio_has_feature(const virtio_dev_t *dev, u32 bit);
+
+// Take the next available chain, following an indirect table if there is one.
+// Returns false when the ring is empty; a malformed chain also sets
+// VIRTIO_STATUS_NEEDS_RESET and stops the device.
+bool virtq_pop(virtio_dev_t *dev, virtq_t *vq, virtq_chain_t *chain);
+// Hand back the chain popped last; the next pop returns it again.
+void virtq_unpop(virtio_dev_t *dev, virtq_t *vq);
+// Queue a completion. Nothing is visible to the driver until virtq_complete().
+void virtq_push(virtq_t *vq, u16 head, u32 len);
+// Publish the completions pushed so far and, unless the driver suppressed it,
+// raise the interrupt once for the whole batch. Returns true if buffers are
+// still available (the driver may have added them before it saw
+// avail_event), in which case the caller should pop again.
+bool virtq_complete(virtio_dev_t *dev, virtq_t *vq);
+
+// Block device backed by a RAM disk image EL2 has mapped (core/virtio_blk.c).
+bool virtio_blk_attach(struct sch_vm *vm, u64 base, u32 intid, void *image, u64 bytes);
+// Port of the EL2 packet switch (core/virtio_net.c), identified by `mac`.
+bool virtio_net_attach(struct sch_vm *vm, u64 base, u32 intid, const u8 *mac);
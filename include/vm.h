@@ -0,0 +1,36 @@
+#pragma once
+#include <stdbool.h>
+#include "types.h"
+#include "guest_layout.h"
+#include "vcpu.h"
+#include "mmio_bus.h"
+#include "vgic.h"
+
+#define VM_MAX_VCPUS 8
+
+// A guest VM: one stage-2 context shared by its vCPUs.
+typedef struct sch_vm
+{
+    int vm_id;
+    u64 vttbr_el2;                 // VMID + stage-2 root shared by all vCPUs
+    vcpu_t *vcpus[VM_MAX_VCPUS];
+    u32 nr_vcpus;
+    mmio_bus_t mmio;               // emulated device regions
+    vgic_dist_t vgic;              // emulated GIC distributor state
+    u64 created;                   // CNTPCT at vm_init()
+    u64 records;                   // where EL2 finds the VM's report rings, pvclock
+                                   // and steal-time records (GUEST_REPORT_RING_BASE..)
+} sch_vm_t;
+
+// Physical address EL2 uses for the per-vCPU record at `ipa` in the report
+// ring, pvclock or steal-time pages of `vm`: a clone has private copies.
+static inline u64 vm_record_pa(const sch_vm_t *vm, u64 ipa)
+{
+    return (vm ? vm->records : GUEST_REPORT_RING_BASE) + (ipa - GUEST_REPORT_RING_BASE);
+}
+
+void vm_init(sch_vm_t *vm, int vm_id, u64 vttbr_el2);
+// Attach a vCPU to the VM; it inherits the VM's stage-2 context.
+bool vm_add_vcpu(sch_vm_t *vm, vcpu_t *vcpu);
+// Find a vCPU of the VM by its vcpu_id.
+vcpu_t *vm_find_vcpu(const sch_vm_t *vm, int vcpu_id);
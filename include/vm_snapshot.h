@@ -0,0 +1,52 @@
+#pragma once
+#include <stdbool.h>
+#include "types.h"
+#include "vcpu.h"
+#include "vm.h"
+
+// Most VMs vm_snapshot_clone() creates. Each one takes a stage-2 root, an
+// MMIO scratch device and a vCPU arena slot per vCPU of the template.
+#define VM_SNAPSHOT_MAX_CLONES 3u
+
+// A VM frozen at one instant: its stage-2 layout and memory, as a root of its
+// own that no vCPU runs on and whose writable pages are copy-on-write, and
+// the register state of each vCPU.
+typedef struct vm_snapshot
+{
+    const sch_vm_t *vm; // template
+    u64 vttbr_el2;      // frozen stage-2 root
+    u64 taken;          // CNTPCT when the snapshot was taken
+    u32 nr_vcpus;
+    struct {
+        int vcpu_id;
+        u32 features;
+        u64 wait;         // acct.wait: run-queue ticks so far
+        vcpu_arch_t arch; // fp/sve/pauth still point at the template's
+        vcpu_cold_t cold;
+    } vcpus[VM_MAX_VCPUS];
+    vgic_dist_t vgic;
+} vm_snapshot_t;
+
+// Clones of `vm` that vm_snapshot_take() and vm_snapshot_clone() can still
+// make together: the snapshot and every clone need a stage-2 root and tables,
+// and each clone a VM slot, arena room for its vCPUs and pool frames for its
+// private pages.
+u32 vm_snapshot_room(const sch_vm_t *vm);
+// Capture `vm`. Its writable memory becomes copy-on-write, for the VM itself
+// as well, except the pages EL2 reads and writes directly: telemetry, rings,
+// pvclock, steal time and packet buffers. False if no stage-2 root or table is
+// left.
+bool vm_snapshot_take(vm_snapshot_t *snap, sch_vm_t *vm);
+// Create and schedule a VM that resumes where the snapshot was taken, under a
+// VMID of its own and sharing the snapshot's memory copy-on-write. It gets
+// private copies of the template's telemetry, poll ring, report ring, pvclock
+// and steal-time pages. Clones get
+// the vGIC and the MMIO scratch device but no virtio devices, and a vCPU that
+// was blocked in WFI resumes as if the WFI had returned. NULL once
+// VM_SNAPSHOT_MAX_CLONES, the stage-2 pools or the vCPU arena run out.
+sch_vm_t *vm_snapshot_clone(const vm_snapshot_t *snap);
+// Give the snapshot's stage-2 root back. Clones already made keep running on
+// their own roots.
+void vm_snapshot_release(vm_snapshot_t *snap);
+// Register SCHISM_HYP_VM_CLONE.
+void vm_snapshot_init(void);
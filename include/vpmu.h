@@ -0,0 +1,57 @@
+#pragma once
+#include <stdbool.h>
+#include "types.h"
+#include "vcpu.h"
+
+// Per-vCPU PMU (core/vpmu.c). A vCPU starts with MDCR_EL2.TPM/TPMCR set, so
+// a guest that never profiles costs one MDCR_EL2 write per switch at most.
+// Its first PMU register access traps; from then on its PMU state is part of
+// the vCPU and saved/restored by world_switch(), and overflow PPI 23 is
+// forwarded to it through the vGIC.
+
+// MDCR_EL2 fields.
+#define MDCR_EL2_HPMN_MASK 0x1Full
+#define MDCR_EL2_TPMCR     (1ull << 5)  // trap PMCR_EL0
+#define MDCR_EL2_TPM       (1ull << 6)  // trap every PMU register
+#define MDCR_EL2_HPME      (1ull << 7)  // enable counters [HPMN, N) reserved for EL2
+#define MDCR_EL2_HPMD      (1ull << 17) // no guest counting at EL2 (FEAT_PMUv3p1)
+
+// PMCR_EL0 fields.
+#define PMCR_E         (1ull << 0)
+#define PMCR_P         (1ull << 1)  // reset event counters (write-only)
+#define PMCR_C         (1ull << 2)  // reset the cycle counter (write-only)
+#define PMCR_LC        (1ull << 6)
+#define PMCR_N_SHIFT   11
+#define PMCR_N_MASK    0x1Full
+#define PMCR_WRITABLE  0xFFull      // E, P, C, D, X, DP, LC, LP
+
+#define PMU_CYCLE_BIT  31u
+
+// PMEVTYPER<n>_EL0 fields.
+#define PMEVTYPER_NSH      (1ull << 27) // count at EL2 as well
+#define PMU_EVT_CPU_CYCLES 0x11ull
+
+// Probe the PMU, quiesce it, trap it for every vCPU and claim PPI 23.
+void vpmu_init(void);
+// Event counters a guest sees (MDCR_EL2.HPMN).
+u32 vpmu_guest_counters(void);
+// The event counter reserved for EL2 in PROFILE builds, or -1.
+int vpmu_el2_counter(void);
+// True for the encodings MDCR_EL2.TPM traps (SYS_REG_ENCODE layout).
+bool vpmu_is_pmu_sysreg(u32 encoding);
+// First trapped access: give `vcpu` the PMU. The caller retries the access,
+// or makes it UNDEFINED on false.
+bool vpmu_trap(vcpu_t *vcpu);
+// Called by world_switch() as `vcpu` leaves and enters the hardware.
+void vpmu_put(vcpu_t *vcpu);
+void vpmu_load(vcpu_t *vcpu);
+// Load for a vCPU configured without VCPU_FEAT_PMU: every access traps.
+void vpmu_block(void);
+// A guest counter overflowed with its interrupt enabled. With `sync` set the
+// overflow is injected into the vCPU owning the PMU right away; without, as
+// when it interrupted EL2, it is held until that vCPU's next vpmu_sync() or
+// vpmu_put(). Returns true if the PPI now belongs to the guest and must stay
+// active; false if there was nothing to forward.
+bool vpmu_overflow(bool sync);
+// Called by world_switch() before entering `vcpu`.
+void vpmu_sync(vcpu_t *vcpu);
@@ -0,0 +1,62 @@
+#pragma once
+#include <stdbool.h>
+#include "types.h"
+#include "vcpu.h"
+
+// Build with WSS=1 (see Makefile) for the working-set estimator (core/wss.c).
+// Every WSS_PERIOD_US it clears the stage-2 access flag of the next
+// WSS_SCAN_PAGES guest RAM pages of the VM that just ran, and counts the pages
+// whose flag came back since the previous sweep. Where the CPU has FEAT_HAFDBS
+// the walker sets the flag again for free (VTCR_EL2.HA); elsewhere the first
+// access to an aged page takes an access-flag fault that EL2 resolves (core/
+// trap.c). Per page it keeps the number of sweeps since it was last accessed,
+// and at the end of each sweep publishes and prints an idle-page histogram.
+#ifndef CONFIG_WSS
+#define CONFIG_WSS 0
+#endif
+
+#ifndef WSS_PERIOD_US
+#define WSS_PERIOD_US  1000u // microseconds between scan windows
+#endif
+#ifndef WSS_SCAN_PAGES
+#define WSS_SCAN_PAGES 512u  // pages per window
+#endif
+
+#define WSS_MAX_VMS    4u    // the boot VM and VM_SNAPSHOT_MAX_CLONES clones
+// Idle-page buckets: accessed during the last sweep, idle 1 sweep, 2-3,
+// 4-7, 8-15, 16-31, 32-63 and 64 or more sweeps.
+#define WSS_BUCKETS    8u
+
+struct sch_vm;
+
+typedef struct wss_histogram
+{
+    u64 sweeps;               // complete sweeps so far
+    u32 mapped;               // mapped guest RAM pages
+    u32 pages[WSS_BUCKETS];   // pages per idle bucket
+} wss_histogram_t;
+
+#if CONFIG_WSS
+
+// Note the scan period and whether access flags are set in hardware.
+void wss_init(void);
+// Scheduler hook, called while `vcpu`'s stage-2 root is still the active one:
+// scan the next window of its VM's guest RAM once a period has passed.
+void wss_poll(vcpu_t *vcpu);
+// The histogram of `vm`'s last complete sweep; false before the first one.
+// The first sweep sees every page as accessed: stage-2 entries are created
+// with the flag set.
+bool wss_histogram(const struct sch_vm *vm, wss_histogram_t *out);
+
+#else
+
+static inline void wss_init(void) { }
+static inline void wss_poll(vcpu_t *vcpu) { (void)vcpu; }
+static inline bool wss_histogram(const struct sch_vm *vm, wss_histogram_t *out)
+{
+    (void)vm;
+    (void)out;
+    return false;
+}
+
+#endif
@@ -0,0 +1,48 @@
+# Turn the serial log of a BENCH=1 run into JSON, one entry per
+# "[guest0] bench <name> <unit> data0=<value> data1=<ticks>" record.
+# Usage: awk -v label=<build id> -f tools/bench_parse.awk serial.log
+# Exits non-zero if the suite did not reach its final "done" record.
+
+function hex(s,    i, c, v) {
+    sub(/^0x/, "", s)
+    v = 0
+    for (i = 1; i <= length(s); i++) {
+        c = index("0123456789abcdef", tolower(substr(s, i, 1)))
+        if (c == 0)
+            break
+        v = v * 16 + c - 1
+    }
+    return v
+}
+
+function field(key,    i) {
+    for (i = 1; i <= NF; i++)
+        if (index($i, key "=") == 1)
+            return hex(substr($i, length(key) + 2))
+    return 0
+}
+
+{ sub(/\r$/, "") }
+
+$1 ~ /^\[guest[0-9]+\]$/ && $2 == "bench" {
+    name = $3
+    if (name == "done") {
+        done = 1
+        next
+    }
+    n++
+    names[n] = name
+    units[n] = $4
+    values[n] = field("data0")
+    ticks[n] = field("data1")
+}
+
+END {
+    printf "{\n  \"label\": \"%s\",\n  \"complete\": %s,\n  \"results\": [", label, done ? "true" : "false"
+    fmt = "%s\n    { \"name\": \"%s\", \"unit\": \"%s\", \"value\": %.0f, \"ticks\": %.0f }"
+    for (i = 1; i <= n; i++)
+        printf fmt, (i > 1 ? "," : ""), names[i], units[i], values[i], ticks[i]
+    printf "\n  ]\n}\n"
+    if (!done)
+        exit 1
+}
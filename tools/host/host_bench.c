@@ -0,0 +1,896 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "el2_mmu.h"
+#include "host_mock.h"
+#include "platform.h"
+#include "s2_mmu.h"
+#include "vcpu.h"
+#include "vm.h"
+
+/*
+ * Host build of the stage-2 and EL2 table builders and the vCPU scheduler
+ * (`make host-bench`). It first cross-checks them against independent
+ * references over randomized rounds - a plain VMSAv8-64 table walker for the
+ * MMU cores, stage-2 copy-on-write, clones and access-flag aging, a
+ * round-robin model for pick-next - and aborts on the first mismatch. Then it
+ * times table construction, cloning, mapping, lookups, aging and pick-next,
+ * and prints how many cache lines of vcpu_t a guest exit touches.
+ *
+ * usage: host_bench [seed [rounds]]
+ */
+
+#define PAGE        0x1000ull
+#define BLOCK_2M    0x200000ull
+#define ADDR_MASK   (((1ull << 48) - 1ull) & ~(PAGE - 1ull))
+#define S2_MAX_ROOTS_HOST 8 // S2_MAX_ROOTS in core/s2_mmu.c
+
+// Leaf attribute bits as the architecture defines them for EL2 stage 1.
+#define REF_ATTRIDX(x) (((u64)(x) & 7ull) << 2)
+#define REF_AP_RO      (1ull << 7)
+#define REF_SH_INNER   (3ull << 8)
+#define REF_AF         (1ull << 10)
+#define REF_PXN_UXN    ((1ull << 53) | (1ull << 54))
+
+static u64 rng_seed;
+static u64 rng_state;
+
+static u64 rnd(void)
+{
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dull;
+}
+
+static u64 rnd_below(u64 n)
+{
+    return n ? rnd() % n : 0;
+}
+
+static u64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + (u64)ts.tv_nsec;
+}
+
+static void fail(const char *what, u64 addr, u64 got, u64 want)
+{
+    fprintf(stderr, "MISMATCH %s at 0x%llx: got 0x%llx want 0x%llx (seed 0x%llx)\n",
+            what, (unsigned long long)addr, (unsigned long long)got,
+            (unsigned long long)want, (unsigned long long)rng_seed);
+    exit(1);
+}
+
+// --- Reference walker --------------------------------------------------------
+
+typedef struct ref_leaf {
+    bool valid;
+    int level;
+    u64 out;    // output address of `va`
+    u64 attrs;  // leaf descriptor without address and type bits
+} ref_leaf_t;
+
+// 4KB granule, 39-bit input, walk starting at level 1. Table addresses are
+// host pointers, which the builders store as their "physical" addresses.
+static ref_leaf_t ref_walk(u64 root, u64 va)
+{
+    ref_leaf_t leaf = {0};
+    u64 table = root & ADDR_MASK;
+    for (int level = 1; level <= 3; ++level)
+    {
+        const unsigned shift = 39u - 9u * (unsigned)level;
+        const u64 desc = ((const u64 *)(uintptr_t)table)[(va >> shift) & 0x1ffull];
+        if (!(desc & 1ull))
+            return leaf;
+        const bool table_or_page = (desc & 2ull) != 0;
+        if (level < 3 && table_or_page)
+        {
+            table = desc & ADDR_MASK;
+            continue;
+        }
+        if (level == 3 && !table_or_page)
+            return leaf; // reserved encoding
+        const u64 size = 1ull << shift;
+        leaf.valid = true;
+        leaf.level = level;
+        leaf.out = (desc & ADDR_MASK & ~(size - 1ull)) | (va & (size - 1ull));
+        leaf.attrs = desc & ~ADDR_MASK & ~3ull;
+        return leaf;
+    }
+    return leaf;
+}
+
+// --- Stage 2 -----------------------------------------------------------------
+
+static u64 s2_root(void)
+{
+    s2_program_regs_and_enable();
+    return host_read_sysreg("VTTBR_EL2");
+}
+
+static u64 s2_expected_attrs(bool r, bool w, bool x)
+{
+    return S2_AF | S2_SH_INNER | S2_MEMATTR(S2_ATTRIDX_NORMAL) |
+           (r ? S2AP_R : 0) | (w ? S2AP_W : 0) | (x ? 0 : S2_XN);
+}
+
+// One round: a random multi-slot identity build, random page swaps, and a
+// full walk of the span against the model after each phase.
+static void check_s2_round(void)
+{
+    const u64 ipa = (1ull + rnd_below(255)) << 30 | rnd_below(1u << 18) * PAGE;
+    const u64 pa = (1ull << 30) + rnd_below(1ull << 28) * PAGE;
+    const u64 vm_pages = 1u + rnd_below(8192);
+    const u64 guard_pages = rnd_below(4);
+    const u32 vm_count = 1u + (u32)rnd_below(4);
+    const bool r = rnd() & 1, w = rnd() & 1, x = rnd() & 1;
+    const u64 slot_pages = vm_pages + guard_pages;
+    const u64 span = vm_count * slot_pages;
+
+    // Unaligned sizes are rounded up to whole pages by the builder.
+    s2_build_tables_identity(ipa, pa, vm_pages * PAGE - rnd_below(PAGE), vm_count,
+                             guard_pages * PAGE - (guard_pages ? rnd_below(PAGE) : 0),
+                             r, w, x);
+    const u64 root = s2_root();
+
+    u64 *model = calloc(span, sizeof(*model));
+    for (u64 i = 0; i < span; ++i)
+        if (i % slot_pages < vm_pages)
+            model[i] = pa + i * PAGE;
+    const u64 attrs = s2_expected_attrs(r, w, x);
+
+    for (int phase = 0; phase < 2; ++phase)
+    {
+        for (u64 i = 0; i < span + 2; ++i)
+        {
+            const u64 page = ipa - PAGE + i * PAGE; // one page either side
+            const u64 want = (i && i <= span) ? model[i - 1] : 0;
+            const ref_leaf_t leaf = ref_walk(root, page);
+            if (leaf.valid != (want != 0))
+                fail("s2 valid", page, leaf.valid, want != 0);
+            if (!want)
+                continue;
+            if (leaf.level != 3 || leaf.out != want)
+                fail("s2 output", page, leaf.out, want);
+            if (leaf.attrs != attrs)
+                fail("s2 attrs", page, leaf.attrs, attrs);
+        }
+
+        for (int n = 0; n < 64; ++n)
+        {
+            const u64 off = rnd_below(span * PAGE);
+            const u64 len = rnd_below(3 * PAGE);
+            const u64 first = off / PAGE;
+            u64 want = model[first] ? model[first] + off % PAGE : 0;
+            for (u64 p = first + 1; want && len && p * PAGE < off + len; ++p)
+                if (p >= span || model[p] != model[first] + (p - first) * PAGE)
+                    want = 0;
+            const u64 got = (u64)(uintptr_t)s2_ipa_to_ptr(ipa + off, len);
+            if (got != want)
+                fail("s2_ipa_to_ptr", ipa + off, got, want);
+        }
+
+        if (phase)
+            break;
+
+        const u32 remapped = s2_remapped_pages;
+        s64 remapped_delta = 0;
+        for (int n = 0; n < 256; ++n)
+        {
+            const u64 a = rnd_below(span), b = rnd_below(span);
+            const u64 ia = ipa + a * PAGE, ib = ipa + b * PAGE;
+            if (rnd_below(16) == 0)
+            {
+                if (s2_swap_pages(ia + 8u, ib))
+                    fail("s2_swap_pages unaligned", ia, 1, 0);
+                continue;
+            }
+            const bool want = a != b && model[a] && model[b];
+            if (s2_swap_pages(ia, ib) != want)
+                fail("s2_swap_pages", ia, !want, want);
+            if (!want)
+                continue;
+            remapped_delta -= (model[a] != ia) + (model[b] != ib);
+            const u64 t = model[a];
+            model[a] = model[b];
+            model[b] = t;
+            remapped_delta += (model[a] != ia) + (model[b] != ib);
+        }
+        if ((s64)(s2_remapped_pages - remapped) != remapped_delta)
+            fail("s2_remapped_pages", ipa, s2_remapped_pages - remapped, (u64)remapped_delta);
+    }
+    free(model);
+}
+
+// One round: image pages mapped over a small identity build, each one shared
+// read-only, copy-on-write, or left alone. Breaking COW, by a fault or through
+// s2_ipa_to_ptr(), must hand out a private writable copy and leave the shared
+// source untouched; read-only shared pages must never be handed out.
+static void check_cow_round(void)
+{
+    enum { KEEP, SHARED, COW };
+    const u64 pages = 1u + rnd_below(32);
+    const u64 ipa = GUEST_RAM_BASE;
+    s2_build_tables_identity(ipa, ipa, pages * PAGE, 1, 0, 1, 1, 1);
+    const u64 root = s2_root();
+
+    u8 *src = aligned_alloc(PAGE, pages * PAGE);
+    u8 *orig = malloc(pages * PAGE);
+    int *kind = malloc(pages * sizeof(*kind));
+    for (u64 i = 0; i < pages * PAGE; ++i)
+        src[i] = (u8)rnd();
+    memcpy(orig, src, pages * PAGE);
+
+    const u32 remapped = s2_remapped_pages;
+    u32 mapped = 0, cows = 0;
+    for (u64 i = 0; i < pages; ++i)
+    {
+        kind[i] = (int)rnd_below(3);
+        if (kind[i] == KEEP)
+            continue;
+        const u64 page = ipa + i * PAGE, pa = (u64)(uintptr_t)(src + i * PAGE);
+        if (!s2_map_guest_page(page, pa, kind[i] == COW, rnd() & 1, true))
+            fail("s2_map_guest_page", page, 0, 1);
+        const ref_leaf_t leaf = ref_walk(root, page);
+        const u64 sw = kind[i] == COW ? S2_SW_COW : S2_SW_SHARED;
+        if (!leaf.valid || leaf.out != pa)
+            fail("cow output", page, leaf.out, pa);
+        if ((leaf.attrs & (S2AP_W | S2_SW_COW | S2_SW_SHARED)) != sw)
+            fail("cow attrs", page, leaf.attrs, sw);
+        mapped++;
+        cows += kind[i] == COW;
+    }
+    if (s2_remapped_pages - remapped != mapped)
+        fail("cow s2_remapped_pages", ipa, s2_remapped_pages - remapped, mapped);
+
+    for (u64 i = 0; i < pages; ++i)
+    {
+        const u64 page = ipa + i * PAGE;
+        u8 *got = s2_ipa_to_ptr(page + 8u, 8);
+        if (kind[i] == KEEP)
+        {
+            if ((u64)(uintptr_t)got != page + 8u)
+                fail("cow identity", page, (u64)(uintptr_t)got, page + 8u);
+            continue;
+        }
+        if (kind[i] == SHARED)
+        {
+            if (got || s2_cow_fault(page) ||
+                (pages > 1 && s2_swap_pages(page, ipa + (i + 1) % pages * PAGE)))
+                fail("cow shared page handed out", page, 1, 0);
+            // A guest store here is no copy-on-write in waiting: the write
+            // fault must leave the page read-only for trap_dabt_perm() to
+            // abort the store.
+            const ref_leaf_t leaf = ref_walk(root, page);
+            if (s2_cow_pending(page) || !leaf.valid ||
+                (leaf.attrs & (S2AP_W | S2_SW_COW | S2_SW_SHARED)) != S2_SW_SHARED)
+                fail("cow read-only store", page, leaf.attrs, S2_SW_SHARED);
+            continue;
+        }
+        if (!got || got == src + i * PAGE + 8u)
+            fail("cow break", page, (u64)(uintptr_t)got, 0);
+        if (memcmp(got - 8u, orig + i * PAGE, PAGE))
+            fail("cow copy", page, 1, 0);
+        const ref_leaf_t leaf = ref_walk(root, page);
+        if ((leaf.attrs & (S2AP_W | S2_SW_COW)) != S2AP_W)
+            fail("cow attrs after break", page, leaf.attrs, S2AP_W);
+        if (s2_cow_fault(page))
+            fail("cow broken twice", page, 1, 0);
+        memset(got - 8u, 0xA5, PAGE);
+    }
+    if (memcmp(src, orig, pages * PAGE))
+        fail("cow source written", ipa, 1, 0);
+    if (s2_frames_used() != cows)
+        fail("cow frames", ipa, s2_frames_used(), cows);
+    free(kind);
+    free(orig);
+    free(src);
+}
+
+// One round: a stage-2 clone of pages backed by host memory or by frame-pool
+// frames, part of them kept direct. Both roots must map the same pages, with
+// writable pages outside the direct range turned copy-on-write on both sides.
+// Breaking COW in the clone must leave the source on the shared page, and the
+// other way round. Pool frames are counted: the source, writing last, keeps
+// its frame instead of copying it.
+static void check_clone_round(void)
+{
+    const u64 pages = 1u + rnd_below(64);
+    const u64 ipa = GUEST_RAM_BASE;
+    const bool x = rnd() & 1;
+    s2_build_tables_identity(ipa, ipa, pages * PAGE, 1, 0, 1, 1, 1);
+    const u64 src = s2_root();
+
+    u8 *host = aligned_alloc(PAGE, pages * PAGE);
+    u8 **mem = malloc(pages * sizeof(*mem));
+    u8 *orig = malloc(pages * PAGE);
+    bool *writable = malloc(pages * sizeof(*writable));
+    bool *pooled = malloc(pages * sizeof(*pooled));
+    u32 pool_frames = 0;
+    for (u64 i = 0; i < pages; ++i)
+    {
+        pooled[i] = rnd() & 1;
+        mem[i] = pooled[i] ? s2_frame_alloc() : host + i * PAGE;
+        pool_frames += pooled[i];
+        for (u64 b = 0; b < PAGE; ++b)
+            mem[i][b] = (u8)rnd();
+        memcpy(orig + i * PAGE, mem[i], PAGE);
+        writable[i] = rnd() & 1;
+        s2_map_guest_page(ipa + i * PAGE, (u64)(uintptr_t)mem[i], writable[i], x, false);
+    }
+    const u64 direct_first = rnd_below(pages);
+    const s2_range_t direct = { ipa + direct_first * PAGE,
+                                rnd_below(pages - direct_first + 1) * PAGE };
+
+    const u32 remapped = s2_remapped_pages;
+    const u64 dst = s2_clone(src, &direct, 1);
+    if (!dst || (dst >> 48) == (src >> 48) || (dst & ADDR_MASK) == (src & ADDR_MASK))
+        fail("s2_clone root", src, dst, 0);
+    if (s2_remapped_pages - remapped != pages)
+        fail("clone s2_remapped_pages", ipa, s2_remapped_pages - remapped, pages);
+
+    u32 copies_want = 0;
+    for (u64 i = 0; i < pages; ++i)
+    {
+        const u64 page = ipa + i * PAGE, pa = (u64)(uintptr_t)mem[i];
+        const bool cow = writable[i] && page - direct.ipa >= direct.size;
+        const u64 want = s2_expected_attrs(true, writable[i] && !cow, x) |
+                         (cow ? S2_SW_COW : 0) | (cow && pooled[i] ? S2_SW_COUNTED : 0);
+        const ref_leaf_t a = ref_walk(src, page), b = ref_walk(dst, page);
+        if (!a.valid || !b.valid || a.out != pa || b.out != pa)
+            fail("clone output", page, b.out, pa);
+        if (a.attrs != want || b.attrs != want)
+            fail("clone attrs", page, b.attrs, want);
+        copies_want += cow ? (pooled[i] ? 1u : 2u) : 0u;
+    }
+
+    // Each side breaks COW on its own: the clone first, then the source.
+    const u64 roots[2] = { dst, src };
+    u8 *copies[2][64] = {{0}};
+    for (int side = 0; side < 2; ++side)
+    {
+        s2_activate(roots[side]);
+        for (u64 i = 0; i < pages; ++i)
+        {
+            const u64 page = ipa + i * PAGE, pa = (u64)(uintptr_t)mem[i];
+            const bool cow = writable[i] && page - direct.ipa >= direct.size;
+            u8 *got = s2_ipa_to_ptr(page, 8);
+            if (!cow)
+            {
+                if ((u64)(uintptr_t)got != pa)
+                    fail("clone private page", page, (u64)(uintptr_t)got, pa);
+                continue;
+            }
+            const bool keep = side && pooled[i]; // last sharer of a counted page
+            if (!got || (got == mem[i]) != keep || (side && got == copies[0][i]))
+                fail("clone cow break", page, (u64)(uintptr_t)got, keep ? pa : 0);
+            if (memcmp(got, orig + i * PAGE, PAGE))
+                fail("clone cow copy", page, 1, 0);
+            const ref_leaf_t other = ref_walk(roots[!side], page);
+            if (!side && (other.out != pa || !(other.attrs & S2_SW_COW)))
+                fail("clone source kept", page, other.out, pa);
+            memset(got, 0x5A + side, PAGE);
+            copies[side][i] = got;
+        }
+    }
+    for (u64 i = 0; i < pages; ++i)
+        if (!pooled[i] && memcmp(mem[i], orig + i * PAGE, PAGE))
+            fail("clone shared page written", ipa + i * PAGE, 1, 0);
+    if (s2_frames_used() != pool_frames + copies_want)
+        fail("clone frames", ipa, s2_frames_used(), pool_frames + copies_want);
+
+    // Outside the direct range every writable page of the source is a pool
+    // frame now. A clone that is released again leaves the source the last
+    // sharer of each, so its writes keep the frames; the released tables are
+    // reused.
+    const u32 room = s2_clone_room(src), frames = s2_frames_used();
+    s2_release(s2_clone(src, &direct, 1));
+    if (s2_clone_room(src) != room)
+        fail("s2_release room", ipa, s2_clone_room(src), room);
+    s2_activate(src);
+    for (u64 i = 0; i < pages; ++i)
+    {
+        const u64 page = ipa + i * PAGE;
+        const ref_leaf_t leaf = ref_walk(src, page);
+        if (writable[i] && (u64)(uintptr_t)s2_ipa_to_ptr(page, 8) != leaf.out)
+            fail("release last sharer", page, (u64)(uintptr_t)s2_ipa_to_ptr(page, 8), leaf.out);
+    }
+    if (s2_frames_used() != frames)
+        fail("release frames", ipa, s2_frames_used(), frames);
+
+    // A fresh clone can take the direct range private: one run of frames
+    // holding what the source maps there, writable in the clone only.
+    if (direct.size)
+    {
+        const u64 n = direct.size / PAGE, free_before = s2_frames_contiguous();
+        const u32 remapped_before = s2_remapped_pages;
+        const u64 priv = s2_clone(src, &direct, 1);
+        const u64 base = s2_copy_range(priv, direct.ipa, direct.size);
+        if (!base || s2_frames_contiguous() != free_before - n)
+            fail("s2_copy_range frames", direct.ipa, free_before - s2_frames_contiguous(), n);
+        for (u64 p = 0; p < n; ++p)
+        {
+            const u64 page = direct.ipa + p * PAGE;
+            const ref_leaf_t a = ref_walk(src, page), b = ref_walk(priv, page);
+            if (b.out != base + p * PAGE || b.attrs != s2_expected_attrs(true, true, x))
+                fail("s2_copy_range map", page, b.out, base + p * PAGE);
+            if (memcmp((const void*)(uintptr_t)b.out, (const void*)(uintptr_t)a.out, PAGE))
+                fail("s2_copy_range copy", page, 1, 0);
+        }
+        if (s2_copy_range(src, direct.ipa, direct.size))
+            fail("s2_copy_range on the boot root", direct.ipa, 1, 0);
+        s2_release(priv);
+        if (s2_remapped_pages != remapped_before)
+            fail("s2_copy_range remapped", direct.ipa, s2_remapped_pages, remapped_before);
+    }
+
+    // With the pool drained a write fault fails and the page stays
+    // copy-on-write, for the caller to refuse the store.
+    s2_activate(src);
+    s2_map_guest_page(ipa, (u64)(uintptr_t)host, true, x, true);
+    while (s2_frame_alloc())
+        ;
+    if (s2_cow_fault(ipa) || !s2_cow_pending(ipa) || s2_cow_pending(ipa + pages * PAGE))
+        fail("cow fault with the pool empty", ipa, 1, 0);
+
+    // The roots run out before the tables do, and come back when released.
+    u64 extra[S2_MAX_ROOTS_HOST];
+    u32 nextra = 0;
+    while (nextra < S2_MAX_ROOTS_HOST && (extra[nextra] = s2_clone(src, NULL, 0)))
+        nextra++;
+    if (nextra != 6u || s2_clone_room(src))
+        fail("s2_clone roots", ipa, nextra, 6u);
+    while (nextra)
+        s2_release(extra[--nextra]);
+    if (s2_clone_room(src) != 6u)
+        fail("s2_release roots", ipa, s2_clone_room(src), 6u);
+    if (s2_clone(0x1234000ull, NULL, 0))
+        fail("s2_clone unknown root", ipa, 1, 0);
+    free(pooled);
+    free(writable);
+    free(orig);
+    free(mem);
+    free(host);
+}
+
+// One round: access-flag aging over an identity build, with a window that
+// runs past its end. The first pass finds every mapped page accessed and
+// clears the flags; after a random subset faults its flag back in (or breaks
+// COW, which maps the copy accessed), the next pass must report exactly that
+// subset, and a pass that finds nothing accessed needs no TLB maintenance.
+static void check_age_round(void)
+{
+    const u64 pages = 1u + rnd_below(300);
+    const u64 window = pages + rnd_below(200);
+    const u64 ipa = GUEST_RAM_BASE;
+    s2_build_tables_identity(ipa, ipa, pages * PAGE, 1, 0, 1, 1, 1);
+    const u64 root = s2_root();
+    u64 accessed[8], mapped[8];
+    bool *touched = malloc(window * sizeof(*touched));
+    u8 *mem = aligned_alloc(PAGE, pages * PAGE);
+
+    if (s2_age_pages(ipa, (u32)window, accessed, mapped) != pages)
+        fail("age mapped count", ipa, 0, pages);
+    for (u64 i = 0; i < window; ++i)
+    {
+        const u64 page = ipa + i * PAGE, bit = 1ull << (i % 64u);
+        const bool in = i < pages;
+        if (!!(mapped[i / 64u] & bit) != in || !!(accessed[i / 64u] & bit) != in)
+            fail("age first pass", page, mapped[i / 64u] & bit, in);
+        if (in && (ref_walk(root, page).attrs & S2_AF))
+            fail("age flag kept", page, 1, 0);
+    }
+
+    const u64 tlbi = host_mock_stats.tlbi;
+    if (s2_age_pages(ipa, (u32)window, accessed, mapped) != pages)
+        fail("age mapped count", ipa, 1, pages);
+    for (u64 w = 0; w < (window + 63u) / 64u; ++w)
+        if (accessed[w])
+            fail("age idle pass", ipa + w * 64u * PAGE, accessed[w], 0);
+    if (host_mock_stats.tlbi != tlbi)
+        fail("age idle pass tlbi", ipa, host_mock_stats.tlbi - tlbi, 0);
+
+    const u64 faults = s2_access_faults();
+    u64 resolved = 0;
+    for (u64 i = 0; i < window; ++i)
+    {
+        const u64 page = ipa + i * PAGE;
+        touched[i] = i < pages && rnd_below(4) == 0;
+        if (i >= pages && s2_access_fault(page))
+            fail("s2_access_fault unmapped", page, 1, 0);
+        if (!touched[i])
+            continue;
+        if (rnd() & 1)
+        {
+            if (!s2_map_guest_page(page, (u64)(uintptr_t)(mem + i * PAGE), true, true, true) ||
+                !s2_cow_fault(page))
+                fail("age cow break", page, 0, 1);
+            continue;
+        }
+        if (!s2_access_fault(page))
+            fail("s2_access_fault", page, 0, 1);
+        resolved++;
+    }
+    if (s2_access_faults() - faults != resolved)
+        fail("s2_access_faults", ipa, s2_access_faults() - faults, resolved);
+
+    if (s2_age_pages(ipa, (u32)window, accessed, mapped) != pages)
+        fail("age mapped count", ipa, 2, pages);
+    for (u64 i = 0; i < window; ++i)
+    {
+        const u64 page = ipa + i * PAGE, bit = 1ull << (i % 64u);
+        if (!!(accessed[i / 64u] & bit) != touched[i])
+            fail("age accessed", page, !touched[i], touched[i]);
+        if (i < pages && (ref_walk(root, page).attrs & S2_AF))
+            fail("age flag kept", page, 1, 0);
+    }
+    free(mem);
+    free(touched);
+}
+
+// --- EL2 stage 1 -------------------------------------------------------------
+
+typedef struct el2_range {
+    u64 va, pa, size;
+    u8 attr_idx;
+    bool ro, exec;
+} el2_range_t;
+
+#define EL2_CHECK_RANGES 18
+#define EL2_CHECK_WINDOW (4ull << 30)
+
+// Last mapping wins; a range covers the whole pages it touches.
+static bool el2_model(const el2_range_t *rs, unsigned n, u64 va, u64 *pa, u64 *attrs)
+{
+    while (n--)
+    {
+        const el2_range_t *rg = &rs[n];
+        const u64 start = rg->va & ~(PAGE - 1ull);
+        const u64 limit = (rg->va + rg->size + PAGE - 1ull) & ~(PAGE - 1ull);
+        if (va < start || va >= limit)
+            continue;
+        *pa = (rg->pa - (rg->va - start)) + (va - start);
+        *attrs = REF_ATTRIDX(rg->attr_idx) | REF_SH_INNER | REF_AF |
+                 (rg->ro ? REF_AP_RO : 0) | (rg->exec ? 0 : REF_PXN_UXN);
+        return true;
+    }
+    return false;
+}
+
+static void el2_check_va(const el2_range_t *rs, unsigned n, u64 root, u64 va)
+{
+    u64 pa = 0, attrs = 0;
+    const bool want = el2_model(rs, n, va, &pa, &attrs);
+    const ref_leaf_t leaf = ref_walk(root, va);
+    if (leaf.valid != want)
+        fail("el2 valid", va, leaf.valid, want);
+    if (want && (leaf.out & ADDR_MASK) != (pa & ADDR_MASK))
+        fail("el2 output", va, leaf.out, pa);
+    if (want && leaf.attrs != attrs)
+        fail("el2 attrs", va, leaf.attrs, attrs);
+}
+
+// One round: overlapping page-granular and 2MB-congruent ranges, so blocks
+// get split and re-covered. Sized to stay inside the builder's static pools.
+static void check_el2_round(void)
+{
+    el2_range_t rs[EL2_CHECK_RANGES];
+    el2_mmu_init();
+    for (unsigned i = 0; i < EL2_CHECK_RANGES; ++i)
+    {
+        el2_range_t *rg = &rs[i];
+        if (i % 3 == 0)
+        {
+            rg->va = rnd_below(EL2_CHECK_WINDOW / BLOCK_2M - 3) * BLOCK_2M;
+            rg->pa = rnd_below(1ull << 19) * BLOCK_2M;
+            rg->size = BLOCK_2M * (1u + rnd_below(3));
+        }
+        else
+        {
+            rg->va = rnd_below(EL2_CHECK_WINDOW - (1u << 18)) & ~7ull;
+            rg->pa = rnd_below(1ull << 28) * PAGE + (rg->va & (PAGE - 1ull));
+            rg->size = 1u + rnd_below(1u << 18);
+        }
+        rg->attr_idx = (u8)rnd_below(8);
+        rg->ro = rnd() & 1;
+        rg->exec = rnd() & 1;
+        el2_map_range(rg->va, rg->pa, rg->size, rg->attr_idx, rg->ro, rg->exec);
+    }
+    el2_mmu_enable();
+    const u64 root = host_read_sysreg("TTBR0_EL2");
+
+    for (unsigned i = 0; i < EL2_CHECK_RANGES; ++i)
+    {
+        const u64 start = rs[i].va & ~(PAGE - 1ull);
+        for (u64 va = start - (start ? PAGE : 0); va < rs[i].va + rs[i].size + PAGE; va += PAGE)
+            el2_check_va(rs, EL2_CHECK_RANGES, root, va);
+    }
+    for (int n = 0; n < 4096; ++n)
+        el2_check_va(rs, EL2_CHECK_RANGES, root, rnd_below(EL2_CHECK_WINDOW) & ~(PAGE - 1ull));
+}
+
+// --- Scheduler ---------------------------------------------------------------
+
+#define SCHED_VCPUS 8
+
+static sch_vm_t sched_vm;
+static vcpu_t sched_vcpus[SCHED_VCPUS];
+static unsigned idle_wake;  // vCPU the idle hook unblocks
+static unsigned idle_calls;
+
+static void sched_idle_hook(void)
+{
+    idle_calls++;
+    sched_vcpus[idle_wake].blocked = false;
+}
+
+static void sched_setup(void)
+{
+    vm_init(&sched_vm, 0, 0);
+    for (unsigned i = 0; i < SCHED_VCPUS; ++i)
+    {
+        sched_vcpus[i].vcpu_id = (int)i;
+        vm_add_vcpu(&sched_vm, &sched_vcpus[i]);
+        vcpu_scheduler_register(&sched_vcpus[i]);
+    }
+    host_idle_hook = sched_idle_hook;
+}
+
+static unsigned sched_index(const vcpu_t *vcpu)
+{
+    return (unsigned)(vcpu - sched_vcpus);
+}
+
+// Round-robin model of vcpu_scheduler_yield(): the directed target if it is
+// runnable, else the next runnable vCPU after the current one, the current
+// one last; with nothing runnable, whatever the idle path wakes.
+static unsigned ref_pick(unsigned cur, const vcpu_t *directed, bool *idled)
+{
+    *idled = false;
+    if (directed && !directed->blocked)
+        return sched_index(directed);
+    for (unsigned step = 1; step <= SCHED_VCPUS; ++step)
+    {
+        const unsigned next = (cur + step) % SCHED_VCPUS;
+        if (!sched_vcpus[next].blocked)
+            return next;
+    }
+    *idled = true;
+    return idle_wake;
+}
+
+static void check_sched_round(void)
+{
+    const unsigned blocked_pct = (unsigned)rnd_below(101);
+    for (unsigned i = 0; i < SCHED_VCPUS; ++i)
+        sched_vcpus[i].blocked = rnd_below(100) < blocked_pct;
+    idle_wake = (unsigned)rnd_below(SCHED_VCPUS);
+
+    vcpu_t *cur = vcpu_scheduler_current();
+    const unsigned cur_idx = sched_index(cur);
+    if (rnd() & 1)
+    {
+        const int target = (int)rnd_below(SCHED_VCPUS + 2) - 1;
+        int want = 0;
+        if (target < 0 || target >= SCHED_VCPUS || target == cur->vcpu_id)
+            want = -1;
+        else if (sched_vcpus[target].blocked)
+            want = -2;
+        const int got = vcpu_yield_to(cur, target);
+        if (got != want)
+            fail("vcpu_yield_to", (u64)target, (u64)got, (u64)want);
+        if (vcpu_scheduler_find(target) != (target >= 0 && target < SCHED_VCPUS ?
+                                            &sched_vcpus[target] : NULL))
+            fail("vcpu_scheduler_find", (u64)target, 0, 0);
+    }
+    else if (rnd() & 1)
+    {
+        // A target that blocked between yield_to and the scheduling decision.
+        cur->yield_to = &sched_vcpus[rnd_below(SCHED_VCPUS)];
+    }
+
+    bool idled;
+    const unsigned want = ref_pick(cur_idx, cur->yield_to, &idled);
+    const unsigned calls = idle_calls;
+    const bool changed = vcpu_scheduler_yield();
+    const unsigned got = sched_index(vcpu_scheduler_current());
+    if (got != want)
+        fail("pick-next", cur_idx, got, want);
+    if (changed != (got != cur_idx))
+        fail("pick-next changed", cur_idx, changed, got != cur_idx);
+    if ((idle_calls != calls) != idled)
+        fail("pick-next idle", cur_idx, idle_calls - calls, idled);
+    if (cur->yield_to)
+        fail("yield_to not consumed", cur_idx, 1, 0);
+    cur->request_yield = false;
+}
+
+// --- Benchmarks --------------------------------------------------------------
+
+static void report(const char *name, u64 ns, u64 ops, const char *unit)
+{
+    printf("%-28s %12.1f ns/%s\n", name, (double)ns / (double)ops, unit);
+}
+
+static void bench_s2(void)
+{
+    const u64 pages = GUEST_RAM_SIZE / PAGE;
+    const unsigned rounds = 32;
+    u64 t0 = now_ns();
+    for (unsigned i = 0; i < rounds; ++i)
+        s2_build_tables_identity(GUEST_RAM_BASE, GUEST_RAM_BASE, GUEST_RAM_SIZE, 1,
+                                 S2_VM_GUARD_BYTES, 1, 1, 1);
+    u64 ns = now_ns() - t0;
+    report("s2_build_guest_ram", ns, rounds, "build");
+    report("s2_build_guest_ram_per_page", ns, rounds * pages, "page");
+
+    const unsigned lookups = 1u << 20;
+    u64 sum = 0;
+    t0 = now_ns();
+    for (unsigned i = 0; i < lookups; ++i)
+        sum += (u64)(uintptr_t)s2_ipa_to_ptr(GUEST_RAM_BASE + rnd_below(pages) * PAGE, 64);
+    ns = now_ns() - t0;
+    report("s2_ipa_to_ptr", ns, lookups, "lookup");
+
+    const unsigned clones = 8;
+    ns = 0;
+    for (unsigned i = 0; i < clones; ++i)
+    {
+        s2_build_tables_identity(GUEST_RAM_BASE, GUEST_RAM_BASE, GUEST_RAM_SIZE, 1,
+                                 S2_VM_GUARD_BYTES, 1, 1, 1);
+        const u64 root = s2_root();
+        t0 = now_ns();
+        sum += s2_clone(root, NULL, 0);
+        ns += now_ns() - t0;
+    }
+    report("s2_clone_guest_ram", ns, clones, "clone");
+    s2_build_tables_identity(GUEST_RAM_BASE, GUEST_RAM_BASE, GUEST_RAM_SIZE, 1,
+                             S2_VM_GUARD_BYTES, 1, 1, 1);
+
+    const unsigned swaps = 1u << 18;
+    t0 = now_ns();
+    for (unsigned i = 0; i < swaps; ++i)
+        sum += s2_swap_pages(GUEST_RAM_BASE + rnd_below(pages) * PAGE,
+                             GUEST_RAM_BASE + rnd_below(pages) * PAGE);
+    ns = now_ns() - t0;
+    report("s2_swap_pages", ns, swaps, "swap");
+
+    // One working-set scan window over guest RAM, half of it re-accessed.
+    const unsigned windows = 1u << 10;
+    u64 accessed[512 / 64], mapped[512 / 64];
+    ns = 0;
+    for (unsigned i = 0; i < windows; ++i)
+    {
+        const u64 ipa = GUEST_RAM_BASE + (i * 512u) % pages * PAGE;
+        for (u64 p = 0; p < 512u; p += 2)
+            s2_access_fault(ipa + p * PAGE);
+        t0 = now_ns();
+        sum += s2_age_pages(ipa, 512u, accessed, mapped);
+        ns += now_ns() - t0;
+    }
+    report("s2_age_pages_512", ns, windows, "window");
+    if (!sum)
+        printf("(no lookups hit)\n");
+}
+
+static void bench_el2(void)
+{
+    const unsigned rounds = 256;
+    const u64 page_bytes = 32ull << 20; // 8192 pages, within the L3 pool
+    u64 t0 = now_ns();
+    for (unsigned i = 0; i < rounds; ++i)
+    {
+        el2_mmu_init();
+        el2_map_range(GUEST_RAM_BASE + PAGE, GUEST_RAM_BASE, page_bytes, NORMAL_WB, false, false);
+    }
+    u64 ns = now_ns() - t0;
+    report("el2_map_pages", ns, rounds * (page_bytes / PAGE), "page");
+
+    const u64 block_bytes = 8ull << 30;
+    t0 = now_ns();
+    for (unsigned i = 0; i < rounds; ++i)
+    {
+        el2_mmu_init();
+        el2_map_range(GUEST_RAM_BASE, GUEST_RAM_BASE, block_bytes, NORMAL_WB, false, false);
+    }
+    ns = now_ns() - t0;
+    report("el2_map_blocks", ns, rounds * (block_bytes / BLOCK_2M), "block");
+}
+
+static void bench_sched_case(const char *name, unsigned blocked, bool directed)
+{
+    for (unsigned i = 0; i < SCHED_VCPUS; ++i)
+        sched_vcpus[i].blocked = i < blocked;
+    const unsigned rounds = 1u << 22;
+    const u64 t0 = now_ns();
+    for (unsigned i = 0; i < rounds; ++i)
+    {
+        if (directed)
+        {
+            vcpu_t *cur = vcpu_scheduler_current();
+            cur->yield_to = &sched_vcpus[SCHED_VCPUS - 1 - (unsigned)cur->vcpu_id % 2u];
+        }
+        vcpu_scheduler_yield();
+    }
+    report(name, now_ns() - t0, rounds, "pick");
+}
+
+static void bench_sched(void)
+{
+    bench_sched_case("sched_pick_all_runnable", 0, false);
+    bench_sched_case("sched_pick_half_blocked", SCHED_VCPUS / 2, false);
+    bench_sched_case("sched_pick_one_runnable", SCHED_VCPUS - 1, false);
+    bench_sched_case("sched_pick_directed", 0, true);
+}
+
+// vcpu_t fields every guest exit reads or writes: the trapframe and VTTBR in
+// the world switch, the yield and preemption flags, the accounting clock, and
+// the vtimer and vGIC fast checks before the guest is re-entered.
+#define VCPU_TRAP_FIELD(f) { #f, offsetof(vcpu_t, f), sizeof(((vcpu_t *)0)->f) }
+static const struct
+{
+    const char *name;
+    size_t off, size;
+} vcpu_trap_fields[] = {
+    VCPU_TRAP_FIELD(arch.tf),
+    VCPU_TRAP_FIELD(arch.vttbr_el2),
+    VCPU_TRAP_FIELD(request_yield),
+    VCPU_TRAP_FIELD(preempted),
+    VCPU_TRAP_FIELD(acct.state),
+    VCPU_TRAP_FIELD(acct.since),
+    VCPU_TRAP_FIELD(arch.vtimer.phys_active),
+    VCPU_TRAP_FIELD(arch.vgic.lr_used),
+    VCPU_TRAP_FIELD(arch.vgic.queue_len),
+};
+
+static void report_layout(void)
+{
+    const size_t nlines = (sizeof(vcpu_t) + 63u) / 64u;
+    unsigned char touched[(sizeof(vcpu_t) + 63u) / 64u] = { 0 };
+    unsigned lines = 0;
+    for (size_t i = 0; i < sizeof(vcpu_trap_fields) / sizeof(vcpu_trap_fields[0]); ++i)
+    {
+        const size_t first = vcpu_trap_fields[i].off / 64u;
+        const size_t last = (vcpu_trap_fields[i].off + vcpu_trap_fields[i].size - 1u) / 64u;
+        for (size_t l = first; l <= last; ++l)
+            if (!touched[l]++)
+                ++lines;
+    }
+    printf("%-28s %8zu bytes, %zu lines, %u touched per exit\n", "vcpu_t layout",
+           sizeof(vcpu_t), nlines, lines);
+    printf("%-28s %8zu bytes\n", "vcpu_cold_t layout", sizeof(vcpu_cold_t));
+}
+
+int main(int argc, char **argv)
+{
+    const u64 seed = argc > 1 ? strtoull(argv[1], NULL, 0) : (u64)time(NULL);
+    const unsigned rounds = argc > 2 ? (unsigned)strtoul(argv[2], NULL, 0) : 64u;
+    rng_seed = seed;
+    rng_state = seed ? seed : 1;
+    printf("seed 0x%llx, %u check rounds\n", (unsigned long long)seed, rounds);
+
+    host_mock_reset();
+    sched_setup();
+    for (unsigned i = 0; i < rounds; ++i)
+    {
+        check_s2_round();
+        check_cow_round();
+        check_clone_round();
+        check_age_round();
+        check_el2_round();
+        for (int n = 0; n < 64; ++n)
+            check_sched_round();
+    }
+    printf("checks passed\n");
+
+    bench_s2();
+    bench_el2();
+    bench_sched();
+    report_layout();
+    return 0;
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include "arch_ops.h"
+#include "types.h"
+
+/*
+ * Mock CPU for the host build (SCHISM_HOST). include/arch_ops.h routes
+ * sysreg, barrier and TLBI accesses here; the few EL2 collaborators of the
+ * cores under test (vtimer, vGIC, MMIO bus) are stubbed out.
+ */
+
+typedef struct host_mock_stats {
+    u64 sysreg_reads;
+    u64 sysreg_writes;
+    u64 barriers;
+    u64 tlbi;
+} host_mock_stats_t;
+
+extern host_mock_stats_t host_mock_stats;
+
+// Called by the vtimer_idle() stub when the scheduler finds nothing runnable;
+// it has to unblock a vCPU or the pick-next loop never ends.
+extern void (*host_idle_hook)(void);
+
+// Clear the register file and the counters.
+void host_mock_reset(void);
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arch_ops.h"
+#include "host_mock.h"
+#include "mmio_bus.h"
+#include "timer.h"
+#include "vgic.h"
+
+#define HOST_SYSREGS 32
+
+static struct {
+    const char *name;
+    u64 val;
+} sysregs[HOST_SYSREGS];
+static unsigned nr_sysregs;
+
+host_mock_stats_t host_mock_stats;
+void (*host_idle_hook)(void);
+
+void host_mock_reset(void)
+{
+    nr_sysregs = 0;
+    memset(&host_mock_stats, 0, sizeof(host_mock_stats));
+}
+
+// Registers never written read as zero.
+static u64 *sysreg_slot(const char *reg, bool create)
+{
+    for (unsigned i = 0; i < nr_sysregs; ++i)
+        if (!strcmp(sysregs[i].name, reg))
+            return &sysregs[i].val;
+    if (!create)
+        return NULL;
+    if (nr_sysregs >= HOST_SYSREGS)
+        host_halt("sysreg file full");
+    sysregs[nr_sysregs].name = reg;
+    sysregs[nr_sysregs].val = 0;
+    return &sysregs[nr_sysregs++].val;
+}
+
+u64 host_read_sysreg(const char *reg)
+{
+    host_mock_stats.sysreg_reads++;
+    const u64 *val = sysreg_slot(reg, false);
+    return val ? *val : 0;
+}
+
+void host_write_sysreg(const char *reg, u64 val)
+{
+    host_mock_stats.sysreg_writes++;
+    *sysreg_slot(reg, true) = val;
+}
+
+void host_barrier(const char *op)
+{
+    (void)op;
+    host_mock_stats.barriers++;
+}
+
+void host_tlbi(const char *op, u64 arg)
+{
+    (void)op;
+    (void)arg;
+    host_mock_stats.tlbi++;
+}
+
+void host_halt(const char *why)
+{
+    fprintf(stderr, "host mock: %s\n", why);
+    abort();
+}
+
+// --- Stubbed EL2 collaborators ----------------------------------------------
+
+void vtimer_idle(void)
+{
+    if (!host_idle_hook)
+        host_halt("vtimer_idle with every vCPU blocked");
+    host_idle_hook();
+}
+
+u64 timer_cnthctl_init(void)
+{
+    return 0;
+}
+
+void mmio_bus_init(mmio_bus_t *bus)
+{
+    memset(bus, 0, sizeof(*bus));
+}
+
+void vgic_dist_init(vgic_dist_t *dist)
+{
+    memset(dist, 0, sizeof(*dist));
+}
+
+void vgic_vcpu_reset(vcpu_t *vcpu)
+{
+    (void)vcpu;
+}
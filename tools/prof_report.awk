@@ -0,0 +1,81 @@
+# Symbolize the "PROF s <pc> <meta>" samples of a PROFILE=1 run (core/prof.c).
+# The first input is `nm -n schism.elf`, the second the serial log; the guests
+# are linked into the same image, so one symbol table covers every EL.
+# Usage: nm -n schism.elf | awk [-v folded=1] -f tools/prof_report.awk - serial.log
+# Flat output is "<samples> <percent> <where> <symbol>", unsorted; folded
+# output is "EL2;vcpuN;<symbol> <samples>" or "vcpuN;EL1;<symbol> <samples>"
+# for flamegraph.pl. EL2 samples taken while no vCPU was scheduled say "idle".
+# Fails on a log without samples or without a single EL2 sample.
+
+function hex(s,    i, c, v) {
+    sub(/^0x/, "", s)
+    v = 0
+    for (i = 1; i <= length(s); i++) {
+        c = index("0123456789abcdef", tolower(substr(s, i, 1)))
+        if (c == 0)
+            break
+        v = v * 16 + c - 1
+    }
+    return v
+}
+
+# Last symbol at or below pc.
+function lookup(pc,    lo, hi, mid) {
+    if (nsyms == 0 || pc < addr[1])
+        return "?"
+    lo = 1
+    hi = nsyms
+    while (lo < hi) {
+        mid = int((lo + hi + 1) / 2)
+        if (addr[mid] <= pc)
+            lo = mid
+        else
+            hi = mid - 1
+    }
+    return name[lo]
+}
+
+{ sub(/\r$/, "") }
+
+FNR == NR {
+    if (NF == 3 && $2 ~ /^[tTwW]$/) {
+        nsyms++
+        addr[nsyms] = hex($1)
+        name[nsyms] = $3
+    }
+    next
+}
+
+$1 == "PROF" && $2 == "s" {
+    meta = hex($4)
+    el = int(meta / 65536) % 4
+    vcpu = meta % 65536
+    who = vcpu == 65535 ? "idle" : "vcpu" vcpu
+    sym = lookup(hex($3))
+    if (el == 2) {
+        key = "EL2;" who ";" sym
+        el2++
+    }
+    else
+        key = who ";EL" el ";" sym
+    count[key]++
+    total++
+}
+
+END {
+    for (key in count) {
+        if (folded) {
+            printf "%s %d\n", key, count[key]
+            continue
+        }
+        split(key, part, ";")
+        where = part[1] == "EL2" ? "EL2/" part[2] : part[2] "/" part[1]
+        printf "%8d %6.2f%% %-10s %s\n", count[key], 100 * count[key] / total, where, part[3]
+    }
+    # EL2 runs between every guest exit; a run without a sample of it means
+    # the current-EL FIQ vector is not reaching prof_fiq_el2().
+    if (total == 0 || el2 == 0) {
+        printf "prof_report: %d samples, %d at EL2\n", total, el2 > "/dev/stderr"
+        exit 1
+    }
+}
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Turn the serial log of a PROFILE=1 run into a flat profile, hottest first,
+# or with -f into folded stacks for flamegraph.pl.
+# Usage: tools/prof_report.sh [-f] build/profile/schism.elf serial.log
+# NM names an nm that reads AArch64 ELF (default aarch64-none-elf-nm).
+set -e
+
+folded=0
+if [ "$1" = "-f" ]; then
+    folded=1
+    shift
+fi
+if [ $# -ne 2 ]; then
+    echo "usage: $0 [-f] schism.elf serial.log" >&2
+    exit 2
+fi
+
+NM=${NM:-aarch64-none-elf-nm}
+syms=$(mktemp)
+out=$(mktemp)
+trap 'rm -f "$syms" "$out"' EXIT
+"$NM" -n "$1" > "$syms"
+if [ ! -s "$syms" ]; then
+    echo "$0: no symbols in $1" >&2
+    exit 1
+fi
+if [ $folded -eq 1 ]; then
+    order=""
+else
+    order="-rn"
+fi
+# Not piped into sort: its status would hide the report's own failure.
+awk -v folded=$folded -f "$(dirname "$0")/prof_report.awk" "$syms" "$2" > "$out"
+sort $order "$out"